@@ -18,6 +18,8 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#include "qapi/error.h"
+#include "trace.h"
 #ifdef CONFIG_EPOLL_CREATE1
 #include <sys/epoll.h>
 #endif
@@ -27,6 +29,7 @@ struct AioHandler
     GPollFD pfd;
     IOHandler *io_read;
     IOHandler *io_write;
+    AioPollFn *io_poll;
     int deleted;
     void *opaque;
     bool is_external;
@@ -269,6 +272,24 @@ void aio_set_event_notifier(AioContext *ctx,
                        is_external, (IOHandler *)io_read, NULL, notifier);
 }
 
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    AioHandler *node = find_aio_handler(ctx, fd);
+
+    if (!node) {
+        assert(!io_poll);
+        return;
+    }
+    node->io_poll = io_poll;
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+    aio_set_fd_poll(ctx, event_notifier_get_fd(notifier), io_poll);
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     return false;
@@ -405,12 +426,131 @@ static void add_pollfd(AioHandler *node)
     npfd++;
 }
 
+static bool aio_has_poll_handlers(AioContext *ctx)
+{
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool run_poll_handlers_once(AioContext *ctx)
+{
+    bool progress = false;
+    AioHandler *node;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (!node->deleted && node->io_poll &&
+            aio_node_check(ctx, node->is_external) &&
+            node->io_poll(node->opaque)) {
+            progress = true;
+        }
+    }
+
+    return progress;
+}
+
+/* run_poll_handlers:
+ * @ctx: the AioContext
+ * @max_ns: maximum time to poll for, in nanoseconds
+ *
+ * Polls for a given time.  Stops as soon as a handler makes progress or
+ * aio_notify() is called, for example because a bottom half was scheduled
+ * or because another thread wants to acquire the AioContext.
+ *
+ * ctx->notify_me must be non-zero so that aio_notify() sets ctx->notified,
+ * and walking_handlers must be incremented so that nodes stay valid.
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool run_poll_handlers(AioContext *ctx, int64_t max_ns)
+{
+    bool progress;
+    int64_t end_time;
+
+    assert(ctx->notify_me);
+    assert(ctx->walking_handlers > 0);
+
+    end_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + max_ns;
+    do {
+        progress = run_poll_handlers_once(ctx);
+    } while (!progress && !atomic_read(&ctx->notified) &&
+             qemu_clock_get_ns(QEMU_CLOCK_REALTIME) < end_time);
+
+    return progress;
+}
+
+/* try_poll_mode:
+ * @ctx: the AioContext
+ * @timeout: timeout for blocking wait, computed by the caller and updated
+ *           to account for the time spent polling
+ *
+ * Returns: true if progress was made, false otherwise
+ */
+static bool try_poll_mode(AioContext *ctx, int64_t *timeout)
+{
+    int64_t max_ns, start, elapsed;
+    bool progress;
+
+    max_ns = qemu_soonest_timeout(*timeout, ctx->poll_ns);
+    if (!max_ns || !aio_has_poll_handlers(ctx)) {
+        return false;
+    }
+
+    start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    progress = run_poll_handlers(ctx, max_ns);
+    elapsed = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start;
+
+    if (progress) {
+        ctx->poll_hits++;
+        *timeout = 0;
+    } else {
+        ctx->poll_misses++;
+        if (*timeout > 0) {
+            *timeout = MAX(*timeout - elapsed, 0);
+        }
+    }
+    return progress;
+}
+
+/* Adjust the polling window after a blocking aio_poll() that took
+ * @block_ns nanoseconds to find work.
+ */
+static void adjust_poll_ns(AioContext *ctx, int64_t block_ns)
+{
+    int64_t old = ctx->poll_ns;
+
+    if (block_ns <= ctx->poll_ns) {
+        /* This is the sweet spot, no adjustment needed */
+        return;
+    } else if (block_ns > ctx->poll_max_ns) {
+        /* We'd have to poll for too long, stop polling until the
+         * event loop becomes busier.
+         */
+        ctx->poll_ns = 0;
+        trace_poll_shrink(ctx, old, ctx->poll_ns);
+    } else if (ctx->poll_ns < ctx->poll_max_ns) {
+        /* There is room to grow, poll longer */
+        ctx->poll_ns = ctx->poll_ns ? ctx->poll_ns * 2 : 4000;
+        if (ctx->poll_ns > ctx->poll_max_ns) {
+            ctx->poll_ns = ctx->poll_max_ns;
+        }
+        trace_poll_grow(ctx, old, ctx->poll_ns);
+    }
+}
+
 bool aio_poll(AioContext *ctx, bool blocking)
 {
     AioHandler *node;
     int i, ret;
     bool progress;
     int64_t timeout;
+    int64_t start = 0;
 
     aio_context_acquire(ctx);
     progress = false;
@@ -430,6 +570,15 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     assert(npfd == 0);
 
+    if (blocking && ctx->poll_max_ns) {
+        start = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+
+    timeout = blocking ? aio_compute_timeout(ctx) : 0;
+    if (blocking && try_poll_mode(ctx, &timeout)) {
+        progress = true;
+    }
+
     /* fill pollfds */
     QLIST_FOREACH(node, &ctx->aio_handlers, node) {
         if (!node->deleted && node->pfd.events
@@ -439,8 +588,6 @@ bool aio_poll(AioContext *ctx, bool blocking)
         }
     }
 
-    timeout = blocking ? aio_compute_timeout(ctx) : 0;
-
     /* wait until next event */
     if (timeout) {
         aio_context_release(ctx);
@@ -475,6 +622,10 @@ bool aio_poll(AioContext *ctx, bool blocking)
     npfd = 0;
     ctx->walking_handlers--;
 
+    if (blocking && ctx->poll_max_ns) {
+        adjust_poll_ns(ctx, qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start);
+    }
+
     /* Run dispatch even if there were no readable fds to run timers */
     if (aio_dispatch(ctx)) {
         progress = true;
@@ -497,3 +648,15 @@ void aio_context_setup(AioContext *ctx, Error **errp)
     }
 #endif
 }
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 Error **errp)
+{
+    /* No thread synchronization here, it doesn't matter if an incorrect
+     * poll_ns value is used briefly.
+     */
+    ctx->poll_max_ns = max_ns;
+    ctx->poll_ns = 0;
+
+    aio_notify(ctx);
+}
@@ -19,6 +19,7 @@
 #include "qemu-common.h"
 #include "block/block.h"
 #include "qemu/queue.h"
+#include "qapi/error.h"
 #include "qemu/sockets.h"
 
 struct AioHandler {
@@ -374,3 +375,24 @@ bool aio_poll(AioContext *ctx, bool blocking)
 void aio_context_setup(AioContext *ctx, Error **errp)
 {
 }
+
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll)
+{
+    /* Polling is not implemented on Windows, handlers only run after
+     * their file descriptor or event becomes ready.
+     */
+}
+
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll)
+{
+}
+
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 Error **errp)
+{
+    if (max_ns) {
+        error_setg(errp, "AioContext polling is not implemented on Windows");
+    }
+}
@@ -236,6 +236,7 @@ BlockDriverState *bdrv_new(void)
         QLIST_INIT(&bs->op_blockers[i]);
     }
     notifier_with_return_list_init(&bs->before_write_notifiers);
+    notifier_with_return_list_init(&bs->after_write_notifiers);
     bs->refcnt = 1;
     bs->aio_context = qemu_get_aio_context();
 
@@ -25,6 +25,7 @@
 #include "qemu/bitmap.h"
 
 #define BACKUP_CLUSTER_SIZE_DEFAULT (1 << 16)
+#define BACKUP_COPY_SIZE_MAX (1 << 20)
 #define SLICE_TIME 100000000ULL /* ns */
 
 typedef struct CowRequest {
@@ -47,9 +48,42 @@ typedef struct BackupBlockJob {
     uint64_t sectors_read;
     unsigned long *done_bitmap;
     int64_t cluster_size;
+    /* Maximum number of clusters copied by a single request */
+    int64_t copy_clusters_max;
     QLIST_HEAD(, CowRequest) inflight_reqs;
+    int max_workers;
+
+    /* Background copy requests, see backup_run_copy() */
+    int workers_in_flight;
+    bool waiting_for_worker;
+    int worker_ret;
+    bool worker_error_is_read;
+    int64_t worker_error_cluster;
+
+    /* Target writes issued on behalf of guest write requests */
+    int offload_in_flight;
+    CoQueue offload_queue;
+    int offload_ret;
+
+    /* Guest write requests that had to copy old data first */
+    uint64_t cow_requests;
+    uint64_t cow_wait_ns;
 } BackupBlockJob;
 
+typedef struct BackupOffloadWrite {
+    BackupBlockJob *job;
+    int64_t sector_num;
+    int nb_sectors;
+    struct iovec iov;
+    QEMUIOVector qiov;
+} BackupOffloadWrite;
+
+typedef struct BackupWorker {
+    BackupBlockJob *job;
+    int64_t cluster;
+    int64_t nb_clusters;
+} BackupWorker;
+
 /* Size of a cluster in sectors, instead of bytes. */
 static inline int64_t cluster_size_sectors(BackupBlockJob *job)
 {
@@ -93,6 +127,81 @@ static void cow_request_end(CowRequest *req)
     qemu_co_queue_restart_all(&req->wait_queue);
 }
 
+static int coroutine_fn backup_write_target(BackupBlockJob *job,
+                                            int64_t sector_num, int nb_sectors,
+                                            QEMUIOVector *qiov)
+{
+    if (buffer_is_zero(qiov->iov[0].iov_base, qiov->size)) {
+        return bdrv_co_write_zeroes(job->target, sector_num, nb_sectors,
+                                    BDRV_REQ_MAY_UNMAP);
+    } else {
+        return bdrv_co_writev(job->target, sector_num, nb_sectors, qiov);
+    }
+}
+
+static void coroutine_fn backup_offload_write_entry(void *opaque)
+{
+    BackupOffloadWrite *w = opaque;
+    BackupBlockJob *job = w->job;
+    int ret;
+
+    /* backup_run() must not finish before the write has completed */
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
+    ret = backup_write_target(job, w->sector_num, w->nb_sectors, &w->qiov);
+    if (ret < 0) {
+        trace_backup_do_cow_write_fail(job,
+                                       w->sector_num / cluster_size_sectors(job),
+                                       ret);
+        /* The old data is lost, so the only option is to fail the job */
+        if (job->offload_ret == 0) {
+            job->offload_ret = ret;
+            block_job_enter(&job->common);
+        }
+    }
+
+    qemu_vfree(w->iov.iov_base);
+    g_free(w);
+
+    job->offload_in_flight--;
+    qemu_co_queue_next(&job->offload_queue);
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+}
+
+/* Write @buf to the target in a separate coroutine, so that the guest write
+ * request that triggered the copy only waits for the read.  Takes ownership
+ * of @buf.  The caller must have reserved a slot in job->offload_in_flight.
+ */
+static void backup_offload_write(BackupBlockJob *job, int64_t sector_num,
+                                 int nb_sectors, void *buf)
+{
+    BackupOffloadWrite *w = g_new0(BackupOffloadWrite, 1);
+    Coroutine *co;
+
+    w->job = job;
+    w->sector_num = sector_num;
+    w->nb_sectors = nb_sectors;
+    w->iov.iov_base = buf;
+    w->iov.iov_len = nb_sectors * BDRV_SECTOR_SIZE;
+    qemu_iovec_init_external(&w->qiov, &w->iov, 1);
+
+    co = qemu_coroutine_create(backup_offload_write_entry);
+    qemu_coroutine_enter(co, w);
+}
+
+/* Record that clusters [start, start + nb_clusters) have reached the target */
+static void backup_clusters_done(BackupBlockJob *job, int64_t start,
+                                 int64_t nb_clusters, int nb_sectors)
+{
+    bitmap_set(job->done_bitmap, start, nb_clusters);
+
+    /* Publish progress, guest I/O counts as progress too.  Note that the
+     * offset field is an opaque progress value, it is not a disk offset.
+     */
+    job->sectors_read += nb_sectors;
+    job->common.offset += nb_sectors * BDRV_SECTOR_SIZE;
+}
+
 static int coroutine_fn backup_do_cow(BlockDriverState *bs,
                                       int64_t sector_num, int nb_sectors,
                                       bool *error_is_read,
@@ -105,34 +214,71 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
     void *bounce_buffer = NULL;
     int ret = 0;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
-    int64_t start, end;
+    int64_t start, end, nb_clusters;
+    int64_t start_ns = 0;
+    bool copied = false;
     int n;
 
     qemu_co_rwlock_rdlock(&job->flush_rwlock);
 
+    if (is_write_notifier) {
+        start_ns = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    }
+
     start = sector_num / sectors_per_cluster;
     end = DIV_ROUND_UP(sector_num + nb_sectors, sectors_per_cluster);
+    end = MIN(end, DIV_ROUND_UP(job->common.len, job->cluster_size));
 
     trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
 
     wait_for_overlapping_requests(job, start, end);
     cow_request_begin(&cow_request, job, start, end);
 
-    for (; start < end; start++) {
+    for (; start < end; start += nb_clusters) {
         if (test_bit(start, job->done_bitmap)) {
             trace_backup_do_cow_skip(job, start);
+            nb_clusters = 1;
             continue; /* already copied */
         }
 
-        trace_backup_do_cow_process(job, start);
+        /* Copy a run of clusters that have not been copied yet at once */
+        nb_clusters = 1;
+        while (nb_clusters < job->copy_clusters_max &&
+               start + nb_clusters < end &&
+               !test_bit(start + nb_clusters, job->done_bitmap)) {
+            nb_clusters++;
+        }
+
+        trace_backup_do_cow_process(job, start, nb_clusters);
 
-        n = MIN(sectors_per_cluster,
+        n = MIN(nb_clusters * sectors_per_cluster,
                 job->common.len / BDRV_SECTOR_SIZE -
                 start * sectors_per_cluster);
 
-        if (!bounce_buffer) {
-            bounce_buffer = qemu_blockalign(bs, job->cluster_size);
+        if (!is_write_notifier &&
+            bdrv_co_copy_range(bs, start * sectors_per_cluster, job->target,
+                               start * sectors_per_cluster, n,
+                               BDRV_REQ_NO_SERIALISING) == 0) {
+            /* Copied without bouncing the data through QEMU.  On failure,
+             * the regular path below reports the error properly.  The
+             * source must not wait for serialising requests: we hold a
+             * cow_request, and a guest write overlapping it waits for us. */
+            backup_clusters_done(job, start, nb_clusters, n);
+            continue;
         }
+
+        if (is_write_notifier) {
+            /* Reserve a slot for the target write before reading, so that
+             * guest writes are throttled rather than memory usage growing
+             * without bounds when the target is slow.
+             */
+            while (job->offload_in_flight >= job->max_workers) {
+                qemu_co_queue_wait(&job->offload_queue);
+            }
+            job->offload_in_flight++;
+        }
+
+        bounce_buffer = qemu_blockalign(bs, n * BDRV_SECTOR_SIZE);
         iov.iov_base = bounce_buffer;
         iov.iov_len = n * BDRV_SECTOR_SIZE;
         qemu_iovec_init_external(&bounce_qiov, &iov, 1);
@@ -150,33 +296,33 @@ static int coroutine_fn backup_do_cow(BlockDriverState *bs,
             if (error_is_read) {
                 *error_is_read = true;
             }
+            if (is_write_notifier) {
+                job->offload_in_flight--;
+                qemu_co_queue_next(&job->offload_queue);
+            }
             goto out;
         }
 
-        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
-            ret = bdrv_co_write_zeroes(job->target,
-                                       start * sectors_per_cluster,
-                                       n, BDRV_REQ_MAY_UNMAP);
+        if (is_write_notifier) {
+            /* The old data is safe in the bounce buffer now */
+            backup_offload_write(job, start * sectors_per_cluster, n,
+                                 bounce_buffer);
         } else {
-            ret = bdrv_co_writev(job->target,
-                                 start * sectors_per_cluster, n,
-                                 &bounce_qiov);
-        }
-        if (ret < 0) {
-            trace_backup_do_cow_write_fail(job, start, ret);
-            if (error_is_read) {
-                *error_is_read = false;
+            ret = backup_write_target(job, start * sectors_per_cluster, n,
+                                      &bounce_qiov);
+            if (ret < 0) {
+                trace_backup_do_cow_write_fail(job, start, ret);
+                if (error_is_read) {
+                    *error_is_read = false;
+                }
+                goto out;
             }
-            goto out;
+            qemu_vfree(bounce_buffer);
         }
+        bounce_buffer = NULL;
 
-        set_bit(start, job->done_bitmap);
-
-        /* Publish progress, guest I/O counts as progress too.  Note that the
-         * offset field is an opaque progress value, it is not a disk offset.
-         */
-        job->sectors_read += n;
-        job->common.offset += n * BDRV_SECTOR_SIZE;
+        backup_clusters_done(job, start, nb_clusters, n);
+        copied = true;
     }
 
 out:
@@ -186,6 +332,11 @@ out:
 
     cow_request_end(&cow_request);
 
+    if (is_write_notifier && copied) {
+        job->cow_requests++;
+        job->cow_wait_ns += qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_ns;
+    }
+
     trace_backup_do_cow_return(job, sector_num, nb_sectors, ret);
 
     qemu_co_rwlock_unlock(&job->flush_rwlock);
@@ -250,10 +401,21 @@ static void backup_abort(BlockJob *job)
     }
 }
 
+static void backup_query(BlockJob *job, BlockJobInfo *info)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    info->has_cow_requests = true;
+    info->cow_requests = s->cow_requests;
+    info->has_cow_wait_ns = true;
+    info->cow_wait_ns = s->cow_wait_ns;
+}
+
 static const BlockJobDriver backup_job_driver = {
     .instance_size  = sizeof(BackupBlockJob),
     .job_type       = BLOCK_JOB_TYPE_BACKUP,
     .set_speed      = backup_set_speed,
+    .query          = backup_query,
     .commit         = backup_commit,
     .abort          = backup_abort,
 };
@@ -285,9 +447,14 @@ static void backup_complete(BlockJob *job, void *opaque)
     g_free(data);
 }
 
+static bool backup_should_stop(BackupBlockJob *job)
+{
+    return block_job_is_cancelled(&job->common) || job->offload_ret < 0;
+}
+
 static bool coroutine_fn yield_and_check(BackupBlockJob *job)
 {
-    if (block_job_is_cancelled(&job->common)) {
+    if (backup_should_stop(job)) {
         return true;
     }
 
@@ -303,7 +470,7 @@ static bool coroutine_fn yield_and_check(BackupBlockJob *job)
         block_job_sleep_ns(&job->common, QEMU_CLOCK_REALTIME, 0);
     }
 
-    if (block_job_is_cancelled(&job->common)) {
+    if (backup_should_stop(job)) {
         return true;
     }
 
@@ -314,10 +481,11 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
 {
     bool error_is_read;
     int ret = 0;
-    int clusters_per_iter;
+    int64_t clusters_per_iter;
     uint32_t granularity;
     int64_t sector;
     int64_t cluster;
+    int64_t nb_clusters;
     int64_t end;
     int64_t last_cluster = -1;
     int64_t sectors_per_cluster = cluster_size_sectors(job);
@@ -338,14 +506,16 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
                                    job->cluster_size);
         }
 
-        for (end = cluster + clusters_per_iter; cluster < end; cluster++) {
+        for (end = cluster + clusters_per_iter; cluster < end;
+             cluster += nb_clusters) {
+            nb_clusters = MIN(end - cluster, job->copy_clusters_max);
             do {
                 if (yield_and_check(job)) {
                     return ret;
                 }
                 ret = backup_do_cow(bs, cluster * sectors_per_cluster,
-                                    sectors_per_cluster, &error_is_read,
-                                    false);
+                                    nb_clusters * sectors_per_cluster,
+                                    &error_is_read, false);
                 if ((ret < 0) &&
                     backup_error_action(job, error_is_read, -ret) ==
                     BLOCK_ERROR_ACTION_REPORT) {
@@ -372,6 +542,165 @@ static int coroutine_fn backup_run_incremental(BackupBlockJob *job)
     return ret;
 }
 
+static void coroutine_fn backup_wait_for_worker(BackupBlockJob *job)
+{
+    assert(!job->waiting_for_worker);
+    job->waiting_for_worker = true;
+    qemu_coroutine_yield();
+    job->waiting_for_worker = false;
+}
+
+static void coroutine_fn backup_worker_entry(void *opaque)
+{
+    BackupWorker *w = opaque;
+    BackupBlockJob *job = w->job;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    bool error_is_read;
+    int ret;
+
+    ret = backup_do_cow(job->common.bs, w->cluster * sectors_per_cluster,
+                        w->nb_clusters * sectors_per_cluster,
+                        &error_is_read, false);
+    if (ret < 0 &&
+        (job->worker_ret == 0 || w->cluster < job->worker_error_cluster)) {
+        job->worker_ret = ret;
+        job->worker_error_is_read = error_is_read;
+        job->worker_error_cluster = w->cluster;
+    }
+    g_free(w);
+
+    job->workers_in_flight--;
+    if (job->waiting_for_worker) {
+        qemu_coroutine_enter(job->common.co, NULL);
+    }
+}
+
+static void coroutine_fn backup_start_worker(BackupBlockJob *job,
+                                             int64_t cluster,
+                                             int64_t nb_clusters)
+{
+    BackupWorker *w = g_new0(BackupWorker, 1);
+    Coroutine *co;
+
+    w->job = job;
+    w->cluster = cluster;
+    w->nb_clusters = nb_clusters;
+
+    job->workers_in_flight++;
+    co = qemu_coroutine_create(backup_worker_entry);
+    qemu_coroutine_enter(co, w);
+}
+
+/* Return true if @cluster needs to be copied by the background loop */
+static bool coroutine_fn backup_cluster_needs_copy(BackupBlockJob *job,
+                                                   int64_t cluster)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int i, n;
+    int alloced = 0;
+
+    if (test_bit(cluster, job->done_bitmap)) {
+        return false;
+    }
+
+    /* FULL sync mode we copy the whole drive. */
+    if (job->sync_mode != MIRROR_SYNC_MODE_TOP) {
+        return true;
+    }
+
+    /* Check to see if these blocks are already in the backing file. */
+    for (i = 0; i < sectors_per_cluster;) {
+        /* bdrv_is_allocated() only returns true/false based
+         * on the first set of sectors it comes across that
+         * are are all in the same state.
+         * For that reason we must verify each sector in the
+         * backup cluster length.  We end up copying more than
+         * needed but at some point that is always the case. */
+        alloced =
+            bdrv_is_allocated(bs,
+                    cluster * sectors_per_cluster + i,
+                    sectors_per_cluster - i, &n);
+        i += n;
+
+        if (alloced == 1 || n == 0) {
+            break;
+        }
+    }
+
+    /* If the above loop never found any sectors that are in
+     * the topmost image, skip this backup. */
+    return alloced != 0;
+}
+
+/* Copy the whole drive (FULL) or its topmost layer (TOP), keeping up to
+ * job->max_workers requests in flight.
+ */
+static int coroutine_fn backup_run_copy(BackupBlockJob *job)
+{
+    int64_t start = 0;
+    int64_t end = DIV_ROUND_UP(job->common.len, job->cluster_size);
+    int64_t n;
+    int ret = 0;
+
+    for (;;) {
+        if (start >= end) {
+            /* Requests that are still in flight may fail and need a retry */
+            while (job->workers_in_flight > 0) {
+                backup_wait_for_worker(job);
+            }
+            if (job->worker_ret == 0) {
+                break;
+            }
+        }
+
+        if (job->worker_ret < 0) {
+            /* Depending on error action, fail now or retry starting at the
+             * first failed cluster; clusters copied in the meantime are
+             * skipped thanks to the done bitmap.
+             */
+            BlockErrorAction action =
+                backup_error_action(job, job->worker_error_is_read,
+                                    -job->worker_ret);
+            if (action == BLOCK_ERROR_ACTION_REPORT) {
+                ret = job->worker_ret;
+                break;
+            }
+            start = job->worker_error_cluster;
+            job->worker_ret = 0;
+        }
+
+        if (job->workers_in_flight >= job->max_workers) {
+            backup_wait_for_worker(job);
+            continue;
+        }
+
+        if (yield_and_check(job)) {
+            break;
+        }
+
+        if (!backup_cluster_needs_copy(job, start)) {
+            start++;
+            continue;
+        }
+
+        for (n = 1; n < job->copy_clusters_max && start + n < end; n++) {
+            if (!backup_cluster_needs_copy(job, start + n)) {
+                break;
+            }
+        }
+
+        backup_start_worker(job, start, n);
+        start += n;
+    }
+
+    while (job->workers_in_flight > 0) {
+        backup_wait_for_worker(job);
+    }
+
+    return ret;
+}
+
 static void coroutine_fn backup_run(void *opaque)
 {
     BackupBlockJob *job = opaque;
@@ -381,14 +710,13 @@ static void coroutine_fn backup_run(void *opaque)
     NotifierWithReturn before_write = {
         .notify = backup_before_write_notify,
     };
-    int64_t start, end;
-    int64_t sectors_per_cluster = cluster_size_sectors(job);
+    int64_t end;
     int ret = 0;
 
     QLIST_INIT(&job->inflight_reqs);
     qemu_co_rwlock_init(&job->flush_rwlock);
+    qemu_co_queue_init(&job->offload_queue);
 
-    start = 0;
     end = DIV_ROUND_UP(job->common.len, job->cluster_size);
 
     job->done_bitmap = bitmap_new(end);
@@ -396,7 +724,7 @@ static void coroutine_fn backup_run(void *opaque)
     bdrv_add_before_write_notifier(bs, &before_write);
 
     if (job->sync_mode == MIRROR_SYNC_MODE_NONE) {
-        while (!block_job_is_cancelled(&job->common)) {
+        while (!backup_should_stop(job)) {
             /* Yield until the job is cancelled.  We just let our before_write
              * notify callback service CoW requests. */
             job->common.busy = false;
@@ -407,67 +735,21 @@ static void coroutine_fn backup_run(void *opaque)
         ret = backup_run_incremental(job);
     } else {
         /* Both FULL and TOP SYNC_MODE's require copying.. */
-        for (; start < end; start++) {
-            bool error_is_read;
-            if (yield_and_check(job)) {
-                break;
-            }
-
-            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
-                int i, n;
-                int alloced = 0;
-
-                /* Check to see if these blocks are already in the
-                 * backing file. */
-
-                for (i = 0; i < sectors_per_cluster;) {
-                    /* bdrv_is_allocated() only returns true/false based
-                     * on the first set of sectors it comes across that
-                     * are are all in the same state.
-                     * For that reason we must verify each sector in the
-                     * backup cluster length.  We end up copying more than
-                     * needed but at some point that is always the case. */
-                    alloced =
-                        bdrv_is_allocated(bs,
-                                start * sectors_per_cluster + i,
-                                sectors_per_cluster - i, &n);
-                    i += n;
-
-                    if (alloced == 1 || n == 0) {
-                        break;
-                    }
-                }
-
-                /* If the above loop never found any sectors that are in
-                 * the topmost image, skip this backup. */
-                if (alloced == 0) {
-                    continue;
-                }
-            }
-            /* FULL sync mode we copy the whole drive. */
-            ret = backup_do_cow(bs, start * sectors_per_cluster,
-                                sectors_per_cluster, &error_is_read, false);
-            if (ret < 0) {
-                /* Depending on error action, fail now or retry cluster */
-                BlockErrorAction action =
-                    backup_error_action(job, error_is_read, -ret);
-                if (action == BLOCK_ERROR_ACTION_REPORT) {
-                    break;
-                } else {
-                    start--;
-                    continue;
-                }
-            }
-        }
+        ret = backup_run_copy(job);
     }
 
     notifier_with_return_remove(&before_write);
 
-    /* wait until pending backup_do_cow() calls have completed */
+    /* wait until pending backup_do_cow() calls and target writes issued on
+     * behalf of guest writes have completed */
     qemu_co_rwlock_wrlock(&job->flush_rwlock);
     qemu_co_rwlock_unlock(&job->flush_rwlock);
     g_free(job->done_bitmap);
 
+    if (ret >= 0 && job->offload_ret < 0) {
+        ret = job->offload_ret;
+    }
+
     bdrv_op_unblock_all(target, job->common.blocker);
 
     data = g_malloc(sizeof(*data));
@@ -477,7 +759,7 @@ static void coroutine_fn backup_run(void *opaque)
 
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
-                  BdrvDirtyBitmap *sync_bitmap,
+                  BdrvDirtyBitmap *sync_bitmap, int64_t max_workers,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
@@ -516,6 +798,12 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    if (max_workers < 1 || max_workers > BACKUP_MAX_WORKERS_MAX) {
+        error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "max-workers",
+                   "a value between 1 and 64");
+        return;
+    }
+
     if (sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
         if (!sync_bitmap) {
             error_setg(errp, "must provide a valid bitmap name for "
@@ -572,6 +860,8 @@ void backup_start(BlockDriverState *bs, BlockDriverState *target,
     } else {
         job->cluster_size = MAX(BACKUP_CLUSTER_SIZE_DEFAULT, bdi.cluster_size);
     }
+    job->copy_clusters_max = MAX(BACKUP_COPY_SIZE_MAX / job->cluster_size, 1);
+    job->max_workers = max_workers;
 
     bdrv_op_block_all(target, job->common.blocker);
     job->common.len = len;
@@ -892,6 +892,66 @@ int blk_write_zeroes(BlockBackend *blk, int64_t offset,
                    flags | BDRV_REQ_ZERO_WRITE);
 }
 
+typedef struct BlkCopyRangeCo {
+    BlockBackend *blk_in;
+    int64_t off_in;
+    BlockBackend *blk_out;
+    int64_t off_out;
+    int bytes;
+    int ret;
+} BlkCopyRangeCo;
+
+static void blk_copy_range_entry(void *opaque)
+{
+    BlkCopyRangeCo *cco = opaque;
+
+    cco->ret = bdrv_co_copy_range(blk_bs(cco->blk_in),
+                                  cco->off_in >> BDRV_SECTOR_BITS,
+                                  blk_bs(cco->blk_out),
+                                  cco->off_out >> BDRV_SECTOR_BITS,
+                                  cco->bytes >> BDRV_SECTOR_BITS, 0);
+}
+
+int blk_copy_range(BlockBackend *blk_in, int64_t off_in,
+                   BlockBackend *blk_out, int64_t off_out, int bytes)
+{
+    AioContext *aio_context;
+    Coroutine *co;
+    BlkCopyRangeCo cco;
+    int ret;
+
+    ret = blk_check_byte_request(blk_in, off_in, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    ret = blk_check_byte_request(blk_out, off_out, bytes);
+    if (ret < 0) {
+        return ret;
+    }
+    if ((off_in | off_out | bytes) & (BDRV_SECTOR_SIZE - 1)) {
+        return -ENOTSUP;
+    }
+
+    cco = (BlkCopyRangeCo) {
+        .blk_in     = blk_in,
+        .off_in     = off_in,
+        .blk_out    = blk_out,
+        .off_out    = off_out,
+        .bytes      = bytes,
+        .ret        = NOT_DONE,
+    };
+
+    co = qemu_coroutine_create(blk_copy_range_entry);
+    qemu_coroutine_enter(co, &cco);
+
+    aio_context = blk_get_aio_context(blk_out);
+    while (cco.ret == NOT_DONE) {
+        aio_poll(aio_context, true);
+    }
+
+    return cco.ret;
+}
+
 static void error_callback_bh(void *opaque)
 {
     struct BlockBackendAIOCB *acb = opaque;
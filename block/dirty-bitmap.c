@@ -42,6 +42,7 @@ struct BdrvDirtyBitmap {
     char *name;                 /* Optional non-empty unique ID */
     int64_t size;               /* Size of the bitmap (Number of sectors) */
     bool disabled;              /* Bitmap is read-only */
+    bool skip_notified;         /* Writes seen by a notifier are not set */
     QLIST_ENTRY(BdrvDirtyBitmap) list;
 };
 
@@ -263,6 +264,18 @@ void bdrv_enable_dirty_bitmap(BdrvDirtyBitmap *bitmap)
     bitmap->disabled = false;
 }
 
+/**
+ * Do not mark sectors dirty for successful writes that have been passed to
+ * the after-write notifiers.  The owner of the bitmap is then responsible for
+ * handling those writes itself.  Failed writes and discards still mark the
+ * bitmap dirty.
+ */
+void bdrv_dirty_bitmap_skip_notified_writes(BdrvDirtyBitmap *bitmap,
+                                            bool skip)
+{
+    bitmap->skip_notified = skip;
+}
+
 BlockDirtyInfoList *bdrv_query_dirty_bitmaps(BlockDriverState *bs)
 {
     BdrvDirtyBitmap *bm;
@@ -329,14 +342,14 @@ void bdrv_set_dirty_bitmap(BdrvDirtyBitmap *bitmap,
                            int64_t cur_sector, int nr_sectors)
 {
     assert(bdrv_dirty_bitmap_enabled(bitmap));
-    hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+    hbitmap_set_atomic(bitmap->bitmap, cur_sector, nr_sectors);
 }
 
 void bdrv_reset_dirty_bitmap(BdrvDirtyBitmap *bitmap,
                              int64_t cur_sector, int nr_sectors)
 {
     assert(bdrv_dirty_bitmap_enabled(bitmap));
-    hbitmap_reset(bitmap->bitmap, cur_sector, nr_sectors);
+    hbitmap_reset_atomic(bitmap->bitmap, cur_sector, nr_sectors);
 }
 
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out)
@@ -361,14 +374,17 @@ void bdrv_undo_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap *in)
 }
 
 void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector,
-                    int nr_sectors)
+                    int nr_sectors, bool notified)
 {
     BdrvDirtyBitmap *bitmap;
     QLIST_FOREACH(bitmap, &bs->dirty_bitmaps, list) {
         if (!bdrv_dirty_bitmap_enabled(bitmap)) {
             continue;
         }
-        hbitmap_set(bitmap->bitmap, cur_sector, nr_sectors);
+        if (notified && bitmap->skip_notified) {
+            continue;
+        }
+        hbitmap_set_atomic(bitmap->bitmap, cur_sector, nr_sectors);
     }
 }
 
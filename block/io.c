@@ -1259,7 +1259,14 @@ static int coroutine_fn bdrv_aligned_pwritev(BlockDriverState *bs,
     }
     bdrv_debug_event(bs, BLKDBG_PWRITEV_DONE);
 
-    bdrv_set_dirty(bs, sector_num, nb_sectors);
+    if (ret >= 0) {
+        req->qiov = qiov;
+        req->flags = flags;
+        ret = notifier_with_return_list_notify(&bs->after_write_notifiers,
+                                               req);
+    }
+
+    bdrv_set_dirty(bs, sector_num, nb_sectors, ret >= 0);
 
     if (bs->wr_highest_offset < offset + bytes) {
         bs->wr_highest_offset = offset + bytes;
@@ -1519,6 +1526,114 @@ int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs,
                              BDRV_REQ_ZERO_WRITE | flags);
 }
 
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+                                         int64_t src_sector,
+                                         BlockDriverState *dst,
+                                         int64_t dst_sector, int nb_sectors,
+                                         BdrvRequestFlags flags)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (!src->drv->bdrv_co_copy_range_from) {
+        return -ENOTSUP;
+    }
+    ret = bdrv_check_request(src, src_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    tracked_request_begin(&req, src, src_sector << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, BDRV_TRACKED_READ);
+    if (!(flags & BDRV_REQ_NO_SERIALISING)) {
+        wait_serialising_requests(&req);
+    }
+    ret = src->drv->bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                            nb_sectors, flags);
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+                                       int64_t src_sector,
+                                       BlockDriverState *dst,
+                                       int64_t dst_sector, int nb_sectors)
+{
+    BdrvTrackedRequest req;
+    int ret;
+
+    if (!src->drv || !dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (!dst->drv->bdrv_co_copy_range_to) {
+        return -ENOTSUP;
+    }
+    if (dst->read_only) {
+        return -EPERM;
+    }
+    ret = bdrv_check_request(dst, dst_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Write notifiers need to see the data, which never reaches QEMU here */
+    if (!QLIST_EMPTY(&dst->before_write_notifiers.notifiers) ||
+        !QLIST_EMPTY(&dst->after_write_notifiers.notifiers)) {
+        return -ENOTSUP;
+    }
+
+    tracked_request_begin(&req, dst, dst_sector << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS, BDRV_TRACKED_WRITE);
+    wait_serialising_requests(&req);
+    ret = dst->drv->bdrv_co_copy_range_to(dst, src, src_sector, dst_sector,
+                                          nb_sectors);
+    if (ret >= 0) {
+        bdrv_set_dirty(dst, dst_sector, nb_sectors, false);
+        if (dst->wr_highest_offset < (dst_sector + nb_sectors) *
+                                     BDRV_SECTOR_SIZE) {
+            dst->wr_highest_offset = (dst_sector + nb_sectors) *
+                                     BDRV_SECTOR_SIZE;
+        }
+        dst->total_sectors = MAX(dst->total_sectors, dst_sector + nb_sectors);
+    }
+    tracked_request_end(&req);
+
+    return ret;
+}
+
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+                                    BlockDriverState *dst, int64_t dst_sector,
+                                    int nb_sectors, BdrvRequestFlags flags)
+{
+    int ret;
+
+    trace_bdrv_co_copy_range(src, src_sector, dst, dst_sector, nb_sectors);
+
+    if (!dst->drv) {
+        return -ENOMEDIUM;
+    }
+    if (dst->read_only) {
+        return -EPERM;
+    }
+    ret = bdrv_check_request(dst, dst_sector, nb_sectors);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* The destination is written without going through its write path */
+    if (!QLIST_EMPTY(&dst->before_write_notifiers.notifiers) ||
+        !QLIST_EMPTY(&dst->after_write_notifiers.notifiers)) {
+        return -ENOTSUP;
+    }
+
+    return bdrv_co_copy_range_from(src, src_sector, dst, dst_sector,
+                                   nb_sectors, flags);
+}
+
 typedef struct BdrvCoGetBlockStatusData {
     BlockDriverState *bs;
     BlockDriverState *base;
@@ -2233,7 +2348,7 @@ int coroutine_fn bdrv_co_discard(BlockDriverState *bs, int64_t sector_num,
 
     tracked_request_begin(&req, bs, sector_num, nb_sectors,
                           BDRV_TRACKED_DISCARD);
-    bdrv_set_dirty(bs, sector_num, nb_sectors);
+    bdrv_set_dirty(bs, sector_num, nb_sectors, false);
 
     max_discard = MIN_NON_ZERO(bs->bl.max_discard, BDRV_REQUEST_MAX_SECTORS);
     while (nb_sectors > 0) {
@@ -2478,6 +2593,12 @@ void bdrv_add_before_write_notifier(BlockDriverState *bs,
     notifier_with_return_list_add(&bs->before_write_notifiers, notifier);
 }
 
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier)
+{
+    notifier_with_return_list_add(&bs->after_write_notifiers, notifier);
+}
+
 void bdrv_io_plug(BlockDriverState *bs)
 {
     BdrvChild *child;
@@ -13,6 +13,7 @@
 #include "qemu/queue.h"
 #include "block/raw-aio.h"
 #include "qemu/event_notifier.h"
+#include "qemu/atomic.h"
 
 #include <libaio.h>
 
@@ -152,6 +153,41 @@ static void qemu_laio_completion_cb(EventNotifier *e)
     }
 }
 
+/* Layout of the completion ring that io_setup() maps into our address
+ * space; the io_context_t handle points to it.
+ */
+struct aio_ring {
+    unsigned id;
+    unsigned nr;
+    unsigned head;
+    unsigned tail;
+    unsigned magic;
+    unsigned compat_features;
+    unsigned incompat_features;
+    unsigned header_length;
+    struct io_event io_events[0];
+};
+
+#define AIO_RING_MAGIC 0xa10a10a1
+
+/* Busy polling callback: peek at the completion ring without entering the
+ * kernel and reap completions if there are any.
+ */
+static bool qemu_laio_poll_cb(void *opaque)
+{
+    EventNotifier *e = opaque;
+    LinuxAioState *s = container_of(e, LinuxAioState, e);
+    struct aio_ring *ring = (struct aio_ring *)s->ctx;
+
+    if (ring->magic != AIO_RING_MAGIC ||
+        atomic_read(&ring->head) == atomic_read(&ring->tail)) {
+        return false;
+    }
+
+    qemu_laio_completion_bh(s);
+    return true;
+}
+
 static void laio_cancel(BlockAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -286,6 +322,7 @@ void laio_attach_aio_context(LinuxAioState *s, AioContext *new_context)
     s->completion_bh = aio_bh_new(new_context, qemu_laio_completion_bh, s);
     aio_set_event_notifier(new_context, &s->e, false,
                            qemu_laio_completion_cb);
+    aio_set_event_notifier_poll(new_context, &s->e, qemu_laio_poll_cb);
 }
 
 LinuxAioState *laio_init(void)
@@ -33,6 +33,8 @@ typedef struct MirrorBuffer {
     QSIMPLEQ_ENTRY(MirrorBuffer) next;
 } MirrorBuffer;
 
+typedef struct MirrorOp MirrorOp;
+
 typedef struct MirrorBlockJob {
     BlockJob common;
     RateLimit limit;
@@ -45,6 +47,7 @@ typedef struct MirrorBlockJob {
     /* Used to block operations on the drive-mirror-replace target */
     Error *replace_blocker;
     bool is_none_mode;
+    MirrorCopyMode copy_mode;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     bool should_complete;
@@ -66,14 +69,25 @@ typedef struct MirrorBlockJob {
     bool waiting_for_io;
     int target_cluster_sectors;
     int max_iov;
+
+    /* Operations that read from the source or write to the target */
+    QTAILQ_HEAD(, MirrorOp) ops_in_flight;
+    /* Write-blocking mode: guest writes are copied by this notifier */
+    NotifierWithReturn after_write;
+    bool active_writes_enabled;
+    int active_write_in_flight;
 } MirrorBlockJob;
 
-typedef struct MirrorOp {
+struct MirrorOp {
     MirrorBlockJob *s;
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
-} MirrorOp;
+
+    /* Guest writes waiting for this operation to reach the target */
+    CoQueue waiting_requests;
+    QTAILQ_ENTRY(MirrorOp) next;
+};
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
                                             int error)
@@ -97,6 +111,11 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
 
     trace_mirror_iteration_done(s, op->sector_num, op->nb_sectors, ret);
 
+    QTAILQ_REMOVE(&s->ops_in_flight, op, next);
+    while (qemu_co_enter_next(&op->waiting_requests)) {
+        /* Writers find the next conflicting operation themselves */
+    }
+
     s->in_flight--;
     s->sectors_in_flight -= op->nb_sectors;
     iov = op->qiov.iov;
@@ -272,6 +291,8 @@ static int mirror_do_read(MirrorBlockJob *s, int64_t sector_num,
     /* Copy the dirty cluster.  */
     s->in_flight++;
     s->sectors_in_flight += nb_sectors;
+    qemu_co_queue_init(&op->waiting_requests);
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, op, next);
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
 
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
@@ -295,6 +316,8 @@ static void mirror_do_zero_or_discard(MirrorBlockJob *s,
 
     s->in_flight++;
     s->sectors_in_flight += nb_sectors;
+    qemu_co_queue_init(&op->waiting_requests);
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, op, next);
     if (is_discard) {
         bdrv_aio_discard(s->target, sector_num, op->nb_sectors,
                          mirror_write_complete, op);
@@ -440,6 +463,133 @@ static void mirror_drain(MirrorBlockJob *s)
     }
 }
 
+/* Wait until no operation that overlaps [sector_num, sector_num + nb_sectors)
+ * is in flight.  Called from guest write requests in write-blocking mode.
+ */
+static void coroutine_fn mirror_wait_on_conflicts(MirrorBlockJob *s,
+                                                  int64_t sector_num,
+                                                  int nb_sectors)
+{
+    MirrorOp *op;
+
+retry:
+    QTAILQ_FOREACH(op, &s->ops_in_flight, next) {
+        if (op->sector_num < sector_num + nb_sectors &&
+            sector_num < op->sector_num + op->nb_sectors) {
+            qemu_co_queue_wait(&op->waiting_requests);
+            goto retry;
+        }
+    }
+}
+
+/* Write-blocking mode: copy a guest write that has just completed on the
+ * source to the target before the request completes.  Chunks that are fully
+ * covered by the write are in sync afterwards; partially covered chunks keep
+ * whatever dirty state they had, because the target received exactly the
+ * bytes that changed on the source.
+ */
+static int coroutine_fn mirror_after_write_notify(NotifierWithReturn *notifier,
+                                                  void *opaque)
+{
+    MirrorBlockJob *s = container_of(notifier, MirrorBlockJob, after_write);
+    BdrvTrackedRequest *req = opaque;
+    int64_t sector_num = req->offset >> BDRV_SECTOR_BITS;
+    int nb_sectors = req->bytes >> BDRV_SECTOR_BITS;
+    int sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    int64_t end = s->bdev_length / BDRV_SECTOR_SIZE;
+    int64_t clean_start, clean_end;
+    MirrorOp op = {
+        .s          = s,
+        .sector_num = sector_num,
+        .nb_sectors = nb_sectors,
+    };
+    int ret;
+
+    assert(req->bs == s->common.bs);
+    assert(req->type == BDRV_TRACKED_WRITE);
+
+    /* Overlapping operations that are still in flight may carry older data
+     * for these sectors to the target; let them finish first.
+     */
+    mirror_wait_on_conflicts(s, sector_num, nb_sectors);
+
+    qemu_co_queue_init(&op.waiting_requests);
+    QTAILQ_INSERT_TAIL(&s->ops_in_flight, &op, next);
+    s->active_write_in_flight++;
+    trace_mirror_active_write(s, sector_num, nb_sectors);
+
+    if (req->flags & BDRV_REQ_ZERO_WRITE) {
+        ret = bdrv_co_write_zeroes(s->target, sector_num, nb_sectors,
+                                   req->flags & BDRV_REQ_MAY_UNMAP);
+    } else {
+        ret = bdrv_co_writev(s->target, sector_num, nb_sectors, req->qiov);
+    }
+
+    if (ret < 0) {
+        BlockErrorAction action;
+
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
+        action = mirror_error_action(s, false, -ret);
+        if (action == BLOCK_ERROR_ACTION_REPORT && s->ret >= 0) {
+            s->ret = ret;
+        }
+    } else {
+        clean_start = QEMU_ALIGN_UP(sector_num, sectors_per_chunk);
+        clean_end = sector_num + nb_sectors;
+        if (clean_end < end) {
+            clean_end = QEMU_ALIGN_DOWN(clean_end, sectors_per_chunk);
+        }
+        if (clean_start < clean_end) {
+            bdrv_reset_dirty_bitmap(s->dirty_bitmap, clean_start,
+                                    clean_end - clean_start);
+        }
+    }
+
+    QTAILQ_REMOVE(&s->ops_in_flight, &op, next);
+    qemu_co_queue_restart_all(&op.waiting_requests);
+    s->active_write_in_flight--;
+
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+
+    /* Errors on the target are handled by the job, not by the guest */
+    return 0;
+}
+
+/* Start copying guest writes synchronously.  From now on, successful writes
+ * are no longer recorded in the dirty bitmap by the block layer.
+ */
+static void coroutine_fn mirror_enable_active_writes(MirrorBlockJob *s)
+{
+    BlockDriverState *bs = s->common.bs;
+
+    /* Writes that are in flight now could complete without being copied and
+     * without marking the bitmap dirty, so quiesce the source first.
+     */
+    bdrv_drained_begin(bs);
+    bdrv_dirty_bitmap_skip_notified_writes(s->dirty_bitmap, true);
+    s->after_write.notify = mirror_after_write_notify;
+    bdrv_add_after_write_notifier(bs, &s->after_write);
+    s->active_writes_enabled = true;
+    bdrv_drained_end(bs);
+}
+
+static void coroutine_fn mirror_disable_active_writes(MirrorBlockJob *s)
+{
+    if (!s->active_writes_enabled) {
+        return;
+    }
+
+    notifier_with_return_remove(&s->after_write);
+    bdrv_dirty_bitmap_skip_notified_writes(s->dirty_bitmap, false);
+    s->active_writes_enabled = false;
+
+    while (s->active_write_in_flight > 0) {
+        mirror_wait_for_io(s);
+    }
+}
+
 typedef struct {
     int ret;
 } MirrorExitData;
@@ -598,6 +748,10 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
+    if (s->copy_mode == MIRROR_COPY_MODE_WRITE_BLOCKING) {
+        mirror_enable_active_writes(s);
+    }
+
     bdrv_dirty_iter_init(s->dirty_bitmap, &s->hbi);
     for (;;) {
         uint64_t delay_ns = 0;
@@ -696,6 +850,8 @@ static void coroutine_fn mirror_run(void *opaque)
     }
 
 immediate_exit:
+    mirror_disable_active_writes(s);
+
     if (s->in_flight > 0) {
         /* We get here only if something went wrong.  Either the job failed,
          * or it was cancelled prematurely so that we do not guarantee that
@@ -795,6 +951,7 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
                              const char *replaces,
                              int64_t speed, uint32_t granularity,
                              int64_t buf_size,
+                             MirrorCopyMode copy_mode,
                              BlockdevOnError on_source_error,
                              BlockdevOnError on_target_error,
                              bool unmap,
@@ -846,10 +1003,12 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
     s->on_target_error = on_target_error;
     s->target = target;
     s->is_none_mode = is_none_mode;
+    s->copy_mode = copy_mode;
     s->base = base;
     s->granularity = granularity;
     s->buf_size = ROUND_UP(buf_size, granularity);
     s->unmap = unmap;
+    QTAILQ_INIT(&s->ops_in_flight);
 
     s->dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
     if (!s->dirty_bitmap) {
@@ -868,7 +1027,8 @@ static void mirror_start_job(BlockDriverState *bs, BlockDriverState *target,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap,
                   BlockCompletionFunc *cb,
@@ -884,7 +1044,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     is_none_mode = mode == MIRROR_SYNC_MODE_NONE;
     base = mode == MIRROR_SYNC_MODE_TOP ? backing_bs(bs) : NULL;
     mirror_start_job(bs, target, replaces,
-                     speed, granularity, buf_size,
+                     speed, granularity, buf_size, copy_mode,
                      on_source_error, on_target_error, unmap, cb, opaque, errp,
                      &mirror_job_driver, is_none_mode, base);
 }
@@ -932,7 +1092,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
     }
 
     bdrv_ref(base);
-    mirror_start_job(bs, base, NULL, speed, 0, 0,
+    mirror_start_job(bs, base, NULL, speed, 0, 0, MIRROR_COPY_MODE_BACKGROUND,
                      on_error, on_error, false, cb, opaque, &local_err,
                      &commit_active_job_driver, false, base);
     if (local_err) {
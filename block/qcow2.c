@@ -2492,6 +2492,96 @@ static coroutine_fn int qcow2_co_discard(BlockDriverState *bs,
     return ret;
 }
 
+static int coroutine_fn qcow2_co_copy_range_from(BlockDriverState *bs,
+                                                  int64_t src_sector,
+                                                  BlockDriverState *dst,
+                                                  int64_t dst_sector,
+                                                  int nb_sectors,
+                                                  BdrvRequestFlags flags)
+{
+    BDRVQcow2State *s = bs->opaque;
+    int index_in_cluster;
+    int cur_nr_sectors;
+    uint64_t cluster_offset;
+    int64_t backing_sectors;
+    int ret;
+
+    if (bs->encrypted) {
+        return -ENOTSUP;
+    }
+
+    qemu_co_mutex_lock(&s->lock);
+
+    while (nb_sectors > 0) {
+        cur_nr_sectors = nb_sectors;
+        ret = qcow2_get_cluster_offset(bs, src_sector << 9,
+                                       &cur_nr_sectors, &cluster_offset);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        index_in_cluster = src_sector & (s->cluster_sectors - 1);
+
+        qemu_co_mutex_unlock(&s->lock);
+        switch (ret) {
+        case QCOW2_CLUSTER_UNALLOCATED:
+            if (bs->backing) {
+                backing_sectors = bdrv_nb_sectors(bs->backing->bs);
+                if (backing_sectors < 0) {
+                    ret = backing_sectors;
+                } else if (src_sector + cur_nr_sectors > backing_sectors) {
+                    /* Partly beyond the end of the backing file */
+                    ret = -ENOTSUP;
+                } else {
+                    ret = bdrv_co_copy_range_from(bs->backing->bs, src_sector,
+                                                  dst, dst_sector,
+                                                  cur_nr_sectors, flags);
+                }
+                break;
+            }
+            /* fall through */
+
+        case QCOW2_CLUSTER_ZERO:
+            ret = bdrv_co_write_zeroes(dst, dst_sector, cur_nr_sectors, 0);
+            break;
+
+        case QCOW2_CLUSTER_COMPRESSED:
+            ret = -ENOTSUP;
+            break;
+
+        case QCOW2_CLUSTER_NORMAL:
+            if ((cluster_offset & 511) != 0) {
+                ret = -EIO;
+                break;
+            }
+            ret = bdrv_co_copy_range_from(bs->file->bs,
+                                          (cluster_offset >> 9) +
+                                          index_in_cluster,
+                                          dst, dst_sector, cur_nr_sectors,
+                                          flags);
+            break;
+
+        default:
+            g_assert_not_reached();
+            ret = -EIO;
+            break;
+        }
+        qemu_co_mutex_lock(&s->lock);
+        if (ret < 0) {
+            goto fail;
+        }
+
+        nb_sectors -= cur_nr_sectors;
+        src_sector += cur_nr_sectors;
+        dst_sector += cur_nr_sectors;
+    }
+    ret = 0;
+
+fail:
+    qemu_co_mutex_unlock(&s->lock);
+    return ret;
+}
+
 static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
 {
     BDRVQcow2State *s = bs->opaque;
@@ -3383,6 +3473,7 @@ BlockDriver bdrv_qcow2 = {
 
     .bdrv_co_write_zeroes   = qcow2_co_write_zeroes,
     .bdrv_co_discard        = qcow2_co_discard,
+    .bdrv_co_copy_range_from = qcow2_co_copy_range_from,
     .bdrv_truncate          = qcow2_truncate,
     .bdrv_write_compressed  = qcow2_write_compressed,
     .bdrv_make_empty        = qcow2_make_empty,
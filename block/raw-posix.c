@@ -71,6 +71,9 @@
 #if defined(CONFIG_FALLOCATE_PUNCH_HOLE) || defined(CONFIG_FALLOCATE_ZERO_RANGE)
 #include <linux/falloc.h>
 #endif
+#ifdef CONFIG_COPY_FILE_RANGE
+#include <sys/syscall.h>
+#endif
 #if defined (__FreeBSD__) || defined(__FreeBSD_kernel__)
 #include <sys/disk.h>
 #include <sys/cdio.h>
@@ -148,6 +151,7 @@ typedef struct BDRVRawState {
     bool has_write_zeroes:1;
     bool discard_zeroes:1;
     bool has_fallocate;
+    bool has_copy_range;
     bool needs_alignment;
 } BDRVRawState;
 
@@ -174,6 +178,9 @@ typedef struct RawPosixAIOData {
 #define aio_ioctl_cmd   aio_nbytes /* for QEMU_AIO_IOCTL */
     off_t aio_offset;
     int aio_type;
+    /* Destination for QEMU_AIO_COPY_RANGE */
+    int aio_fd2;
+    off_t aio_offset2;
 } RawPosixAIOData;
 
 #if defined(__FreeBSD__) || defined(__FreeBSD_kernel__)
@@ -530,6 +537,7 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     if (S_ISREG(st.st_mode)) {
         s->discard_zeroes = true;
         s->has_fallocate = true;
+        s->has_copy_range = true;
     }
     if (S_ISBLK(st.st_mode)) {
 #ifdef BLKDISCARDZEROES
@@ -1201,6 +1209,80 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+#ifdef CONFIG_COPY_FILE_RANGE
+static ssize_t qemu_copy_file_range(int in_fd, off_t *in_off, int out_fd,
+                                    off_t *out_off, size_t len,
+                                    unsigned int flags)
+{
+    return syscall(__NR_copy_file_range, in_fd, in_off, out_fd, out_off, len,
+                   flags);
+}
+#endif
+
+static ssize_t handle_aiocb_copy_range(RawPosixAIOData *aiocb)
+{
+#ifdef CONFIG_COPY_FILE_RANGE
+    BDRVRawState *s = aiocb->bs->opaque;
+#endif
+
+#ifdef FICLONERANGE
+    {
+        struct file_clone_range range = {
+            .src_fd         = aiocb->aio_fildes,
+            .src_offset     = aiocb->aio_offset,
+            .src_length     = aiocb->aio_nbytes,
+            .dest_offset    = aiocb->aio_offset2,
+        };
+
+        /* Sharing the extents is cheapest, but only works within one file
+         * system and for ranges aligned to its block size.  Fall back to
+         * copy_file_range() on any error. */
+        if (ioctl(aiocb->aio_fd2, FICLONERANGE, &range) == 0) {
+            return 0;
+        }
+    }
+#endif
+
+#ifdef CONFIG_COPY_FILE_RANGE
+    {
+        off_t in_off = aiocb->aio_offset;
+        off_t out_off = aiocb->aio_offset2;
+        uint64_t bytes = aiocb->aio_nbytes;
+        ssize_t ret;
+
+        while (bytes > 0) {
+            ret = qemu_copy_file_range(aiocb->aio_fildes, &in_off,
+                                       aiocb->aio_fd2, &out_off, bytes, 0);
+            if (ret < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                ret = translate_err(-errno);
+                if (ret == -ENOTSUP || ret == -EXDEV || ret == -EINVAL ||
+                    ret == -EBADF) {
+                    /* E.g. different file systems or overlapping ranges; the
+                     * caller must copy the data itself.  Only stop trying if
+                     * the kernel does not support the system call at all. */
+                    if (ret == -ENOTSUP) {
+                        s->has_copy_range = false;
+                    }
+                    return -ENOTSUP;
+                }
+                return ret;
+            }
+            if (ret == 0) {
+                /* End of the source file; let the caller read zeroes */
+                return -ENOTSUP;
+            }
+            bytes -= ret;
+        }
+        return 0;
+    }
+#endif
+
+    return -ENOTSUP;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -1241,6 +1323,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_WRITE_ZEROES:
         ret = handle_aiocb_write_zeroes(aiocb);
         break;
+    case QEMU_AIO_COPY_RANGE:
+        ret = handle_aiocb_copy_range(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -1251,6 +1336,17 @@ static int aio_worker(void *arg)
     return ret;
 }
 
+/* Flushes, discards and copies can take much longer than reads and
+ * writes; do not let them occupy all threads in the pool.
+ */
+static ThreadPoolPriority paio_priority(int type)
+{
+    if (type & (QEMU_AIO_READ | QEMU_AIO_WRITE | QEMU_AIO_IOCTL)) {
+        return THREAD_POOL_PRIO_LATENCY;
+    }
+    return THREAD_POOL_PRIO_BULK;
+}
+
 static int paio_submit_co(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         int type)
@@ -1273,7 +1369,8 @@ static int paio_submit_co(BlockDriverState *bs, int fd,
 
     trace_paio_submit_co(sector_num, nb_sectors, type);
     pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
-    return thread_pool_submit_co(pool, aio_worker, acb);
+    return thread_pool_submit_co_prio(pool, paio_priority(type),
+                                      aio_worker, acb);
 }
 
 static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
@@ -1298,7 +1395,8 @@ static BlockAIOCB *paio_submit(BlockDriverState *bs, int fd,
 
     trace_paio_submit(acb, opaque, sector_num, nb_sectors, type);
     pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
-    return thread_pool_submit_aio(pool, aio_worker, acb, cb, opaque);
+    return thread_pool_submit_aio_prio(pool, paio_priority(type),
+                                       aio_worker, acb, cb, opaque);
 }
 
 static BlockAIOCB *raw_aio_submit(BlockDriverState *bs,
@@ -1884,6 +1982,50 @@ static int coroutine_fn raw_co_write_zeroes(
     return -ENOTSUP;
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t src_sector,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors,
+                                               BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_to(bs, src_sector, dst, dst_sector, nb_sectors);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BlockDriverState *src,
+                                             int64_t src_sector,
+                                             int64_t dst_sector,
+                                             int nb_sectors)
+{
+    BDRVRawState *s = bs->opaque;
+    BDRVRawState *src_s;
+    RawPosixAIOData *acb;
+    ThreadPool *pool;
+
+    if (src->drv != bs->drv) {
+        return -ENOTSUP;
+    }
+    src_s = src->opaque;
+    if (!s->has_copy_range || !src_s->has_copy_range) {
+        return -ENOTSUP;
+    }
+
+    acb = g_new(RawPosixAIOData, 1);
+    acb->bs = bs;
+    acb->aio_type = QEMU_AIO_COPY_RANGE;
+    acb->aio_fildes = src_s->fd;
+    acb->aio_offset = src_sector * BDRV_SECTOR_SIZE;
+    acb->aio_fd2 = s->fd;
+    acb->aio_offset2 = dst_sector * BDRV_SECTOR_SIZE;
+    acb->aio_nbytes = nb_sectors * BDRV_SECTOR_SIZE;
+
+    trace_paio_submit_co(dst_sector, nb_sectors, QEMU_AIO_COPY_RANGE);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co_prio(pool, THREAD_POOL_PRIO_BULK,
+                                      aio_worker, acb);
+}
+
 static int raw_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVRawState *s = bs->opaque;
@@ -1932,6 +2074,8 @@ BlockDriver bdrv_file = {
     .bdrv_has_zero_init = bdrv_has_zero_init_1,
     .bdrv_co_get_block_status = raw_co_get_block_status,
     .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_co_copy_range_from = raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = raw_co_copy_range_to,
 
     .bdrv_aio_readv = raw_aio_readv,
     .bdrv_aio_writev = raw_aio_writev,
@@ -140,6 +140,32 @@ static int coroutine_fn raw_co_discard(BlockDriverState *bs,
     return bdrv_co_discard(bs->file->bs, sector_num, nb_sectors);
 }
 
+static int coroutine_fn raw_co_copy_range_from(BlockDriverState *bs,
+                                               int64_t src_sector,
+                                               BlockDriverState *dst,
+                                               int64_t dst_sector,
+                                               int nb_sectors,
+                                               BdrvRequestFlags flags)
+{
+    return bdrv_co_copy_range_from(bs->file->bs, src_sector, dst, dst_sector,
+                                   nb_sectors, flags);
+}
+
+static int coroutine_fn raw_co_copy_range_to(BlockDriverState *bs,
+                                             BlockDriverState *src,
+                                             int64_t src_sector,
+                                             int64_t dst_sector,
+                                             int nb_sectors)
+{
+    if (bs->probed && dst_sector == 0) {
+        /* The probe check in raw_co_writev_flags() needs to see the data */
+        return -ENOTSUP;
+    }
+
+    return bdrv_co_copy_range_to(src, src_sector, bs->file->bs, dst_sector,
+                                 nb_sectors);
+}
+
 static int64_t raw_getlength(BlockDriverState *bs)
 {
     return bdrv_getlength(bs->file->bs);
@@ -254,6 +280,8 @@ BlockDriver bdrv_raw = {
     .bdrv_co_writev_flags = &raw_co_writev_flags,
     .bdrv_co_write_zeroes = &raw_co_write_zeroes,
     .bdrv_co_discard      = &raw_co_discard,
+    .bdrv_co_copy_range_from = &raw_co_copy_range_from,
+    .bdrv_co_copy_range_to = &raw_co_copy_range_to,
     .bdrv_co_get_block_status = &raw_co_get_block_status,
     .bdrv_truncate        = &raw_truncate,
     .bdrv_getlength       = &raw_getlength,
@@ -1851,6 +1851,7 @@ static void do_drive_backup(const char *device, const char *target,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
                             BlockJobTxn *txn, Error **errp);
 
 static void drive_backup_prepare(BlkActionState *common, Error **errp)
@@ -1889,6 +1890,7 @@ static void drive_backup_prepare(BlkActionState *common, Error **errp)
                     backup->has_bitmap, backup->bitmap,
                     backup->has_on_source_error, backup->on_source_error,
                     backup->has_on_target_error, backup->on_target_error,
+                    backup->has_max_workers, backup->max_workers,
                     common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -1933,6 +1935,7 @@ static void do_blockdev_backup(const char *device, const char *target,
                                BlockdevOnError on_source_error,
                                bool has_on_target_error,
                                BlockdevOnError on_target_error,
+                               bool has_max_workers, int64_t max_workers,
                                BlockJobTxn *txn, Error **errp);
 
 static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
@@ -1978,6 +1981,7 @@ static void blockdev_backup_prepare(BlkActionState *common, Error **errp)
                        backup->has_speed, backup->speed,
                        backup->has_on_source_error, backup->on_source_error,
                        backup->has_on_target_error, backup->on_target_error,
+                       backup->has_max_workers, backup->max_workers,
                        common->block_job_txn, &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -3187,6 +3191,7 @@ static void do_drive_backup(const char *device, const char *target,
                             BlockdevOnError on_source_error,
                             bool has_on_target_error,
                             BlockdevOnError on_target_error,
+                            bool has_max_workers, int64_t max_workers,
                             BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk;
@@ -3213,6 +3218,9 @@ static void do_drive_backup(const char *device, const char *target,
     if (!has_mode) {
         mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
     }
+    if (!has_max_workers) {
+        max_workers = BACKUP_MAX_WORKERS_DEFAULT;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3301,7 +3309,7 @@ static void do_drive_backup(const char *device, const char *target,
         }
     }
 
-    backup_start(bs, target_bs, speed, sync, bmap,
+    backup_start(bs, target_bs, speed, sync, bmap, max_workers,
                  on_source_error, on_target_error,
                  block_job_cb, bs, txn, &local_err);
     if (local_err != NULL) {
@@ -3322,6 +3330,7 @@ void qmp_drive_backup(const char *device, const char *target,
                       bool has_bitmap, const char *bitmap,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
+                      bool has_max_workers, int64_t max_workers,
                       Error **errp)
 {
     return do_drive_backup(device, target, has_format, format, sync,
@@ -3329,6 +3338,7 @@ void qmp_drive_backup(const char *device, const char *target,
                            has_bitmap, bitmap,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
+                           has_max_workers, max_workers,
                            NULL, errp);
 }
 
@@ -3344,6 +3354,7 @@ void do_blockdev_backup(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
                          BlockJobTxn *txn, Error **errp)
 {
     BlockBackend *blk, *target_blk;
@@ -3361,6 +3372,9 @@ void do_blockdev_backup(const char *device, const char *target,
     if (!has_on_target_error) {
         on_target_error = BLOCKDEV_ON_ERROR_REPORT;
     }
+    if (!has_max_workers) {
+        max_workers = BACKUP_MAX_WORKERS_DEFAULT;
+    }
 
     blk = blk_by_name(device);
     if (!blk) {
@@ -3391,8 +3405,9 @@ void do_blockdev_backup(const char *device, const char *target,
 
     bdrv_ref(target_bs);
     bdrv_set_aio_context(target_bs, aio_context);
-    backup_start(bs, target_bs, speed, sync, NULL, on_source_error,
-                 on_target_error, block_job_cb, bs, txn, &local_err);
+    backup_start(bs, target_bs, speed, sync, NULL, max_workers,
+                 on_source_error, on_target_error,
+                 block_job_cb, bs, txn, &local_err);
     if (local_err != NULL) {
         bdrv_unref(target_bs);
         error_propagate(errp, local_err);
@@ -3408,11 +3423,13 @@ void qmp_blockdev_backup(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_max_workers, int64_t max_workers,
                          Error **errp)
 {
     do_blockdev_backup(device, target, sync, has_speed, speed,
                        has_on_source_error, on_source_error,
                        has_on_target_error, on_target_error,
+                       has_max_workers, max_workers,
                        NULL, errp);
 }
 
@@ -3431,6 +3448,8 @@ static void blockdev_mirror_common(BlockDriverState *bs,
                                    bool has_on_target_error,
                                    BlockdevOnError on_target_error,
                                    bool has_unmap, bool unmap,
+                                   bool has_copy_mode,
+                                   MirrorCopyMode copy_mode,
                                    Error **errp)
 {
 
@@ -3452,6 +3471,9 @@ static void blockdev_mirror_common(BlockDriverState *bs,
     if (!has_unmap) {
         unmap = true;
     }
+    if (!has_copy_mode) {
+        copy_mode = MIRROR_COPY_MODE_BACKGROUND;
+    }
 
     if (granularity != 0 && (granularity < 512 || granularity > 1048576 * 64)) {
         error_setg(errp, QERR_INVALID_PARAMETER_VALUE, "granularity",
@@ -3484,7 +3506,7 @@ static void blockdev_mirror_common(BlockDriverState *bs,
      */
     mirror_start(bs, target,
                  has_replaces ? replaces : NULL,
-                 speed, granularity, buf_size, sync,
+                 speed, granularity, buf_size, sync, copy_mode,
                  on_source_error, on_target_error, unmap,
                  block_job_cb, bs, errp);
 }
@@ -3501,6 +3523,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                       bool has_on_source_error, BlockdevOnError on_source_error,
                       bool has_on_target_error, BlockdevOnError on_target_error,
                       bool has_unmap, bool unmap,
+                      bool has_copy_mode, MirrorCopyMode copy_mode,
                       Error **errp)
 {
     BlockDriverState *bs;
@@ -3638,6 +3661,7 @@ void qmp_drive_mirror(const char *device, const char *target,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            has_unmap, unmap,
+                           has_copy_mode, copy_mode,
                            &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -3657,6 +3681,7 @@ void qmp_blockdev_mirror(const char *device, const char *target,
                          BlockdevOnError on_source_error,
                          bool has_on_target_error,
                          BlockdevOnError on_target_error,
+                         bool has_copy_mode, MirrorCopyMode copy_mode,
                          Error **errp)
 {
     BlockDriverState *bs;
@@ -3696,6 +3721,7 @@ void qmp_blockdev_mirror(const char *device, const char *target,
                            has_on_source_error, on_source_error,
                            has_on_target_error, on_target_error,
                            true, true,
+                           has_copy_mode, copy_mode,
                            &local_err);
     if (local_err) {
         error_propagate(errp, local_err);
@@ -46,6 +46,8 @@
 #include "qapi-event.h"
 #include "hw/nmi.h"
 #include "sysemu/replay.h"
+#include "trace.h"
+#include "trace/control.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -899,6 +901,58 @@ static QemuCond qemu_cpu_cond;
 static QemuCond qemu_pause_cond;
 static QemuCond qemu_work_cond;
 
+static __thread bool iothread_locked = false;
+static __thread int64_t iothread_locked_since;
+
+/* Protected by qemu_global_mutex itself */
+static IOThreadLockStats iothread_lock_stats;
+
+bool qemu_mutex_iothread_locked(void)
+{
+    return iothread_locked;
+}
+
+/* Hold time costs two clock reads per BQL cycle, so it is only measured
+ * while the iothread_lock_hold trace event is enabled.  Contended
+ * acquisitions already paid for a clock read before sleeping.
+ */
+static void iothread_lock_acquired(int64_t wait_start)
+{
+    int64_t now = 0;
+
+    iothread_locked = true;
+    if (wait_start || trace_event_get_state(TRACE_IOTHREAD_LOCK_HOLD)) {
+        now = get_clock();
+    }
+    iothread_locked_since = now;
+
+    iothread_lock_stats.acquisitions++;
+    if (wait_start) {
+        iothread_lock_stats.contended++;
+        iothread_lock_stats.wait_ns += now - wait_start;
+    }
+}
+
+static void iothread_lock_releasing(void)
+{
+    if (iothread_locked_since &&
+        trace_event_get_state(TRACE_IOTHREAD_LOCK_HOLD)) {
+        int64_t hold_ns = get_clock() - iothread_locked_since;
+
+        iothread_lock_stats.hold_ns += hold_ns;
+        trace_iothread_lock_hold(hold_ns);
+    }
+    iothread_locked = false;
+}
+
+/* qemu_cond_wait on the global mutex, keeping hold time accounting right */
+static void qemu_cond_wait_iothread(QemuCond *cond)
+{
+    iothread_lock_releasing();
+    qemu_cond_wait(cond, &qemu_global_mutex);
+    iothread_lock_acquired(0);
+}
+
 void qemu_init_cpu_loop(void)
 {
     qemu_init_sigbus();
@@ -939,7 +993,7 @@ void run_on_cpu(CPUState *cpu, void (*func)(void *data), void *data)
     while (!atomic_mb_read(&wi.done)) {
         CPUState *self_cpu = current_cpu;
 
-        qemu_cond_wait(&qemu_work_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_work_cond);
         current_cpu = self_cpu;
     }
 }
@@ -1014,11 +1068,11 @@ static void qemu_wait_io_event_common(CPUState *cpu)
 static void qemu_tcg_wait_io_event(CPUState *cpu)
 {
     while (all_cpu_threads_idle()) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(cpu->halt_cond);
     }
 
     while (iothread_requesting_mutex) {
-        qemu_cond_wait(&qemu_io_proceeded_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_io_proceeded_cond);
     }
 
     CPU_FOREACH(cpu) {
@@ -1029,7 +1083,7 @@ static void qemu_tcg_wait_io_event(CPUState *cpu)
 static void qemu_kvm_wait_io_event(CPUState *cpu)
 {
     while (cpu_thread_is_idle(cpu)) {
-        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(cpu->halt_cond);
     }
 
     qemu_kvm_eat_signals(cpu);
@@ -1139,7 +1193,7 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
 
     /* wait for initial kick-off after machine start */
     while (first_cpu->stopped) {
-        qemu_cond_wait(first_cpu->halt_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(first_cpu->halt_cond);
 
         /* process any pending work */
         CPU_FOREACH(cpu) {
@@ -1224,40 +1278,45 @@ bool qemu_in_vcpu_thread(void)
     return current_cpu && qemu_cpu_is_self(current_cpu);
 }
 
-static __thread bool iothread_locked = false;
-
-bool qemu_mutex_iothread_locked(void)
-{
-    return iothread_locked;
-}
-
 void qemu_mutex_lock_iothread(void)
 {
+    int64_t wait_start = 0;
+
     atomic_inc(&iothread_requesting_mutex);
     /* In the simple case there is no need to bump the VCPU thread out of
      * TCG code execution.
      */
     if (!tcg_enabled() || qemu_in_vcpu_thread() ||
         !first_cpu || !first_cpu->created) {
-        qemu_mutex_lock(&qemu_global_mutex);
+        if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            wait_start = get_clock();
+            qemu_mutex_lock(&qemu_global_mutex);
+        }
         atomic_dec(&iothread_requesting_mutex);
     } else {
         if (qemu_mutex_trylock(&qemu_global_mutex)) {
+            wait_start = get_clock();
             qemu_cpu_kick_no_halt();
             qemu_mutex_lock(&qemu_global_mutex);
         }
         atomic_dec(&iothread_requesting_mutex);
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
-    iothread_locked = true;
+    iothread_lock_acquired(wait_start);
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
-    iothread_locked = false;
+    iothread_lock_releasing();
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+void qemu_mutex_iothread_get_stats(IOThreadLockStats *stats)
+{
+    assert(qemu_mutex_iothread_locked());
+    *stats = iothread_lock_stats;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUState *cpu;
@@ -1293,7 +1352,7 @@ void pause_all_vcpus(void)
     }
 
     while (!all_vcpus_paused()) {
-        qemu_cond_wait(&qemu_pause_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_pause_cond);
         CPU_FOREACH(cpu) {
             qemu_cpu_kick(cpu);
         }
@@ -1340,7 +1399,7 @@ static void qemu_tcg_init_vcpu(CPUState *cpu)
         cpu->hThread = qemu_thread_get_handle(cpu->thread);
 #endif
         while (!cpu->created) {
-            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+            qemu_cond_wait_iothread(&qemu_cpu_cond);
         }
         tcg_cpu_thread = cpu->thread;
     } else {
@@ -1361,7 +1420,7 @@ static void qemu_kvm_start_vcpu(CPUState *cpu)
     qemu_thread_create(cpu->thread, thread_name, qemu_kvm_cpu_thread_fn,
                        cpu, QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
@@ -1377,7 +1436,7 @@ static void qemu_dummy_start_vcpu(CPUState *cpu)
     qemu_thread_create(cpu->thread, thread_name, qemu_dummy_cpu_thread_fn, cpu,
                        QEMU_THREAD_JOINABLE);
     while (!cpu->created) {
-        qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        qemu_cond_wait_iothread(&qemu_cpu_cond);
     }
 }
 
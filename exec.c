@@ -413,6 +413,26 @@ address_space_translate_internal(AddressSpaceDispatch *d, hwaddr addr, hwaddr *x
     return section;
 }
 
+/* Called from RCU critical section.  An address space whose view is the
+ * same as another's can use that address space's dispatch tree instead
+ * of having its own; memory.c picks the lender in
+ * memory_region_transaction_commit().
+ */
+static AddressSpaceDispatch *address_space_to_dispatch(AddressSpace *as)
+{
+    AddressSpaceDispatch *d;
+
+    /* While a commit is in progress the lender may itself have started
+     * borrowing from another address space, so follow the chain.
+     */
+    while (!(d = atomic_rcu_read(&as->dispatch))) {
+        /* Pairs with the barrier in atomic_rcu_set in mem_commit.  */
+        smp_rmb();
+        as = atomic_rcu_read(&as->dispatch_lender);
+    }
+    return d;
+}
+
 /* Called from RCU critical section */
 MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
                                       hwaddr *xlat, hwaddr *plen,
@@ -423,7 +443,7 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     MemoryRegion *mr;
 
     for (;;) {
-        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        AddressSpaceDispatch *d = address_space_to_dispatch(as);
         section = address_space_translate_internal(d, addr, &addr, plen, true);
         mr = section->mr;
 
@@ -935,19 +955,87 @@ void cpu_abort(CPUState *cpu, const char *fmt, ...)
 }
 
 #if !defined(CONFIG_USER_ONLY)
+static int ram_block_cmp_offset(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->offset < bb->offset ? -1 : ba->offset > bb->offset;
+}
+
+static int ram_block_cmp_host(const void *a, const void *b)
+{
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->host < bb->host ? -1 : ba->host > bb->host;
+}
+
+/* Called with the ramlist lock taken, after ram_list.blocks changed.  */
+static void ram_list_update_index(void)
+{
+    RAMBlockIndex *old_index = ram_list.index;
+    RAMBlockIndex *new_index;
+    RAMBlock *block;
+    unsigned nr = 0;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        nr++;
+    }
+
+    new_index = g_malloc(sizeof(*new_index) + 2 * nr * sizeof(RAMBlock *));
+    new_index->nr = 0;
+    new_index->nr_host = 0;
+    new_index->by_host = new_index->by_offset + nr;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        new_index->by_offset[new_index->nr++] = block;
+        if (block->host) {
+            new_index->by_host[new_index->nr_host++] = block;
+        }
+    }
+    qsort(new_index->by_offset, new_index->nr, sizeof(RAMBlock *),
+          ram_block_cmp_offset);
+    qsort(new_index->by_host, new_index->nr_host, sizeof(RAMBlock *),
+          ram_block_cmp_host);
+
+    atomic_rcu_set(&ram_list.index, new_index);
+    if (old_index) {
+        g_free_rcu(old_index, rcu);
+    }
+}
+
+/* Return the last block in @blocks, sorted by @key, whose key is not
+ * above @val, or NULL if there is none.
+ */
+#define RAM_BLOCK_BSEARCH(blocks, nr, key, val) ({                      \
+        unsigned _lo = 0, _hi = (nr);                                   \
+        while (_lo < _hi) {                                             \
+            unsigned _mid = _lo + (_hi - _lo) / 2;                      \
+            if ((blocks)[_mid]->key <= (val)) {                         \
+                _lo = _mid + 1;                                         \
+            } else {                                                    \
+                _hi = _mid;                                             \
+            }                                                           \
+        }                                                               \
+        _lo ? (blocks)[_lo - 1] : NULL;                                 \
+    })
+
 /* Called from RCU critical section */
 static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
 {
+    RAMBlockIndex *index;
     RAMBlock *block;
 
     block = atomic_rcu_read(&ram_list.mru_block);
     if (block && addr - block->offset < block->max_length) {
         return block;
     }
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->max_length) {
-            goto found;
-        }
+
+    index = atomic_rcu_read(&ram_list.index);
+    block = index ? RAM_BLOCK_BSEARCH(index->by_offset, index->nr,
+                                      offset, addr) : NULL;
+    if (block && addr - block->offset < block->max_length) {
+        goto found;
     }
 
     fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
@@ -1055,7 +1143,7 @@ hwaddr memory_region_section_get_iotlb(CPUState *cpu,
     } else {
         AddressSpaceDispatch *d;
 
-        d = atomic_rcu_read(&section->address_space->dispatch);
+        d = address_space_to_dispatch(section->address_space);
         iotlb = section - d->map.sections;
         iotlb += xlat;
     }
@@ -1181,13 +1269,20 @@ static void register_multipage(AddressSpaceDispatch *d,
     phys_page_set(d, start_addr >> TARGET_PAGE_BITS, num_pages, section_index);
 }
 
+static AddressSpaceDispatch *address_space_next_dispatch(AddressSpace *as);
+
 static void mem_add(MemoryListener *listener, MemoryRegionSection *section)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = as->next_dispatch;
+    AddressSpaceDispatch *d;
     MemoryRegionSection now = *section, remain = *section;
     Int128 page_size = int128_make64(TARGET_PAGE_SIZE);
 
+    if (as->next_dispatch_lender) {
+        return;
+    }
+    d = address_space_next_dispatch(as);
+
     if (now.offset_within_address_space & ~TARGET_PAGE_MASK) {
         uint64_t left = TARGET_PAGE_ALIGN(now.offset_within_address_space)
                        - now.offset_within_address_space;
@@ -1510,6 +1605,133 @@ int qemu_ram_resize(RAMBlock *block, ram_addr_t newsize, Error **errp)
     return 0;
 }
 
+/* Pages dirtied for migration are first recorded in a small per-thread
+ * log, and only merged into ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]
+ * when the log fills up or when migration syncs the dirty bitmap.  This
+ * keeps DMA and TCG writes from many threads from bouncing the cache
+ * lines of the global bitmap.
+ */
+#define DIRTY_LOG_SIZE 256
+
+typedef struct DirtyLogEntry {
+    unsigned long page;
+    unsigned long npages;
+} DirtyLogEntry;
+
+typedef struct DirtyLog {
+    QemuMutex lock;
+    Notifier exit;
+    /* Protected by lock */
+    unsigned nr;
+    DirtyLogEntry entries[DIRTY_LOG_SIZE];
+    /* Protected by dirty_logs_lock */
+    QLIST_ENTRY(DirtyLog) next;
+} DirtyLog;
+
+static QemuMutex dirty_logs_lock;
+static QLIST_HEAD(, DirtyLog) dirty_logs = QLIST_HEAD_INITIALIZER(dirty_logs);
+static __thread DirtyLog *dirty_log;
+
+/* Called with log->lock held */
+static void dirty_log_flush_locked(DirtyLog *log)
+{
+    DirtyMemoryBlocks *blocks;
+    unsigned i;
+
+    rcu_read_lock();
+    blocks = atomic_rcu_read(&ram_list.dirty_memory[DIRTY_MEMORY_MIGRATION]);
+    for (i = 0; i < log->nr; i++) {
+        unsigned long page = log->entries[i].page;
+        unsigned long end = page + log->entries[i].npages;
+
+        while (page < end) {
+            unsigned long idx = page / DIRTY_MEMORY_BLOCK_SIZE;
+            unsigned long offset = page % DIRTY_MEMORY_BLOCK_SIZE;
+            unsigned long num = MIN(end - page,
+                                    DIRTY_MEMORY_BLOCK_SIZE - offset);
+
+            bitmap_set_atomic(blocks->blocks[idx], offset, num);
+            page += num;
+        }
+    }
+    rcu_read_unlock();
+    log->nr = 0;
+}
+
+static void dirty_log_exit(Notifier *n, void *unused)
+{
+    DirtyLog *log = container_of(n, DirtyLog, exit);
+
+    qemu_mutex_lock(&dirty_logs_lock);
+    QLIST_REMOVE(log, next);
+    qemu_mutex_unlock(&dirty_logs_lock);
+
+    qemu_mutex_lock(&log->lock);
+    dirty_log_flush_locked(log);
+    qemu_mutex_unlock(&log->lock);
+
+    qemu_mutex_destroy(&log->lock);
+    g_free(log);
+    dirty_log = NULL;
+}
+
+static DirtyLog *dirty_log_get(void)
+{
+    DirtyLog *log = dirty_log;
+
+    if (!log) {
+        log = g_new0(DirtyLog, 1);
+        qemu_mutex_init(&log->lock);
+        log->exit.notify = dirty_log_exit;
+        qemu_thread_atexit_add(&log->exit);
+
+        qemu_mutex_lock(&dirty_logs_lock);
+        QLIST_INSERT_HEAD(&dirty_logs, log, next);
+        qemu_mutex_unlock(&dirty_logs_lock);
+        dirty_log = log;
+    }
+    return log;
+}
+
+void cpu_physical_memory_log_dirty(ram_addr_t start, ram_addr_t length)
+{
+    unsigned long page = start >> TARGET_PAGE_BITS;
+    unsigned long end = TARGET_PAGE_ALIGN(start + length) >> TARGET_PAGE_BITS;
+    DirtyLog *log = dirty_log_get();
+    DirtyLogEntry *last;
+
+    qemu_mutex_lock(&log->lock);
+    last = log->nr ? &log->entries[log->nr - 1] : NULL;
+    if (last && page <= last->page + last->npages && end >= last->page) {
+        /* Sequential DMA usually extends the previous entry.  */
+        unsigned long last_end = last->page + last->npages;
+
+        last->page = MIN(last->page, page);
+        last->npages = MAX(last_end, end) - last->page;
+    } else {
+        if (log->nr == DIRTY_LOG_SIZE) {
+            dirty_log_flush_locked(log);
+        }
+        log->entries[log->nr].page = page;
+        log->entries[log->nr].npages = end - page;
+        log->nr++;
+    }
+    qemu_mutex_unlock(&log->lock);
+}
+
+void cpu_physical_memory_flush_dirty_logs(void)
+{
+    DirtyLog *log;
+
+    qemu_mutex_lock(&dirty_logs_lock);
+    QLIST_FOREACH(log, &dirty_logs, next) {
+        qemu_mutex_lock(&log->lock);
+        dirty_log_flush_locked(log);
+        qemu_mutex_unlock(&log->lock);
+    }
+    qemu_mutex_unlock(&dirty_logs_lock);
+}
+
 /* Called with ram_list.mutex held */
 static void dirty_memory_extend(ram_addr_t old_ram_size,
                                 ram_addr_t new_ram_size)
@@ -1610,6 +1832,7 @@ static void ram_block_add(RAMBlock *new_block, Error **errp)
         QLIST_INSERT_HEAD_RCU(&ram_list.blocks, new_block, next);
     }
     ram_list.mru_block = NULL;
+    ram_list_update_index();
 
     /* Write list before version */
     smp_wmb();
@@ -1759,6 +1982,7 @@ void qemu_ram_free(RAMBlock *block)
     qemu_mutex_lock_ramlist();
     QLIST_REMOVE_RCU(block, next);
     ram_list.mru_block = NULL;
+    ram_list_update_index();
     /* Write list before version */
     smp_wmb();
     ram_list.version++;
@@ -1934,6 +2158,7 @@ RAMBlock *qemu_ram_block_from_host(void *ptr, bool round_offset,
                                    ram_addr_t *ram_addr,
                                    ram_addr_t *offset)
 {
+    RAMBlockIndex *index;
     RAMBlock *block;
     uint8_t *host = ptr;
 
@@ -1954,14 +2179,12 @@ RAMBlock *qemu_ram_block_from_host(void *ptr, bool round_offset,
         goto found;
     }
 
-    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
-        /* This case append when the block is not mapped. */
-        if (block->host == NULL) {
-            continue;
-        }
-        if (host - block->host < block->max_length) {
-            goto found;
-        }
+    /* Blocks that are not mapped are not in by_host.  */
+    index = atomic_rcu_read(&ram_list.index);
+    block = index ? RAM_BLOCK_BSEARCH(index->by_host, index->nr_host,
+                                      host, host) : NULL;
+    if (block && host - block->host < block->max_length) {
+        goto found;
     }
 
     rcu_read_unlock();
@@ -2034,10 +2257,14 @@ static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
         abort();
     }
     /* Set both VGA and migration bits for simplicity and to remove
-     * the notdirty callback faster.
+     * the notdirty callback faster.  The migration bit must not go
+     * through the dirty log, or cpu_physical_memory_is_clean would keep
+     * sending writes to this page here until the log is flushed.
      */
     cpu_physical_memory_set_dirty_range(ram_addr, size,
-                                        DIRTY_CLIENTS_NOCODE);
+                                        DIRTY_CLIENTS_NOCODE &
+                                        ~(1 << DIRTY_MEMORY_MIGRATION));
+    cpu_physical_memory_set_dirty_flag(ram_addr, DIRTY_MEMORY_MIGRATION);
     /* we remove the notdirty callback only if the code has been
        flushed */
     if (!cpu_physical_memory_is_clean(ram_addr)) {
@@ -2332,12 +2559,20 @@ static void io_mem_init(void)
                           NULL, UINT64_MAX);
 }
 
-static void mem_begin(MemoryListener *listener)
+/* The dispatch tree is only rebuilt for address spaces whose FlatView
+ * changed, which is when memory.c sends region_add/region_del/region_nop.
+ */
+static AddressSpaceDispatch *address_space_next_dispatch(AddressSpace *as)
 {
-    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
-    AddressSpaceDispatch *d = g_new0(AddressSpaceDispatch, 1);
+    AddressSpaceDispatch *d = as->next_dispatch;
     uint16_t n;
 
+    if (d) {
+        return d;
+    }
+
+    d = g_new0(AddressSpaceDispatch, 1);
+
     n = dummy_section(&d->map, as, &io_mem_unassigned);
     assert(n == PHYS_SECTION_UNASSIGNED);
     n = dummy_section(&d->map, as, &io_mem_notdirty);
@@ -2350,6 +2585,24 @@ static void mem_begin(MemoryListener *listener)
     d->phys_map  = (PhysPageEntry) { .ptr = PHYS_MAP_NODE_NIL, .skip = 1 };
     d->as = as;
     as->next_dispatch = d;
+    return d;
+}
+
+static void mem_begin(MemoryListener *listener)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    as->next_dispatch = NULL;
+}
+
+static void mem_del(MemoryListener *listener, MemoryRegionSection *section)
+{
+    AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
+
+    /* The remaining sections are added back with region_nop.  */
+    if (!as->next_dispatch_lender) {
+        address_space_next_dispatch(as);
+    }
 }
 
 static void address_space_dispatch_free(AddressSpaceDispatch *d)
@@ -2363,10 +2616,34 @@ static void mem_commit(MemoryListener *listener)
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
     AddressSpaceDispatch *cur = as->dispatch;
     AddressSpaceDispatch *next = as->next_dispatch;
+    AddressSpace *lender = as->next_dispatch_lender;
+
+    if (lender) {
+        assert(!next);
+        /* Publish the lender before clearing as->dispatch, see
+         * address_space_to_dispatch.
+         */
+        atomic_rcu_set(&as->dispatch_lender, lender);
+        if (cur) {
+            atomic_rcu_set(&as->dispatch, NULL);
+            call_rcu(cur, address_space_dispatch_free, rcu);
+        }
+        return;
+    }
+
+    if (!next) {
+        if (cur) {
+            /* The address space did not change.  */
+            return;
+        }
+        next = address_space_next_dispatch(as);
+    }
+    as->next_dispatch = NULL;
 
     phys_page_compact_all(next, next->map.nodes_nb);
 
     atomic_rcu_set(&as->dispatch, next);
+    atomic_rcu_set(&as->dispatch_lender, NULL);
     if (cur) {
         call_rcu(cur, address_space_dispatch_free, rcu);
     }
@@ -2385,7 +2662,7 @@ static void tcg_commit(MemoryListener *listener)
      * We reload the dispatch pointer now because cpu_reloading_memory_map()
      * may have split the RCU critical section.
      */
-    d = atomic_rcu_read(&cpuas->as->dispatch);
+    d = address_space_to_dispatch(cpuas->as);
     cpuas->memory_dispatch = d;
     tlb_flush(cpuas->cpu, 1);
 }
@@ -2393,10 +2670,14 @@ static void tcg_commit(MemoryListener *listener)
 void address_space_init_dispatch(AddressSpace *as)
 {
     as->dispatch = NULL;
+    as->next_dispatch = NULL;
+    as->dispatch_lender = NULL;
+    as->next_dispatch_lender = NULL;
     as->dispatch_listener = (MemoryListener) {
         .begin = mem_begin,
         .commit = mem_commit,
         .region_add = mem_add,
+        .region_del = mem_del,
         .region_nop = mem_add,
         .priority = 0,
     };
@@ -2413,6 +2694,7 @@ void address_space_destroy_dispatch(AddressSpace *as)
     AddressSpaceDispatch *d = as->dispatch;
 
     atomic_rcu_set(&as->dispatch, NULL);
+    as->dispatch_lender = NULL;
     if (d) {
         call_rcu(d, address_space_dispatch_free, rcu);
     }
@@ -2537,7 +2819,11 @@ static bool prepare_mmio_access(MemoryRegion *mr)
     bool unlocked = !qemu_mutex_iothread_locked();
     bool release_lock = false;
 
-    if (unlocked && mr->global_locking) {
+    /* Without KVM ioeventfd support, memory_region_dispatch_write matches
+     * ioeventfds in userspace; the table is only stable under the BQL.
+     */
+    if (unlocked && (mr->global_locking ||
+                     (mr->ioeventfd_nb && !kvm_eventfds_enabled()))) {
         qemu_mutex_lock_iothread();
         unlocked = false;
         release_lock = true;
@@ -2874,6 +3160,7 @@ void cpu_register_map_client(QEMUBH *bh)
 void cpu_exec_init_all(void)
 {
     qemu_mutex_init(&ram_list.mutex);
+    qemu_mutex_init(&dirty_logs_lock);
     io_mem_init();
     memory_map_init();
     qemu_mutex_init(&map_client_list_lock);
@@ -274,6 +274,37 @@ STEXI
 @item info mtree
 @findex mtree
 Show memory tree.
+ETEXI
+
+    {
+        .name       = "iothread-lock",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show main loop mutex contention statistics",
+        .mhandler.cmd = hmp_info_iothread_lock,
+    },
+
+STEXI
+@item info iothread-lock
+@findex iothread-lock
+Show how often the global QEMU mutex was taken, how often it was contended,
+and the total time spent waiting for and holding it.  Hold time is only
+measured while the @code{iothread_lock_hold} trace event is enabled.
+ETEXI
+
+    {
+        .name       = "coroutine-pool",
+        .args_type  = "",
+        .params     = "",
+        .help       = "show coroutine pool statistics",
+        .mhandler.cmd = hmp_info_coroutine_pool,
+    },
+
+STEXI
+@item info coroutine-pool
+@findex coroutine-pool
+Show the number of coroutines kept in the per-thread pools, the pool hit
+rate and how many idle coroutine stacks were trimmed.
 ETEXI
 
     {
@@ -1083,7 +1083,7 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
                      false, NULL, false, NULL,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
-                     false, 0, false, 0, false, true, &err);
+                     false, 0, false, 0, false, true, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -1112,7 +1112,7 @@ void hmp_drive_backup(Monitor *mon, const QDict *qdict)
     qmp_drive_backup(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, NULL,
-                     false, 0, false, 0, &err);
+                     false, 0, false, 0, false, 0, &err);
     hmp_handle_error(mon, &err);
 }
 
@@ -2008,8 +2008,12 @@ void hmp_info_iothreads(Monitor *mon, const QDict *qdict)
     IOThreadInfoList *info;
 
     for (info = info_list; info; info = info->next) {
-        monitor_printf(mon, "%s: thread_id=%" PRId64 "\n",
-                       info->value->id, info->value->thread_id);
+        monitor_printf(mon, "%s: thread_id=%" PRId64 " poll_max_ns=%" PRId64
+                       " poll_ns=%" PRId64 " poll_hits=%" PRId64
+                       " poll_misses=%" PRId64 "\n",
+                       info->value->id, info->value->thread_id,
+                       info->value->poll_max_ns, info->value->poll_ns,
+                       info->value->poll_hits, info->value->poll_misses);
     }
 
     qapi_free_IOThreadInfoList(info_list);
@@ -29,9 +29,11 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-void virtio_blk_init_request(VirtIOBlock *s, VirtIOBlockReq *req)
+void virtio_blk_init_request(VirtIOBlock *s, VirtQueue *vq,
+                             VirtIOBlockReq *req)
 {
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->in_len = 0;
     req->next = NULL;
@@ -45,22 +47,47 @@ void virtio_blk_free_request(VirtIOBlockReq *req)
     }
 }
 
-static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
+static void virtio_blk_notify(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlock *s = req->dev;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
-
-    trace_virtio_blk_req_complete(req, status);
-
-    stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->in_len);
     if (s->dataplane_started && !s->dataplane_disabled) {
-        virtio_blk_data_plane_notify(s->dataplane);
+        virtio_blk_data_plane_notify(s->dataplane, vq);
     } else {
-        virtio_notify(vdev, s->vq);
+        virtio_notify(VIRTIO_DEVICE(s), vq);
+    }
+}
+
+/* Complete @count requests; each run of requests from the same virtqueue
+ * is pushed with one used index update and one notification. */
+static void virtio_blk_req_complete_batch(VirtIOBlockReq **reqs,
+                                          unsigned int count,
+                                          unsigned char status)
+{
+    VirtQueueElement *elems[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int lens[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i, n = 0;
+
+    assert(count <= VIRTIO_BLK_MAX_MERGE_REQS);
+    for (i = 0; i < count; i++) {
+        VirtIOBlockReq *req = reqs[i];
+
+        trace_virtio_blk_req_complete(req, status);
+
+        stb_p(&req->in->status, status);
+        elems[n] = &req->elem;
+        lens[n++] = req->in_len;
+        if (i + 1 == count || reqs[i + 1]->vq != req->vq) {
+            virtqueue_push_batch(req->vq, elems, lens, n);
+            virtio_blk_notify(req->dev, req->vq);
+            n = 0;
+        }
     }
 }
 
+static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
+{
+    virtio_blk_req_complete_batch(&req, 1, status);
+}
+
 static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
     bool is_read)
 {
@@ -87,6 +114,8 @@ static int virtio_blk_handle_rw_error(VirtIOBlockReq *req, int error,
 static void virtio_blk_rw_complete(void *opaque, int ret)
 {
     VirtIOBlockReq *next = opaque;
+    VirtIOBlockReq *done[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i, num_done = 0;
 
     while (next) {
         VirtIOBlockReq *req = next;
@@ -116,9 +145,14 @@ static void virtio_blk_rw_complete(void *opaque, int ret)
             }
         }
 
-        virtio_blk_req_complete(req, VIRTIO_BLK_S_OK);
-        block_acct_done(blk_get_stats(req->dev->blk), &req->acct);
-        virtio_blk_free_request(req);
+        done[num_done++] = req;
+    }
+
+    /* A merged request completes all of its parts in one go */
+    virtio_blk_req_complete_batch(done, num_done, VIRTIO_BLK_S_OK);
+    for (i = 0; i < num_done; i++) {
+        block_acct_done(blk_get_stats(done[i]->dev->blk), &done[i]->acct);
+        virtio_blk_free_request(done[i]);
     }
 }
 
@@ -187,15 +221,6 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
-{
-    VirtIOBlockReq *req = virtqueue_pop(s->vq, sizeof(VirtIOBlockReq));
-
-    if (req) {
-        virtio_blk_init_request(s, req);
-    }
-    return req;
-}
 
 static int virtio_blk_handle_scsi_req(VirtIOBlockReq *req)
 {
@@ -576,15 +601,22 @@ void virtio_blk_handle_request(VirtIOBlockReq *req, MultiReqBuffer *mrb)
     }
 }
 
-void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
+bool virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req;
+    void *reqs[VIRTIO_BLK_MAX_MERGE_REQS];
+    unsigned int i, count;
     MultiReqBuffer mrb = {};
+    bool progress = false;
 
     blk_io_plug(s->blk);
 
-    while ((req = virtio_blk_get_request(s))) {
-        virtio_blk_handle_request(req, &mrb);
+    while ((count = virtqueue_pop_batch(vq, sizeof(VirtIOBlockReq), reqs,
+                                        ARRAY_SIZE(reqs)))) {
+        progress = true;
+        for (i = 0; i < count; i++) {
+            virtio_blk_init_request(s, vq, reqs[i]);
+            virtio_blk_handle_request(reqs[i], &mrb);
+        }
     }
 
     if (mrb.num_reqs) {
@@ -592,6 +624,7 @@ void virtio_blk_handle_vq(VirtIOBlock *s, VirtQueue *vq)
     }
 
     blk_io_unplug(s->blk);
+    return progress;
 }
 
 static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
@@ -708,6 +741,7 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = blk_enable_write_cache(s->blk);
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
     memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
 }
 
@@ -751,6 +785,9 @@ static uint64_t virtio_blk_get_features(VirtIODevice *vdev, uint64_t features,
     if (blk_is_read_only(s->blk)) {
         virtio_add_feature(&features, VIRTIO_BLK_F_RO);
     }
+    if (s->conf.num_queues > 1) {
+        virtio_add_feature(&features, VIRTIO_BLK_F_MQ);
+    }
 
     return features;
 }
@@ -811,7 +848,12 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
-        qemu_put_virtqueue_element(f, &req->elem);
+
+        if (s->conf.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
+
+        qemu_put_virtqueue_element(vdev, f, &req->elem);
         req = req->next;
     }
     qemu_put_sbyte(f, 0);
@@ -834,9 +876,22 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
+        unsigned nvqs = s->conf.num_queues;
+        unsigned vq_idx = 0;
         VirtIOBlockReq *req;
-        req = qemu_get_virtqueue_element(f, sizeof(VirtIOBlockReq));
-        virtio_blk_init_request(s, req);
+
+        if (nvqs > 1) {
+            vq_idx = qemu_get_be32(f);
+
+            if (vq_idx >= nvqs) {
+                error_report("Invalid virtqueue index in request list: %#x",
+                             vq_idx);
+                return -EINVAL;
+            }
+        }
+
+        req = qemu_get_virtqueue_element(vdev, f, sizeof(VirtIOBlockReq));
+        virtio_blk_init_request(s, virtio_get_queue(vdev, vq_idx), req);
         req->next = s->rq;
         s->rq = req;
     }
@@ -862,6 +917,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     VirtIOBlkConf *conf = &s->conf;
     Error *err = NULL;
     static int virtio_blk_id;
+    unsigned i;
 
     if (!conf->conf.blk) {
         error_setg(errp, "drive property not set");
@@ -871,6 +927,11 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "Device needs media, but drive is empty");
         return;
     }
+    if (!conf->num_queues || conf->num_queues > VIRTIO_QUEUE_MAX) {
+        error_setg(errp, "num-queues property must be between 1 and %d",
+                   VIRTIO_QUEUE_MAX);
+        return;
+    }
 
     blkconf_serial(&conf->conf, &conf->serial);
     s->original_wce = blk_enable_write_cache(conf->conf.blk);
@@ -888,7 +949,9 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < conf->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
@@ -941,6 +1004,7 @@ static Property virtio_blk_properties[] = {
 #endif
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
     DEFINE_PROP_END_OF_LIST(),
 };
 
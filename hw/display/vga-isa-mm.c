@@ -121,7 +121,6 @@ static void vga_mm_init(ISAVGAMMState *s, hwaddr vram_base,
     s->vga.bank_offset = 0;
     memory_region_add_subregion(address_space,
                                 vram_base + 0x000a0000, vga_io_memory);
-    memory_region_set_coalescing(vga_io_memory);
 }
 
 int isa_vga_mm_init(hwaddr vram_base,
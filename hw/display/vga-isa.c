@@ -67,7 +67,6 @@ static void vga_isa_realizefn(DeviceState *dev, Error **errp)
     memory_region_add_subregion_overlap(isa_address_space(isadev),
                                         0x000a0000,
                                         vga_io_memory, 1);
-    memory_region_set_coalescing(vga_io_memory);
     s->con = graphic_console_init(DEVICE(dev), 0, s->hw_ops, s);
 
     vga_init_vbe(s, OBJECT(dev), isa_address_space(isadev));
@@ -2042,6 +2042,12 @@ static void vga_mem_write(void *opaque, hwaddr addr,
     vga_mem_writeb(s, addr, data);
 }
 
+/* Plane writes only land in vram; every read flushes them first */
+static const MemoryRegionCoalescedRange vga_mem_coalesced[] = {
+    { .offset = 0, .size = 0x20000 },
+    { }
+};
+
 const MemoryRegionOps vga_mem_ops = {
     .read = vga_mem_read,
     .write = vga_mem_write,
@@ -2050,6 +2056,7 @@ const MemoryRegionOps vga_mem_ops = {
         .min_access_size = 1,
         .max_access_size = 1,
     },
+    .coalesced = vga_mem_coalesced,
 };
 
 static int vga_common_post_load(void *opaque, int version_id)
@@ -2268,7 +2275,6 @@ void vga_init(VGACommonState *s, Object *obj, MemoryRegion *address_space,
                                         0x000a0000,
                                         vga_io_memory,
                                         1);
-    memory_region_set_coalescing(vga_io_memory);
     if (init_vga_ports) {
         portio_list_init(&s->vga_port_list, obj, vga_ports, s, "vga");
         portio_list_set_flush_coalesced(&s->vga_port_list);
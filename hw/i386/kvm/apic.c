@@ -15,6 +15,7 @@
 #include "hw/i386/apic_internal.h"
 #include "hw/pci/msi.h"
 #include "sysemu/kvm.h"
+#include "qemu/main-loop.h"
 
 static inline void kvm_apic_set_reg(struct kvm_lapic_state *kapic,
                                     int reg_id, uint32_t val)
@@ -159,9 +160,20 @@ static void kvm_apic_mem_write(void *opaque, hwaddr addr,
                                uint64_t data, unsigned size)
 {
     MSIMessage msg = { .address = addr, .data = data };
+    bool unlocked;
     int ret;
 
+    /* Direct MSI injection is a single ioctl; the routing fallback updates
+     * KVMState and needs the BQL.
+     */
+    unlocked = !kvm_direct_msi_enabled() && !qemu_mutex_iothread_locked();
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
     ret = kvm_irqchip_send_msi(kvm_state, msg);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
     if (ret < 0) {
         fprintf(stderr, "KVM: injection failed, MSI lost (%s)\n",
                 strerror(-ret));
@@ -186,6 +198,7 @@ static void kvm_apic_realize(DeviceState *dev, Error **errp)
 
     memory_region_init_io(&s->io_memory, NULL, &kvm_apic_io_ops, s, "kvm-apic-msi",
                           APIC_SPACE_SIZE);
+    memory_region_clear_global_locking(&s->io_memory);
 
     if (kvm_has_gsi_routing()) {
         msi_nonbroken = true;
@@ -1527,6 +1527,20 @@ e1000_mmio_read(void *opaque, hwaddr addr, unsigned size)
     return 0;
 }
 
+/* Everything but the registers that kick the device or touch the
+ * interrupt state: MDIC, ICR, ICS, IMS, IMC, TCTL and TDT */
+static const MemoryRegionCoalescedRange e1000_mmio_coalesced[] = {
+    { .offset = 0, .size = E1000_MDIC },
+    { .offset = E1000_MDIC + 4, .size = E1000_ICR - E1000_MDIC - 4 },
+    { .offset = E1000_ICR + 4, .size = E1000_ICS - E1000_ICR - 4 },
+    { .offset = E1000_ICS + 4, .size = E1000_IMS - E1000_ICS - 4 },
+    { .offset = E1000_IMS + 4, .size = E1000_IMC - E1000_IMS - 4 },
+    { .offset = E1000_IMC + 4, .size = E1000_TCTL - E1000_IMC - 4 },
+    { .offset = E1000_TCTL + 4, .size = E1000_TDT - E1000_TCTL - 4 },
+    { .offset = E1000_TDT + 4, .size = PNPMMIO_SIZE - E1000_TDT - 4 },
+    { }
+};
+
 static const MemoryRegionOps e1000_mmio_ops = {
     .read = e1000_mmio_read,
     .write = e1000_mmio_write,
@@ -1535,6 +1549,7 @@ static const MemoryRegionOps e1000_mmio_ops = {
         .min_access_size = 4,
         .max_access_size = 4,
     },
+    .coalesced = e1000_mmio_coalesced,
 };
 
 static uint64_t e1000_io_read(void *opaque, hwaddr addr,
@@ -1757,18 +1772,8 @@ static const uint16_t e1000_eeprom_template[64] = {
 static void
 e1000_mmio_setup(E1000State *d)
 {
-    int i;
-    const uint32_t excluded_regs[] = {
-        E1000_MDIC, E1000_ICR, E1000_ICS, E1000_IMS,
-        E1000_IMC, E1000_TCTL, E1000_TDT, PNPMMIO_SIZE
-    };
-
     memory_region_init_io(&d->mmio, OBJECT(d), &e1000_mmio_ops, d,
                           "e1000-mmio", PNPMMIO_SIZE);
-    memory_region_add_coalescing(&d->mmio, 0, excluded_regs[0]);
-    for (i = 0; excluded_regs[i] != PNPMMIO_SIZE; i++)
-        memory_region_add_coalescing(&d->mmio, excluded_regs[i] + 4,
-                                     excluded_regs[i+1] - excluded_regs[i] - 4);
     memory_region_init_io(&d->io, OBJECT(d), &e1000_io_ops, d, "e1000-io", IOPORT_SIZE);
 }
 
@@ -115,6 +115,18 @@ void vhost_net_ack_features(struct vhost_net *net, uint64_t features)
     vhost_ack_features(&net->dev, vhost_net_get_feature_bits(net), features);
 }
 
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return net->dev.acked_features;
+}
+
+void vhost_net_get_mem_table_stats(VHostNetState *net, uint64_t *rebuilds,
+                                   uint64_t *updates)
+{
+    *rebuilds = net->dev.mem_table_rebuilds;
+    *updates = net->dev.mem_table_updates;
+}
+
 uint64_t vhost_net_get_max_queues(VHostNetState *net)
 {
     return net->dev.max_queues;
@@ -136,6 +148,7 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
     int r;
     bool backend_kernel = options->backend_type == VHOST_BACKEND_TYPE_KERNEL;
     struct vhost_net *net = g_malloc(sizeof *net);
+    uint64_t features;
 
     if (!options->net_backend) {
         fprintf(stderr, "vhost-net requires net backend to be setup\n");
@@ -183,8 +196,25 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
             goto fail;
         }
     }
-    /* Set sane init value. Override when guest acks. */
-    vhost_net_ack_features(net, 0);
+    /* Set sane init value. Override when guest acks. A vhost-user backend
+     * that reconnects gets what the guest acked on the previous connection,
+     * since the guest has no reason to negotiate again.
+     */
+    features = 0;
+    if (net->nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        uint64_t missing;
+
+        /* Only the bits that vhost handles matter */
+        features = vhost_user_get_acked_features(net->nc);
+        missing = features & ~vhost_net_get_features(net, features);
+        if (missing) {
+            error_report("vhost lacks feature mask 0x%" PRIx64
+                         " for reconnected backend", missing);
+            vhost_dev_cleanup(&net->dev);
+            goto fail;
+        }
+    }
+    vhost_net_ack_features(net, features);
     return net;
 fail:
     g_free(net);
@@ -270,6 +300,36 @@ static void vhost_net_stop_one(struct vhost_net *net,
     vhost_dev_disable_notifiers(&net->dev, dev);
 }
 
+/* The inflight region of a vhost-user backend covers every queue of the
+ * connection and is passed on the first queue pair.
+ */
+static int vhost_net_set_inflight(VirtIODevice *dev, NetClientState *ncs,
+                                  int total_queues)
+{
+    NetClientState *peer = ncs[0].peer;
+    struct vhost_net *net = get_vhost_net(peer);
+    struct vhost_inflight *inflight;
+    uint16_t queue_size = 0;
+    int i, r;
+
+    if (peer->info->type != NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        return 0;
+    }
+
+    inflight = vhost_user_get_inflight(peer);
+    for (i = 0; i < total_queues * 2; i++) {
+        queue_size = MAX(queue_size, virtio_queue_get_num(dev, i));
+    }
+
+    r = vhost_dev_get_inflight(&net->dev, queue_size, total_queues * 2,
+                               inflight);
+    if (r < 0) {
+        return r;
+    }
+
+    return vhost_dev_set_inflight(&net->dev, inflight);
+}
+
 int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
                     int total_queues)
 {
@@ -304,6 +364,12 @@ int vhost_net_start(VirtIODevice *dev, NetClientState *ncs,
         goto err;
     }
 
+    r = vhost_net_set_inflight(dev, ncs, total_queues);
+    if (r < 0) {
+        i = 0;
+        goto err_start;
+    }
+
     for (i = 0; i < total_queues; i++) {
         r = vhost_net_start_one(get_vhost_net(ncs[i].peer), dev);
 
@@ -339,6 +405,13 @@ void vhost_net_stop(VirtIODevice *dev, NetClientState *ncs,
         vhost_net_stop_one(get_vhost_net(ncs[i].peer), dev);
     }
 
+    /* Unless the backend went away, and the next one is expected to
+     * resume the rings, the requests recorded as inflight are void.
+     */
+    if (!ncs[0].peer->link_down) {
+        vhost_net_reset_inflight(ncs[0].peer);
+    }
+
     r = k->set_guest_notifiers(qbus->parent, total_queues * 2, false);
     if (r < 0) {
         fprintf(stderr, "vhost guest notifier cleanup failed: %d\n", r);
@@ -353,6 +426,41 @@ void vhost_net_cleanup(struct vhost_net *net)
     g_free(net);
 }
 
+struct vhost_inflight *vhost_net_inflight_new(void)
+{
+    struct vhost_inflight *inflight = g_new(struct vhost_inflight, 1);
+
+    vhost_dev_init_inflight(inflight);
+    return inflight;
+}
+
+void vhost_net_inflight_free(struct vhost_inflight *inflight)
+{
+    vhost_dev_free_inflight(inflight);
+    g_free(inflight);
+}
+
+/* Forget the requests a vhost-user backend recorded as inflight, once the
+ * rings they belong to are gone.  @nc is the first queue of the backend.
+ */
+void vhost_net_reset_inflight(NetClientState *nc)
+{
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_dev_reset_inflight(vhost_user_get_inflight(nc));
+    }
+}
+
+/* Remember what the guest acked for a vhost-user backend, so that it can
+ * be restored on reconnect even if the guest negotiated while the
+ * backend was away.
+ */
+void vhost_net_save_acked_features(NetClientState *nc, uint64_t features)
+{
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER) {
+        vhost_user_set_acked_features(nc, features);
+    }
+}
+
 int vhost_net_notify_migration_done(struct vhost_net *net, char* mac_addr)
 {
     const VhostOps *vhost_ops = net->dev.vhost_ops;
@@ -438,6 +546,23 @@ void vhost_net_cleanup(struct vhost_net *net)
 {
 }
 
+struct vhost_inflight *vhost_net_inflight_new(void)
+{
+    return NULL;
+}
+
+void vhost_net_inflight_free(struct vhost_inflight *inflight)
+{
+}
+
+void vhost_net_reset_inflight(NetClientState *nc)
+{
+}
+
+void vhost_net_save_acked_features(NetClientState *nc, uint64_t features)
+{
+}
+
 uint64_t vhost_net_get_features(struct vhost_net *net, uint64_t features)
 {
     return features;
@@ -446,6 +571,18 @@ void vhost_net_ack_features(struct vhost_net *net, uint64_t features)
 {
 }
 
+uint64_t vhost_net_get_acked_features(VHostNetState *net)
+{
+    return 0;
+}
+
+void vhost_net_get_mem_table_stats(VHostNetState *net, uint64_t *rebuilds,
+                                   uint64_t *updates)
+{
+    *rebuilds = 0;
+    *updates = 0;
+}
+
 bool vhost_net_virtqueue_pending(VHostNetState *net, int idx)
 {
     return false;
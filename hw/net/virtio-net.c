@@ -13,9 +13,12 @@
 
 #include "qemu/osdep.h"
 #include "qemu/iov.h"
+#include "qapi/error.h"
+#include "qapi/visitor.h"
 #include "hw/virtio/virtio.h"
 #include "net/net.h"
 #include "net/checksum.h"
+#include "net/eth.h"
 #include "net/tap.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
@@ -25,12 +28,16 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "block/aio.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
+/* TX packets popped and completed per used index update */
+#define VIRTIO_NET_TX_BATCH 32
+
 /*
  * Calculate the number of bytes up to and including the given 'field' of
  * 'container'.
@@ -102,6 +109,38 @@ static bool virtio_net_started(VirtIONet *n, uint8_t status)
         (n->status & VIRTIO_NET_S_LINK_UP) && vdev->vm_running;
 }
 
+/* With dataplane a queue pair, its rings and its backend are serviced by
+ * the queue's IOThread.  Anything else that touches them must hold the
+ * queue's AioContext. */
+static void virtio_net_queue_acquire(VirtIONetQueue *q)
+{
+    if (q->ctx) {
+        aio_context_acquire(q->ctx);
+    }
+}
+
+static void virtio_net_queue_release(VirtIONetQueue *q)
+{
+    if (q->ctx) {
+        aio_context_release(q->ctx);
+    }
+}
+
+/* Interrupts cannot be injected from an IOThread through virtio_notify(),
+ * so dataplane goes through the guest notifier instead */
+static void virtio_net_notify(VirtIONet *n, VirtQueue *vq)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+
+    if (n->dataplane_started) {
+        if (virtio_should_notify(vdev, vq)) {
+            event_notifier_set(virtio_queue_get_guest_notifier(vq));
+        }
+    } else {
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_net_announce_timer(void *opaque)
 {
     VirtIONet *n = opaque;
@@ -213,6 +252,26 @@ static void virtio_net_vnet_endian_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_dataplane_start(VirtIONet *n);
+static void virtio_net_dataplane_stop(VirtIONet *n);
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+    if (!n->vqs[0].iothread) {
+        return;
+    }
+
+    if (virtio_net_started(n, status) && !n->vhost_started) {
+        virtio_net_dataplane_start(n);
+    } else {
+        virtio_net_dataplane_stop(n);
+    }
+}
+
+static bool virtio_net_rsc_drain(VirtIONetQueue *q);
+static void virtio_net_rsc_purge(VirtIONetQueue *q);
+static void virtio_net_rsc_flush(VirtIONet *n);
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -222,6 +281,15 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 
     virtio_net_vnet_endian_status(n, status);
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
+
+    /* Also when vhost was not running, e.g. because the backend is away:
+     * after a reset the next backend must not resume the old rings.
+     */
+    if (!(status & VIRTIO_CONFIG_S_DRIVER_OK) && !n->vhost_started &&
+        qemu_get_queue(n->nic)->peer) {
+        vhost_net_reset_inflight(qemu_get_queue(n->nic)->peer);
+    }
 
     for (i = 0; i < n->max_queues; i++) {
         NetClientState *ncs = qemu_get_subqueue(n->nic, i);
@@ -236,28 +304,32 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
         queue_started =
             virtio_net_started(n, queue_status) && !n->vhost_started;
 
+        virtio_net_queue_acquire(q);
         if (queue_started) {
+            virtio_net_rsc_drain(q);
             qemu_flush_queued_packets(ncs);
+        } else {
+            virtio_net_rsc_purge(q);
         }
 
-        if (!q->tx_waiting) {
-            continue;
-        }
-
-        if (queue_started) {
-            if (q->tx_timer) {
-                timer_mod(q->tx_timer,
-                               qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
-            } else {
-                qemu_bh_schedule(q->tx_bh);
-            }
-        } else {
-            if (q->tx_timer) {
-                timer_del(q->tx_timer);
+        if (q->tx_waiting) {
+            if (queue_started) {
+                if (q->tx_timer) {
+                    timer_mod(q->tx_timer,
+                              qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                              n->tx_timeout);
+                } else {
+                    qemu_bh_schedule(q->tx_bh);
+                }
             } else {
-                qemu_bh_cancel(q->tx_bh);
+                if (q->tx_timer) {
+                    timer_del(q->tx_timer);
+                } else {
+                    qemu_bh_cancel(q->tx_bh);
+                }
             }
         }
+        virtio_net_queue_release(q);
     }
 }
 
@@ -533,10 +605,14 @@ static uint64_t virtio_net_get_features(VirtIODevice *vdev, uint64_t features,
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_HOST_ECN);
 
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
-        virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
         virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_ECN);
+
+        /* Receive coalescing builds GSO packets without the peer's help */
+        if (!n->net_conf.rsc) {
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_CSUM);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO4);
+            virtio_clear_feature(&features, VIRTIO_NET_F_GUEST_TSO6);
+        }
     }
 
     if (!peer_has_vnet_hdr(n) || !peer_has_ufo(n)) {
@@ -607,7 +683,7 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
                                virtio_has_feature(features,
                                                   VIRTIO_F_VERSION_1));
 
-    if (n->has_vnet_hdr) {
+    if (n->has_vnet_hdr || n->net_conf.rsc) {
         n->curr_guest_offloads =
             virtio_net_guest_offloads_by_features(features);
         virtio_net_apply_guest_offloads(n);
@@ -616,6 +692,10 @@ static void virtio_net_set_features(VirtIODevice *vdev, uint64_t features)
     for (i = 0;  i < n->max_queues; i++) {
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
+        if (!nc->peer) {
+            continue;
+        }
+        vhost_net_save_acked_features(nc->peer, features);
         if (!get_vhost_net(nc->peer)) {
             continue;
         }
@@ -681,7 +761,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
     if (cmd == VIRTIO_NET_CTRL_GUEST_OFFLOADS_SET) {
         uint64_t supported_offloads;
 
-        if (!n->has_vnet_hdr) {
+        if (!n->has_vnet_hdr && !n->net_conf.rsc) {
             return VIRTIO_NET_ERR;
         }
 
@@ -690,6 +770,7 @@ static int virtio_net_handle_offloads(VirtIONet *n, uint8_t cmd,
             return VIRTIO_NET_ERR;
         }
 
+        virtio_net_rsc_flush(n);
         n->curr_guest_offloads = offloads;
         virtio_net_apply_guest_offloads(n);
 
@@ -884,6 +965,12 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
     size_t s;
     struct iovec *iov, *iov2;
     unsigned int iov_cnt;
+    int i;
+
+    /* Commands change state that the dataplane threads read */
+    for (i = 0; i < n->max_queues; i++) {
+        virtio_net_queue_acquire(&n->vqs[i]);
+    }
 
     for (;;) {
         elem = virtqueue_pop(vq, sizeof(VirtQueueElement));
@@ -924,6 +1011,10 @@ static void virtio_net_handle_ctrl(VirtIODevice *vdev, VirtQueue *vq)
         g_free(iov2);
         g_free(elem);
     }
+
+    for (i = n->max_queues - 1; i >= 0; i--) {
+        virtio_net_queue_release(&n->vqs[i]);
+    }
 }
 
 /* RX */
@@ -932,8 +1023,14 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
+    VirtIONetQueue *q = &n->vqs[queue_index];
 
+    /* Coalesced segments that found no room were received before
+     * anything still queued by the peer */
+    virtio_net_queue_acquire(q);
+    virtio_net_rsc_drain(q);
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
+    virtio_net_queue_release(q);
 }
 
 static int virtio_net_can_receive(NetClientState *nc)
@@ -1017,9 +1114,12 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
+                           const struct virtio_net_hdr *hdr,
                            const void *buf, size_t size)
 {
-    if (n->has_vnet_hdr) {
+    if (hdr) {
+        iov_from_buf(iov, iov_cnt, 0, hdr, sizeof(*hdr));
+    } else if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
         void *wbuf = (void *)buf;
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
@@ -1048,8 +1148,6 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     if (n->promisc)
         return 1;
 
-    ptr += n->host_hdr_len;
-
     if (!memcmp(&ptr[12], vlan, sizeof(vlan))) {
         int vid = be16_to_cpup((uint16_t *)(ptr + 14)) & 0xfff;
         if (!(n->vlans[vid >> 5] & (1U << (vid & 0x1f))))
@@ -1089,7 +1187,42 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Publish the RX buffers filled so far with one used index update */
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    if (!q->rx_filled) {
+        return;
+    }
+    virtqueue_flush(q->rx_vq, q->rx_filled);
+    q->rx_filled = 0;
+    virtio_net_notify(q->n, q->rx_vq);
+}
+
+static void virtio_net_receive_batch_begin(NetClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    virtio_net_queue_acquire(q);
+    q->rx_batching = true;
+    virtio_net_queue_release(q);
+}
+
+static void virtio_net_receive_batch_end(NetClientState *nc)
+{
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    virtio_net_queue_acquire(q);
+    q->rx_batching = false;
+    virtio_net_rx_flush(q);
+    virtio_net_queue_release(q);
+}
+
+/* Deliver one frame to the guest.  @buf starts with the peer's
+ * virtio-net header (n->host_hdr_len bytes), unless @hdr is given; then
+ * @buf is the bare frame and @hdr is the header for the guest. */
+static ssize_t virtio_net_do_receive(NetClientState *nc,
+                                     const struct virtio_net_hdr *hdr,
+                                     const uint8_t *buf, size_t size)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -1097,6 +1230,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     struct iovec mhdr_sg[VIRTQUEUE_MAX_SIZE];
     struct virtio_net_hdr_mrg_rxbuf mhdr;
     unsigned mhdr_cnt = 0;
+    size_t host_hdr_len = hdr ? 0 : n->host_hdr_len;
     size_t offset, i, guest_offset;
 
     if (!virtio_net_can_receive(nc)) {
@@ -1104,11 +1238,11 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
     }
 
     /* hdr_len refers to the header we supply to the guest */
-    if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - n->host_hdr_len)) {
+    if (!virtio_net_has_buffers(q, size + n->guest_hdr_len - host_hdr_len)) {
         return 0;
     }
 
-    if (!receive_filter(n, buf, size))
+    if (!receive_filter(n, buf + host_hdr_len, size - host_hdr_len))
         return size;
 
     offset = i = 0;
@@ -1149,8 +1283,8 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem->in_num, buf, size);
-            offset = n->host_hdr_len;
+            receive_header(n, sg, elem->in_num, hdr, buf, size);
+            offset = host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
         } else {
@@ -1172,7 +1306,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, elem, total, i++);
+        virtqueue_fill(q->rx_vq, elem, total, q->rx_filled + i++);
         g_free(elem);
     }
 
@@ -1183,28 +1317,453 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_filled += i;
+    if (!q->rx_batching) {
+        virtio_net_rx_flush(q);
+    }
 
     return size;
 }
 
+/* Receive segment coalescing (RSC)
+ *
+ * In-order TCP segments of one flow are merged into a single buffer that
+ * reaches the guest as a GSO packet, so a bulk transfer costs the guest
+ * one buffer and one interrupt per 64k rather than per MSS.  The merge
+ * rules follow Linux GRO: contiguous sequence numbers, identical ACK,
+ * window and options, and payloads no larger than the first one.  A
+ * short or pushed segment completes the buffer; otherwise it is handed
+ * over after at most net_conf.rsctimer ns.
+ */
+
+#define VIRTIO_NET_RSC_MAX_SEGS     8           /* flows held per queue */
+#define VIRTIO_NET_RSC_MAX_SIZE     (64 << 10)  /* coalesced frame size */
+
+typedef struct VirtIONetRscSeg {
+    QTAILQ_ENTRY(VirtIONetRscSeg) next;
+    uint8_t *buf;           /* coalesced Ethernet frame */
+    size_t size;
+    size_t tcp_off;
+    size_t hdr_len;         /* Ethernet, IP and TCP headers */
+    bool ipv6;
+    uint16_t mss;           /* payload size of the first segment */
+    uint32_t next_seq;
+    unsigned int packets;
+} VirtIONetRscSeg;
+
+typedef struct VirtIONetRscPkt {
+    const uint8_t *buf;
+    size_t size;            /* without Ethernet padding */
+    size_t tcp_off;
+    size_t hdr_len;
+    size_t payload_len;
+    bool ipv6;
+    uint32_t seq;
+    uint8_t flags;
+} VirtIONetRscPkt;
+
+static bool virtio_net_rsc_enabled(VirtIONet *n, bool ipv6)
+{
+    uint64_t needed = (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                      (1ULL << (ipv6 ? VIRTIO_NET_F_GUEST_TSO6
+                                     : VIRTIO_NET_F_GUEST_TSO4));
+
+    return (n->curr_guest_offloads & needed) == needed;
+}
+
+/* Parse an untagged Ethernet frame carrying TCP over IPv4 without
+ * options or over IPv6 without extension headers. */
+static bool virtio_net_rsc_parse(const uint8_t *buf, size_t size,
+                                 VirtIONetRscPkt *pkt)
+{
+    const uint8_t *ip = buf + ETH_HLEN;
+    const uint8_t *tcp;
+    size_t ip_hlen, ip_len, tcp_hlen;
+
+    if (size < ETH_HLEN) {
+        return false;
+    }
+
+    switch (lduw_be_p(buf + 12)) {
+    case ETH_P_IP:
+        ip_hlen = sizeof(struct ip_header);
+        if (size < ETH_HLEN + ip_hlen || ip[0] != 0x45 ||
+            (lduw_be_p(ip + 6) & (IP_MF | IP_OFFMASK)) ||
+            ip[9] != IP_PROTO_TCP) {
+            return false;
+        }
+        ip_len = lduw_be_p(ip + 2);
+        pkt->ipv6 = false;
+        break;
+    case ETH_P_IPV6:
+        ip_hlen = sizeof(struct ip6_header);
+        if (size < ETH_HLEN + ip_hlen || (ip[0] >> 4) != 6 ||
+            ip[6] != IP_PROTO_TCP) {
+            return false;
+        }
+        ip_len = ip_hlen + lduw_be_p(ip + 4);
+        pkt->ipv6 = true;
+        break;
+    default:
+        return false;
+    }
+
+    /* The frame may carry Ethernet padding after the datagram */
+    if (ip_len < ip_hlen + sizeof(struct tcp_hdr) ||
+        ETH_HLEN + ip_len > size) {
+        return false;
+    }
+    tcp = ip + ip_hlen;
+    tcp_hlen = (tcp[12] >> 4) * 4;
+    if (tcp_hlen < sizeof(struct tcp_hdr) || ip_hlen + tcp_hlen > ip_len) {
+        return false;
+    }
+
+    pkt->buf = buf;
+    pkt->size = ETH_HLEN + ip_len;
+    pkt->tcp_off = ETH_HLEN + ip_hlen;
+    pkt->hdr_len = pkt->tcp_off + tcp_hlen;
+    pkt->payload_len = pkt->size - pkt->hdr_len;
+    pkt->seq = ldl_be_p(tcp + 4);
+    pkt->flags = tcp[13];
+    return true;
+}
+
+/* Whether @pkt is a plain data segment that may be held back.  The guest
+ * is told that coalesced checksums are valid, so they are verified here
+ * unless the peer already did. */
+static bool virtio_net_rsc_eligible(VirtIONet *n, const uint8_t *buf,
+                                    const VirtIONetRscPkt *pkt)
+{
+    uint8_t *ip = (uint8_t *)pkt->buf + ETH_HLEN;
+    size_t tcp_len = pkt->size - pkt->tcp_off;
+    uint32_t sum;
+
+    if ((pkt->flags & ~(TH_ACK | TH_PUSH)) || !(pkt->flags & TH_ACK) ||
+        !pkt->payload_len || pkt->size > VIRTIO_NET_RSC_MAX_SIZE) {
+        return false;
+    }
+
+    if (n->has_vnet_hdr) {
+        const struct virtio_net_hdr *hdr = (const void *)buf;
+
+        if (hdr->gso_type != VIRTIO_NET_HDR_GSO_NONE ||
+            (hdr->flags & VIRTIO_NET_HDR_F_NEEDS_CSUM)) {
+            return false;
+        }
+        if (hdr->flags & VIRTIO_NET_HDR_F_DATA_VALID) {
+            return true;
+        }
+    }
+
+    if (!pkt->ipv6 && net_raw_checksum(ip, sizeof(struct ip_header))) {
+        return false;
+    }
+    if (pkt->ipv6) {
+        sum = net_checksum_add(32, ip + 8);
+    } else {
+        sum = net_checksum_add(8, ip + 12);
+    }
+    sum += IP_PROTO_TCP + tcp_len;
+    sum += net_checksum_add(tcp_len, ip + pkt->tcp_off - ETH_HLEN);
+    return !net_checksum_finish(sum);
+}
+
+static bool virtio_net_rsc_same_flow(const VirtIONetRscSeg *seg,
+                                     const VirtIONetRscPkt *pkt)
+{
+    const uint8_t *sip = seg->buf + ETH_HLEN;
+    const uint8_t *pip = pkt->buf + ETH_HLEN;
+
+    if (seg->ipv6 != pkt->ipv6) {
+        return false;
+    }
+    /* Addresses, then ports */
+    if (seg->ipv6 ? memcmp(sip + 8, pip + 8, 32)
+                  : memcmp(sip + 12, pip + 12, 8)) {
+        return false;
+    }
+    return !memcmp(seg->buf + seg->tcp_off, pkt->buf + pkt->tcp_off, 4);
+}
+
+static bool virtio_net_rsc_can_merge(const VirtIONetRscSeg *seg,
+                                     const VirtIONetRscPkt *pkt)
+{
+    const uint8_t *sip = seg->buf + ETH_HLEN;
+    const uint8_t *pip = pkt->buf + ETH_HLEN;
+    const uint8_t *sth = seg->buf + seg->tcp_off;
+    const uint8_t *pth = pkt->buf + pkt->tcp_off;
+
+    if (pkt->seq != seg->next_seq || pkt->hdr_len != seg->hdr_len ||
+        pkt->payload_len > seg->mss ||
+        seg->size + pkt->payload_len > VIRTIO_NET_RSC_MAX_SIZE) {
+        return false;
+    }
+
+    if (seg->ipv6) {
+        /* Traffic class, flow label and hop limit */
+        if (memcmp(sip, pip, 4) || sip[7] != pip[7]) {
+            return false;
+        }
+    } else {
+        /* TOS, TTL and DF */
+        if (sip[1] != pip[1] || sip[8] != pip[8] ||
+            ((sip[6] ^ pip[6]) & (IP_DF >> 8))) {
+            return false;
+        }
+    }
+
+    /* ACK, data offset, flags except PSH, window and options */
+    return !memcmp(sth + 8, pth + 8, 5) &&
+           !((sth[13] ^ pth[13]) & ~TH_PUSH) &&
+           !memcmp(sth + 14, pth + 14, 2) &&
+           !memcmp(sth + 20, pth + 20, seg->hdr_len - seg->tcp_off - 20);
+}
+
+static void virtio_net_rsc_new_seg(VirtIONetQueue *q,
+                                   const VirtIONetRscPkt *pkt)
+{
+    VirtIONetRscSeg *seg = g_new(VirtIONetRscSeg, 1);
+
+    seg->buf = g_malloc(VIRTIO_NET_RSC_MAX_SIZE);
+    memcpy(seg->buf, pkt->buf, pkt->size);
+    seg->size = pkt->size;
+    seg->tcp_off = pkt->tcp_off;
+    seg->hdr_len = pkt->hdr_len;
+    seg->ipv6 = pkt->ipv6;
+    seg->mss = pkt->payload_len;
+    seg->next_seq = pkt->seq + pkt->payload_len;
+    seg->packets = 1;
+
+    QTAILQ_INSERT_TAIL(&q->rsc_segs, seg, next);
+    q->rsc_nsegs++;
+
+    if (!timer_pending(q->rsc_timer)) {
+        timer_mod(q->rsc_timer, qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) +
+                                q->n->net_conf.rsctimer);
+    }
+}
+
+static void virtio_net_rsc_merge(VirtIONetRscSeg *seg,
+                                 const VirtIONetRscPkt *pkt)
+{
+    memcpy(seg->buf + seg->size, pkt->buf + pkt->hdr_len, pkt->payload_len);
+    seg->size += pkt->payload_len;
+    seg->next_seq += pkt->payload_len;
+    seg->packets++;
+    seg->buf[seg->tcp_off + 13] |= pkt->flags & TH_PUSH;
+}
+
+static void virtio_net_rsc_free_seg(VirtIONetQueue *q, VirtIONetRscSeg *seg)
+{
+    QTAILQ_REMOVE(&q->rsc_segs, seg, next);
+    q->rsc_nsegs--;
+    g_free(seg->buf);
+    g_free(seg);
+}
+
+/* Hand @seg to the guest.  It stays pending if the guest has no room. */
+static ssize_t virtio_net_rsc_drain_seg(VirtIONetQueue *q,
+                                        VirtIONetRscSeg *seg)
+{
+    VirtIONet *n = q->n;
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    NetClientState *nc = qemu_get_subqueue(n->nic, q - n->vqs);
+    struct virtio_net_hdr hdr = {
+        .flags = VIRTIO_NET_HDR_F_DATA_VALID,
+        .gso_type = VIRTIO_NET_HDR_GSO_NONE
+    };
+    uint8_t *ip = seg->buf + ETH_HLEN;
+    ssize_t ret;
+
+    if (seg->packets > 1) {
+        if (seg->ipv6) {
+            stw_be_p(ip + 4, seg->size - seg->tcp_off);
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV6;
+        } else {
+            stw_be_p(ip + 2, seg->size - ETH_HLEN);
+            stw_be_p(ip + 10, 0);
+            stw_be_p(ip + 10, net_raw_checksum(ip, sizeof(struct ip_header)));
+            hdr.gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        }
+        virtio_stw_p(vdev, &hdr.hdr_len, seg->hdr_len);
+        virtio_stw_p(vdev, &hdr.gso_size, seg->mss);
+    }
+
+    ret = virtio_net_do_receive(nc, &hdr, seg->buf, seg->size);
+    if (ret > 0) {
+        q->rsc_stats.delivered++;
+        virtio_net_rsc_free_seg(q, seg);
+    }
+    return ret;
+}
+
+/* Returns false if some buffers are still pending. */
+static bool virtio_net_rsc_drain(VirtIONetQueue *q)
+{
+    VirtIONetRscSeg *seg, *tmp;
+
+    QTAILQ_FOREACH_SAFE(seg, &q->rsc_segs, next, tmp) {
+        if (virtio_net_rsc_drain_seg(q, seg) <= 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void virtio_net_rsc_purge(VirtIONetQueue *q)
+{
+    while (!QTAILQ_EMPTY(&q->rsc_segs)) {
+        q->rsc_stats.purged++;
+        virtio_net_rsc_free_seg(q, QTAILQ_FIRST(&q->rsc_segs));
+    }
+    if (q->rsc_timer) {
+        timer_del(q->rsc_timer);
+    }
+}
+
+/* Deliver whatever was coalesced, e.g. before the guest offloads change */
+static void virtio_net_rsc_flush(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->curr_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        virtio_net_queue_acquire(q);
+        if (!virtio_net_rsc_drain(q)) {
+            virtio_net_rsc_purge(q);
+        }
+        virtio_net_queue_release(q);
+    }
+}
+
+static void virtio_net_rsc_timer(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+
+    virtio_net_queue_acquire(q);
+    q->rsc_stats.timeouts++;
+    /* What does not fit stays pending: the guest posting receive
+     * buffers or the device starting again drains it */
+    virtio_net_rsc_drain(q);
+    virtio_net_queue_release(q);
+}
+
+static ssize_t virtio_net_rsc_receive(NetClientState *nc, const uint8_t *buf,
+                                      size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    VirtIONetRscSeg *seg;
+    VirtIONetRscPkt pkt;
+    bool eligible;
+    ssize_t ret;
+
+    if (size < n->host_hdr_len ||
+        !virtio_net_rsc_parse(buf + n->host_hdr_len,
+                              size - n->host_hdr_len, &pkt) ||
+        !virtio_net_rsc_enabled(n, pkt.ipv6)) {
+        return virtio_net_do_receive(nc, NULL, buf, size);
+    }
+
+    if (!virtio_net_can_receive(nc)) {
+        return -1;
+    }
+    if (!receive_filter(n, pkt.buf, pkt.size)) {
+        return size;
+    }
+
+    q->rsc_stats.received++;
+    eligible = virtio_net_rsc_eligible(n, buf, &pkt);
+
+    QTAILQ_FOREACH(seg, &q->rsc_segs, next) {
+        if (virtio_net_rsc_same_flow(seg, &pkt)) {
+            break;
+        }
+    }
+
+    if (seg) {
+        if (eligible && virtio_net_rsc_can_merge(seg, &pkt)) {
+            virtio_net_rsc_merge(seg, &pkt);
+            q->rsc_stats.coalesced++;
+            /* A short or pushed segment ends the burst; if the guest
+             * has no room, virtio_net_handle_rx retries. */
+            if ((pkt.flags & TH_PUSH) || pkt.payload_len < seg->mss) {
+                virtio_net_rsc_drain_seg(q, seg);
+            }
+            return size;
+        }
+
+        /* Keep the flow in order */
+        ret = virtio_net_rsc_drain_seg(q, seg);
+        if (ret <= 0) {
+            return ret;
+        }
+    }
+
+    if (eligible && !(pkt.flags & TH_PUSH) &&
+        q->rsc_nsegs < VIRTIO_NET_RSC_MAX_SEGS) {
+        virtio_net_rsc_new_seg(q, &pkt);
+        return size;
+    }
+
+    q->rsc_stats.bypassed++;
+    return virtio_net_do_receive(nc, NULL, buf, size);
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf,
+                                  size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    ssize_t r;
+
+    /* Queued packets may be flushed from the main loop */
+    virtio_net_queue_acquire(q);
+    if (n->net_conf.rsc) {
+        r = virtio_net_rsc_receive(nc, buf, size);
+    } else {
+        r = virtio_net_do_receive(nc, NULL, buf, size);
+    }
+    virtio_net_queue_release(q);
+    return r;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
+/* Sent and dropped packets are returned to the guest together */
+static void virtio_net_tx_push_batch(VirtIONetQueue *q,
+                                     VirtQueueElement **elems,
+                                     unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+    virtqueue_push_batch(q->tx_vq, elems, lens, count);
+    virtio_net_notify(q->n, q->tx_vq);
+    for (i = 0; i < count; i++) {
+        g_free(elems[i]);
+    }
+}
+
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
-    VirtIODevice *vdev = VIRTIO_DEVICE(n);
 
+    virtio_net_queue_acquire(q);
     virtqueue_push(q->tx_vq, q->async_tx.elem, 0);
-    virtio_notify(vdev, q->tx_vq);
+    virtio_net_notify(n, q->tx_vq);
 
     g_free(q->async_tx.elem);
     q->async_tx.elem = NULL;
 
     virtio_queue_set_notification(q->tx_vq, 1);
     virtio_net_flush_tx(q);
+    virtio_net_queue_release(q);
 }
 
 /* TX */
@@ -1212,7 +1771,8 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement *elem;
+    VirtQueueElement *elems[VIRTIO_NET_TX_BATCH];
+    unsigned int lens[VIRTIO_NET_TX_BATCH] = { 0 };
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -1224,77 +1784,87 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    for (;;) {
-        ssize_t ret;
-        unsigned int out_num;
-        struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
-        struct virtio_net_hdr_mrg_rxbuf mhdr;
+    while (num_packets < n->tx_burst) {
+        unsigned int i, count;
 
-        elem = virtqueue_pop(q->tx_vq, sizeof(VirtQueueElement));
-        if (!elem) {
+        count = virtqueue_pop_batch(q->tx_vq, sizeof(VirtQueueElement),
+                                    (void **)elems,
+                                    MIN(VIRTIO_NET_TX_BATCH,
+                                        n->tx_burst - num_packets));
+        if (!count) {
             break;
         }
 
-        out_num = elem->out_num;
-        out_sg = elem->out_sg;
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
-
-        if (n->has_vnet_hdr) {
-            if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
-                n->guest_hdr_len) {
-                error_report("virtio-net header incorrect");
+        for (i = 0; i < count; i++) {
+            VirtQueueElement *elem = elems[i];
+            ssize_t ret;
+            unsigned int out_num;
+            struct iovec sg[VIRTQUEUE_MAX_SIZE], sg2[VIRTQUEUE_MAX_SIZE + 1], *out_sg;
+            struct virtio_net_hdr_mrg_rxbuf mhdr;
+
+            out_num = elem->out_num;
+            out_sg = elem->out_sg;
+            if (out_num < 1) {
+                error_report("virtio-net header not in first element");
                 exit(1);
             }
-            if (n->needs_vnet_hdr_swap) {
-                virtio_net_hdr_swap(vdev, (void *) &mhdr);
-                sg2[0].iov_base = &mhdr;
-                sg2[0].iov_len = n->guest_hdr_len;
-                out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
-                                   out_sg, out_num,
-                                   n->guest_hdr_len, -1);
-                if (out_num == VIRTQUEUE_MAX_SIZE) {
-                    goto drop;
-		}
-                out_num += 1;
-                out_sg = sg2;
-	    }
-        }
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+
+            if (n->has_vnet_hdr) {
+                if (iov_to_buf(out_sg, out_num, 0, &mhdr, n->guest_hdr_len) <
+                    n->guest_hdr_len) {
+                    error_report("virtio-net header incorrect");
+                    exit(1);
+                }
+                if (n->needs_vnet_hdr_swap) {
+                    virtio_net_hdr_swap(vdev, (void *) &mhdr);
+                    sg2[0].iov_base = &mhdr;
+                    sg2[0].iov_len = n->guest_hdr_len;
+                    out_num = iov_copy(&sg2[1], ARRAY_SIZE(sg2) - 1,
                                        out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
+                                       n->guest_hdr_len, -1);
+                    if (out_num == VIRTQUEUE_MAX_SIZE) {
+                        continue;
+                    }
+                    out_num += 1;
+                    out_sg = sg2;
+                }
+            }
+            /*
+             * If host wants to see the guest header as is, we can
+             * pass it on unchanged. Otherwise, copy just the parts
+             * that host is interested in.
+             */
+            assert(n->host_hdr_len <= n->guest_hdr_len);
+            if (n->host_hdr_len != n->guest_hdr_len) {
+                unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
+                                           out_sg, out_num,
+                                           0, n->host_hdr_len);
+                sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
+                                 out_sg, out_num,
+                                 n->guest_hdr_len, -1);
+                out_num = sg_num;
+                out_sg = sg;
+            }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            return -EBUSY;
+            ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
+                                          out_sg, out_num, virtio_net_tx_complete);
+            if (ret == 0) {
+                virtio_queue_set_notification(q->tx_vq, 0);
+                q->async_tx.elem = elem;
+                /* Hand the rest of the batch back to the ring, newest
+                 * first, and complete what was sent before this one. */
+                while (--count > i) {
+                    virtqueue_discard(q->tx_vq, elems[count], 0);
+                    g_free(elems[count]);
+                }
+                count = i;
+                virtio_net_tx_push_batch(q, elems, lens, count);
+                return -EBUSY;
+            }
         }
 
-drop:
-        virtqueue_push(q->tx_vq, elem, 0);
-        virtio_notify(vdev, q->tx_vq);
-        g_free(elem);
-
-        if (++num_packets >= n->tx_burst) {
-            break;
-        }
+        virtio_net_tx_push_batch(q, elems, lens, count);
+        num_packets += count;
     }
     return num_packets;
 }
@@ -1340,6 +1910,25 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     qemu_bh_schedule(q->tx_bh);
 }
 
+static bool virtio_net_handle_aio_rx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    virtio_net_handle_rx(vdev, vq);
+    return false;
+}
+
+static bool virtio_net_handle_aio_tx(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
+
+    /* Only scheduling the flush counts; the ring stays non-empty until
+     * the bottom half has run. */
+    bool progress = !q->tx_waiting && vdev->vm_running;
+
+    virtio_net_handle_tx_bh(vdev, vq);
+    return progress;
+}
+
 static void virtio_net_tx_timer(void *opaque)
 {
     VirtIONetQueue *q = opaque;
@@ -1427,6 +2016,14 @@ static void virtio_net_add_queue(VirtIONet *n, int index)
 
     n->vqs[index].tx_waiting = 0;
     n->vqs[index].n = n;
+
+    QTAILQ_INIT(&n->vqs[index].rsc_segs);
+    n->vqs[index].rsc_nsegs = 0;
+    if (n->net_conf.rsc) {
+        n->vqs[index].rsc_timer = timer_new_ns(QEMU_CLOCK_VIRTUAL,
+                                               virtio_net_rsc_timer,
+                                               &n->vqs[index]);
+    }
 }
 
 static void virtio_net_del_queue(VirtIONet *n, int index)
@@ -1436,6 +2033,11 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     NetClientState *nc = qemu_get_subqueue(n->nic, index);
 
     qemu_purge_queued_packets(nc);
+    virtio_net_rsc_purge(q);
+    if (q->rsc_timer) {
+        timer_free(q->rsc_timer);
+        q->rsc_timer = NULL;
+    }
 
     virtio_del_queue(vdev, index * 2);
     if (q->tx_timer) {
@@ -1447,6 +2049,204 @@ static void virtio_net_del_queue(VirtIONet *n, int index)
     virtio_del_queue(vdev, index * 2 + 1);
 }
 
+/* Dataplane: queue pairs served by IOThreads */
+
+/* Pick the IOThread of each queue pair: either the "iothread" link for
+ * all of them, or entry i modulo the length of the "iothreads" array for
+ * queue pair i, so queue pairs can be spread over threads. */
+static void virtio_net_dataplane_init(VirtIONet *n, Error **errp)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    uint32_t count = n->net_conf.num_iothreads;
+    int i;
+
+    if (!n->net_conf.iothread && !count) {
+        return;
+    }
+    if (n->net_conf.iothread && count) {
+        error_setg(errp, "iothread and iothreads are mutually exclusive");
+        return;
+    }
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp, "device is incompatible with dataplane "
+                   "(transport does not support notifiers)");
+        return;
+    }
+    if (n->net_conf.tx && !strcmp(n->net_conf.tx, "timer")) {
+        error_setg(errp, "iothread requires tx=bh");
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = n->nic_conf.peers.ncs[i];
+        Object *obj = OBJECT(n->net_conf.iothread);
+
+        if (!qemu_has_aio_context(peer)) {
+            error_setg(errp, "netdev for queue %d cannot be served by an "
+                       "iothread", i);
+            return;
+        }
+        /* Filter timers and flushes run in the main loop, while tap_send
+         * would run in the IOThread and append to the filters' queues */
+        if (!QTAILQ_EMPTY(&peer->filters)) {
+            error_setg(errp, "netdev for queue %d has netfilters, which "
+                       "are not supported with an iothread", i);
+            return;
+        }
+
+        if (count) {
+            const char *id = n->net_conf.iothreads[i % count];
+
+            obj = id ? object_resolve_path_component(object_get_objects_root(),
+                                                     id) : NULL;
+            if (!obj || !object_dynamic_cast(obj, TYPE_IOTHREAD)) {
+                error_setg(errp, "iothread '%s' not found", id ? id : "");
+                return;
+            }
+        }
+        object_ref(obj);
+        n->vqs[i].iothread = IOTHREAD(obj);
+        n->vqs[i].ctx = iothread_get_aio_context(n->vqs[i].iothread);
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        n->nic_conf.peers.ncs[i]->iothread_bound = true;
+    }
+}
+
+static void virtio_net_dataplane_cleanup(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].iothread) {
+            object_unref(OBJECT(n->vqs[i].iothread));
+            n->vqs[i].iothread = NULL;
+            n->vqs[i].ctx = NULL;
+            if (n->nic_conf.peers.ncs[i]) {
+                n->nic_conf.peers.ncs[i]->iothread_bound = false;
+            }
+        }
+    }
+}
+
+/* Move a queue pair's TX bottom half, host notifiers and backend fd into
+ * @ctx, or back to the main loop if @ctx is NULL */
+static void virtio_net_queue_set_aio_context(VirtIONet *n, int index,
+                                             AioContext *ctx)
+{
+    VirtIONetQueue *q = &n->vqs[index];
+    NetClientState *nc = qemu_get_subqueue(n->nic, index);
+
+    virtio_net_queue_acquire(q);
+    qemu_bh_delete(q->tx_bh);
+    if (ctx) {
+        q->tx_bh = aio_bh_new(ctx, virtio_net_tx_bh, q);
+        virtio_queue_aio_set_host_notifier_handler_no_poll(
+            q->rx_vq, ctx, virtio_net_handle_aio_rx);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, ctx,
+                                                   virtio_net_handle_aio_tx);
+    } else {
+        q->tx_bh = qemu_bh_new(virtio_net_tx_bh, q);
+        virtio_queue_aio_set_host_notifier_handler(q->rx_vq, q->ctx, NULL);
+        virtio_queue_aio_set_host_notifier_handler(q->tx_vq, q->ctx, NULL);
+    }
+    qemu_set_aio_context(nc->peer, ctx);
+    if (q->tx_waiting) {
+        qemu_bh_schedule(q->tx_bh);
+    }
+    virtio_net_queue_release(q);
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_start(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i, r;
+
+    if (n->dataplane_started) {
+        return;
+    }
+
+    /* Masking goes through irqfd routes; there is no vhost to ask */
+    vdev->use_guest_notifier_mask = false;
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, nvqs, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        goto fail_guest_notifiers;
+    }
+
+    /* Set up virtqueue notify */
+    for (i = 0; i < nvqs; i++) {
+        r = k->set_host_notifier(qbus->parent, i, true);
+        if (r != 0) {
+            error_report("virtio-net failed to set host notifier (%d)", r);
+            while (i--) {
+                k->set_host_notifier(qbus->parent, i, false);
+            }
+            goto fail_host_notifier;
+        }
+    }
+
+    n->dataplane_started = true;
+    for (i = 0; i < queues; i++) {
+        virtio_net_queue_set_aio_context(n, i, n->vqs[i].ctx);
+    }
+
+    /* Kick right away to begin processing requests already in vring */
+    for (i = 0; i < nvqs; i++) {
+        VirtQueue *vq = virtio_get_queue(vdev, i);
+
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+    return;
+
+fail_host_notifier:
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+fail_guest_notifiers:
+    vdev->use_guest_notifier_mask = true;
+    error_report("virtio-net: falling back to the main loop");
+}
+
+/* Context: QEMU global mutex held */
+static void virtio_net_dataplane_stop(VirtIONet *n)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int nvqs = queues * 2;
+    int i;
+
+    if (!n->dataplane_started) {
+        return;
+    }
+
+    for (i = 0; i < queues; i++) {
+        virtio_net_queue_set_aio_context(n, i, NULL);
+    }
+    n->dataplane_started = false;
+
+    for (i = 0; i < nvqs; i++) {
+        k->set_host_notifier(qbus->parent, i, false);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, nvqs, false);
+    vdev->use_guest_notifier_mask = true;
+}
+
 static void virtio_net_change_num_queues(VirtIONet *n, int new_max_queues)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -1500,6 +2300,7 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
     assert(!n->vhost_started);
+    assert(!n->dataplane_started);
     virtio_save(vdev, f);
 }
 
@@ -1690,6 +2491,8 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_batch_begin = virtio_net_receive_batch_begin,
+    .receive_batch_end = virtio_net_receive_batch_end,
     .link_status_changed = virtio_net_set_link_status,
     .query_rx_filter = virtio_net_query_rxfilter,
 };
@@ -1743,6 +2546,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    Error *local_err = NULL;
     int i;
 
     virtio_net_set_config_size(n, n->host_features);
@@ -1768,6 +2572,15 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
         error_report("Defaulting to \"bh\"");
     }
 
+    virtio_net_dataplane_init(n, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        virtio_net_dataplane_cleanup(n);
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return;
+    }
+
     for (i = 0; i < n->max_queues; i++) {
         virtio_net_add_queue(n, i);
     }
@@ -1825,8 +2638,9 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     VirtIONet *n = VIRTIO_NET(dev);
     int i, max_queues;
 
-    /* This will stop vhost backend if appropriate. */
+    /* This will stop vhost backend or dataplane if appropriate. */
     virtio_net_set_status(vdev, 0);
+    virtio_net_dataplane_cleanup(n);
 
     unregister_savevm(dev, "virtio-net", n);
 
@@ -1850,6 +2664,54 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     virtio_cleanup(vdev);
 }
 
+static void virtio_net_rsc_get_stats(Object *obj, Visitor *v,
+                                     const char *name, void *opaque,
+                                     Error **errp)
+{
+    VirtIONet *n = opaque;
+    VirtIONetRscStats stats = { 0 };
+    Error *err = NULL;
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        const VirtIONetRscStats *qs = &n->vqs[i].rsc_stats;
+
+        stats.received += qs->received;
+        stats.coalesced += qs->coalesced;
+        stats.delivered += qs->delivered;
+        stats.bypassed += qs->bypassed;
+        stats.timeouts += qs->timeouts;
+        stats.purged += qs->purged;
+    }
+
+    visit_start_struct(v, name, NULL, 0, &err);
+    if (err) {
+        goto out;
+    }
+    visit_type_uint64(v, "received", &stats.received, &err);
+    if (!err) {
+        visit_type_uint64(v, "coalesced", &stats.coalesced, &err);
+    }
+    if (!err) {
+        visit_type_uint64(v, "delivered", &stats.delivered, &err);
+    }
+    if (!err) {
+        visit_type_uint64(v, "bypassed", &stats.bypassed, &err);
+    }
+    if (!err) {
+        visit_type_uint64(v, "timeouts", &stats.timeouts, &err);
+    }
+    if (!err) {
+        visit_type_uint64(v, "purged", &stats.purged, &err);
+    }
+    if (!err) {
+        visit_check_struct(v, &err);
+    }
+    visit_end_struct(v);
+out:
+    error_propagate(errp, err);
+}
+
 static void virtio_net_instance_init(Object *obj)
 {
     VirtIONet *n = VIRTIO_NET(obj);
@@ -1862,6 +2724,20 @@ static void virtio_net_instance_init(Object *obj)
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
+    object_property_add(obj, "rsc-stats", "receive coalescing statistics",
+                        virtio_net_rsc_get_stats, NULL, NULL, n, NULL);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
+}
+
+static void virtio_net_instance_finalize(Object *obj)
+{
+    VirtIONet *n = VIRTIO_NET(obj);
+
+    /* The elements were released together with the array properties */
+    g_free(n->net_conf.iothreads);
 }
 
 static Property virtio_net_properties[] = {
@@ -1909,6 +2785,11 @@ static Property virtio_net_properties[] = {
                        TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_ARRAY("iothreads", VirtIONet, net_conf.num_iothreads,
+                      net_conf.iothreads, qdev_prop_string, char *),
+    DEFINE_PROP_BOOL("rsc", VirtIONet, net_conf.rsc, false),
+    DEFINE_PROP_UINT32("x-rsctimer", VirtIONet, net_conf.rsctimer,
+                       RSC_TIMER_INTERVAL),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -1939,6 +2820,7 @@ static const TypeInfo virtio_net_info = {
     .parent = TYPE_VIRTIO_DEVICE,
     .instance_size = sizeof(VirtIONet),
     .instance_init = virtio_net_instance_init,
+    .instance_finalize = virtio_net_instance_finalize,
     .class_init = virtio_net_class_init,
 };
 
@@ -31,6 +31,8 @@
 #include "qapi/error.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
+#include "qemu/seqlock.h"
+#include "qemu/main-loop.h"
 #include "hw/timer/hpet.h"
 #include "hw/sysbus.h"
 #include "hw/timer/mc146818rtc.h"
@@ -69,6 +71,10 @@ typedef struct HPETState {
     /*< public >*/
 
     MemoryRegion iomem;
+    /* Protects hpet_offset, hpet_counter and HPET_CFG_ENABLE for lock-free
+     * counter reads.  Writers hold the BQL.
+     */
+    QemuSeqLock counter_lock;
     uint64_t hpet_offset;
     qemu_irq irqs[HPET_NUM_IRQ_ROUTES];
     uint32_t flags;
@@ -158,6 +164,24 @@ static uint64_t hpet_get_ticks(HPETState *s)
     return ns_to_ticks(qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + s->hpet_offset);
 }
 
+/* Called with or without the BQL */
+static uint64_t hpet_read_counter(HPETState *s)
+{
+    uint64_t cur_tick;
+    unsigned start;
+
+    do {
+        start = seqlock_read_begin(&s->counter_lock);
+        if (hpet_enabled(s)) {
+            cur_tick = hpet_get_ticks(s);
+        } else {
+            cur_tick = s->hpet_counter;
+        }
+    } while (seqlock_read_retry(&s->counter_lock, start));
+
+    return cur_tick;
+}
+
 /*
  * calculate diff between comparator value and current ticks
  */
@@ -250,7 +274,9 @@ static int hpet_post_load(void *opaque, int version_id)
     HPETState *s = opaque;
 
     /* Recalculate the offset between the main counter and guest time */
+    seqlock_write_lock(&s->counter_lock);
     s->hpet_offset = ticks_to_ns(s->hpet_counter) - qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+    seqlock_write_unlock(&s->counter_lock);
 
     /* Push number of timers into capability returned via HPET_ID */
     s->capability &= ~HPET_ID_NUM_TIM_MASK;
@@ -401,8 +427,8 @@ static uint32_t hpet_ram_readw(void *opaque, hwaddr addr)
 }
 #endif
 
-static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
-                              unsigned size)
+static uint64_t hpet_ram_read_locked(void *opaque, hwaddr addr,
+                                     unsigned size)
 {
     HPETState *s = opaque;
     uint64_t cur_tick, index;
@@ -448,19 +474,11 @@ static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
             DPRINTF("qemu: invalid HPET_CFG + 4 hpet_ram_readl\n");
             return 0;
         case HPET_COUNTER:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter  = %" PRIx64 "\n", cur_tick);
             return cur_tick;
         case HPET_COUNTER + 4:
-            if (hpet_enabled(s)) {
-                cur_tick = hpet_get_ticks(s);
-            } else {
-                cur_tick = s->hpet_counter;
-            }
+            cur_tick = hpet_read_counter(s);
             DPRINTF("qemu: reading counter + 4  = %" PRIx64 "\n", cur_tick);
             return cur_tick >> 32;
         case HPET_STATUS:
@@ -473,8 +491,34 @@ static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
     return 0;
 }
 
-static void hpet_ram_write(void *opaque, hwaddr addr,
-                           uint64_t value, unsigned size)
+static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
+                              unsigned size)
+{
+    bool unlocked;
+    uint64_t val;
+
+    /* Guests using the HPET as clocksource read the main counter very
+     * often, serve it without taking the BQL.
+     */
+    if (addr == HPET_COUNTER) {
+        return hpet_read_counter(opaque);
+    } else if (addr == HPET_COUNTER + 4) {
+        return hpet_read_counter(opaque) >> 32;
+    }
+
+    unlocked = !qemu_mutex_iothread_locked();
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    val = hpet_ram_read_locked(opaque, addr, size);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
+    return val;
+}
+
+static void hpet_ram_write_locked(void *opaque, hwaddr addr,
+                                  uint64_t value, unsigned size)
 {
     int i;
     HPETState *s = opaque;
@@ -482,7 +526,7 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
 
     DPRINTF("qemu: Enter hpet_ram_writel at %" PRIx64 " = %#x\n", addr, value);
     index = addr;
-    old_val = hpet_ram_read(opaque, addr, 4);
+    old_val = hpet_ram_read_locked(opaque, addr, 4);
     new_val = value;
 
     /*address range of all TN regs*/
@@ -576,11 +620,17 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             return;
         case HPET_CFG:
             val = hpet_fixup_reg(new_val, old_val, HPET_CFG_WRITE_MASK);
+            seqlock_write_lock(&s->counter_lock);
             s->config = (s->config & 0xffffffff00000000ULL) | val;
             if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
-                /* Enable main counter and interrupt generation. */
                 s->hpet_offset =
                     ticks_to_ns(s->hpet_counter) - qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL);
+            } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                s->hpet_counter = hpet_get_ticks(s);
+            }
+            seqlock_write_unlock(&s->counter_lock);
+            if (activating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
+                /* Enable main counter and interrupt generation. */
                 for (i = 0; i < s->num_timers; i++) {
                     if ((&s->timer[i])->cmp != ~0ULL) {
                         hpet_set_timer(&s->timer[i]);
@@ -588,7 +638,6 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
                 }
             } else if (deactivating_bit(old_val, new_val, HPET_CFG_ENABLE)) {
                 /* Halt main counter and disable interrupt generation. */
-                s->hpet_counter = hpet_get_ticks(s);
                 for (i = 0; i < s->num_timers; i++) {
                     hpet_del_timer(&s->timer[i]);
                 }
@@ -620,8 +669,10 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            seqlock_write_lock(&s->counter_lock);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffff00000000ULL) | value;
+            seqlock_write_unlock(&s->counter_lock);
             DPRINTF("qemu: HPET counter written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -629,8 +680,10 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
             if (hpet_enabled(s)) {
                 DPRINTF("qemu: Writing counter while HPET enabled!\n");
             }
+            seqlock_write_lock(&s->counter_lock);
             s->hpet_counter =
                 (s->hpet_counter & 0xffffffffULL) | (((uint64_t)value) << 32);
+            seqlock_write_unlock(&s->counter_lock);
             DPRINTF("qemu: HPET counter + 4 written. ctr = %#x -> %" PRIx64 "\n",
                     value, s->hpet_counter);
             break;
@@ -641,6 +694,20 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
     }
 }
 
+static void hpet_ram_write(void *opaque, hwaddr addr,
+                           uint64_t value, unsigned size)
+{
+    bool unlocked = !qemu_mutex_iothread_locked();
+
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    hpet_ram_write_locked(opaque, addr, value, size);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static const MemoryRegionOps hpet_ram_ops = {
     .read = hpet_ram_read,
     .write = hpet_ram_write,
@@ -673,9 +740,11 @@ static void hpet_reset(DeviceState *d)
     }
 
     qemu_set_irq(s->pit_enabled, 1);
+    seqlock_write_lock(&s->counter_lock);
     s->hpet_counter = 0ULL;
     s->hpet_offset = 0ULL;
     s->config = 0ULL;
+    seqlock_write_unlock(&s->counter_lock);
     hpet_cfg.hpet[s->hpet_id].event_timer_block_id = (uint32_t)s->capability;
     hpet_cfg.hpet[s->hpet_id].address = sbd->mmio[0].addr;
 
@@ -704,8 +773,11 @@ static void hpet_init(Object *obj)
     SysBusDevice *sbd = SYS_BUS_DEVICE(obj);
     HPETState *s = HPET(obj);
 
+    seqlock_init(&s->counter_lock, NULL);
+
     /* HPET Area */
     memory_region_init_io(&s->iomem, obj, &hpet_ram_ops, s, "hpet", HPET_LEN);
+    memory_region_clear_global_locking(&s->iomem);
     sysbus_init_mmio(sbd, &s->iomem);
 }
 
@@ -831,6 +831,12 @@ static void rtc_reset(void *opaque)
 #endif
 }
 
+/* Selecting the CMOS index has no effect until the data port is used */
+static const MemoryRegionCoalescedRange cmos_coalesced[] = {
+    { .offset = 0, .size = 1 },
+    { }
+};
+
 static const MemoryRegionOps cmos_ops = {
     .read = cmos_ioport_read,
     .write = cmos_ioport_write,
@@ -839,6 +845,7 @@ static const MemoryRegionOps cmos_ops = {
         .max_access_size = 1,
     },
     .endianness = DEVICE_LITTLE_ENDIAN,
+    .coalesced = cmos_coalesced,
 };
 
 static void rtc_get_date(Object *obj, struct tm *current_tm, Error **errp)
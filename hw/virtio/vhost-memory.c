@@ -0,0 +1,296 @@
+/*
+ * vhost memory table
+ *
+ * Copyright Red Hat, Inc. 2010
+ *
+ * Authors:
+ *  Michael S. Tsirkin <mst@redhat.com>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2.  See
+ * the COPYING file in the top-level directory.
+ *
+ * Contributions after 2012-01-13 are licensed under the terms of the
+ * GNU GPL, version 2 or (at your option) any later version.
+ */
+
+#include "qemu/osdep.h"
+#include <linux/vhost.h>
+#include "hw/virtio/vhost.h"
+#include "qemu/range.h"
+
+/* Assign/unassign. Keep an array of non-overlapping memory regions in
+ * dev->mem, sorted by guest address, so that the regions touched by an
+ * update are found by binary search and only their neighbours have to be
+ * considered for merging.  The array grows geometrically instead of being
+ * reallocated on every update.
+ */
+
+/* Index of the first region that ends at or after @addr */
+static int vhost_dev_mem_lower_bound(struct vhost_dev *dev, uint64_t addr)
+{
+    int lo = 0, hi = dev->mem->nregions;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        struct vhost_memory_region *reg = dev->mem->regions + mid;
+
+        if (range_get_last(reg->guest_phys_addr, reg->memory_size) < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+static void vhost_dev_mem_insert(struct vhost_dev *dev, int i,
+                                 uint64_t start_addr,
+                                 uint64_t size,
+                                 uint64_t uaddr)
+{
+    struct vhost_memory_region *reg;
+
+    assert(size);
+    if (dev->mem->nregions == dev->mem_nregions_alloc) {
+        dev->mem_nregions_alloc = MAX(dev->mem_nregions_alloc * 2, 8);
+        dev->mem = g_realloc(dev->mem, offsetof(struct vhost_memory, regions) +
+                             dev->mem_nregions_alloc * sizeof *reg);
+    }
+
+    reg = dev->mem->regions + i;
+    memmove(reg + 1, reg, (dev->mem->nregions - i) * sizeof *reg);
+    memset(reg, 0, sizeof *reg);
+    reg->guest_phys_addr = start_addr;
+    reg->memory_size = size;
+    reg->userspace_addr = uaddr;
+    ++dev->mem->nregions;
+}
+
+static void vhost_dev_mem_remove(struct vhost_dev *dev, int i, int n)
+{
+    struct vhost_memory_region *reg = dev->mem->regions + i;
+
+    memmove(reg, reg + n, (dev->mem->nregions - i - n) * sizeof *reg);
+    dev->mem->nregions -= n;
+}
+
+void vhost_dev_unassign_memory(struct vhost_dev *dev,
+                               uint64_t start_addr,
+                               uint64_t size)
+{
+    uint64_t memlast = range_get_last(start_addr, size);
+    int i = vhost_dev_mem_lower_bound(dev, start_addr);
+    int first;
+    struct vhost_memory_region *reg;
+    uint64_t reglast;
+    uint64_t change;
+
+    if (i == dev->mem->nregions) {
+        return;
+    }
+
+    /* A region starting below the range keeps its head, and is split if
+     * it also extends past the range.  No other region can overlap then.
+     */
+    reg = dev->mem->regions + i;
+    if (reg->guest_phys_addr < start_addr) {
+        reglast = range_get_last(reg->guest_phys_addr, reg->memory_size);
+        reg->memory_size = start_addr - reg->guest_phys_addr;
+        if (reglast > memlast) {
+            change = memlast + 1 - reg->guest_phys_addr;
+            vhost_dev_mem_insert(dev, i + 1, memlast + 1, reglast - memlast,
+                                 reg->userspace_addr + change);
+            return;
+        }
+        ++i;
+    }
+
+    /* Remove the regions inside the range */
+    first = i;
+    while (i < dev->mem->nregions) {
+        reg = dev->mem->regions + i;
+        if (range_get_last(reg->guest_phys_addr, reg->memory_size) > memlast) {
+            break;
+        }
+        ++i;
+    }
+    vhost_dev_mem_remove(dev, first, i - first);
+
+    /* Shift a region that extends past the range */
+    if (first < dev->mem->nregions) {
+        reg = dev->mem->regions + first;
+        if (reg->guest_phys_addr <= memlast) {
+            change = memlast + 1 - reg->guest_phys_addr;
+            reg->memory_size -= change;
+            reg->guest_phys_addr += change;
+            reg->userspace_addr += change;
+            assert(reg->memory_size);
+        }
+    }
+}
+
+/* Can [@start1, @size1) at @uaddr1 and the range directly above it be one
+ * region?
+ */
+static bool vhost_dev_mem_can_merge(struct vhost_dev *dev,
+                                    uint64_t start1, uint64_t size1,
+                                    uint64_t uaddr1,
+                                    uint64_t start2, uint64_t size2,
+                                    uint64_t uaddr2)
+{
+    if (start1 + size1 != start2 || uaddr1 + size1 != uaddr2) {
+        return false;
+    }
+
+    return !dev->vhost_ops->vhost_backend_can_merge ||
+           dev->vhost_ops->vhost_backend_can_merge(dev, uaddr1, size1,
+                                                   uaddr2, size2);
+}
+
+/* Called after unassign, so no regions overlap the given range. */
+void vhost_dev_assign_memory(struct vhost_dev *dev,
+                             uint64_t start_addr,
+                             uint64_t size,
+                             uint64_t uaddr)
+{
+    int i = vhost_dev_mem_lower_bound(dev, start_addr);
+    struct vhost_memory_region *prev = NULL, *next = NULL;
+
+    if (i > 0) {
+        prev = dev->mem->regions + i - 1;
+    }
+    if (i < dev->mem->nregions) {
+        next = dev->mem->regions + i;
+        /* check for overlapping regions: should never happen. */
+        assert(range_get_last(start_addr, size) < next->guest_phys_addr);
+    }
+
+    if (prev && vhost_dev_mem_can_merge(dev, prev->guest_phys_addr,
+                                        prev->memory_size,
+                                        prev->userspace_addr,
+                                        start_addr, size, uaddr)) {
+        prev->memory_size += size;
+        if (next && vhost_dev_mem_can_merge(dev, prev->guest_phys_addr,
+                                            prev->memory_size,
+                                            prev->userspace_addr,
+                                            next->guest_phys_addr,
+                                            next->memory_size,
+                                            next->userspace_addr)) {
+            prev->memory_size += next->memory_size;
+            vhost_dev_mem_remove(dev, i, 1);
+        }
+        return;
+    }
+
+    if (next && vhost_dev_mem_can_merge(dev, start_addr, size, uaddr,
+                                        next->guest_phys_addr,
+                                        next->memory_size,
+                                        next->userspace_addr)) {
+        next->guest_phys_addr = start_addr;
+        next->userspace_addr = uaddr;
+        next->memory_size += size;
+        return;
+    }
+
+    vhost_dev_mem_insert(dev, i, start_addr, size, uaddr);
+}
+
+struct vhost_memory_region *vhost_dev_find_reg(struct vhost_dev *dev,
+                                               uint64_t start_addr,
+                                               uint64_t size)
+{
+    int i = vhost_dev_mem_lower_bound(dev, start_addr);
+    struct vhost_memory_region *reg = dev->mem->regions + i;
+
+    if (i < dev->mem->nregions &&
+        ranges_overlap(reg->guest_phys_addr, reg->memory_size,
+                       start_addr, size)) {
+        return reg;
+    }
+    return NULL;
+}
+
+/* The sections the memory listener reported, for dirty log syncing.  An
+ * addition is appended and a removal only clears the entry's mr, so a
+ * transaction that changes many sections does not shift the array each
+ * time.  The array is compacted, and sorted again if needed, when the
+ * transaction commits.
+ */
+static int vhost_dev_section_cmp(const void *a, const void *b)
+{
+    const MemoryRegionSection *sa = a, *sb = b;
+
+    if (sa->offset_within_address_space < sb->offset_within_address_space) {
+        return -1;
+    }
+    return sa->offset_within_address_space > sb->offset_within_address_space;
+}
+
+void vhost_dev_add_section(struct vhost_dev *dev,
+                           MemoryRegionSection *section)
+{
+    int n = dev->n_mem_sections;
+
+    if (n == dev->mem_sections_alloc) {
+        dev->mem_sections_alloc = MAX(dev->mem_sections_alloc * 2, 8);
+        dev->mem_sections = g_renew(MemoryRegionSection, dev->mem_sections,
+                                    dev->mem_sections_alloc);
+    }
+    if (n == 0) {
+        dev->mem_sections_sorted = true;
+    } else if (dev->mem_sections[n - 1].offset_within_address_space >=
+               section->offset_within_address_space) {
+        dev->mem_sections_sorted = false;
+    }
+    dev->mem_sections[n] = *section;
+    dev->n_mem_sections++;
+}
+
+/* Returns false if @section was not there */
+bool vhost_dev_del_section(struct vhost_dev *dev,
+                           MemoryRegionSection *section)
+{
+    hwaddr addr = section->offset_within_address_space;
+    int lo = 0, hi;
+
+    if (!dev->mem_sections_sorted) {
+        vhost_dev_commit_sections(dev);
+    }
+
+    hi = dev->n_mem_sections;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+
+        if (dev->mem_sections[mid].offset_within_address_space < addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    if (lo == dev->n_mem_sections ||
+        dev->mem_sections[lo].offset_within_address_space != addr ||
+        !dev->mem_sections[lo].mr) {
+        return false;
+    }
+    dev->mem_sections[lo].mr = NULL;
+    return true;
+}
+
+void vhost_dev_commit_sections(struct vhost_dev *dev)
+{
+    int i, n = 0;
+
+    for (i = 0; i < dev->n_mem_sections; i++) {
+        if (dev->mem_sections[i].mr) {
+            dev->mem_sections[n++] = dev->mem_sections[i];
+        }
+    }
+    dev->n_mem_sections = n;
+
+    if (!dev->mem_sections_sorted) {
+        qsort(dev->mem_sections, n, sizeof *dev->mem_sections,
+              vhost_dev_section_cmp);
+        dev->mem_sections_sorted = true;
+    }
+}
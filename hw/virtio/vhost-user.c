@@ -32,11 +32,21 @@ enum VhostUserProtocolFeature {
     VHOST_USER_PROTOCOL_F_MQ = 0,
     VHOST_USER_PROTOCOL_F_LOG_SHMFD = 1,
     VHOST_USER_PROTOCOL_F_RARP = 2,
+    VHOST_USER_PROTOCOL_F_REPLY_ACK = 3,
+    /* Same bit as in other vhost-user implementations */
+    VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD = 12,
+    VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS = 15,
 
     VHOST_USER_PROTOCOL_F_MAX
 };
 
-#define VHOST_USER_PROTOCOL_FEATURE_MASK ((1 << VHOST_USER_PROTOCOL_F_MAX) - 1)
+#define VHOST_USER_PROTOCOL_FEATURE_MASK                \
+    ((1ULL << VHOST_USER_PROTOCOL_F_MQ) |               \
+     (1ULL << VHOST_USER_PROTOCOL_F_LOG_SHMFD) |        \
+     (1ULL << VHOST_USER_PROTOCOL_F_RARP) |             \
+     (1ULL << VHOST_USER_PROTOCOL_F_REPLY_ACK) |        \
+     (1ULL << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD) |   \
+     (1ULL << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS))
 
 typedef enum VhostUserRequest {
     VHOST_USER_NONE = 0,
@@ -59,6 +69,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_QUEUE_NUM = 17,
     VHOST_USER_SET_VRING_ENABLE = 18,
     VHOST_USER_SEND_RARP = 19,
+    VHOST_USER_GET_INFLIGHT_FD = 31,
+    VHOST_USER_SET_INFLIGHT_FD = 32,
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -75,16 +89,29 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserMemRegMsg {
+    uint64_t padding;
+    VhostUserMemoryRegion region;
+} VhostUserMemRegMsg;
+
 typedef struct VhostUserLog {
     uint64_t mmap_size;
     uint64_t mmap_offset;
 } VhostUserLog;
 
+typedef struct VhostUserInflight {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+    uint16_t num_queues;
+    uint16_t queue_size;
+} VhostUserInflight;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
 #define VHOST_USER_VERSION_MASK     (0x3)
 #define VHOST_USER_REPLY_MASK       (0x1<<2)
+#define VHOST_USER_NEED_REPLY_MASK  (0x1<<3)
     uint32_t flags;
     uint32_t size; /* the following payload size */
     union {
@@ -94,7 +121,9 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemRegMsg mem_reg;
         VhostUserLog log;
+        VhostUserInflight inflight;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -165,6 +194,8 @@ static bool vhost_user_one_time_request(VhostUserRequest request)
     case VHOST_USER_SET_OWNER:
     case VHOST_USER_RESET_OWNER:
     case VHOST_USER_SET_MEM_TABLE:
+    case VHOST_USER_ADD_MEM_REG:
+    case VHOST_USER_REM_MEM_REG:
     case VHOST_USER_GET_QUEUE_NUM:
         return true;
     default:
@@ -234,6 +265,29 @@ static int vhost_user_set_log_base(struct vhost_dev *dev, uint64_t base,
     return 0;
 }
 
+/* Describe @reg to the slave.  Returns the fd backing it, or a value
+ * <= 0 if it is not shareable and the slave must not see it.
+ */
+static int vhost_user_fill_region(struct vhost_memory_region *reg,
+                                  VhostUserMemoryRegion *dst)
+{
+    ram_addr_t ram_addr;
+    int fd;
+
+    assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
+    qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
+                            &ram_addr);
+    fd = qemu_get_ram_fd(ram_addr);
+    if (fd > 0) {
+        dst->userspace_addr = reg->userspace_addr;
+        dst->memory_size  = reg->memory_size;
+        dst->guest_phys_addr = reg->guest_phys_addr;
+        dst->mmap_offset = reg->userspace_addr -
+            (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
+    }
+    return fd;
+}
+
 static int vhost_user_set_mem_table(struct vhost_dev *dev,
                                     struct vhost_memory *mem)
 {
@@ -247,18 +301,10 @@ static int vhost_user_set_mem_table(struct vhost_dev *dev,
 
     for (i = 0; i < dev->mem->nregions; ++i) {
         struct vhost_memory_region *reg = dev->mem->regions + i;
-        ram_addr_t ram_addr;
 
-        assert((uintptr_t)reg->userspace_addr == reg->userspace_addr);
-        qemu_ram_addr_from_host((void *)(uintptr_t)reg->userspace_addr,
-                                &ram_addr);
-        fd = qemu_get_ram_fd(ram_addr);
+        fd = vhost_user_fill_region(reg,
+                                    &msg.payload.memory.regions[fd_num]);
         if (fd > 0) {
-            msg.payload.memory.regions[fd_num].userspace_addr = reg->userspace_addr;
-            msg.payload.memory.regions[fd_num].memory_size  = reg->memory_size;
-            msg.payload.memory.regions[fd_num].guest_phys_addr = reg->guest_phys_addr;
-            msg.payload.memory.regions[fd_num].mmap_offset = reg->userspace_addr -
-                (uintptr_t) qemu_get_ram_block_host_ptr(ram_addr);
             assert(fd_num < VHOST_MEMORY_MAX_NREGIONS);
             fds[fd_num++] = fd;
         }
@@ -281,6 +327,124 @@ static int vhost_user_set_mem_table(struct vhost_dev *dev,
     return 0;
 }
 
+/* Wait for the slave to acknowledge a message sent with
+ * VHOST_USER_NEED_REPLY_MASK.  Returns 1 if it refused the request.
+ */
+static int vhost_user_read_ack(struct vhost_dev *dev,
+                               VhostUserRequest request)
+{
+    VhostUserMsg msg;
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != request) {
+        error_report("Received unexpected msg type. "
+                     "Expected %d received %d", request, msg.request);
+        return -1;
+    }
+
+    return msg.payload.u64 ? 1 : 0;
+}
+
+static int vhost_user_write_acked(struct vhost_dev *dev, VhostUserMsg *msg,
+                                  int *fds, int fd_num)
+{
+    if (vhost_user_write(dev, msg, fds, fd_num) < 0) {
+        return -1;
+    }
+    return vhost_user_read_ack(dev, msg->request);
+}
+
+/* Only tell the slave about the regions that changed, so that it does
+ * not have to unmap and map again every region on each update.
+ *
+ * Each message is acknowledged: without that, a region the slave failed
+ * to map would go unnoticed.  If the slave refuses one, it gets the whole
+ * table instead, which replaces whatever subset it did apply.
+ */
+static int vhost_user_update_mem_table(struct vhost_dev *dev,
+                                       struct vhost_memory_region *del,
+                                       int ndel,
+                                       struct vhost_memory_region *add,
+                                       int nadd)
+{
+    VhostUserMemoryRegion tmp;
+    int i, fd, nshared = 0;
+    int r;
+    VhostUserMsg msg = {
+        .flags = VHOST_USER_VERSION | VHOST_USER_NEED_REPLY_MASK,
+        .size = sizeof(msg.payload.mem_reg),
+    };
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS) ||
+        !virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_REPLY_ACK)) {
+        return -ENOTSUP;
+    }
+
+    /* Messages for the slave go through the first device only */
+    if (dev->vq_index != 0) {
+        return 0;
+    }
+
+    /* The same limit as for a full table */
+    for (i = 0; i < dev->mem->nregions; i++) {
+        if (vhost_user_fill_region(dev->mem->regions + i, &tmp) > 0) {
+            nshared++;
+        }
+    }
+    if (nshared > VHOST_MEMORY_MAX_NREGIONS) {
+        error_report("vhost-user: %d memory regions, at most %d supported",
+                     nshared, VHOST_MEMORY_MAX_NREGIONS);
+        return -E2BIG;
+    }
+
+    msg.request = VHOST_USER_REM_MEM_REG;
+    for (i = 0; i < ndel; i++) {
+        VhostUserMemoryRegion *region = &msg.payload.mem_reg.region;
+        ram_addr_t ram_addr;
+        MemoryRegion *mr;
+
+        /* Skip regions the slave never got.  The RAM block of a removed
+         * region may be gone already; only unplugged memory backends go
+         * away like that, and those are shared.  The slave identifies the
+         * region by its addresses and size, the offset is not needed.
+         */
+        mr = qemu_ram_addr_from_host((void *)(uintptr_t)del[i].userspace_addr,
+                                     &ram_addr);
+        if (mr && qemu_get_ram_fd(ram_addr) <= 0) {
+            continue;
+        }
+
+        memset(&msg.payload.mem_reg, 0, sizeof(msg.payload.mem_reg));
+        region->guest_phys_addr = del[i].guest_phys_addr;
+        region->memory_size = del[i].memory_size;
+        region->userspace_addr = del[i].userspace_addr;
+        r = vhost_user_write_acked(dev, &msg, NULL, 0);
+        if (r) {
+            return r < 0 ? r : -ENOTSUP;
+        }
+    }
+
+    msg.request = VHOST_USER_ADD_MEM_REG;
+    for (i = 0; i < nadd; i++) {
+        memset(&msg.payload.mem_reg, 0, sizeof(msg.payload.mem_reg));
+        fd = vhost_user_fill_region(&add[i], &msg.payload.mem_reg.region);
+        if (fd <= 0) {
+            continue;
+        }
+        r = vhost_user_write_acked(dev, &msg, &fd, 1);
+        if (r) {
+            return r < 0 ? r : -ENOTSUP;
+        }
+    }
+
+    return 0;
+}
+
 static int vhost_user_set_vring_addr(struct vhost_dev *dev,
                                      struct vhost_vring_addr *addr)
 {
@@ -364,7 +528,8 @@ static int vhost_user_get_vring_base(struct vhost_dev *dev,
     vhost_user_write(dev, &msg, NULL, 0);
 
     if (vhost_user_read(dev, &msg) < 0) {
-        return 0;
+        /* No reply means no ring state: let the caller recover it */
+        return -1;
     }
 
     if (msg.request != VHOST_USER_GET_VRING_BASE) {
@@ -631,6 +796,96 @@ static bool vhost_user_can_merge(struct vhost_dev *dev,
     return mfd == rfd;
 }
 
+static int vhost_user_get_inflight_fd(struct vhost_dev *dev,
+                                      uint16_t queue_size,
+                                      uint16_t num_queues,
+                                      struct vhost_inflight *inflight)
+{
+    CharDriverState *chr = dev->opaque;
+    void *addr;
+    int fd;
+    VhostUserMsg msg = {
+        .request = VHOST_USER_GET_INFLIGHT_FD,
+        .flags = VHOST_USER_VERSION,
+        .payload.inflight.num_queues = num_queues,
+        .payload.inflight.queue_size = queue_size,
+        .size = sizeof(msg.payload.inflight),
+    };
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+        return 0;
+    }
+
+    if (vhost_user_write(dev, &msg, NULL, 0) < 0) {
+        return -1;
+    }
+
+    if (vhost_user_read(dev, &msg) < 0) {
+        return -1;
+    }
+
+    if (msg.request != VHOST_USER_GET_INFLIGHT_FD) {
+        error_report("Received unexpected msg type. "
+                     "Expected %d received %d",
+                     VHOST_USER_GET_INFLIGHT_FD, msg.request);
+        return -1;
+    }
+
+    if (msg.size != sizeof(msg.payload.inflight)) {
+        error_report("Received bad msg size.");
+        return -1;
+    }
+
+    if (!msg.payload.inflight.mmap_size) {
+        return 0;
+    }
+
+    fd = qemu_chr_fe_get_msgfd(chr);
+    if (fd < 0) {
+        error_report("Failed to get inflight region fd");
+        return -1;
+    }
+
+    addr = mmap(0, msg.payload.inflight.mmap_size, PROT_READ | PROT_WRITE,
+                MAP_SHARED, fd, msg.payload.inflight.mmap_offset);
+    if (addr == MAP_FAILED) {
+        error_report("Failed to mmap inflight region: %s", strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    inflight->addr = addr;
+    inflight->fd = fd;
+    inflight->size = msg.payload.inflight.mmap_size;
+    inflight->offset = msg.payload.inflight.mmap_offset;
+    inflight->queue_size = queue_size;
+    inflight->num_queues = num_queues;
+
+    return 0;
+}
+
+static int vhost_user_set_inflight_fd(struct vhost_dev *dev,
+                                      struct vhost_inflight *inflight)
+{
+    VhostUserMsg msg = {
+        .request = VHOST_USER_SET_INFLIGHT_FD,
+        .flags = VHOST_USER_VERSION,
+        .payload.inflight.mmap_size = inflight->size,
+        .payload.inflight.mmap_offset = inflight->offset,
+        .payload.inflight.num_queues = inflight->num_queues,
+        .payload.inflight.queue_size = inflight->queue_size,
+        .size = sizeof(msg.payload.inflight),
+    };
+
+    if (!virtio_has_feature(dev->protocol_features,
+                            VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD)) {
+        return 0;
+    }
+
+    return vhost_user_write(dev, &msg, &inflight->fd, 1);
+}
+
 const VhostOps user_ops = {
         .backend_type = VHOST_BACKEND_TYPE_USER,
         .vhost_backend_init = vhost_user_init,
@@ -638,6 +893,7 @@ const VhostOps user_ops = {
         .vhost_backend_memslots_limit = vhost_user_memslots_limit,
         .vhost_set_log_base = vhost_user_set_log_base,
         .vhost_set_mem_table = vhost_user_set_mem_table,
+        .vhost_update_mem_table = vhost_user_update_mem_table,
         .vhost_set_vring_addr = vhost_user_set_vring_addr,
         .vhost_set_vring_endian = vhost_user_set_vring_endian,
         .vhost_set_vring_num = vhost_user_set_vring_num,
@@ -654,4 +910,6 @@ const VhostOps user_ops = {
         .vhost_requires_shm_log = vhost_user_requires_shm_log,
         .vhost_migration_done = vhost_user_migration_done,
         .vhost_backend_can_merge = vhost_user_can_merge,
+        .vhost_get_inflight_fd = vhost_user_get_inflight_fd,
+        .vhost_set_inflight_fd = vhost_user_set_inflight_fd,
 };
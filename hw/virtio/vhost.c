@@ -26,6 +26,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 #include "migration/migration.h"
+#include "trace.h"
 
 static struct vhost_log *vhost_log;
 static struct vhost_log *vhost_log_shm;
@@ -138,164 +139,14 @@ static void vhost_log_sync_range(struct vhost_dev *dev,
     /* FIXME: this is N^2 in number of sections */
     for (i = 0; i < dev->n_mem_sections; ++i) {
         MemoryRegionSection *section = &dev->mem_sections[i];
-        vhost_sync_dirty_bitmap(dev, section, first, last);
-    }
-}
-
-/* Assign/unassign. Keep an unsorted array of non-overlapping
- * memory regions in dev->mem. */
-static void vhost_dev_unassign_memory(struct vhost_dev *dev,
-                                      uint64_t start_addr,
-                                      uint64_t size)
-{
-    int from, to, n = dev->mem->nregions;
-    /* Track overlapping/split regions for sanity checking. */
-    int overlap_start = 0, overlap_end = 0, overlap_middle = 0, split = 0;
-
-    for (from = 0, to = 0; from < n; ++from, ++to) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        uint64_t reglast;
-        uint64_t memlast;
-        uint64_t change;
-
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, dev->mem->regions + from, sizeof *reg);
-        }
-
-        /* No overlap is simple */
-        if (!ranges_overlap(reg->guest_phys_addr, reg->memory_size,
-                            start_addr, size)) {
-            continue;
-        }
-
-        /* Split only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!split);
-
-        reglast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        memlast = range_get_last(start_addr, size);
-
-        /* Remove whole region */
-        if (start_addr <= reg->guest_phys_addr && memlast >= reglast) {
-            --dev->mem->nregions;
-            --to;
-            ++overlap_middle;
-            continue;
-        }
-
-        /* Shrink region */
-        if (memlast >= reglast) {
-            reg->memory_size = start_addr - reg->guest_phys_addr;
-            assert(reg->memory_size);
-            assert(!overlap_end);
-            ++overlap_end;
+        /* removed in the current transaction */
+        if (!section->mr) {
             continue;
         }
-
-        /* Shift region */
-        if (start_addr <= reg->guest_phys_addr) {
-            change = memlast + 1 - reg->guest_phys_addr;
-            reg->memory_size -= change;
-            reg->guest_phys_addr += change;
-            reg->userspace_addr += change;
-            assert(reg->memory_size);
-            assert(!overlap_start);
-            ++overlap_start;
-            continue;
-        }
-
-        /* This only happens if supplied region
-         * is in the middle of an existing one. Thus it can not
-         * overlap with any other existing region. */
-        assert(!overlap_start);
-        assert(!overlap_end);
-        assert(!overlap_middle);
-        /* Split region: shrink first part, shift second part. */
-        memcpy(dev->mem->regions + n, reg, sizeof *reg);
-        reg->memory_size = start_addr - reg->guest_phys_addr;
-        assert(reg->memory_size);
-        change = memlast + 1 - reg->guest_phys_addr;
-        reg = dev->mem->regions + n;
-        reg->memory_size -= change;
-        assert(reg->memory_size);
-        reg->guest_phys_addr += change;
-        reg->userspace_addr += change;
-        /* Never add more than 1 region */
-        assert(dev->mem->nregions == n);
-        ++dev->mem->nregions;
-        ++split;
+        vhost_sync_dirty_bitmap(dev, section, first, last);
     }
 }
 
-/* Called after unassign, so no regions overlap the given range. */
-static void vhost_dev_assign_memory(struct vhost_dev *dev,
-                                    uint64_t start_addr,
-                                    uint64_t size,
-                                    uint64_t uaddr)
-{
-    int from, to;
-    struct vhost_memory_region *merged = NULL;
-    for (from = 0, to = 0; from < dev->mem->nregions; ++from, ++to) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        uint64_t prlast, urlast;
-        uint64_t pmlast, umlast;
-        uint64_t s, e, u;
-
-        /* clone old region */
-        if (to != from) {
-            memcpy(reg, dev->mem->regions + from, sizeof *reg);
-        }
-        prlast = range_get_last(reg->guest_phys_addr, reg->memory_size);
-        pmlast = range_get_last(start_addr, size);
-        urlast = range_get_last(reg->userspace_addr, reg->memory_size);
-        umlast = range_get_last(uaddr, size);
-
-        /* check for overlapping regions: should never happen. */
-        assert(prlast < start_addr || pmlast < reg->guest_phys_addr);
-        /* Not an adjacent or overlapping region - do not merge. */
-        if ((prlast + 1 != start_addr || urlast + 1 != uaddr) &&
-            (pmlast + 1 != reg->guest_phys_addr ||
-             umlast + 1 != reg->userspace_addr)) {
-            continue;
-        }
-
-        if (dev->vhost_ops->vhost_backend_can_merge &&
-            !dev->vhost_ops->vhost_backend_can_merge(dev, uaddr, size,
-                                                     reg->userspace_addr,
-                                                     reg->memory_size)) {
-            continue;
-        }
-
-        if (merged) {
-            --to;
-            assert(to >= 0);
-        } else {
-            merged = reg;
-        }
-        u = MIN(uaddr, reg->userspace_addr);
-        s = MIN(start_addr, reg->guest_phys_addr);
-        e = MAX(pmlast, prlast);
-        uaddr = merged->userspace_addr = u;
-        start_addr = merged->guest_phys_addr = s;
-        size = merged->memory_size = e - s + 1;
-        assert(merged->memory_size);
-    }
-
-    if (!merged) {
-        struct vhost_memory_region *reg = dev->mem->regions + to;
-        memset(reg, 0, sizeof *reg);
-        reg->memory_size = size;
-        assert(reg->memory_size);
-        reg->guest_phys_addr = start_addr;
-        reg->userspace_addr = uaddr;
-        ++to;
-    }
-    assert(to <= dev->mem->nregions + 1);
-    dev->mem->nregions = to;
-}
-
 static uint64_t vhost_get_log_size(struct vhost_dev *dev)
 {
     uint64_t log_size = 0;
@@ -434,21 +285,6 @@ static int vhost_verify_ring_mappings(struct vhost_dev *dev,
     return r;
 }
 
-static struct vhost_memory_region *vhost_dev_find_reg(struct vhost_dev *dev,
-						      uint64_t start_addr,
-						      uint64_t size)
-{
-    int i, n = dev->mem->nregions;
-    for (i = 0; i < n; ++i) {
-        struct vhost_memory_region *reg = dev->mem->regions + i;
-        if (ranges_overlap(reg->guest_phys_addr, reg->memory_size,
-                           start_addr, size)) {
-            return reg;
-        }
-    }
-    return NULL;
-}
-
 static bool vhost_dev_cmp_memory(struct vhost_dev *dev,
                                  uint64_t start_addr,
                                  uint64_t size,
@@ -483,12 +319,8 @@ static void vhost_set_memory(MemoryListener *listener,
     ram_addr_t size = int128_get64(section->size);
     bool log_dirty =
         memory_region_get_dirty_log_mask(section->mr) & ~(1 << DIRTY_MEMORY_MIGRATION);
-    int s = offsetof(struct vhost_memory, regions) +
-        (dev->mem->nregions + 1) * sizeof dev->mem->regions[0];
     void *ram;
 
-    dev->mem = g_realloc(dev->mem, s);
-
     if (log_dirty) {
         add = false;
     }
@@ -536,6 +368,103 @@ static void vhost_begin(MemoryListener *listener)
     dev->mem_changed_start_addr = -1;
 }
 
+/* Send the whole table, which the backend takes as its new state. */
+static int vhost_dev_set_mem_table(struct vhost_dev *dev)
+{
+    int r;
+
+    r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+    if (r < 0) {
+        return r;
+    }
+
+    dev->mem_table_rebuilds++;
+    trace_vhost_set_mem_table(dev, dev->mem->nregions, dev->mem_table_rebuilds);
+
+    g_free(dev->mem_sent);
+    dev->mem_sent = g_memdup(dev->mem, offsetof(struct vhost_memory, regions) +
+                             dev->mem->nregions * sizeof dev->mem->regions[0]);
+    return 0;
+}
+
+static bool vhost_dev_mem_region_equal(struct vhost_memory_region *a,
+                                       struct vhost_memory_region *b)
+{
+    return a->guest_phys_addr == b->guest_phys_addr &&
+           a->memory_size == b->memory_size &&
+           a->userspace_addr == b->userspace_addr;
+}
+
+/* Bring the backend's table up to date.  Both the new table and the one
+ * the backend has are sorted, so the regions to remove and to add fall
+ * out of a single merge pass.  If the backend cannot take single region
+ * updates, it gets the whole table.
+ */
+static int vhost_dev_update_mem_table(struct vhost_dev *dev)
+{
+    struct vhost_memory *old = dev->mem_sent;
+    struct vhost_memory *new = dev->mem;
+    struct vhost_memory_region *del, *add;
+    int i = 0, j = 0, ndel = 0, nadd = 0;
+    int r;
+
+    if (!dev->vhost_ops->vhost_update_mem_table || !old) {
+        return vhost_dev_set_mem_table(dev);
+    }
+
+    del = g_new(struct vhost_memory_region, old->nregions);
+    add = g_new(struct vhost_memory_region, new->nregions);
+    while (i < old->nregions || j < new->nregions) {
+        struct vhost_memory_region *o = NULL, *n = NULL;
+
+        if (i < old->nregions) {
+            o = old->regions + i;
+        }
+        if (j < new->nregions) {
+            n = new->regions + j;
+        }
+
+        if (o && n && vhost_dev_mem_region_equal(o, n)) {
+            ++i;
+            ++j;
+        } else if (o && (!n || o->guest_phys_addr <= n->guest_phys_addr)) {
+            del[ndel++] = *o;
+            ++i;
+        } else {
+            add[nadd++] = *n;
+            ++j;
+        }
+    }
+
+    r = 0;
+    if (ndel || nadd) {
+        r = dev->vhost_ops->vhost_update_mem_table(dev, del, ndel, add, nadd);
+    }
+    g_free(del);
+    g_free(add);
+
+    if (r == -ENOTSUP) {
+        return vhost_dev_set_mem_table(dev);
+    }
+    if (r < 0) {
+        /* Like a failed full table write, this means the backend went
+         * away or the table has more regions than it takes.  Keep
+         * mem_sent as it was; the backend gets the whole table when
+         * vhost is started again.
+         */
+        error_report("vhost: failed to update memory table: %d", r);
+        return 0;
+    }
+
+    dev->mem_table_updates++;
+    trace_vhost_update_mem_table(dev, ndel, nadd, dev->mem_table_updates);
+
+    g_free(dev->mem_sent);
+    dev->mem_sent = g_memdup(dev->mem, offsetof(struct vhost_memory, regions) +
+                             dev->mem->nregions * sizeof dev->mem->regions[0]);
+    return 0;
+}
+
 static void vhost_commit(MemoryListener *listener)
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
@@ -545,6 +474,8 @@ static void vhost_commit(MemoryListener *listener)
     uint64_t log_size;
     int r;
 
+    vhost_dev_commit_sections(dev);
+
     if (!dev->memory_changed) {
         return;
     }
@@ -564,7 +495,7 @@ static void vhost_commit(MemoryListener *listener)
     }
 
     if (!dev->log_enabled) {
-        r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+        r = vhost_dev_update_mem_table(dev);
         assert(r >= 0);
         dev->memory_changed = false;
         return;
@@ -577,7 +508,7 @@ static void vhost_commit(MemoryListener *listener)
     if (dev->log_size < log_size) {
         vhost_dev_log_resize(dev, log_size + VHOST_LOG_BUFFER);
     }
-    r = dev->vhost_ops->vhost_set_mem_table(dev, dev->mem);
+    r = vhost_dev_update_mem_table(dev);
     assert(r >= 0);
     /* To log less, can only decrease log size after table update. */
     if (dev->log_size > log_size + VHOST_LOG_BUFFER) {
@@ -596,10 +527,7 @@ static void vhost_region_add(MemoryListener *listener,
         return;
     }
 
-    ++dev->n_mem_sections;
-    dev->mem_sections = g_renew(MemoryRegionSection, dev->mem_sections,
-                                dev->n_mem_sections);
-    dev->mem_sections[dev->n_mem_sections - 1] = *section;
+    vhost_dev_add_section(dev, section);
     memory_region_ref(section->mr);
     vhost_set_memory(listener, section, true);
 }
@@ -609,7 +537,6 @@ static void vhost_region_del(MemoryListener *listener,
 {
     struct vhost_dev *dev = container_of(listener, struct vhost_dev,
                                          memory_listener);
-    int i;
 
     if (!vhost_section(section)) {
         return;
@@ -617,15 +544,7 @@ static void vhost_region_del(MemoryListener *listener,
 
     vhost_set_memory(listener, section, false);
     memory_region_unref(section->mr);
-    for (i = 0; i < dev->n_mem_sections; ++i) {
-        if (dev->mem_sections[i].offset_within_address_space
-            == section->offset_within_address_space) {
-            --dev->n_mem_sections;
-            memmove(&dev->mem_sections[i], &dev->mem_sections[i+1],
-                    (dev->n_mem_sections - i) * sizeof(*dev->mem_sections));
-            break;
-        }
-    }
+    vhost_dev_del_section(dev, section);
 }
 
 static void vhost_region_nop(MemoryListener *listener,
@@ -923,10 +842,13 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
 
     r = dev->vhost_ops->vhost_get_vring_base(dev, &state);
     if (r < 0) {
+        /* The backend is gone; resume from what it last completed */
         fprintf(stderr, "vhost VQ %d ring restore failed: %d\n", idx, r);
         fflush(stderr);
+        virtio_queue_restore_last_avail_idx(vdev, idx);
+    } else {
+        virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     }
-    virtio_queue_set_last_avail_idx(vdev, idx, state.num);
     virtio_queue_invalidate_signalled_used(vdev, idx);
 
     /* In the cross-endian case, we need to reset the vring endianness to
@@ -941,7 +863,6 @@ static void vhost_virtqueue_stop(struct vhost_dev *dev,
         }
     }
 
-    assert (r >= 0);
     cpu_physical_memory_unmap(vq->ring, virtio_queue_get_ring_size(vdev, idx),
                               0, virtio_queue_get_ring_size(vdev, idx));
     cpu_physical_memory_unmap(vq->used, virtio_queue_get_used_size(vdev, idx),
@@ -1068,7 +989,13 @@ int vhost_dev_init(struct vhost_dev *hdev, void *opaque,
     }
 
     hdev->mem = g_malloc0(offsetof(struct vhost_memory, regions));
+    hdev->mem_nregions_alloc = 0;
+    hdev->mem_sent = NULL;
+    hdev->mem_table_rebuilds = 0;
+    hdev->mem_table_updates = 0;
     hdev->n_mem_sections = 0;
+    hdev->mem_sections_alloc = 0;
+    hdev->mem_sections_sorted = true;
     hdev->mem_sections = NULL;
     hdev->log = NULL;
     hdev->log_size = 0;
@@ -1100,6 +1027,7 @@ void vhost_dev_cleanup(struct vhost_dev *hdev)
         error_free(hdev->migration_blocker);
     }
     g_free(hdev->mem);
+    g_free(hdev->mem_sent);
     g_free(hdev->mem_sections);
     hdev->vhost_ops->vhost_backend_cleanup(hdev);
     QLIST_REMOVE(hdev, entry);
@@ -1205,6 +1133,9 @@ uint64_t vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
         }
         bit++;
     }
+    /* Only the split ring's avail index is passed to and read back from
+     * the backend; the packed ring's wrap counters and used index are not */
+    features &= ~(1ULL << VIRTIO_F_RING_PACKED);
     return features;
 }
 
@@ -1232,7 +1163,7 @@ int vhost_dev_start(struct vhost_dev *hdev, VirtIODevice *vdev)
     if (r < 0) {
         goto fail_features;
     }
-    r = hdev->vhost_ops->vhost_set_mem_table(hdev, hdev->mem);
+    r = vhost_dev_set_mem_table(hdev);
     if (r < 0) {
         r = -errno;
         goto fail_mem;
@@ -1299,3 +1230,81 @@ void vhost_dev_stop(struct vhost_dev *hdev, VirtIODevice *vdev)
     hdev->log_size = 0;
 }
 
+
+void vhost_dev_init_inflight(struct vhost_inflight *inflight)
+{
+    memset(inflight, 0, sizeof(*inflight));
+    inflight->fd = -1;
+}
+
+/* Forget everything recorded in the region, e.g. when the rings it
+ * describes have been reset.
+ */
+void vhost_dev_reset_inflight(struct vhost_inflight *inflight)
+{
+    if (inflight->addr) {
+        memset(inflight->addr, 0, inflight->size);
+    }
+}
+
+void vhost_dev_free_inflight(struct vhost_inflight *inflight)
+{
+    if (inflight->addr) {
+        munmap(inflight->addr, inflight->size);
+    }
+    if (inflight->fd >= 0) {
+        close(inflight->fd);
+    }
+    vhost_dev_init_inflight(inflight);
+}
+
+/* Ask the backend for an inflight region, unless one from an earlier
+ * connection is still around.  Returns 0 without setting up anything if
+ * the backend does not support inflight tracking.
+ */
+int vhost_dev_get_inflight(struct vhost_dev *hdev, uint16_t queue_size,
+                           uint16_t num_queues,
+                           struct vhost_inflight *inflight)
+{
+    int r;
+
+    if (!hdev->vhost_ops->vhost_get_inflight_fd) {
+        return 0;
+    }
+
+    if (inflight->addr) {
+        if (inflight->queue_size == queue_size &&
+            inflight->num_queues == num_queues) {
+            return 0;
+        }
+        /* Ring layout changed, the old region describes nothing useful */
+        vhost_dev_free_inflight(inflight);
+    }
+
+    r = hdev->vhost_ops->vhost_get_inflight_fd(hdev, queue_size, num_queues,
+                                               inflight);
+    if (r < 0) {
+        error_report("vhost: failed to get inflight region: %d", r);
+        return r;
+    }
+
+    return 0;
+}
+
+int vhost_dev_set_inflight(struct vhost_dev *hdev,
+                           struct vhost_inflight *inflight)
+{
+    int r;
+
+    if (!hdev->vhost_ops->vhost_set_inflight_fd || !inflight->addr) {
+        return 0;
+    }
+
+    r = hdev->vhost_ops->vhost_set_inflight_fd(hdev, inflight);
+    if (r < 0) {
+        error_report("vhost: failed to set inflight region: %d", r);
+        return r;
+    }
+
+    return 0;
+}
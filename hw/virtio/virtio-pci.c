@@ -1423,7 +1423,7 @@ static void virtio_pci_notify_write(void *opaque, hwaddr addr,
     unsigned queue = addr / QEMU_VIRTIO_PCI_QUEUE_MEM_MULT;
 
     if (queue < VIRTIO_QUEUE_MAX) {
-        virtio_queue_notify(vdev, queue);
+        virtio_queue_notify_unlocked(vdev, queue);
     }
 }
 
@@ -1434,7 +1434,7 @@ static void virtio_pci_notify_write_pio(void *opaque, hwaddr addr,
     unsigned queue = val;
 
     if (queue < VIRTIO_QUEUE_MAX) {
-        virtio_queue_notify(vdev, queue);
+        virtio_queue_notify_unlocked(vdev, queue);
     }
 }
 
@@ -1571,6 +1571,10 @@ static void virtio_pci_modern_regions_init(VirtIOPCIProxy *proxy)
                           virtio_bus_get_device(&proxy->bus),
                           "virtio-pci-notify-pio",
                           proxy->notify.size);
+
+    /* Kicks are dispatched without the BQL, see virtio_queue_notify_unlocked */
+    memory_region_clear_global_locking(&proxy->notify.mr);
+    memory_region_clear_global_locking(&proxy->notify_pio.mr);
 }
 
 static void virtio_pci_modern_region_map(VirtIOPCIProxy *proxy,
@@ -20,9 +20,11 @@
 #include "qemu/error-report.h"
 #include "hw/virtio/virtio.h"
 #include "qemu/atomic.h"
+#include "qemu/main-loop.h"
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -59,6 +61,34 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
+/* An element filled into a packed ring but not yet flushed */
+typedef struct VirtQueuePackedUsed
+{
+    unsigned int index;
+    unsigned int len;
+    unsigned int ndescs;
+} VirtQueuePackedUsed;
+
+/*
+ * With VIRTIO_F_RING_PACKED, vring.desc is the descriptor ring and
+ * vring.avail/vring.used hold the driver and device event suppression
+ * structures.  Descriptors are made available and used in place, and
+ * the wrap counters tell the current lap from the previous one.
+ */
 typedef struct VRing
 {
     unsigned int num;
@@ -69,6 +99,21 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/*
+ * Host mappings of the ring areas.  Rings live in guest RAM in every sane
+ * configuration, so resolve them once when the driver sets them up and
+ * access them through a plain pointer afterwards instead of walking the
+ * memory map on every index or descriptor access.  A cache that cannot be
+ * established (ring not in RAM, or crossing a region boundary) is left
+ * empty and its accesses take the address_space_* slow path.
+ */
+typedef struct VRingCache {
+    MemoryRegion *mr;
+    void *ptr;
+    hwaddr xlat;
+    hwaddr len;
+} VRingCache;
+
 struct VirtQueue
 {
     VRing vring;
@@ -81,6 +126,20 @@ struct VirtQueue
 
     uint16_t used_idx;
 
+    /* Packed ring wrap counters for the indexes above */
+    bool last_avail_wrap_counter;
+    bool shadow_avail_wrap_counter;
+    bool used_wrap_counter;
+
+    /* Packed ring elements filled since the last flush */
+    VirtQueuePackedUsed *used_elems;
+
+    /* Host mappings of desc/avail/used, see virtio_queue_update_caches() */
+    VRingCache desc_cache;
+    VRingCache avail_cache;
+    VRingCache used_cache;
+    unsigned cache_generation;
+
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
@@ -96,33 +155,234 @@ struct VirtQueue
 
     uint16_t vector;
     void (*handle_output)(VirtIODevice *vdev, VirtQueue *vq);
-    void (*handle_aio_output)(VirtIODevice *vdev, VirtQueue *vq);
+    VirtIOHandleAIOOutput handle_aio_output;
     VirtIODevice *vdev;
     EventNotifier guest_notifier;
     EventNotifier host_notifier;
+    bool host_notifier_enabled;
     QLIST_ENTRY(VirtQueue) node;
 };
 
+static inline bool virtio_queue_packed(VirtQueue *vq)
+{
+    return virtio_vdev_has_feature(vq->vdev, VIRTIO_F_RING_PACKED);
+}
+
+static void virtio_queue_update_caches(VirtQueue *vq);
+
 /* virt queue functions */
 void virtio_queue_update_rings(VirtIODevice *vdev, int n)
 {
     VRing *vring = &vdev->vq[n].vring;
 
+    /* Nothing to compute before the ring is set up; the driver always
+     * places the packed ring event structures itself */
+    if (vring->desc && !virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        vring->avail = vring->desc + vring->num * sizeof(VRingDesc);
+        vring->used = vring_align(vring->avail +
+                                  offsetof(VRingAvail, ring[vring->num]),
+                                  vring->align);
+    }
+    virtio_queue_update_caches(&vdev->vq[n]);
+}
+
+/* Bumped by the listener below whenever the guest memory map changes */
+static unsigned vring_cache_generation;
+static bool vring_cache_invalidate_pending;
+
+static void vring_cache_invalidate(MemoryListener *listener,
+                                   MemoryRegionSection *section)
+{
+    vring_cache_invalidate_pending = true;
+}
+
+/* Only bump the generation once the new dispatch tree is published, or a
+ * queue could rebuild its caches from the old one and keep them.
+ */
+static void vring_cache_commit(MemoryListener *listener)
+{
+    if (vring_cache_invalidate_pending) {
+        vring_cache_invalidate_pending = false;
+        atomic_inc(&vring_cache_generation);
+    }
+}
+
+static MemoryListener vring_cache_listener = {
+    .region_add = vring_cache_invalidate,
+    .region_del = vring_cache_invalidate,
+    .commit = vring_cache_commit,
+    /* Commit after the address space's dispatch listener (priority 0) */
+    .priority = 1,
+};
+static bool vring_cache_listener_registered;
+
+static void vring_cache_release(VRingCache *cache)
+{
+    if (cache->mr) {
+        memory_region_unref(cache->mr);
+    }
+    memset(cache, 0, sizeof(*cache));
+}
+
+static void vring_cache_init(VRingCache *cache, hwaddr pa, hwaddr len,
+                             bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, l = len;
+
+    vring_cache_release(cache);
+    /* Xen maps guest RAM piecewise through its map cache */
+    if (!pa || !len || xen_enabled()) {
+        return;
+    }
+
+    rcu_read_lock();
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &l,
+                                 is_write);
+    if (l >= len && memory_region_is_ram(mr) &&
+        !(is_write && mr->readonly)) {
+        memory_region_ref(mr);
+        cache->mr = mr;
+        cache->xlat = xlat;
+        cache->len = len;
+        cache->ptr = memory_region_get_ram_ptr(mr) + xlat;
+    }
+    rcu_read_unlock();
+}
+
+static void virtio_queue_release_caches(VirtQueue *vq)
+{
+    vring_cache_release(&vq->desc_cache);
+    vring_cache_release(&vq->avail_cache);
+    vring_cache_release(&vq->used_cache);
+}
+
+static void virtio_queue_update_caches(VirtQueue *vq)
+{
+    VRing *vring = &vq->vring;
+    hwaddr avail_size, used_size;
+
+    vq->cache_generation = atomic_read(&vring_cache_generation);
     if (!vring->desc) {
-        /* not yet setup -> nothing to do */
+        virtio_queue_release_caches(vq);
         return;
     }
-    vring->avail = vring->desc + vring->num * sizeof(VRingDesc);
-    vring->used = vring_align(vring->avail +
-                              offsetof(VRingAvail, ring[vring->num]),
-                              vring->align);
+
+    if (virtio_queue_packed(vq)) {
+        avail_size = used_size = sizeof(VRingPackedDescEvent);
+    } else {
+        /* include used_event and avail_event at the end of the rings */
+        avail_size = offsetof(VRingAvail, ring[vring->num]) + sizeof(uint16_t);
+        used_size = offsetof(VRingUsed, ring[vring->num]) + sizeof(uint16_t);
+    }
+
+    /* packed rings write back used descriptors in place */
+    vring_cache_init(&vq->desc_cache, vring->desc,
+                     vring->num * sizeof(VRingDesc), virtio_queue_packed(vq));
+    vring_cache_init(&vq->avail_cache, vring->avail, avail_size, false);
+    vring_cache_init(&vq->used_cache, vring->used, used_size, true);
+}
+
+/* Host pointer for @len bytes at @off into a ring area, or NULL if the
+ * access has to go through the address space */
+static inline void *vring_cache_ptr(VirtQueue *vq, VRingCache *cache,
+                                    hwaddr off, hwaddr len)
+{
+    if (unlikely(vq->cache_generation != atomic_read(&vring_cache_generation))) {
+        virtio_queue_update_caches(vq);
+    }
+    if (!cache->ptr || off + len > cache->len) {
+        return NULL;
+    }
+    return cache->ptr + off;
+}
+
+/* Writes that bypass the address space must still reach the dirty log */
+static inline void vring_cache_dirty(VRingCache *cache, hwaddr off,
+                                     hwaddr len)
+{
+    memory_region_set_dirty(cache->mr, cache->xlat + off, len);
+}
+
+static void vring_read(VirtQueue *vq, VRingCache *cache, hwaddr pa,
+                       hwaddr off, void *buf, hwaddr len)
+{
+    void *ptr = vring_cache_ptr(vq, cache, off, len);
+
+    if (ptr) {
+        memcpy(buf, ptr, len);
+    } else {
+        address_space_read(&address_space_memory, pa + off,
+                           MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+static void vring_write(VirtQueue *vq, VRingCache *cache, hwaddr pa,
+                        hwaddr off, const void *buf, hwaddr len)
+{
+    void *ptr = vring_cache_ptr(vq, cache, off, len);
+
+    if (ptr) {
+        memcpy(ptr, buf, len);
+        vring_cache_dirty(cache, off, len);
+    } else {
+        address_space_write(&address_space_memory, pa + off,
+                            MEMTXATTRS_UNSPECIFIED, buf, len);
+    }
+}
+
+static inline uint16_t vring_lduw(VirtQueue *vq, VRingCache *cache,
+                                  hwaddr pa, hwaddr off)
+{
+    void *ptr = vring_cache_ptr(vq, cache, off, sizeof(uint16_t));
+
+    if (ptr) {
+        return virtio_lduw_p(vq->vdev, ptr);
+    }
+    return virtio_lduw_phys(vq->vdev, pa + off);
+}
+
+static inline void vring_stw(VirtQueue *vq, VRingCache *cache,
+                             hwaddr pa, hwaddr off, uint16_t val)
+{
+    void *ptr = vring_cache_ptr(vq, cache, off, sizeof(uint16_t));
+
+    if (ptr) {
+        virtio_stw_p(vq->vdev, ptr, val);
+        vring_cache_dirty(cache, off, sizeof(uint16_t));
+    } else {
+        virtio_stw_phys(vq->vdev, pa + off, val);
+    }
 }
 
-static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+static inline void vring_stl(VirtQueue *vq, VRingCache *cache,
+                             hwaddr pa, hwaddr off, uint32_t val)
+{
+    void *ptr = vring_cache_ptr(vq, cache, off, sizeof(uint32_t));
+
+    if (ptr) {
+        virtio_stl_p(vq->vdev, ptr, val);
+        vring_cache_dirty(cache, off, sizeof(uint32_t));
+    } else {
+        virtio_stl_phys(vq->vdev, pa + off, val);
+    }
+}
+
+/* Only the ring itself is cached; indirect tables always take the slow path */
+static inline VRingCache *vring_desc_cache(VirtQueue *vq, hwaddr desc_pa)
+{
+    static VRingCache no_cache;
+
+    return desc_pa == vq->vring.desc ? &vq->desc_cache : &no_cache;
+}
+
+static void vring_desc_read(VirtQueue *vq, VRingDesc *desc,
                             hwaddr desc_pa, int i)
 {
-    address_space_read(&address_space_memory, desc_pa + i * sizeof(VRingDesc),
-                       MEMTXATTRS_UNSPECIFIED, (void *)desc, sizeof(VRingDesc));
+    VirtIODevice *vdev = vq->vdev;
+
+    vring_read(vq, vring_desc_cache(vq, desc_pa), desc_pa,
+               i * sizeof(VRingDesc), desc, sizeof(VRingDesc));
     virtio_tswap64s(vdev, &desc->addr);
     virtio_tswap32s(vdev, &desc->len);
     virtio_tswap16s(vdev, &desc->flags);
@@ -131,24 +391,21 @@ static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, &vq->avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    vq->shadow_avail_idx = virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_lduw(vq, &vq->avail_cache, vq->vring.avail,
+                                      offsetof(VRingAvail, idx));
     return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, &vq->avail_cache, vq->vring.avail,
+                      offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_get_used_event(VirtQueue *vq)
@@ -159,59 +416,137 @@ static inline uint16_t vring_get_used_event(VirtQueue *vq)
 static inline void vring_used_write(VirtQueue *vq, VRingUsedElem *uelem,
                                     int i)
 {
-    hwaddr pa;
     virtio_tswap32s(vq->vdev, &uelem->id);
     virtio_tswap32s(vq->vdev, &uelem->len);
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i]);
-    address_space_write(&address_space_memory, pa, MEMTXATTRS_UNSPECIFIED,
-                       (void *)uelem, sizeof(VRingUsedElem));
+    vring_write(vq, &vq->used_cache, vq->vring.used,
+                offsetof(VRingUsed, ring[i]), uelem, sizeof(VRingUsedElem));
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq, &vq->used_cache, vq->vring.used,
+                      offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, &vq->used_cache, vq->vring.used,
+              offsetof(VRingUsed, idx), val);
     vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+    uint16_t flags = vring_lduw(vq, &vq->used_cache, vq->vring.used, off);
+
+    vring_stw(vq, &vq->used_cache, vq->vring.used, off, flags | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+    uint16_t flags = vring_lduw(vq, &vq->used_cache, vq->vring.used, off);
+
+    vring_stw(vq, &vq->used_cache, vq->vring.used, off, flags & ~mask);
 }
 
 static inline void vring_set_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq, &vq->used_cache, vq->vring.used,
+              offsetof(VRingUsed, ring[vq->vring.num]), val);
+}
+
+static void vring_packed_desc_read_flags(VirtQueue *vq, uint16_t *flags,
+                                         hwaddr desc_pa, int i)
+{
+    *flags = vring_lduw(vq, vring_desc_cache(vq, desc_pa), desc_pa,
+                        i * sizeof(VRingPackedDesc) +
+                        offsetof(VRingPackedDesc, flags));
+}
+
+static void vring_packed_desc_read(VirtQueue *vq, VRingPackedDesc *desc,
+                                   hwaddr desc_pa, int i)
+{
+    VirtIODevice *vdev = vq->vdev;
+
+    vring_read(vq, vring_desc_cache(vq, desc_pa), desc_pa,
+               i * sizeof(VRingPackedDesc), desc, sizeof(VRingPackedDesc));
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->id);
+    virtio_tswap16s(vdev, &desc->flags);
+}
+
+/* Write back a used descriptor; with @strict_order the flags, which hand
+ * the descriptor to the driver, are written after everything else. */
+static void vring_packed_desc_write(VirtQueue *vq, VRingPackedDesc *desc,
+                                    hwaddr desc_pa, int i, bool strict_order)
+{
+    VRingCache *cache = vring_desc_cache(vq, desc_pa);
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_stw(vq, cache, desc_pa, off + offsetof(VRingPackedDesc, id),
+              desc->id);
+    vring_stl(vq, cache, desc_pa, off + offsetof(VRingPackedDesc, len),
+              desc->len);
+    if (strict_order) {
+        smp_wmb();
+    }
+    vring_stw(vq, cache, desc_pa, off + offsetof(VRingPackedDesc, flags),
+              desc->flags);
+}
+
+static void vring_packed_event_read(VirtQueue *vq, VRingPackedDescEvent *e)
+{
+    e->flags = vring_lduw(vq, &vq->avail_cache, vq->vring.avail,
+                          offsetof(VRingPackedDescEvent, flags));
+    /* Make sure flags is read before off_wrap */
+    smp_rmb();
+    e->off_wrap = vring_lduw(vq, &vq->avail_cache, vq->vring.avail,
+                             offsetof(VRingPackedDescEvent, off_wrap));
+}
+
+static inline bool is_desc_avail(uint16_t flags, bool wrap_counter)
+{
+    bool avail, used;
+
+    avail = !!(flags & (1 << VRING_PACKED_DESC_F_AVAIL));
+    used = !!(flags & (1 << VRING_PACKED_DESC_F_USED));
+    return (avail != used) && (avail == wrap_counter);
+}
+
+static void virtio_queue_packed_set_notification(VirtQueue *vq, int enable)
+{
+    VirtIODevice *vdev = vq->vdev;
+    uint16_t off_wrap, flags;
+
+    if (!enable) {
+        flags = VRING_PACKED_EVENT_FLAG_DISABLE;
+    } else if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        off_wrap = vq->shadow_avail_idx |
+                   vq->shadow_avail_wrap_counter << VRING_PACKED_EVENT_F_WRAP_CTR;
+        vring_stw(vq, &vq->used_cache, vq->vring.used,
+                  offsetof(VRingPackedDescEvent, off_wrap), off_wrap);
+        /* Make sure off_wrap is written before flags */
+        smp_wmb();
+        flags = VRING_PACKED_EVENT_FLAG_DESC;
+    } else {
+        flags = VRING_PACKED_EVENT_FLAG_ENABLE;
+    }
+    vring_stw(vq, &vq->used_cache, vq->vring.used,
+              offsetof(VRingPackedDescEvent, flags), flags);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_queue_packed(vq)) {
+        virtio_queue_packed_set_notification(vq, enable);
+    } else if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -231,7 +566,7 @@ int virtio_queue_ready(VirtQueue *vq)
 
 /* Fetch avail_idx from VQ memory only when we really need to know if
  * guest has added some buffers. */
-int virtio_queue_empty(VirtQueue *vq)
+static int virtio_queue_split_empty(VirtQueue *vq)
 {
     if (vq->shadow_avail_idx != vq->last_avail_idx) {
         return 0;
@@ -240,6 +575,23 @@ int virtio_queue_empty(VirtQueue *vq)
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    uint16_t flags;
+
+    vring_packed_desc_read_flags(vq, &flags, vq->vring.desc,
+                                 vq->last_avail_idx);
+    return !is_desc_avail(flags, vq->last_avail_wrap_counter);
+}
+
+int virtio_queue_empty(VirtQueue *vq)
+{
+    if (virtio_queue_packed(vq)) {
+        return virtio_queue_packed_empty(vq);
+    }
+    return virtio_queue_split_empty(vq);
+}
+
 static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
                                unsigned int len)
 {
@@ -266,19 +618,23 @@ static void virtqueue_unmap_sg(VirtQueue *vq, const VirtQueueElement *elem,
 void virtqueue_discard(VirtQueue *vq, const VirtQueueElement *elem,
                        unsigned int len)
 {
-    vq->last_avail_idx--;
+    if (!virtio_queue_packed(vq)) {
+        vq->last_avail_idx--;
+    } else if (vq->last_avail_idx < elem->ndescs) {
+        vq->last_avail_idx += vq->vring.num - elem->ndescs;
+        vq->last_avail_wrap_counter ^= 1;
+    } else {
+        vq->last_avail_idx -= elem->ndescs;
+    }
+    vq->inuse--;
     virtqueue_unmap_sg(vq, elem, len);
 }
 
-void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
-                    unsigned int len, unsigned int idx)
+static void virtqueue_split_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                 unsigned int len, unsigned int idx)
 {
     VRingUsedElem uelem;
 
-    trace_virtqueue_fill(vq, elem, len, idx);
-
-    virtqueue_unmap_sg(vq, elem, len);
-
     idx = (idx + vq->used_idx) % vq->vring.num;
 
     uelem.id = elem->index;
@@ -286,12 +642,40 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
     vring_used_write(vq, &uelem, idx);
 }
 
-void virtqueue_flush(VirtQueue *vq, unsigned int count)
+/* Packed ring elements are only written back on flush, so that the
+ * first one of a batch can be exposed last. */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    if (!vq->used_elems) {
+        vq->used_elems = g_new(VirtQueuePackedUsed, VIRTQUEUE_MAX_SIZE);
+    }
+    assert(idx < VIRTQUEUE_MAX_SIZE);
+
+    vq->used_elems[idx].index = elem->index;
+    vq->used_elems[idx].len = len;
+    vq->used_elems[idx].ndescs = elem->ndescs;
+}
+
+void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                    unsigned int len, unsigned int idx)
+{
+    trace_virtqueue_fill(vq, elem, len, idx);
+
+    virtqueue_unmap_sg(vq, elem, len);
+
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+    } else {
+        virtqueue_split_fill(vq, elem, len, idx);
+    }
+}
+
+static void virtqueue_split_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
     /* Make sure buffer is written before we update index. */
     smp_wmb();
-    trace_virtqueue_flush(vq, count);
     old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
@@ -300,6 +684,68 @@ void virtqueue_flush(VirtQueue *vq, unsigned int count)
         vq->signalled_used_valid = false;
 }
 
+/* Write @uelem to the descriptor @offset entries past used_idx */
+static void virtqueue_packed_fill_desc(VirtQueue *vq,
+                                       const VirtQueuePackedUsed *uelem,
+                                       unsigned int offset, bool strict_order)
+{
+    unsigned int head = vq->used_idx + offset;
+    bool wrap_counter = vq->used_wrap_counter;
+    VRingPackedDesc desc = {
+        .id = uelem->index,
+        .len = uelem->len,
+    };
+
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap_counter ^= 1;
+    }
+    if (wrap_counter) {
+        desc.flags |= (1 << VRING_PACKED_DESC_F_AVAIL) |
+                      (1 << VRING_PACKED_DESC_F_USED);
+    }
+    vring_packed_desc_write(vq, &desc, vq->vring.desc, head,
+                            strict_order);
+}
+
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    unsigned int i, ndescs;
+
+    if (!count) {
+        return;
+    }
+
+    /* The driver polls the flags of the descriptor at its used index, so
+     * write the rest of the batch first and expose its head last.  This
+     * also orders the buffer contents before the descriptors. */
+    smp_wmb();
+    ndescs = vq->used_elems[0].ndescs;
+    for (i = 1; i < count; i++) {
+        virtqueue_packed_fill_desc(vq, &vq->used_elems[i], ndescs, false);
+        ndescs += vq->used_elems[i].ndescs;
+    }
+    virtqueue_packed_fill_desc(vq, &vq->used_elems[0], 0, true);
+
+    vq->inuse -= count;
+    vq->used_idx += ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter ^= 1;
+        vq->signalled_used_valid = false;
+    }
+}
+
+void virtqueue_flush(VirtQueue *vq, unsigned int count)
+{
+    trace_virtqueue_flush(vq, count);
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_flush(vq, count);
+    } else {
+        virtqueue_split_flush(vq, count);
+    }
+}
+
 void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len)
 {
@@ -307,6 +753,22 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
     virtqueue_flush(vq, 1);
 }
 
+/* Return @count elements to the guest with a single used index update.
+ * The caller decides about notification once for the whole batch. */
+void virtqueue_push_batch(VirtQueue *vq, VirtQueueElement *const *elems,
+                          const unsigned int *lens, unsigned int count)
+{
+    unsigned int i;
+
+    if (!count) {
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        virtqueue_fill(vq, elems[i], lens[i], i);
+    }
+    virtqueue_flush(vq, count);
+}
+
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
     uint16_t num_heads = vring_avail_idx(vq) - idx;
@@ -343,7 +805,7 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
+static unsigned virtqueue_read_next_desc(VirtQueue *vq, VRingDesc *desc,
                                          hwaddr desc_pa, unsigned int max)
 {
     unsigned int next;
@@ -363,13 +825,15 @@ static unsigned virtqueue_read_next_desc(VirtIODevice *vdev, VRingDesc *desc,
         exit(1);
     }
 
-    vring_desc_read(vdev, desc, desc_pa, next);
+    vring_desc_read(vq, desc, desc_pa, next);
     return next;
 }
 
-void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
-                               unsigned int *out_bytes,
-                               unsigned max_in_bytes, unsigned max_out_bytes)
+static void virtqueue_split_get_avail_bytes(VirtQueue *vq,
+                                           unsigned int *in_bytes,
+                                           unsigned int *out_bytes,
+                                           unsigned max_in_bytes,
+                                           unsigned max_out_bytes)
 {
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
@@ -378,7 +842,6 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
-        VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
         VRingDesc desc;
         hwaddr desc_pa;
@@ -388,7 +851,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_desc_read(vq, &desc, desc_pa, i);
 
         if (desc.flags & VRING_DESC_F_INDIRECT) {
             if (desc.len % sizeof(VRingDesc)) {
@@ -407,7 +870,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             max = desc.len / sizeof(VRingDesc);
             desc_pa = desc.addr;
             num_bufs = i = 0;
-            vring_desc_read(vdev, &desc, desc_pa, i);
+            vring_desc_read(vq, &desc, desc_pa, i);
         }
 
         do {
@@ -425,7 +888,7 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+        } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -441,6 +904,122 @@ done:
     }
 }
 
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                            unsigned int *in_bytes,
+                                            unsigned int *out_bytes,
+                                            unsigned max_in_bytes,
+                                            unsigned max_out_bytes)
+{
+    bool wrap_counter = vq->last_avail_wrap_counter;
+    unsigned int idx = vq->last_avail_idx;
+    unsigned int total_bufs, in_total, out_total;
+
+    total_bufs = in_total = out_total = 0;
+    for (;;) {
+        unsigned int max, num_bufs, i;
+        bool indirect = false;
+        VRingPackedDesc desc;
+        hwaddr desc_pa;
+        uint16_t flags;
+
+        vring_packed_desc_read_flags(vq, &flags, vq->vring.desc, idx);
+        if (!is_desc_avail(flags, wrap_counter)) {
+            break;
+        }
+        /* Read the rest of the descriptor only after its flags */
+        smp_rmb();
+
+        max = vq->vring.num;
+        num_bufs = total_bufs;
+        i = idx;
+        desc_pa = vq->vring.desc;
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+
+            /* If we've got too many, that implies a descriptor loop. */
+            if (num_bufs >= max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            /* loop over the indirect descriptor table */
+            indirect = true;
+            max = desc.len / sizeof(VRingPackedDesc);
+            desc_pa = desc.addr;
+            num_bufs = i = 0;
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        for (;;) {
+            /* If we've got too many, that implies a descriptor loop. */
+            if (++num_bufs > max) {
+                error_report("Looped descriptor");
+                exit(1);
+            }
+
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+
+            if (indirect) {
+                if (++i == max) {
+                    break;
+                }
+            } else {
+                if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                    break;
+                }
+                if (++i == vq->vring.num) {
+                    i = 0;
+                }
+            }
+            vring_packed_desc_read(vq, &desc, desc_pa, i);
+        }
+
+        if (indirect) {
+            total_bufs++;
+            idx++;
+        } else {
+            idx += num_bufs - total_bufs;
+            total_bufs = num_bufs;
+        }
+        if (idx >= vq->vring.num) {
+            idx -= vq->vring.num;
+            wrap_counter ^= 1;
+        }
+    }
+done:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
+void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
+                               unsigned int *out_bytes,
+                               unsigned max_in_bytes, unsigned max_out_bytes)
+{
+    if (virtio_queue_packed(vq)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+    } else {
+        virtqueue_split_get_avail_bytes(vq, in_bytes, out_bytes,
+                                        max_in_bytes, max_out_bytes);
+    }
+}
+
 int virtqueue_avail_bytes(VirtQueue *vq, unsigned int in_bytes,
                           unsigned int out_bytes)
 {
@@ -538,17 +1117,82 @@ void *virtqueue_alloc_element(size_t sz, unsigned out_num, unsigned in_num)
     return elem;
 }
 
-void *virtqueue_pop(VirtQueue *vq, size_t sz)
+/* Map the descriptor chain starting at @head into a new element */
+static void *virtqueue_split_read_elem(VirtQueue *vq, unsigned int head,
+                                       size_t sz)
 {
-    unsigned int i, head, max;
+    unsigned int i, max;
     hwaddr desc_pa = vq->vring.desc;
-    VirtIODevice *vdev = vq->vdev;
     VirtQueueElement *elem;
     unsigned out_num, in_num;
     hwaddr addr[VIRTQUEUE_MAX_SIZE];
     struct iovec iov[VIRTQUEUE_MAX_SIZE];
     VRingDesc desc;
 
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = 0;
+
+    max = vq->vring.num;
+
+    i = head;
+    vring_desc_read(vq, &desc, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* loop over the indirect descriptor table */
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        i = 0;
+        vring_desc_read(vq, &desc, desc_pa, i);
+    }
+
+    /* Collect all the descriptors */
+    do {
+        if (desc.flags & VRING_DESC_F_WRITE) {
+            virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
+                               VIRTQUEUE_MAX_SIZE - out_num, true, desc.addr, desc.len);
+        } else {
+            if (in_num) {
+                error_report("Incorrect order for descriptors");
+                exit(1);
+            }
+            virtqueue_map_desc(&out_num, addr, iov,
+                               VIRTQUEUE_MAX_SIZE, false, desc.addr, desc.len);
+        }
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if ((in_num + out_num) > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+    } while ((i = virtqueue_read_next_desc(vq, &desc, desc_pa, max)) != max);
+
+    /* Now copy what we have collected and mapped */
+    elem = virtqueue_alloc_element(sz, out_num, in_num);
+    elem->index = head;
+    elem->ndescs = 1;
+    for (i = 0; i < out_num; i++) {
+        elem->out_addr[i] = addr[i];
+        elem->out_sg[i] = iov[i];
+    }
+    for (i = 0; i < in_num; i++) {
+        elem->in_addr[i] = addr[out_num + i];
+        elem->in_sg[i] = iov[out_num + i];
+    }
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem;
+}
+
+static void *virtqueue_split_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int head;
+
     if (virtio_queue_empty(vq)) {
         return NULL;
     }
@@ -556,32 +1200,81 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
      * virtqueue_num_heads(). */
     smp_rmb();
 
-    /* When we start there are none of either input nor output. */
-    out_num = in_num = 0;
+    head = virtqueue_get_head(vq, vq->last_avail_idx++);
+    if (virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
+        vring_set_avail_event(vq, vq->last_avail_idx);
+    }
+    return virtqueue_split_read_elem(vq, head, sz);
+}
 
-    max = vq->vring.num;
+static unsigned int virtqueue_split_pop_batch(VirtQueue *vq, size_t sz,
+                                              void **elems, unsigned int max)
+{
+    unsigned int i, count;
 
-    i = head = virtqueue_get_head(vq, vq->last_avail_idx++);
-    if (virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
+    /* Only go back to the avail ring if the shadow index cannot fill the
+     * whole batch; either way there is one barrier for all heads. */
+    count = (uint16_t)(vq->shadow_avail_idx - vq->last_avail_idx);
+    if (count < max) {
+        count = virtqueue_num_heads(vq, vq->last_avail_idx);
+    } else {
+        smp_rmb();
+    }
+    count = MIN(count, max);
+
+    for (i = 0; i < count; i++) {
+        unsigned int head = virtqueue_get_head(vq, vq->last_avail_idx++);
+        elems[i] = virtqueue_split_read_elem(vq, head, sz);
+    }
+
+    if (count && virtio_vdev_has_feature(vq->vdev, VIRTIO_RING_F_EVENT_IDX)) {
         vring_set_avail_event(vq, vq->last_avail_idx);
     }
+    return count;
+}
 
-    vring_desc_read(vdev, &desc, desc_pa, i);
+static void *virtqueue_packed_pop(VirtQueue *vq, size_t sz)
+{
+    unsigned int i, max, entries;
+    hwaddr desc_pa = vq->vring.desc;
+    VirtQueueElement *elem;
+    unsigned out_num, in_num;
+    hwaddr addr[VIRTQUEUE_MAX_SIZE];
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
+
+    if (virtio_queue_packed_empty(vq)) {
+        return NULL;
+    }
+    /* Read the rest of the head descriptor only after its flags */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    out_num = in_num = entries = 0;
+
+    max = vq->vring.num;
+
+    i = vq->last_avail_idx;
+    vring_packed_desc_read(vq, &desc, desc_pa, i);
+    id = desc.id;
     if (desc.flags & VRING_DESC_F_INDIRECT) {
-        if (desc.len % sizeof(VRingDesc)) {
+        if (desc.len % sizeof(VRingPackedDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = desc.len / sizeof(VRingDesc);
+        indirect = true;
+        max = desc.len / sizeof(VRingPackedDesc);
         desc_pa = desc.addr;
         i = 0;
-        vring_desc_read(vdev, &desc, desc_pa, i);
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
     }
 
     /* Collect all the descriptors */
-    do {
+    for (;;) {
         if (desc.flags & VRING_DESC_F_WRITE) {
             virtqueue_map_desc(&in_num, addr + out_num, iov + out_num,
                                VIRTQUEUE_MAX_SIZE - out_num, true, desc.addr, desc.len);
@@ -595,15 +1288,31 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         }
 
         /* If we've got too many, that implies a descriptor loop. */
-        if ((in_num + out_num) > max) {
+        if (++entries > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_read_next_desc(vdev, &desc, desc_pa, max)) != max);
+
+        /* Indirect tables are used whole; chains in the ring may wrap */
+        if (indirect) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++i == vq->vring.num) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(vq, &desc, desc_pa, i);
+    }
 
     /* Now copy what we have collected and mapped */
     elem = virtqueue_alloc_element(sz, out_num, in_num);
-    elem->index = head;
+    elem->index = id;
+    elem->ndescs = indirect ? 1 : entries;
     for (i = 0; i < out_num; i++) {
         elem->out_addr[i] = addr[i];
         elem->out_sg[i] = iov[i];
@@ -613,12 +1322,47 @@ void *virtqueue_pop(VirtQueue *vq, size_t sz)
         elem->in_sg[i] = iov[out_num + i];
     }
 
+    vq->last_avail_idx += elem->ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter ^= 1;
+    }
+    vq->shadow_avail_idx = vq->last_avail_idx;
+    vq->shadow_avail_wrap_counter = vq->last_avail_wrap_counter;
+
     vq->inuse++;
 
     trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
     return elem;
 }
 
+void *virtqueue_pop(VirtQueue *vq, size_t sz)
+{
+    if (virtio_queue_packed(vq)) {
+        return virtqueue_packed_pop(vq, sz);
+    }
+    return virtqueue_split_pop(vq, sz);
+}
+
+/* Pop up to @max elements into @elems and return how many were popped.
+ * Each element is allocated as by virtqueue_pop() and is owned by the
+ * caller, so requests that complete out of order can still be freed one
+ * by one. */
+unsigned int virtqueue_pop_batch(VirtQueue *vq, size_t sz, void **elems,
+                                 unsigned int max)
+{
+    unsigned int count = 0;
+
+    if (virtio_queue_packed(vq)) {
+        /* each packed descriptor carries its own availability flag */
+        while (count < max && (elems[count] = virtqueue_packed_pop(vq, sz))) {
+            count++;
+        }
+        return count;
+    }
+    return virtqueue_split_pop_batch(vq, sz, elems, max);
+}
+
 /* Reading and writing a structure directly to QEMUFile is *awful*, but
  * it is what QEMU has always done by mistake.  We can change it sooner
  * or later by bumping the version number of the affected vm states.
@@ -636,7 +1380,7 @@ typedef struct VirtQueueElementOld {
     struct iovec out_sg[VIRTQUEUE_MAX_SIZE];
 } VirtQueueElementOld;
 
-void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
+void *qemu_get_virtqueue_element(VirtIODevice *vdev, QEMUFile *f, size_t sz)
 {
     VirtQueueElement *elem;
     VirtQueueElementOld data;
@@ -646,6 +1390,11 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
 
     elem = virtqueue_alloc_element(sz, data.out_num, data.in_num);
     elem->index = data.index;
+    elem->ndescs = 1;
+    /* Only devices offering the packed layout carry the entry count */
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        elem->ndescs = qemu_get_be32(f);
+    }
 
     for (i = 0; i < elem->in_num; i++) {
         elem->in_addr[i] = data.in_addr[i];
@@ -671,7 +1420,8 @@ void *qemu_get_virtqueue_element(QEMUFile *f, size_t sz)
     return elem;
 }
 
-void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
+void qemu_put_virtqueue_element(VirtIODevice *vdev, QEMUFile *f,
+                                VirtQueueElement *elem)
 {
     VirtQueueElementOld data;
     int i;
@@ -700,6 +1450,10 @@ void qemu_put_virtqueue_element(QEMUFile *f, VirtQueueElement *elem)
         data.out_sg[i].iov_len = elem->out_sg[i].iov_len;
     }
     qemu_put_buffer(f, (uint8_t *)&data, sizeof(VirtQueueElementOld));
+
+    if (virtio_host_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        qemu_put_be32(f, elem->ndescs);
+    }
 }
 
 /* virtio device */
@@ -805,9 +1559,13 @@ void virtio_reset(void *opaque)
         vdev->vq[i].last_avail_idx = 0;
         vdev->vq[i].shadow_avail_idx = 0;
         vdev->vq[i].used_idx = 0;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
         virtio_queue_set_vector(vdev, i, VIRTIO_NO_VECTOR);
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
+        virtio_queue_release_caches(&vdev->vq[i]);
         vdev->vq[i].notification = true;
         vdev->vq[i].vring.num = vdev->vq[i].vring.num_default;
     }
@@ -1019,6 +1777,7 @@ void virtio_queue_set_rings(VirtIODevice *vdev, int n, hwaddr desc,
     vdev->vq[n].vring.desc = desc;
     vdev->vq[n].vring.avail = avail;
     vdev->vq[n].vring.used = used;
+    virtio_queue_update_caches(&vdev->vq[n]);
 }
 
 void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
@@ -1032,6 +1791,7 @@ void virtio_queue_set_num(VirtIODevice *vdev, int n, int num)
         return;
     }
     vdev->vq[n].vring.num = num;
+    virtio_queue_update_caches(&vdev->vq[n]);
 }
 
 VirtQueue *virtio_vector_first_queue(VirtIODevice *vdev, uint16_t vector)
@@ -1089,14 +1849,16 @@ void virtio_queue_set_align(VirtIODevice *vdev, int n, int align)
     virtio_queue_update_rings(vdev, n);
 }
 
-static void virtio_queue_notify_aio_vq(VirtQueue *vq)
+static bool virtio_queue_notify_aio_vq(VirtQueue *vq)
 {
     if (vq->vring.desc && vq->handle_aio_output) {
         VirtIODevice *vdev = vq->vdev;
 
         trace_virtio_queue_notify(vdev, vq - vdev->vq, vq);
-        vq->handle_aio_output(vdev, vq);
+        return vq->handle_aio_output(vdev, vq);
     }
+
+    return false;
 }
 
 static void virtio_queue_notify_vq(VirtQueue *vq)
@@ -1114,6 +1876,39 @@ void virtio_queue_notify(VirtIODevice *vdev, int n)
     virtio_queue_notify_vq(&vdev->vq[n]);
 }
 
+/* Like virtio_queue_notify, but may be called without the BQL.  Queues that
+ * are serviced through their host notifier (ioeventfd or dataplane) are
+ * kicked directly; everything else is processed under the BQL.
+ */
+void virtio_queue_notify_unlocked(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+    bool unlocked;
+
+    if (atomic_read(&vq->host_notifier_enabled)) {
+        event_notifier_set(&vq->host_notifier);
+
+        /* Pairs with atomic_mb_set in
+         * virtio_queue_set_host_notifier_fd_handler.  If the notifier is
+         * still enabled, whoever disables it will see the kick when
+         * draining the notifier.
+         */
+        smp_mb();
+        if (atomic_read(&vq->host_notifier_enabled)) {
+            return;
+        }
+    }
+
+    unlocked = !qemu_mutex_iothread_locked();
+    if (unlocked) {
+        qemu_mutex_lock_iothread();
+    }
+    virtio_queue_notify_vq(vq);
+    if (unlocked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 uint16_t virtio_queue_vector(VirtIODevice *vdev, int n)
 {
     return n < VIRTIO_QUEUE_MAX ? vdev->vq[n].vector :
@@ -1167,6 +1962,9 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
 
     vdev->vq[n].vring.num = 0;
     vdev->vq[n].vring.num_default = 0;
+    g_free(vdev->vq[n].used_elems);
+    vdev->vq[n].used_elems = NULL;
+    virtio_queue_release_caches(&vdev->vq[n]);
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -1176,6 +1974,42 @@ void virtio_irq(VirtQueue *vq)
     virtio_notify_vector(vq->vdev, vq->vector);
 }
 
+static bool vring_packed_need_event(VirtQueue *vq, bool wrap,
+                                    uint16_t off_wrap, uint16_t new,
+                                    uint16_t old)
+{
+    int off = off_wrap & ~(1 << VRING_PACKED_EVENT_F_WRAP_CTR);
+
+    if (wrap != off_wrap >> VRING_PACKED_EVENT_F_WRAP_CTR) {
+        off -= vq->vring.num;
+    }
+
+    return vring_need_event(off, new, old);
+}
+
+static bool virtio_packed_should_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VRingPackedDescEvent e;
+    uint16_t old, new;
+    bool v;
+
+    vring_packed_event_read(vq, &e);
+
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+
+    if (e.flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    } else if (e.flags == VRING_PACKED_EVENT_FLAG_ENABLE) {
+        return true;
+    }
+
+    return !v || vring_packed_need_event(vq, vq->used_wrap_counter,
+                                         e.off_wrap, new, old);
+}
+
 bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
@@ -1188,6 +2022,10 @@ bool virtio_should_notify(VirtIODevice *vdev, VirtQueue *vq)
         return true;
     }
 
+    if (virtio_queue_packed(vq)) {
+        return virtio_packed_should_notify(vdev, vq);
+    }
+
     if (!virtio_vdev_has_feature(vdev, VIRTIO_RING_F_EVENT_IDX)) {
         return !(vring_avail_flags(vq) & VRING_AVAIL_F_NO_INTERRUPT);
     }
@@ -1246,6 +2084,13 @@ static bool virtio_virtqueue_needed(void *opaque)
     return virtio_host_has_feature(vdev, VIRTIO_F_VERSION_1);
 }
 
+static bool virtio_packed_virtqueue_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED);
+}
+
 static bool virtio_ringsize_needed(void *opaque)
 {
     VirtIODevice *vdev = opaque;
@@ -1292,6 +2137,32 @@ static const VMStateDescription vmstate_virtio_virtqueues = {
     }
 };
 
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT16(last_avail_idx, struct VirtQueue),
+        VMSTATE_BOOL(last_avail_wrap_counter, struct VirtQueue),
+        VMSTATE_UINT16(used_idx, struct VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, struct VirtQueue),
+        VMSTATE_INT32(inuse, struct VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .needed = &virtio_packed_virtqueue_needed,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, struct VirtIODevice,
+                      VIRTIO_QUEUE_MAX, 0, vmstate_packed_virtqueue, VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_ringsize = {
     .name = "ringsize_state",
     .version_id = 1,
@@ -1396,6 +2267,7 @@ static const VMStateDescription vmstate_virtio = {
         &vmstate_virtio_64bit_features,
         &vmstate_virtio_virtqueues,
         &vmstate_virtio_ringsize,
+        &vmstate_virtio_packed_virtqueues,
         &vmstate_virtio_extra_state,
         NULL
     }
@@ -1455,12 +2327,20 @@ static int virtio_set_features_nocheck(VirtIODevice *vdev, uint64_t val)
 {
     VirtioDeviceClass *k = VIRTIO_DEVICE_GET_CLASS(vdev);
     bool bad = (val & ~(vdev->host_features)) != 0;
+    int i;
 
     val &= vdev->host_features;
     if (k->set_features) {
         k->set_features(vdev, val);
     }
     vdev->guest_features = val;
+
+    /* The ring layout depends on VIRTIO_F_RING_PACKED */
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.desc) {
+            virtio_queue_update_caches(&vdev->vq[i]);
+        }
+    }
     return bad ? -1 : 0;
 }
 
@@ -1595,7 +2475,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].vring.desc) {
+        if (vdev->vq[i].vring.desc &&
+            virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+            /* The packed ring state came in its own subsection */
+            vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+            vdev->vq[i].shadow_avail_wrap_counter =
+                vdev->vq[i].last_avail_wrap_counter;
+        } else if (vdev->vq[i].vring.desc) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1617,7 +2503,13 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
+        g_free(vdev->vq[i].used_elems);
+        virtio_queue_release_caches(&vdev->vq[i]);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
     g_free(vdev->vector_queues);
@@ -1675,10 +2567,17 @@ void virtio_init(VirtIODevice *vdev, const char *name,
     vdev->config_vector = VIRTIO_NO_VECTOR;
     vdev->vq = g_malloc0(sizeof(VirtQueue) * VIRTIO_QUEUE_MAX);
     vdev->vm_running = runstate_is_running();
+    if (!vring_cache_listener_registered) {
+        memory_listener_register(&vring_cache_listener, &address_space_memory);
+        vring_cache_listener_registered = true;
+    }
     for (i = 0; i < VIRTIO_QUEUE_MAX; i++) {
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].shadow_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1721,12 +2620,18 @@ hwaddr virtio_queue_get_desc_size(VirtIODevice *vdev, int n)
 
 hwaddr virtio_queue_get_avail_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingAvail, ring) +
         sizeof(uint16_t) * vdev->vq[n].vring.num;
 }
 
 hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n)
 {
+    if (virtio_vdev_has_feature(vdev, VIRTIO_F_RING_PACKED)) {
+        return sizeof(VRingPackedDescEvent);
+    }
     return offsetof(VRingUsed, ring) +
         sizeof(VRingUsedElem) * vdev->vq[n].vring.num;
 }
@@ -1748,6 +2653,23 @@ void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
     vdev->vq[n].shadow_avail_idx = idx;
 }
 
+/* The device-side ring owner went away without reporting where it had
+ * stopped: go back to the last used index it published, so that requests
+ * it had taken but not completed are processed again.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (!vq->vring.desc || virtio_queue_packed(vq)) {
+        return;
+    }
+
+    vq->used_idx = vring_used_idx(vq);
+    vq->last_avail_idx = vq->used_idx;
+    vq->shadow_avail_idx = vq->used_idx;
+}
+
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
 {
     vdev->vq[n].signalled_used_valid = false;
@@ -1800,14 +2722,30 @@ static void virtio_queue_host_notifier_aio_read(EventNotifier *n)
     }
 }
 
-void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
-                                                void (*handle_output)(VirtIODevice *,
-                                                                      VirtQueue *))
+static bool virtio_queue_host_notifier_aio_poll(void *opaque)
+{
+    EventNotifier *n = opaque;
+    VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
+
+    if (!vq->vring.desc || virtio_queue_empty(vq)) {
+        return false;
+    }
+
+    /* Buffers the handler leaves in the ring are not progress */
+    return virtio_queue_notify_aio_vq(vq);
+}
+
+static void virtio_queue_aio_set_handler(VirtQueue *vq, AioContext *ctx,
+                                         VirtIOHandleAIOOutput handle_output,
+                                         bool poll)
 {
     if (handle_output) {
         vq->handle_aio_output = handle_output;
         aio_set_event_notifier(ctx, &vq->host_notifier, true,
                                virtio_queue_host_notifier_aio_read);
+        aio_set_event_notifier_poll(ctx, &vq->host_notifier,
+                                    poll ? virtio_queue_host_notifier_aio_poll
+                                         : NULL);
     } else {
         aio_set_event_notifier(ctx, &vq->host_notifier, true, NULL);
         /* Test and clear notifier before after disabling event,
@@ -1817,6 +2755,22 @@ void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
     }
 }
 
+void virtio_queue_aio_set_host_notifier_handler(VirtQueue *vq, AioContext *ctx,
+                                                VirtIOHandleAIOOutput fn)
+{
+    virtio_queue_aio_set_handler(vq, ctx, fn, true);
+}
+
+/* For queues that the guest keeps stocked with buffers for the device to
+ * fill on its own events (receive, event queues): a non-empty ring is not
+ * work, so busy waiting on it would only burn the IOThread. */
+void virtio_queue_aio_set_host_notifier_handler_no_poll(VirtQueue *vq,
+                                                        AioContext *ctx,
+                                                        VirtIOHandleAIOOutput fn)
+{
+    virtio_queue_aio_set_handler(vq, ctx, fn, false);
+}
+
 static void virtio_queue_host_notifier_read(EventNotifier *n)
 {
     VirtQueue *vq = container_of(n, VirtQueue, host_notifier);
@@ -1828,6 +2782,7 @@ static void virtio_queue_host_notifier_read(EventNotifier *n)
 void virtio_queue_set_host_notifier_fd_handler(VirtQueue *vq, bool assign,
                                                bool set_handler)
 {
+    atomic_mb_set(&vq->host_notifier_enabled, assign);
     if (assign && set_handler) {
         event_notifier_set_handler(&vq->host_notifier, true,
                                    virtio_queue_host_notifier_read);
@@ -46,6 +46,7 @@ void qemu_aio_ref(void *p);
 typedef struct AioHandler AioHandler;
 typedef void QEMUBHFunc(void *opaque);
 typedef void IOHandler(void *opaque);
+typedef bool AioPollFn(void *opaque);
 
 struct AioContext {
     GSource source;
@@ -128,6 +129,18 @@ struct AioContext {
     int epollfd;
     bool epoll_enabled;
     bool epoll_available;
+
+    /* Adaptive polling.  aio_poll() busy waits on the handlers' io_poll
+     * callbacks for up to poll_ns nanoseconds before blocking.  poll_ns
+     * self-tunes between 0 and poll_max_ns depending on how long the
+     * event loop would otherwise have slept; poll_max_ns == 0 disables
+     * polling.  poll_hits and poll_misses count polling phases that did
+     * and did not find work, respectively.
+     */
+    int64_t poll_max_ns;
+    int64_t poll_ns;
+    uint64_t poll_hits;
+    uint64_t poll_misses;
 };
 
 /**
@@ -327,6 +340,23 @@ void aio_set_event_notifier(AioContext *ctx,
                             bool is_external,
                             EventNotifierHandler *io_read);
 
+/* Set a busy polling callback for a file descriptor that was registered
+ * with aio_set_fd_handler.  @io_poll is invoked by aio_poll() when it is
+ * about to block; it should cheaply check for new work (e.g. by looking at
+ * a ring index in shared memory), process it and return true, or return
+ * false if there is nothing to do.  Passing NULL removes the callback.
+ *
+ * The callback is dropped together with the fd handler.
+ */
+void aio_set_fd_poll(AioContext *ctx, int fd, AioPollFn *io_poll);
+
+/* Like aio_set_fd_poll, but for an event notifier registered with
+ * aio_set_event_notifier.  @io_poll receives @notifier as its argument.
+ */
+void aio_set_event_notifier_poll(AioContext *ctx,
+                                 EventNotifier *notifier,
+                                 AioPollFn *io_poll);
+
 /* Return a GSource that lets the main loop poll the file descriptors attached
  * to this AioContext.
  */
@@ -441,4 +471,15 @@ static inline bool aio_node_check(AioContext *ctx, bool is_external)
  */
 void aio_context_setup(AioContext *ctx, Error **errp);
 
+/**
+ * aio_context_set_poll_params:
+ * @ctx: the aio context
+ * @max_ns: how long to busy poll for, in nanoseconds
+ *
+ * Set the maximum time that aio_poll() may spend running io_poll callbacks
+ * before blocking.  Zero disables polling.
+ */
+void aio_context_set_poll_params(AioContext *ctx, int64_t max_ns,
+                                 Error **errp);
+
 #endif
@@ -258,6 +258,23 @@ int coroutine_fn bdrv_co_writev(BlockDriverState *bs, int64_t sector_num,
  */
 int coroutine_fn bdrv_co_write_zeroes(BlockDriverState *bs, int64_t sector_num,
     int nb_sectors, BdrvRequestFlags flags);
+/*
+ * Copy @nb_sectors from @src to @dst without bouncing the data through a
+ * QEMU buffer, e.g. with copy_file_range() or a reflink when both images
+ * live on the same file system.  Returns -ENOTSUP if the copy cannot be
+ * offloaded, in which case the caller should read and write the data itself.
+ * With BDRV_REQ_NO_SERIALISING in @flags, the read side does not wait for
+ * serialising requests on @src, as for bdrv_co_readv_no_serialising().
+ */
+int coroutine_fn bdrv_co_copy_range(BlockDriverState *src, int64_t src_sector,
+    BlockDriverState *dst, int64_t dst_sector, int nb_sectors,
+    BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_from(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors, BdrvRequestFlags flags);
+int coroutine_fn bdrv_co_copy_range_to(BlockDriverState *src,
+    int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+    int nb_sectors);
 BlockDriverState *bdrv_find_backing_image(BlockDriverState *bs,
     const char *backing_file);
 int bdrv_get_backing_file_depth(BlockDriverState *bs);
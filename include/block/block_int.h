@@ -82,6 +82,10 @@ typedef struct BdrvTrackedRequest {
     CoQueue wait_queue; /* coroutines blocked on this request */
 
     struct BdrvTrackedRequest *waiting_for;
+
+    /* Payload of a write request, valid while after-write notifiers run */
+    QEMUIOVector *qiov;
+    BdrvRequestFlags flags;
 } BdrvTrackedRequest;
 
 struct BlockDriver {
@@ -167,6 +171,28 @@ struct BlockDriver {
         int64_t sector_num, int nb_sectors, BdrvRequestFlags flags);
     int coroutine_fn (*bdrv_co_discard)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors);
+
+    /*
+     * Copy a range of sectors from @bs to @dst without passing the data
+     * through QEMU.  Format drivers map the source range and forward the
+     * request to the node holding the data with bdrv_co_copy_range_from();
+     * protocol drivers hand it to the destination with
+     * bdrv_co_copy_range_to().  Return -ENOTSUP if the range cannot be
+     * offloaded; callers then fall back to reading and writing the data.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_from)(BlockDriverState *bs,
+        int64_t src_sector, BlockDriverState *dst, int64_t dst_sector,
+        int nb_sectors, BdrvRequestFlags flags);
+
+    /*
+     * Destination side of a copy offload: @src is the protocol node that
+     * holds the source data.  Only protocol drivers that can copy between
+     * two of their own nodes actually perform the copy.
+     */
+    int coroutine_fn (*bdrv_co_copy_range_to)(BlockDriverState *bs,
+        BlockDriverState *src, int64_t src_sector, int64_t dst_sector,
+        int nb_sectors);
+
     int64_t coroutine_fn (*bdrv_co_get_block_status)(BlockDriverState *bs,
         int64_t sector_num, int nb_sectors, int *pnum,
         BlockDriverState **file);
@@ -438,6 +464,9 @@ struct BlockDriverState {
     /* Callback before write request is processed */
     NotifierWithReturnList before_write_notifiers;
 
+    /* Callback after write request has successfully completed */
+    NotifierWithReturnList after_write_notifiers;
+
     /* number of in-flight serialising requests */
     unsigned int serialising_in_flight;
 
@@ -469,6 +498,7 @@ struct BlockDriverState {
     QLIST_HEAD(, BdrvDirtyBitmap) dirty_bitmaps;
     int refcnt;
 
+    /* only accessed from aio_context, there is no lock */
     QLIST_HEAD(, BdrvTrackedRequest) tracked_requests;
 
     /* operation blockers */
@@ -550,6 +580,17 @@ BlockDriver *bdrv_probe_all(const uint8_t *buf, int buf_size,
 void bdrv_add_before_write_notifier(BlockDriverState *bs,
                                     NotifierWithReturn *notifier);
 
+/**
+ * bdrv_add_after_write_notifier:
+ *
+ * Register a callback that is invoked after a write request has successfully
+ * completed, but before the request is removed from the tracked requests list
+ * and before dirty bitmaps are updated.  The written data is available in the
+ * tracked request.
+ */
+void bdrv_add_after_write_notifier(BlockDriverState *bs,
+                                   NotifierWithReturn *notifier);
+
 /**
  * bdrv_detach_aio_context:
  *
@@ -670,6 +711,7 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
  * @granularity: The chosen granularity for the dirty bitmap.
  * @buf_size: The amount of data that can be in flight at one time.
  * @mode: Whether to collapse all images in the chain to the target.
+ * @copy_mode: When to trigger writes to the target.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @unmap: Whether to unmap target where source sectors only contain zeroes.
@@ -685,12 +727,16 @@ void commit_active_start(BlockDriverState *bs, BlockDriverState *base,
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   const char *replaces,
                   int64_t speed, uint32_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, MirrorCopyMode copy_mode,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   bool unmap,
                   BlockCompletionFunc *cb,
                   void *opaque, Error **errp);
 
+#define BACKUP_MAX_WORKERS_DEFAULT 4
+#define BACKUP_MAX_WORKERS_MAX 64
+
 /*
  * backup_start:
  * @bs: Block device to operate on.
@@ -698,6 +744,8 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  * @speed: The maximum speed, in bytes per second, or 0 for unlimited.
  * @sync_mode: What parts of the disk image should be copied to the destination.
  * @sync_bitmap: The dirty bitmap if sync_mode is MIRROR_SYNC_MODE_INCREMENTAL.
+ * @max_workers: Maximum number of copy requests in flight, between 1 and
+ *               BACKUP_MAX_WORKERS_MAX.
  * @on_source_error: The action to take upon error reading from the source.
  * @on_target_error: The action to take upon error writing to the target.
  * @cb: Completion function for the job.
@@ -709,7 +757,7 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
  */
 void backup_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, MirrorSyncMode sync_mode,
-                  BdrvDirtyBitmap *sync_bitmap,
+                  BdrvDirtyBitmap *sync_bitmap, int64_t max_workers,
                   BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockCompletionFunc *cb, void *opaque,
@@ -730,7 +778,8 @@ void blk_dev_eject_request(BlockBackend *blk, bool force);
 bool blk_dev_is_tray_open(BlockBackend *blk);
 bool blk_dev_is_medium_locked(BlockBackend *blk);
 
-void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors);
+void bdrv_set_dirty(BlockDriverState *bs, int64_t cur_sector, int nr_sectors,
+                    bool notified);
 bool bdrv_requests_pending(BlockDriverState *bs);
 
 void bdrv_clear_dirty_bitmap(BdrvDirtyBitmap *bitmap, HBitmap **out);
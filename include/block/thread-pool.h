@@ -24,6 +24,30 @@ typedef int ThreadPoolFunc(void *opaque);
 
 typedef struct ThreadPool ThreadPool;
 
+typedef enum ThreadPoolPriority {
+    /* Short requests on the guest's critical path, e.g. reads and writes */
+    THREAD_POOL_PRIO_LATENCY,
+    /* Long-running requests such as flushes; they may not use more than
+     * half of the worker threads.
+     */
+    THREAD_POOL_PRIO_BULK,
+    THREAD_POOL_PRIO__MAX,
+} ThreadPoolPriority;
+
+typedef struct ThreadPoolQueueStats {
+    uint64_t queued;
+    uint64_t completed;
+    uint64_t wait_ns;   /* total time completed requests spent queued */
+    uint64_t run_ns;    /* total time spent running completed requests */
+} ThreadPoolQueueStats;
+
+typedef struct ThreadPoolStats {
+    int threads;
+    int idle_threads;   /* sleeping or spinning for new requests */
+    uint64_t stolen;    /* requests taken from another worker's queue */
+    ThreadPoolQueueStats queue[THREAD_POOL_PRIO__MAX];
+} ThreadPoolStats;
+
 ThreadPool *thread_pool_new(struct AioContext *ctx);
 void thread_pool_free(ThreadPool *pool);
 
@@ -34,4 +58,12 @@ int coroutine_fn thread_pool_submit_co(ThreadPool *pool,
         ThreadPoolFunc *func, void *arg);
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg);
 
+BlockAIOCB *thread_pool_submit_aio_prio(ThreadPool *pool,
+        ThreadPoolPriority prio, ThreadPoolFunc *func, void *arg,
+        BlockCompletionFunc *cb, void *opaque);
+int coroutine_fn thread_pool_submit_co_prio(ThreadPool *pool,
+        ThreadPoolPriority prio, ThreadPoolFunc *func, void *arg);
+
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats);
+
 #endif
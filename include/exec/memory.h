@@ -75,6 +75,17 @@ struct IOMMUTLBEntry {
 #define MEMTX_DECODE_ERROR      (1U << 1) /* nothing at that address */
 typedef uint32_t MemTxResult;
 
+/*
+ * A range of registers whose writes may be batched by the accelerator
+ * (coalesced MMIO or PIO): the registers must be write-only and writing
+ * them must have no side effect that is visible before the next access
+ * to any other register of the region.
+ */
+typedef struct MemoryRegionCoalescedRange {
+    hwaddr offset;
+    uint64_t size;
+} MemoryRegionCoalescedRange;
+
 /*
  * Memory region callbacks
  */
@@ -142,6 +153,12 @@ struct MemoryRegionOps {
      * backwards compatibility with old mmio registration
      */
     const MemoryRegionMmio old_mmio;
+
+    /* Registers that memory_region_init_io() makes coalesced, as if by
+     * memory_region_add_coalescing().  Terminated by an entry with
+     * size 0.
+     */
+    const MemoryRegionCoalescedRange *coalesced;
 };
 
 typedef struct MemoryRegionIOMMUOps MemoryRegionIOMMUOps;
@@ -190,6 +207,7 @@ struct MemoryRegion {
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
     QTAILQ_HEAD(coalesced_ranges, CoalescedMemoryRange) coalesced;
+    uint64_t coalesced_writes; /* batched writes, i.e. exits saved */
     const char *name;
     unsigned ioeventfd_nb;
     MemoryRegionIoeventfd *ioeventfds;
@@ -213,6 +231,9 @@ struct MemoryListener {
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section,
                      int old, int new);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    /* For listeners that can only sync the whole address space at once;
+     * called once per sync instead of log_sync for every section */
+    void (*log_sync_global)(MemoryListener *listener);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -247,6 +268,9 @@ struct AddressSpace {
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
     struct AddressSpaceDispatch *next_dispatch;
+    /* Address space whose dispatch tree is used when dispatch is NULL */
+    struct AddressSpace *dispatch_lender;
+    struct AddressSpace *next_dispatch_lender;
     MemoryListener dispatch_listener;
 
     QTAILQ_ENTRY(AddressSpace) address_spaces_link;
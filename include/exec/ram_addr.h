@@ -80,11 +80,32 @@ typedef struct {
     unsigned long *blocks[];
 } DirtyMemoryBlocks;
 
+/* Sorted views of ram_list.blocks, used to find the block that contains a
+ * ram_addr_t or a host pointer with a binary search.  The index is
+ * rebuilt whenever a block is added or removed, and published with RCU:
+ *
+ *   rcu_read_lock();
+ *   RAMBlockIndex *index = atomic_rcu_read(&ram_list.index);
+ *   ...binary search in index->by_offset or index->by_host...
+ *   rcu_read_unlock();
+ *
+ * by_offset holds all nr blocks sorted by offset; by_host holds the
+ * nr_host blocks that have a host mapping, sorted by host address.
+ */
+typedef struct {
+    struct rcu_head rcu;
+    unsigned nr;
+    unsigned nr_host;
+    RAMBlock **by_host;
+    RAMBlock *by_offset[];
+} RAMBlockIndex;
+
 typedef struct RAMList {
     QemuMutex mutex;
     RAMBlock *mru_block;
     /* RCU-enabled, writes protected by the ramlist lock. */
     QLIST_HEAD(, RAMBlock) blocks;
+    RAMBlockIndex *index;
     DirtyMemoryBlocks *dirty_memory[DIRTY_MEMORY_NUM];
     uint32_t version;
 } RAMList;
@@ -233,6 +254,9 @@ static inline uint8_t cpu_physical_memory_range_includes_clean(ram_addr_t start,
     return ret;
 }
 
+void cpu_physical_memory_log_dirty(ram_addr_t start, ram_addr_t length);
+void cpu_physical_memory_flush_dirty_logs(void);
+
 static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
                                                       unsigned client)
 {
@@ -249,7 +273,10 @@ static inline void cpu_physical_memory_set_dirty_flag(ram_addr_t addr,
 
     blocks = atomic_rcu_read(&ram_list.dirty_memory[client]);
 
-    set_bit_atomic(offset, blocks->blocks[idx]);
+    /* Avoid dirtying the cache line if the bit is already set.  */
+    if (!test_bit(offset, blocks->blocks[idx])) {
+        set_bit_atomic(offset, blocks->blocks[idx]);
+    }
 
     rcu_read_unlock();
 }
@@ -261,6 +288,7 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     DirtyMemoryBlocks *blocks[DIRTY_MEMORY_NUM];
     unsigned long end, page;
     unsigned long idx, offset, base;
+    bool log_migration = false;
     int i;
 
     if (!mask && !xen_enabled()) {
@@ -281,16 +309,27 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
     base = page - offset;
     while (page < end) {
         unsigned long next = MIN(end, base + DIRTY_MEMORY_BLOCK_SIZE);
+        unsigned long last = offset + next - page;
 
-        if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION))) {
-            bitmap_set_atomic(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
-                              offset, next - page);
+        /* Only write to the bitmaps if some bit is still clear, so that
+         * threads dirtying the same pages only share the cache lines.
+         * Migration is only interested in the bitmap when it syncs, so
+         * new dirty pages go to a per-thread log instead.
+         */
+        if (likely(mask & (1 << DIRTY_MEMORY_MIGRATION)) && !log_migration &&
+            find_next_zero_bit(blocks[DIRTY_MEMORY_MIGRATION]->blocks[idx],
+                               last, offset) < last) {
+            log_migration = true;
         }
-        if (unlikely(mask & (1 << DIRTY_MEMORY_VGA))) {
+        if (unlikely(mask & (1 << DIRTY_MEMORY_VGA)) &&
+            find_next_zero_bit(blocks[DIRTY_MEMORY_VGA]->blocks[idx],
+                               last, offset) < last) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_VGA]->blocks[idx],
                               offset, next - page);
         }
-        if (unlikely(mask & (1 << DIRTY_MEMORY_CODE))) {
+        if (unlikely(mask & (1 << DIRTY_MEMORY_CODE)) &&
+            find_next_zero_bit(blocks[DIRTY_MEMORY_CODE]->blocks[idx],
+                               last, offset) < last) {
             bitmap_set_atomic(blocks[DIRTY_MEMORY_CODE]->blocks[idx],
                               offset, next - page);
         }
@@ -303,6 +342,10 @@ static inline void cpu_physical_memory_set_dirty_range(ram_addr_t start,
 
     rcu_read_unlock();
 
+    if (log_migration) {
+        cpu_physical_memory_log_dirty(start, length);
+    }
+
     xen_modified_memory(start, length);
 }
 
@@ -35,11 +35,34 @@ struct vhost_log {
     vhost_log_chunk_t *log;
 };
 
+/* Shared memory in which the backend records the descriptors it is
+ * processing, so that a new backend instance can resubmit them after a
+ * reconnect.  The layout belongs to the backend; the master only keeps
+ * the region alive across connections.
+ */
+struct vhost_inflight {
+    int fd;
+    void *addr;
+    uint64_t size;
+    uint64_t offset;
+    uint16_t queue_size;
+    uint16_t num_queues;
+};
+
 struct vhost_memory;
 struct vhost_dev {
     MemoryListener memory_listener;
+    /* sorted by guest address, room for mem_nregions_alloc regions */
     struct vhost_memory *mem;
+    int mem_nregions_alloc;
+    /* the table as the backend knows it, for incremental updates */
+    struct vhost_memory *mem_sent;
+    uint64_t mem_table_rebuilds;
+    uint64_t mem_table_updates;
+    /* sorted by address between transactions, room for mem_sections_alloc */
     int n_mem_sections;
+    int mem_sections_alloc;
+    bool mem_sections_sorted;
     MemoryRegionSection *mem_sections;
     struct vhost_virtqueue *vqs;
     int nvqs;
@@ -85,4 +108,26 @@ uint64_t vhost_get_features(struct vhost_dev *hdev, const int *feature_bits,
 void vhost_ack_features(struct vhost_dev *hdev, const int *feature_bits,
                         uint64_t features);
 bool vhost_has_free_slot(void);
+
+void vhost_dev_assign_memory(struct vhost_dev *dev, uint64_t start_addr,
+                             uint64_t size, uint64_t uaddr);
+void vhost_dev_unassign_memory(struct vhost_dev *dev, uint64_t start_addr,
+                               uint64_t size);
+struct vhost_memory_region *vhost_dev_find_reg(struct vhost_dev *dev,
+                                               uint64_t start_addr,
+                                               uint64_t size);
+void vhost_dev_add_section(struct vhost_dev *dev,
+                           MemoryRegionSection *section);
+bool vhost_dev_del_section(struct vhost_dev *dev,
+                           MemoryRegionSection *section);
+void vhost_dev_commit_sections(struct vhost_dev *dev);
+
+void vhost_dev_init_inflight(struct vhost_inflight *inflight);
+void vhost_dev_reset_inflight(struct vhost_inflight *inflight);
+void vhost_dev_free_inflight(struct vhost_inflight *inflight);
+int vhost_dev_get_inflight(struct vhost_dev *hdev, uint16_t queue_size,
+                           uint16_t num_queues,
+                           struct vhost_inflight *inflight);
+int vhost_dev_set_inflight(struct vhost_dev *hdev,
+                           struct vhost_inflight *inflight);
 #endif
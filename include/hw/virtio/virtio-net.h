@@ -16,6 +16,7 @@
 
 #include "standard-headers/linux/virtio_net.h"
 #include "hw/virtio/virtio.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -30,16 +31,34 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Upper bound on the time received TCP segments are held back for
+ * coalescing before they are handed to the guest. */
+#define RSC_TIMER_INTERVAL 300000 /* 300 us */
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    IOThread *iothread;     /* dataplane thread for every queue pair */
+    uint32_t num_iothreads;
+    char **iothreads;       /* or IOThread ids, used round-robin */
+    bool rsc;           /* coalesce received TCP segments */
+    uint32_t rsctimer;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
 #define VIRTIO_NET_MAX_BUFSIZE (sizeof(struct virtio_net_hdr) + (64 << 10))
 
+typedef struct VirtIONetRscStats {
+    uint64_t received;      /* TCP segments considered for coalescing */
+    uint64_t coalesced;     /* segments appended to a pending buffer */
+    uint64_t delivered;     /* coalesced buffers handed to the guest */
+    uint64_t bypassed;      /* segments delivered unchanged */
+    uint64_t timeouts;      /* flushes triggered by the timer */
+    uint64_t purged;        /* buffers dropped when the queue stopped */
+} VirtIONetRscStats;
+
 typedef struct VirtIONetQueue {
     VirtQueue *rx_vq;
     VirtQueue *tx_vq;
@@ -50,6 +69,14 @@ typedef struct VirtIONetQueue {
         VirtQueueElement *elem;
     } async_tx;
     struct VirtIONet *n;
+    bool rx_batching;       /* defer RX used index updates and interrupts */
+    unsigned int rx_filled; /* RX used entries filled but not flushed */
+    QTAILQ_HEAD(, VirtIONetRscSeg) rsc_segs;
+    unsigned int rsc_nsegs;
+    QEMUTimer *rsc_timer;
+    VirtIONetRscStats rsc_stats;
+    IOThread *iothread;     /* dataplane thread serving this queue pair */
+    AioContext *ctx;
 } VirtIONetQueue;
 
 typedef struct VirtIONet {
@@ -95,6 +122,7 @@ typedef struct VirtIONet {
     QEMUTimer *announce_timer;
     int announce_counter;
     bool needs_vnet_hdr_swap;
+    bool dataplane_started;
 } VirtIONet;
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
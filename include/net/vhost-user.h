@@ -12,6 +12,10 @@
 #define VHOST_USER_H_
 
 struct vhost_net;
+struct vhost_inflight;
 struct vhost_net *vhost_user_get_vhost_net(NetClientState *nc);
+uint64_t vhost_user_get_acked_features(NetClientState *nc);
+void vhost_user_set_acked_features(NetClientState *nc, uint64_t features);
+struct vhost_inflight *vhost_user_get_inflight(NetClientState *nc);
 
 #endif /* VHOST_USER_H_ */
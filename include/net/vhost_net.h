@@ -5,6 +5,7 @@
 #include "hw/virtio/vhost-backend.h"
 
 struct vhost_net;
+struct vhost_inflight;
 typedef struct vhost_net VHostNetState;
 
 typedef struct VhostNetOptions {
@@ -21,8 +22,16 @@ void vhost_net_stop(VirtIODevice *dev, NetClientState *ncs, int total_queues);
 
 void vhost_net_cleanup(VHostNetState *net);
 
+struct vhost_inflight *vhost_net_inflight_new(void);
+void vhost_net_inflight_free(struct vhost_inflight *inflight);
+void vhost_net_reset_inflight(NetClientState *nc);
+void vhost_net_save_acked_features(NetClientState *nc, uint64_t features);
+
 uint64_t vhost_net_get_features(VHostNetState *net, uint64_t features);
 void vhost_net_ack_features(VHostNetState *net, uint64_t features);
+uint64_t vhost_net_get_acked_features(VHostNetState *net);
+void vhost_net_get_mem_table_stats(VHostNetState *net, uint64_t *rebuilds,
+                                   uint64_t *updates);
 
 bool vhost_net_virtqueue_pending(VHostNetState *net, int n);
 void vhost_net_virtqueue_mask(VHostNetState *net, VirtIODevice *dev,
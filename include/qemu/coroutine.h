@@ -80,6 +80,21 @@ void qemu_coroutine_enter(Coroutine *coroutine, void *opaque);
  */
 void coroutine_fn qemu_coroutine_yield(void);
 
+typedef struct CoroutinePoolStats {
+    uint64_t pool_size;     /* coroutines kept in the per-thread pools */
+    uint64_t hits;          /* creations served from a pool */
+    uint64_t misses;        /* creations that allocated a new coroutine */
+    uint64_t trimmed;       /* idle pooled stacks released to the kernel */
+} CoroutinePoolStats;
+
+/**
+ * Get coroutine pool statistics
+ *
+ * Each thread publishes its counters every few thousand coroutine creations
+ * and when it exits, so the numbers may lag behind slightly.
+ */
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats);
+
 /**
  * Get the currently executing coroutine
  */
@@ -28,17 +28,29 @@
 #include "qemu/queue.h"
 #include "qemu/coroutine.h"
 
+#define COROUTINE_STACK_SIZE (1 << 20)
+
+/* Bytes at the top of a pooled coroutine's stack that are preserved when
+ * the stack is trimmed: the trampoline frame that the coroutine restarts
+ * from, plus any signal frame the backend used to bootstrap it.
+ */
+#define COROUTINE_STACK_LIVE_SIZE (64 * 1024)
+
 typedef enum {
     COROUTINE_YIELD = 1,
     COROUTINE_TERMINATE = 2,
     COROUTINE_ENTER = 3,
 } CoroutineAction;
 
+typedef struct CoroutineOwner CoroutineOwner;
+
 struct Coroutine {
     CoroutineEntry *entry;
     void *entry_arg;
     Coroutine *caller;
     QSLIST_ENTRY(Coroutine) pool_next;
+    bool stack_trimmed;
+    CoroutineOwner *owner;      /* pool to return to, or NULL */
 
     /* Coroutines that should be woken up when we yield or terminate */
     QTAILQ_HEAD(, Coroutine) co_queue_wakeup;
@@ -47,6 +59,7 @@ struct Coroutine {
 
 Coroutine *qemu_coroutine_new(void);
 void qemu_coroutine_delete(Coroutine *co);
+void qemu_coroutine_trim_stack(Coroutine *co);
 CoroutineAction qemu_coroutine_switch(Coroutine *from, Coroutine *to,
                                       CoroutineAction action);
 void coroutine_fn qemu_co_queue_run_restart(Coroutine *co);
@@ -128,6 +128,34 @@ void hbitmap_set(HBitmap *hb, uint64_t start, uint64_t count);
  */
 void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
 
+/**
+ * hbitmap_set_atomic:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to set (0-based).
+ * @count: Number of bits to set.
+ *
+ * Set a consecutive range of bits in an HBitmap using atomic operations.
+ * Unlike hbitmap_set(), this does not need to scan the range first, and it
+ * can run concurrently with hbitmap_set_atomic(), hbitmap_reset_atomic(),
+ * hbitmap_get() and iteration on the same bitmap.  Upper levels are only
+ * touched when a word of the level below goes from empty to non-empty.
+ *
+ * Iterators that run concurrently with this function may or may not see
+ * the new bits.
+ */
+void hbitmap_set_atomic(HBitmap *hb, uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_reset_atomic:
+ * @hb: HBitmap to operate on.
+ * @start: First bit to reset (0-based).
+ * @count: Number of bits to reset.
+ *
+ * Reset a consecutive range of bits in an HBitmap using atomic operations.
+ * The same concurrency rules as for hbitmap_set_atomic() apply.
+ */
+void hbitmap_reset_atomic(HBitmap *hb, uint64_t start, uint64_t count);
+
 /**
  * hbitmap_reset_all:
  * @hb: HBitmap to operate on.
@@ -165,9 +193,11 @@ void hbitmap_free(HBitmap *hb);
  *
  * Concurrent setting of bits is acceptable, and will at worst cause the
  * iteration to miss some of those bits.  Resetting bits before the current
- * position of the iterator is also okay.  However, concurrent resetting of
- * bits can lead to unexpected behavior if the iterator has not yet reached
- * those bits.
+ * position of the iterator is also okay.  Concurrent resetting of bits the
+ * iterator has not yet reached is only okay with hbitmap_reset_atomic():
+ * the iteration may then still return a bit that was reset after it read
+ * the word holding it, but it never misses a bit that stays set.  With
+ * hbitmap_reset(), it can lead to unexpected behavior.
  */
 void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first);
 
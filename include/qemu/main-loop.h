@@ -264,6 +264,25 @@ void qemu_mutex_lock_iothread(void);
  */
 void qemu_mutex_unlock_iothread(void);
 
+typedef struct IOThreadLockStats {
+    uint64_t acquisitions;      /* number of times the mutex was taken */
+    uint64_t contended;         /* ... of which had to wait for it */
+    uint64_t wait_ns;           /* total time spent waiting for the mutex */
+    uint64_t hold_ns;           /* total time the mutex was held, only
+                                   measured while the iothread_lock_hold
+                                   trace event is enabled */
+} IOThreadLockStats;
+
+/**
+ * qemu_mutex_iothread_get_stats: Return main loop mutex statistics.
+ *
+ * Fills in @stats with cumulative acquisition, contention and hold time
+ * counters for the main loop mutex.  Must be called with the mutex held.
+ *
+ * @stats: where to store the statistics
+ */
+void qemu_mutex_iothread_get_stats(IOThreadLockStats *stats);
+
 /* internal interfaces */
 
 void qemu_fd_register(int fd);
@@ -218,6 +218,7 @@ struct CPUWatchpoint {
 
 struct KVMState;
 struct kvm_run;
+struct kvm_dirty_gfn;
 
 #define TB_JMP_CACHE_BITS 12
 #define TB_JMP_CACHE_SIZE (1 << TB_JMP_CACHE_BITS)
@@ -270,6 +271,8 @@ struct qemu_work_item {
  * @mem_io_pc: Host Program Counter at which the memory was accessed.
  * @mem_io_vaddr: Target virtual address at which the memory was accessed.
  * @kvm_fd: vCPU file descriptor for KVM.
+ * @kvm_dirty_gfns: vCPU dirty ring mapped from KVM, or %NULL.
+ * @kvm_fetch_index: Next dirty ring entry to harvest.
  * @work_mutex: Lock to prevent multiple access to queued_work_*.
  * @queued_work_first: First asynchronous work pending.
  *
@@ -337,6 +340,8 @@ struct CPUState {
     bool kvm_vcpu_dirty;
     struct KVMState *kvm_state;
     struct kvm_run *kvm_run;
+    struct kvm_dirty_gfn *kvm_dirty_gfns;
+    uint32_t kvm_fetch_index;
 
     /* TODO Move common fields from CPUArchState here. */
     int cpu_index; /* used by alpha TCG */
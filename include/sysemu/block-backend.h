@@ -116,6 +116,8 @@ int blk_pread_unthrottled(BlockBackend *blk, int64_t offset, uint8_t *buf,
                           int count);
 int blk_write_zeroes(BlockBackend *blk, int64_t offset,
                      int count, BdrvRequestFlags flags);
+int blk_copy_range(BlockBackend *blk_in, int64_t off_in,
+                   BlockBackend *blk_out, int64_t off_out, int bytes);
 BlockAIOCB *blk_aio_write_zeroes(BlockBackend *blk, int64_t offset,
                                  int count, BdrvRequestFlags flags,
                                  BlockCompletionFunc *cb, void *opaque);
@@ -59,4 +59,40 @@ int qemu_utimens(const char *path, const qemu_timespec *times);
 
 bool is_daemonized(void);
 
+/**
+ * qemu_alloc_stack:
+ * @sz: pointer to a size_t holding the requested usable stack size
+ *
+ * Allocate memory that can be used as a stack, for instance for
+ * coroutines.  The memory is mapped lazily, so untouched parts of the
+ * stack do not consume physical memory, and a guard page at the bottom
+ * catches stack overflows.  The memory must be freed with qemu_free_stack.
+ *
+ * On return *sz is updated to the size of the whole allocation, including
+ * the guard page.
+ *
+ * Returns: pointer to (the lowest address of) the stack memory.
+ */
+void *qemu_alloc_stack(size_t *sz);
+
+/**
+ * qemu_trim_stack:
+ * @stack: stack memory allocated with qemu_alloc_stack
+ * @sz: size of the allocation as returned by qemu_alloc_stack
+ * @keep: number of bytes at the top of the stack that are still in use
+ *
+ * Release the physical memory behind the unused part of a stack.  The
+ * pages read as zero if the stack grows into them again.
+ */
+void qemu_trim_stack(void *stack, size_t sz, size_t keep);
+
+/**
+ * qemu_free_stack:
+ * @stack: stack memory allocated with qemu_alloc_stack
+ * @sz: size of the allocation as returned by qemu_alloc_stack
+ *
+ * Free a stack allocated with qemu_alloc_stack.
+ */
+void qemu_free_stack(void *stack, size_t sz);
+
 #endif
@@ -34,6 +34,9 @@
 #include "exec/ram_addr.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
+#include "qemu/thread.h"
+#include "qemu/timer.h"
+#include "qemu/rcu.h"
 #include "trace.h"
 #include "hw/irq.h"
 
@@ -61,6 +64,15 @@
 
 #define KVM_MSI_HASHTAB_SIZE    256
 
+/* KVM address spaces (memory and, on x86, SMM) that carry slot ids */
+#define KVM_MAX_ADDRESS_SPACES  2
+
+/* How often the reaper drains dirty rings while dirty logging is on */
+#define KVM_DIRTY_RING_REAP_MS  100
+
+/* Longest time a batched MMIO/PIO write may wait in the coalesced ring */
+#define KVM_COALESCED_DRAIN_MS  5
+
 struct KVMState
 {
     AccelState parent_obj;
@@ -71,6 +83,8 @@ struct KVMState
     int coalesced_mmio;
     struct kvm_coalesced_mmio_ring *coalesced_mmio_ring;
     bool coalesced_flush_in_progress;
+    bool coalesced_pio;
+    QEMUTimer *coalesced_drain_timer;
     int broken_set_mem_region;
     int vcpu_events;
     int robust_singlestep;
@@ -94,6 +108,12 @@ struct KVMState
     QTAILQ_HEAD(msi_hashtab, KVMMSIRoute) msi_hashtab[KVM_MSI_HASHTAB_SIZE];
 #endif
     KVMMemoryListener memory_listener;
+    KVMMemoryListener *as_listeners[KVM_MAX_ADDRESS_SPACES];
+    /* Entries in each vCPU dirty ring, 0 when the dirty bitmap is used */
+    uint32_t dirty_ring_size;
+    bool dirty_ring_logging;
+    QemuThread dirty_ring_reaper;
+    QemuSemaphore dirty_ring_reaper_sem;
 };
 
 KVMState *kvm_state;
@@ -275,6 +295,22 @@ int kvm_init_vcpu(CPUState *cpu)
             (void *)cpu->kvm_run + s->coalesced_mmio * PAGE_SIZE;
     }
 
+    if (s->dirty_ring_size) {
+        cpu->kvm_dirty_gfns = mmap(NULL,
+                                   s->dirty_ring_size *
+                                   sizeof(struct kvm_dirty_gfn),
+                                   PROT_READ | PROT_WRITE, MAP_SHARED,
+                                   cpu->kvm_fd,
+                                   PAGE_SIZE * KVM_DIRTY_LOG_PAGE_OFFSET);
+        if (cpu->kvm_dirty_gfns == MAP_FAILED) {
+            cpu->kvm_dirty_gfns = NULL;
+            ret = -errno;
+            DPRINTF("mmap'ing vcpu dirty ring failed\n");
+            goto err;
+        }
+        cpu->kvm_fetch_index = 0;
+    }
+
     ret = kvm_arch_init_vcpu(cpu);
 err:
     return ret;
@@ -374,6 +410,201 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
     return 0;
 }
 
+/*
+ * dirty ring support
+ *
+ * With KVM_CAP_DIRTY_LOG_RING each vCPU pushes the frames it dirties
+ * into its own ring instead of the per-slot bitmap, so harvesting costs
+ * time proportional to the number of dirtied pages rather than to the
+ * size of the guest.  Rings are only ever harvested with the BQL held.
+ */
+
+/* Mark @npages pages starting at @offset within slot @as_slot dirty */
+static void kvm_dirty_ring_mark_pages(KVMState *s, uint32_t as_slot,
+                                      uint64_t offset, uint64_t npages)
+{
+    uint32_t as_id = as_slot >> 16;
+    uint32_t slot_id = as_slot & 0xffff;
+    KVMMemoryListener *kml;
+    ram_addr_t ram_addr;
+    KVMSlot *mem;
+
+    if (as_id >= KVM_MAX_ADDRESS_SPACES || !s->as_listeners[as_id] ||
+        slot_id >= s->nr_slots) {
+        return;
+    }
+
+    kml = s->as_listeners[as_id];
+    mem = &kml->slots[slot_id];
+
+    /* The slot may have gone away since the entry was pushed */
+    if (offset + npages > mem->memory_size / qemu_real_host_page_size) {
+        return;
+    }
+
+    if (!qemu_ram_addr_from_host(mem->ram + offset * qemu_real_host_page_size,
+                                 &ram_addr)) {
+        return;
+    }
+
+    cpu_physical_memory_set_dirty_range(ram_addr,
+                                        npages * qemu_real_host_page_size,
+                                        tcg_enabled() ? DIRTY_CLIENTS_ALL :
+                                        DIRTY_CLIENTS_NOCODE);
+}
+
+/* Harvest one vCPU ring, merging runs of adjacent frames in a slot */
+static uint64_t kvm_dirty_ring_reap_one(KVMState *s, CPUState *cpu)
+{
+    struct kvm_dirty_gfn *ring = cpu->kvm_dirty_gfns;
+    uint32_t mask = s->dirty_ring_size - 1;
+    uint32_t run_slot = 0;
+    uint64_t run_offset = 0, run_pages = 0, count = 0;
+
+    if (!ring) {
+        return 0;
+    }
+
+    for (;;) {
+        struct kvm_dirty_gfn *gfn = &ring[cpu->kvm_fetch_index & mask];
+        uint32_t slot;
+        uint64_t offset;
+
+        if (!(atomic_read(&gfn->flags) & KVM_DIRTY_GFN_F_DIRTY)) {
+            break;
+        }
+        /* Read slot and offset only after seeing the DIRTY flag */
+        smp_rmb();
+        slot = gfn->slot;
+        offset = gfn->offset;
+
+        if (run_pages && slot == run_slot &&
+            offset == run_offset + run_pages) {
+            run_pages++;
+        } else {
+            if (run_pages) {
+                kvm_dirty_ring_mark_pages(s, run_slot, run_offset, run_pages);
+            }
+            run_slot = slot;
+            run_offset = offset;
+            run_pages = 1;
+        }
+
+        /* Hand the entry back; KVM recycles it on KVM_RESET_DIRTY_RINGS */
+        smp_mb();
+        atomic_set(&gfn->flags, KVM_DIRTY_GFN_F_RESET);
+        cpu->kvm_fetch_index++;
+        count++;
+    }
+
+    if (run_pages) {
+        kvm_dirty_ring_mark_pages(s, run_slot, run_offset, run_pages);
+    }
+
+    return count;
+}
+
+/*
+ * Harvest all vCPU rings into the dirty memory bitmaps.  Frames still
+ * buffered by the hardware of a running vCPU reach its ring on the next
+ * exit and are picked up by a later call; once the VM is stopped the
+ * harvest is complete.
+ */
+static uint64_t kvm_dirty_ring_reap(KVMState *s)
+{
+    int64_t start = get_clock();
+    uint64_t total = 0;
+    CPUState *cpu;
+    int ret;
+
+    CPU_FOREACH(cpu) {
+        total += kvm_dirty_ring_reap_one(s, cpu);
+    }
+
+    if (total) {
+        ret = kvm_vm_ioctl(s, KVM_RESET_DIRTY_RINGS);
+        if (ret < 0) {
+            fprintf(stderr, "%s: KVM_RESET_DIRTY_RINGS failed: %s\n",
+                    __func__, strerror(-ret));
+            abort();
+        }
+    }
+
+    trace_kvm_dirty_ring_reap(total, get_clock() - start);
+    return total;
+}
+
+static void *kvm_dirty_ring_reaper_thread(void *opaque)
+{
+    KVMState *s = opaque;
+
+    rcu_register_thread();
+
+    for (;;) {
+        if (atomic_read(&s->dirty_ring_logging)) {
+            qemu_sem_timedwait(&s->dirty_ring_reaper_sem,
+                               KVM_DIRTY_RING_REAP_MS);
+        } else {
+            qemu_sem_wait(&s->dirty_ring_reaper_sem);
+        }
+
+        if (atomic_read(&s->dirty_ring_logging)) {
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(s);
+            qemu_mutex_unlock_iothread();
+        }
+    }
+
+    return NULL;
+}
+
+static void kvm_dirty_ring_log_global_start(MemoryListener *listener)
+{
+    KVMState *s = kvm_state;
+
+    atomic_set(&s->dirty_ring_logging, true);
+    qemu_sem_post(&s->dirty_ring_reaper_sem);
+}
+
+static void kvm_dirty_ring_log_global_stop(MemoryListener *listener)
+{
+    KVMState *s = kvm_state;
+
+    atomic_set(&s->dirty_ring_logging, false);
+}
+
+static int kvm_dirty_ring_init(KVMState *s)
+{
+    uint64_t ring_bytes = (uint64_t)s->dirty_ring_size *
+                          sizeof(struct kvm_dirty_gfn);
+    int max_bytes;
+    int ret;
+
+    max_bytes = kvm_vm_check_extension(s, KVM_CAP_DIRTY_LOG_RING);
+    if (max_bytes <= 0) {
+        error_report("warning: KVM dirty ring not supported by the host, "
+                     "using the dirty bitmap");
+        s->dirty_ring_size = 0;
+        return 0;
+    }
+
+    if (ring_bytes > max_bytes) {
+        error_report("KVM dirty ring size %" PRIu32 " too big (maximum is %zu)",
+                     s->dirty_ring_size,
+                     max_bytes / sizeof(struct kvm_dirty_gfn));
+        return -EINVAL;
+    }
+
+    ret = kvm_vm_enable_cap(s, KVM_CAP_DIRTY_LOG_RING, 0, ring_bytes);
+    if (ret < 0) {
+        error_report("Enabling KVM dirty ring of %" PRIu32 " entries failed: "
+                     "%s", s->dirty_ring_size, strerror(-ret));
+        return ret;
+    }
+
+    return 0;
+}
+
 #define ALIGN(x, y)  (((x)+(y)-1) & ~((y)-1))
 
 /**
@@ -395,7 +626,14 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
+    int64_t start;
 
+    if (s->dirty_ring_size) {
+        kvm_dirty_ring_reap(s);
+        return 0;
+    }
+
+    start = get_clock();
     d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(kml, start_addr, end_addr);
@@ -437,6 +675,9 @@ static int kvm_physical_sync_dirty_bitmap(KVMMemoryListener *kml,
     }
     g_free(d.dirty_bitmap);
 
+    trace_kvm_dirty_log_sync(kml->as_id, section->offset_within_address_space,
+                             int128_get64(section->size), get_clock() - start);
+
     return ret;
 }
 
@@ -474,6 +715,63 @@ static void kvm_uncoalesce_mmio_region(MemoryListener *listener,
     }
 }
 
+/*
+ * Batched writes only have to reach the device before its region is
+ * accessed again, and every such access flushes the ring first.  The
+ * rest of the time the ring is drained lazily from the main loop, at
+ * most KVM_COALESCED_DRAIN_MS after a vCPU exit found it non-empty.
+ */
+static void kvm_coalesced_drain(void *opaque)
+{
+    kvm_flush_coalesced_mmio_buffer();
+}
+
+static void kvm_coalesced_schedule_drain(KVMState *s)
+{
+    struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
+
+    if (ring && atomic_read(&ring->first) != atomic_read(&ring->last) &&
+        !timer_pending(s->coalesced_drain_timer)) {
+        timer_mod(s->coalesced_drain_timer,
+                  qemu_clock_get_ms(QEMU_CLOCK_REALTIME) +
+                  KVM_COALESCED_DRAIN_MS);
+    }
+}
+
+static void kvm_coalesce_pio_add(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_REGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
+static void kvm_coalesce_pio_del(MemoryListener *listener,
+                                 MemoryRegionSection *section,
+                                 hwaddr start, hwaddr size)
+{
+    KVMState *s = kvm_state;
+
+    if (s->coalesced_pio) {
+        struct kvm_coalesced_mmio_zone zone;
+
+        zone.addr = start;
+        zone.size = size;
+        zone.pio = 1;
+
+        (void)kvm_vm_ioctl(s, KVM_UNREGISTER_COALESCED_MMIO, &zone);
+    }
+}
+
 int kvm_check_extension(KVMState *s, unsigned int extension)
 {
     int ret;
@@ -819,6 +1117,11 @@ static void kvm_log_sync(MemoryListener *listener,
     }
 }
 
+static void kvm_log_sync_global(MemoryListener *listener)
+{
+    kvm_dirty_ring_reap(kvm_state);
+}
+
 static void kvm_mem_ioeventfd_add(MemoryListener *listener,
                                   MemoryRegionSection *section,
                                   bool match_data, uint64_t data,
@@ -895,6 +1198,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 
     kml->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
     kml->as_id = as_id;
+    assert(as_id < KVM_MAX_ADDRESS_SPACES);
+    s->as_listeners[as_id] = kml;
 
     for (i = 0; i < s->nr_slots; i++) {
         kml->slots[i].slot = i;
@@ -904,7 +1209,15 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
     kml->listener.region_del = kvm_region_del;
     kml->listener.log_start = kvm_log_start;
     kml->listener.log_stop = kvm_log_stop;
-    kml->listener.log_sync = kvm_log_sync;
+    if (!s->dirty_ring_size) {
+        kml->listener.log_sync = kvm_log_sync;
+    } else if (as_id == 0) {
+        /* The rings hold the frames of every address space, so a sync
+         * reaps them once, through the listener of address space 0 */
+        kml->listener.log_sync_global = kvm_log_sync_global;
+        kml->listener.log_global_start = kvm_dirty_ring_log_global_start;
+        kml->listener.log_global_stop = kvm_dirty_ring_log_global_stop;
+    }
     kml->listener.priority = 10;
 
     memory_listener_register(&kml->listener, as);
@@ -913,6 +1226,8 @@ void kvm_memory_listener_register(KVMState *s, KVMMemoryListener *kml,
 static MemoryListener kvm_io_listener = {
     .eventfd_add = kvm_io_ioeventfd_add,
     .eventfd_del = kvm_io_ioeventfd_del,
+    .coalesced_mmio_add = kvm_coalesce_pio_add,
+    .coalesced_mmio_del = kvm_coalesce_pio_del,
     .priority = 10,
 };
 
@@ -1593,6 +1908,8 @@ static int kvm_init(MachineState *ms)
     }
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
+    s->coalesced_pio = s->coalesced_mmio &&
+                       kvm_check_extension(s, KVM_CAP_COALESCED_PIO);
 
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
@@ -1642,6 +1959,14 @@ static int kvm_init(MachineState *ms)
     kvm_ioeventfd_any_length_allowed =
         (kvm_check_extension(s, KVM_CAP_IOEVENTFD_ANY_LENGTH) > 0);
 
+    s->dirty_ring_size = machine_kvm_dirty_ring_size(ms);
+    if (s->dirty_ring_size) {
+        ret = kvm_dirty_ring_init(s);
+        if (ret < 0) {
+            goto err;
+        }
+    }
+
     ret = kvm_arch_init(ms, s);
     if (ret < 0) {
         goto err;
@@ -1665,6 +1990,18 @@ static int kvm_init(MachineState *ms)
     memory_listener_register(&kvm_io_listener,
                              &address_space_io);
 
+    if (s->coalesced_mmio) {
+        s->coalesced_drain_timer = timer_new_ms(QEMU_CLOCK_REALTIME,
+                                                kvm_coalesced_drain, s);
+    }
+
+    if (s->dirty_ring_size) {
+        qemu_sem_init(&s->dirty_ring_reaper_sem, 0);
+        qemu_thread_create(&s->dirty_ring_reaper, "kvm-reaper",
+                           kvm_dirty_ring_reaper_thread, s,
+                           QEMU_THREAD_DETACHED);
+    }
+
     s->many_ioeventfds = kvm_check_many_ioeventfds();
 
     cpu_interrupt_handler = kvm_handle_interrupt;
@@ -1729,6 +2066,18 @@ static int kvm_handle_internal_error(CPUState *cpu, struct kvm_run *run)
     return -1;
 }
 
+/* Charge a batched write to the region it lands in; called with the BQL */
+static void kvm_coalesced_account(AddressSpace *as, hwaddr addr, hwaddr len)
+{
+    MemoryRegion *mr;
+    hwaddr xlat;
+
+    rcu_read_lock();
+    mr = address_space_translate(as, addr, &xlat, &len, true);
+    mr->coalesced_writes++;
+    rcu_read_unlock();
+}
+
 void kvm_flush_coalesced_mmio_buffer(void)
 {
     KVMState *s = kvm_state;
@@ -1743,10 +2092,14 @@ void kvm_flush_coalesced_mmio_buffer(void)
         struct kvm_coalesced_mmio_ring *ring = s->coalesced_mmio_ring;
         while (ring->first != ring->last) {
             struct kvm_coalesced_mmio *ent;
+            AddressSpace *as;
 
             ent = &ring->coalesced_mmio[ring->first];
+            as = ent->pio ? &address_space_io : &address_space_memory;
 
-            cpu_physical_memory_write(ent->phys_addr, ent->data, ent->len);
+            kvm_coalesced_account(as, ent->phys_addr, ent->len);
+            address_space_rw(as, ent->phys_addr, MEMTXATTRS_UNSPECIFIED,
+                             ent->data, ent->len, true);
             smp_wmb();
             ring->first = (ring->first + 1) % KVM_COALESCED_MMIO_MAX;
         }
@@ -1835,6 +2188,8 @@ int kvm_cpu_exec(CPUState *cpu)
 
         attrs = kvm_arch_post_run(cpu, run);
 
+        kvm_coalesced_schedule_drain(kvm_state);
+
         if (run_ret < 0) {
             if (run_ret == -EINTR || run_ret == -EAGAIN) {
                 DPRINTF("io window exit\n");
@@ -1877,6 +2232,13 @@ int kvm_cpu_exec(CPUState *cpu)
                              run->mmio.is_write);
             ret = 0;
             break;
+        case KVM_EXIT_DIRTY_RING_FULL:
+            DPRINTF("dirty ring full\n");
+            qemu_mutex_lock_iothread();
+            kvm_dirty_ring_reap(kvm_state);
+            qemu_mutex_unlock_iothread();
+            ret = 0;
+            break;
         case KVM_EXIT_IRQ_WINDOW_OPEN:
             DPRINTF("irq_window_open\n");
             ret = EXCP_INTERRUPT;
@@ -23,6 +23,7 @@
 #include "qapi/visitor.h"
 #include "qemu/bitops.h"
 #include "qemu/error-report.h"
+#include "qemu/timer.h"
 #include "qom/object.h"
 #include "trace.h"
 
@@ -40,6 +41,16 @@ static bool memory_region_update_pending;
 static bool ioeventfd_update_pending;
 static bool global_dirty_log = false;
 
+/* Cost of memory_region_transaction_commit, reported by "info mtree" */
+static struct {
+    uint64_t commits;
+    uint64_t updates;       /* address spaces whose FlatView changed */
+    uint64_t unchanged;     /* address spaces that were left alone */
+    uint64_t rendered;      /* FlatViews generated */
+    uint64_t total_ns;
+    uint64_t max_ns;
+} topology_stats;
+
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
@@ -254,6 +265,25 @@ static bool flatrange_equal(FlatRange *a, FlatRange *b)
         && a->readonly == b->readonly;
 }
 
+static bool flatview_equal(FlatView *a, FlatView *b)
+{
+    unsigned i;
+
+    if (a == b) {
+        return true;
+    }
+    if (a->nr != b->nr) {
+        return false;
+    }
+    for (i = 0; i < a->nr; i++) {
+        if (!flatrange_equal(&a->ranges[i], &b->ranges[i])
+            || a->ranges[i].dirty_log_mask != b->ranges[i].dirty_log_mask) {
+            return false;
+        }
+    }
+    return true;
+}
+
 static void flatview_init(FlatView *view)
 {
     view->ref = 1;
@@ -806,6 +836,9 @@ static void address_space_update_ioeventfds(AddressSpace *as)
     flatview_unref(view);
 }
 
+static void flat_range_coalesced_io_del(FlatRange *fr, AddressSpace *as);
+static void flat_range_coalesced_io_add(FlatRange *fr, AddressSpace *as);
+
 static void address_space_update_topology_pass(AddressSpace *as,
                                                const FlatView *old_view,
                                                const FlatView *new_view,
@@ -838,6 +871,9 @@ static void address_space_update_topology_pass(AddressSpace *as,
             /* In old but not in new, or in both but attributes changed. */
 
             if (!adding) {
+                if (!QTAILQ_EMPTY(&frold->mr->coalesced)) {
+                    flat_range_coalesced_io_del(frold, as);
+                }
                 MEMORY_LISTENER_UPDATE_REGION(frold, as, Reverse, region_del);
             }
 
@@ -866,6 +902,9 @@ static void address_space_update_topology_pass(AddressSpace *as,
 
             if (adding) {
                 MEMORY_LISTENER_UPDATE_REGION(frnew, as, Forward, region_add);
+                if (!QTAILQ_EMPTY(&frnew->mr->coalesced)) {
+                    flat_range_coalesced_io_add(frnew, as);
+                }
             }
 
             ++inew;
@@ -874,10 +913,99 @@ static void address_space_update_topology_pass(AddressSpace *as,
 }
 
 
-static void address_space_update_topology(AddressSpace *as)
+/* Return the region that is rendered to build the view of @as.  PCI bus
+ * master address spaces, for example, have a root that aliases all of the
+ * DMA address space; they can share the FlatView and dispatch tree of the
+ * aliased region.  Returns NULL if the view is empty.
+ */
+static MemoryRegion *address_space_view_root(AddressSpace *as)
+{
+    MemoryRegion *mr = as->root;
+
+    if (mr && !mr->enabled) {
+        return NULL;
+    }
+    while (mr && mr->alias
+           && !mr->addr && !mr->alias_offset && !mr->readonly
+           && !mr->alias->addr
+           && int128_ge(mr->size, mr->alias->size)) {
+        mr = mr->alias;
+        if (!mr->enabled) {
+            return NULL;
+        }
+    }
+    return mr;
+}
+
+/* Address spaces with the same view root use the dispatch tree of the
+ * first address space whose root is that region.  Called before the
+ * listeners' begin callback; exec.c picks up the choice in mem_commit.
+ */
+static void address_space_choose_dispatch_lenders(void)
+{
+    GHashTable *lenders = g_hash_table_new(NULL, NULL);
+    AddressSpace *as;
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        MemoryRegion *root = address_space_view_root(as);
+
+        as->next_dispatch_lender = root ? g_hash_table_lookup(lenders, root)
+                                        : NULL;
+        if (root && !as->next_dispatch_lender && as->root == root
+            && as->dispatch) {
+            g_hash_table_insert(lenders, root, as);
+        }
+    }
+    g_hash_table_destroy(lenders);
+}
+
+static void address_space_update_topology(AddressSpace *as, GHashTable *views)
 {
+    MemoryRegion *root = address_space_view_root(as);
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view = g_hash_table_lookup(views, root);
+    bool rebuild_dispatch = as->dispatch_lender && !as->next_dispatch_lender;
+
+    /* Render each root only once per transaction, and let all address
+     * spaces with the same root share the result.  The first one keeps
+     * its current FlatView if nothing changed, so that the others can
+     * switch to it.
+     */
+    if (!new_view) {
+        new_view = generate_memory_topology(root);
+        topology_stats.rendered++;
+        if (flatview_equal(old_view, new_view)) {
+            flatview_unref(new_view);
+            new_view = old_view;
+            flatview_ref(new_view);
+        }
+        g_hash_table_insert(views, root, new_view);
+    }
+    flatview_ref(new_view);
+
+    /* Most transactions only touch one address space, e.g. when a PCI BAR
+     * is remapped.  If the view did not change, listeners would only see
+     * region_nop calls, so skip them; in particular this avoids rebuilding
+     * the dispatch tree of every other address space.  The exception is
+     * an address space that stops borrowing another one's dispatch tree
+     * and has to build its own.
+     */
+    if (flatview_equal(old_view, new_view) && !rebuild_dispatch) {
+        topology_stats.unchanged++;
+        if (new_view != old_view) {
+            /* Same contents; switch to the shared copy.  */
+            atomic_rcu_set(&as->current_map, new_view);
+            call_rcu(old_view, flatview_unref, rcu);
+        } else {
+            flatview_unref(new_view);
+        }
+        flatview_unref(old_view);
+        if (ioeventfd_update_pending) {
+            address_space_update_ioeventfds(as);
+        }
+        return;
+    }
+    topology_stats.updates++;
 
     address_space_update_topology_pass(as, old_view, new_view, false);
     address_space_update_topology_pass(as, old_view, new_view, true);
@@ -917,13 +1045,26 @@ void memory_region_transaction_commit(void)
     --memory_region_transaction_depth;
     if (!memory_region_transaction_depth) {
         if (memory_region_update_pending) {
+            int64_t start = get_clock();
+            GHashTable *views;
+            uint64_t ns;
+
+            views = g_hash_table_new_full(NULL, NULL, NULL,
+                                          (GDestroyNotify)flatview_unref);
+            address_space_choose_dispatch_lenders();
             MEMORY_LISTENER_CALL_GLOBAL(begin, Forward);
 
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
-                address_space_update_topology(as);
+                address_space_update_topology(as, views);
             }
 
             MEMORY_LISTENER_CALL_GLOBAL(commit, Forward);
+            g_hash_table_destroy(views);
+
+            ns = get_clock() - start;
+            topology_stats.commits++;
+            topology_stats.total_ns += ns;
+            topology_stats.max_ns = MAX(topology_stats.max_ns, ns);
         } else if (ioeventfd_update_pending) {
             QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
                 address_space_update_ioeventfds(as);
@@ -1283,10 +1424,16 @@ void memory_region_init_io(MemoryRegion *mr,
                            const char *name,
                            uint64_t size)
 {
+    const MemoryRegionCoalescedRange *range;
+
     memory_region_init(mr, owner, name, size);
     mr->ops = ops ? ops : &unassigned_mem_ops;
     mr->opaque = opaque;
     mr->terminates = true;
+
+    for (range = mr->ops->coalesced; range && range->size; range++) {
+        memory_region_add_coalescing(mr, range->offset, range->size);
+    }
 }
 
 void memory_region_init_ram(MemoryRegion *mr,
@@ -1576,6 +1723,19 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
 }
 
 
+static void memory_listeners_sync_global(AddressSpace *as)
+{
+    MemoryListener *listener;
+
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        if (listener->log_sync_global &&
+            (!listener->address_space_filter ||
+             listener->address_space_filter == as)) {
+            listener->log_sync_global(listener);
+        }
+    }
+}
+
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 {
     AddressSpace *as;
@@ -1583,12 +1743,19 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         FlatView *view = address_space_get_flatview(as);
+        bool mapped = false;
+
         FOR_EACH_FLAT_RANGE(fr, view) {
             if (fr->mr == mr) {
                 MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, log_sync);
+                mapped = true;
             }
         }
         flatview_unref(view);
+
+        if (mapped) {
+            memory_listeners_sync_global(as);
+        }
     }
 }
 
@@ -1660,38 +1827,54 @@ void memory_region_ram_resize(MemoryRegion *mr, ram_addr_t newsize, Error **errp
     qemu_ram_resize(mr->ram_block, newsize, errp);
 }
 
+static void flat_range_coalesced_io_del(FlatRange *fr, AddressSpace *as)
+{
+    MemoryRegionSection section = {
+        .address_space = as,
+        .offset_within_address_space = int128_get64(fr->addr.start),
+        .size = fr->addr.size,
+    };
+
+    MEMORY_LISTENER_CALL(coalesced_mmio_del, Reverse, &section,
+                         int128_get64(fr->addr.start),
+                         int128_get64(fr->addr.size));
+}
+
+static void flat_range_coalesced_io_add(FlatRange *fr, AddressSpace *as)
+{
+    MemoryRegion *mr = fr->mr;
+    CoalescedMemoryRange *cmr;
+    AddrRange tmp;
+    MemoryRegionSection section = {
+        .address_space = as,
+        .offset_within_address_space = int128_get64(fr->addr.start),
+        .size = fr->addr.size,
+    };
+
+    QTAILQ_FOREACH(cmr, &mr->coalesced, link) {
+        tmp = addrrange_shift(cmr->addr,
+                              int128_sub(fr->addr.start,
+                                         int128_make64(fr->offset_in_region)));
+        if (!addrrange_intersects(tmp, fr->addr)) {
+            continue;
+        }
+        tmp = addrrange_intersection(tmp, fr->addr);
+        MEMORY_LISTENER_CALL(coalesced_mmio_add, Forward, &section,
+                             int128_get64(tmp.start),
+                             int128_get64(tmp.size));
+    }
+}
+
 static void memory_region_update_coalesced_range_as(MemoryRegion *mr, AddressSpace *as)
 {
     FlatView *view;
     FlatRange *fr;
-    CoalescedMemoryRange *cmr;
-    AddrRange tmp;
-    MemoryRegionSection section;
 
     view = address_space_get_flatview(as);
     FOR_EACH_FLAT_RANGE(fr, view) {
         if (fr->mr == mr) {
-            section = (MemoryRegionSection) {
-                .address_space = as,
-                .offset_within_address_space = int128_get64(fr->addr.start),
-                .size = fr->addr.size,
-            };
-
-            MEMORY_LISTENER_CALL(coalesced_mmio_del, Reverse, &section,
-                                 int128_get64(fr->addr.start),
-                                 int128_get64(fr->addr.size));
-            QTAILQ_FOREACH(cmr, &mr->coalesced, link) {
-                tmp = addrrange_shift(cmr->addr,
-                                      int128_sub(fr->addr.start,
-                                                 int128_make64(fr->offset_in_region)));
-                if (!addrrange_intersects(tmp, fr->addr)) {
-                    continue;
-                }
-                tmp = addrrange_intersection(tmp, fr->addr);
-                MEMORY_LISTENER_CALL(coalesced_mmio_add, Forward, &section,
-                                     int128_get64(tmp.start),
-                                     int128_get64(tmp.size));
-            }
+            flat_range_coalesced_io_del(fr, as);
+            flat_range_coalesced_io_add(fr, as);
         }
     }
     flatview_unref(view);
@@ -2078,6 +2261,8 @@ void address_space_sync_dirty_bitmap(AddressSpace *as)
         MEMORY_LISTENER_UPDATE_REGION(fr, as, Forward, log_sync);
     }
     flatview_unref(view);
+
+    memory_listeners_sync_global(as);
 }
 
 void memory_global_dirty_log_start(void)
@@ -2197,8 +2382,13 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
 static void do_address_space_destroy(AddressSpace *as)
 {
     MemoryListener *listener;
+    AddressSpace *other;
     bool do_free = as->malloced;
 
+    /* address_space_destroy moved the borrowers elsewhere */
+    QTAILQ_FOREACH(other, &address_spaces, address_spaces_link) {
+        assert(other->dispatch_lender != as);
+    }
     address_space_destroy_dispatch(as);
 
     QTAILQ_FOREACH(listener, &memory_listeners, link) {
@@ -2239,9 +2429,14 @@ void address_space_destroy(AddressSpace *as)
     if (as->ref_count) {
         return;
     }
-    /* Flush out anything from MemoryListeners listening in on this */
+    /* Flush out anything from MemoryListeners listening in on this.  The
+     * commit must run even if nothing else changed: address spaces that
+     * borrow our dispatch tree have to pick another lender, or build their
+     * own, before the tree goes away.
+     */
     memory_region_transaction_begin();
     as->root = NULL;
+    memory_region_update_pending = true;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
     address_space_unregister(as);
@@ -2319,7 +2514,7 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
                    mr->enabled ? "" : " [disabled]");
     } else {
         mon_printf(f,
-                   TARGET_FMT_plx "-" TARGET_FMT_plx " (prio %d, %c%c): %s%s\n",
+                   TARGET_FMT_plx "-" TARGET_FMT_plx " (prio %d, %c%c): %s%s",
                    base + mr->addr,
                    base + mr->addr
                    + (int128_nz(mr->size) ?
@@ -2331,6 +2526,11 @@ static void mtree_print_mr(fprintf_function mon_printf, void *f,
                                                                        : '-',
                    memory_region_name(mr),
                    mr->enabled ? "" : " [disabled]");
+        if (!QTAILQ_EMPTY(&mr->coalesced)) {
+            mon_printf(f, " [coalesced, %" PRIu64 " exits saved]",
+                       mr->coalesced_writes);
+        }
+        mon_printf(f, "\n");
     }
 
     QTAILQ_INIT(&submr_print_queue);
@@ -2367,6 +2567,7 @@ void mtree_info(fprintf_function mon_printf, void *f)
     MemoryRegionListHead ml_head;
     MemoryRegionList *ml, *ml2;
     AddressSpace *as;
+    unsigned n;
 
     QTAILQ_INIT(&ml_head);
 
@@ -2386,6 +2587,23 @@ void mtree_info(fprintf_function mon_printf, void *f)
     QTAILQ_FOREACH_SAFE(ml, &ml_head, queue, ml2) {
         g_free(ml);
     }
+
+    mon_printf(f, "topology commits: %" PRIu64 ", views rendered: %" PRIu64
+               ", address space updates: %" PRIu64 ", unchanged: %" PRIu64
+               "\n",
+               topology_stats.commits, topology_stats.rendered,
+               topology_stats.updates, topology_stats.unchanged);
+    n = 0;
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        n += !!as->dispatch_lender;
+    }
+    mon_printf(f, "address spaces sharing a dispatch tree: %u\n", n);
+    if (topology_stats.commits) {
+        mon_printf(f, "commit time: average %" PRIu64 " us, max %" PRIu64
+                   " us\n",
+                   topology_stats.total_ns / topology_stats.commits / SCALE_US,
+                   topology_stats.max_ns / SCALE_US);
+    }
 }
 
 static const TypeInfo memory_region_info = {
@@ -632,6 +632,7 @@ static void migration_bitmap_sync(void)
 
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
+    cpu_physical_memory_flush_dirty_logs();
 
     qemu_mutex_lock(&migration_bitmap_mutex);
     rcu_read_lock();
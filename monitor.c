@@ -38,6 +38,7 @@
 #include "sysemu/char.h"
 #include "ui/qemu-spice.h"
 #include "sysemu/sysemu.h"
+#include "qemu/coroutine.h"
 #include "sysemu/numa.h"
 #include "monitor/monitor.h"
 #include "qemu/readline.h"
@@ -1497,6 +1498,35 @@ static void hmp_info_mtree(Monitor *mon, const QDict *qdict)
     mtree_info((fprintf_function)monitor_printf, mon);
 }
 
+static void hmp_info_iothread_lock(Monitor *mon, const QDict *qdict)
+{
+    IOThreadLockStats stats;
+
+    qemu_mutex_iothread_get_stats(&stats);
+    monitor_printf(mon, "acquisitions %" PRIu64 "\n", stats.acquisitions);
+    monitor_printf(mon, "contended    %" PRIu64 "\n", stats.contended);
+    monitor_printf(mon, "wait time    %" PRIu64 " (%0.3f)\n",
+                   stats.wait_ns,
+                   stats.wait_ns / (double)NANOSECONDS_PER_SECOND);
+    monitor_printf(mon, "hold time    %" PRIu64 " (%0.3f)\n",
+                   stats.hold_ns,
+                   stats.hold_ns / (double)NANOSECONDS_PER_SECOND);
+}
+
+static void hmp_info_coroutine_pool(Monitor *mon, const QDict *qdict)
+{
+    CoroutinePoolStats stats;
+    uint64_t total;
+
+    qemu_coroutine_get_pool_stats(&stats);
+    total = stats.hits + stats.misses;
+    monitor_printf(mon, "pooled coroutines %" PRIu64 "\n", stats.pool_size);
+    monitor_printf(mon, "hits              %" PRIu64 " (%0.1f%%)\n",
+                   stats.hits, total ? stats.hits * 100.0 / total : 0.0);
+    monitor_printf(mon, "misses            %" PRIu64 "\n", stats.misses);
+    monitor_printf(mon, "trimmed stacks    %" PRIu64 "\n", stats.trimmed);
+}
+
 static void hmp_info_numa(Monitor *mon, const QDict *qdict)
 {
     int i;
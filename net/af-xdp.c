@@ -0,0 +1,493 @@
+/*
+ * AF_XDP network backend.
+ *
+ * Copyright (c) 2023 Red Hat, Inc.
+ *
+ * Authors:
+ *  Ilya Maximets <i.maximets@ovn.org>
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <bpf/bpf.h>
+#include <linux/if_link.h>
+#include <linux/if_xdp.h>
+#include <net/if.h>
+#include <xdp/xsk.h>
+
+#include "clients.h"
+#include "net/net.h"
+#include "qapi/error.h"
+#include "qemu/cutils.h"
+#include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "block/aio.h"
+
+/* Frames drained from the RX ring and handed to the peer per wakeup */
+#define AF_XDP_BATCH_SIZE 64
+
+typedef struct AFXDPState {
+    NetClientState       nc;
+
+    struct xsk_socket    *xsk;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_ring_cons cq;
+    struct xsk_ring_prod fq;
+
+    char                 ifname[IFNAMSIZ];
+    int                  ifindex;
+    bool                 read_poll;
+    bool                 write_poll;
+    uint32_t             outstanding_tx;
+
+    /* UMEM frames that are neither in the fill ring nor in flight */
+    uint64_t             *pool;
+    uint32_t             n_pool;
+    char                 *buffer;
+    struct xsk_umem      *umem;
+
+    uint32_t             n_queues;
+    uint32_t             xdp_flags;
+    bool                 inhibit;
+    AioContext           *ctx;      /* NULL when served by the main loop */
+} AFXDPState;
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+/* Set the event-loop handlers for the AF_XDP backend. */
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    int fd = xsk_socket__fd(s->xsk);
+    IOHandler *io_read = s->read_poll ? af_xdp_send : NULL;
+    IOHandler *io_write = s->write_poll ? af_xdp_writable : NULL;
+
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+        aio_set_fd_handler(s->ctx, fd, false, io_read, io_write, s);
+        aio_context_release(s->ctx);
+    } else {
+        qemu_set_fd_handler(fd, io_read, io_write, s);
+    }
+}
+
+/* Update the read handler. */
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) {
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Update the write handler. */
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->write_poll = enable;
+        s->read_poll  = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    bool read_poll = s->read_poll, write_poll = s->write_poll;
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Unregister from the old context, then re-register in the new one */
+    s->read_poll = s->write_poll = false;
+    af_xdp_update_fd_handler(s);
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    af_xdp_update_fd_handler(s);
+}
+
+/* Return the frames of completed transmissions to the pool. */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t idx = 0;
+    uint32_t done, i;
+
+    done = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+
+    for (i = 0; i < done; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+
+    if (done) {
+        xsk_ring_cons__release(&s->cq, done);
+        s->outstanding_tx -= done;
+    }
+}
+
+/*
+ * The fd_write() callback, invoked if the fd is marked as writable
+ * after a poll.  Reclaim completed frames and flush any packets that
+ * were queued while the TX ring was full.
+ */
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+
+    /* Keep polling until the kernel has consumed everything we sent */
+    if (!s->outstanding_tx) {
+        af_xdp_write_poll(s, false);
+    }
+
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    struct xdp_desc *desc;
+    uint32_t idx;
+    void *data;
+
+    /* Try to recover buffers that are already sent. */
+    af_xdp_complete_tx(s);
+
+    if (size > XSK_UMEM__DEFAULT_FRAME_SIZE) {
+        /* We can't transmit a packet this size... */
+        return size;
+    }
+
+    if (!s->n_pool || !xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+        /* Out of frames or TX slots, wait for the kernel to catch up. */
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = s->pool[--s->n_pool];
+    desc->len = size;
+
+    data = xsk_umem__get_data(s->buffer, desc->addr);
+    memcpy(data, buf, size);
+
+    xsk_ring_prod__submit(&s->tx, 1);
+    s->outstanding_tx++;
+
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    return size;
+}
+
+/* Give up to @n pool frames to the kernel for reception. */
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t i, idx = 0;
+
+    /* Leave one packet for Tx, just in case. */
+    if (s->n_pool < n + 1) {
+        n = s->n_pool;
+    }
+
+    if (!n || !xsk_ring_prod__reserve(&s->fq, n, &idx)) {
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (s->xsk && xsk_ring_prod__needs_wakeup(&s->fq)) {
+        /* Receive was blocked by not having enough buffers.  Wake it up. */
+        af_xdp_read_poll(s, true);
+    }
+}
+
+/* Complete a previous send (backend --> guest) and enable the
+   fd_read callback. */
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    uint32_t i, n_rx, idx = 0;
+    AFXDPState *s = opaque;
+
+    n_rx = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    if (!n_rx) {
+        return;
+    }
+
+    qemu_send_batch_begin(&s->nc);
+    for (i = 0; i < n_rx; i++) {
+        const struct xdp_desc *desc;
+        struct iovec iov;
+
+        desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+
+        iov.iov_base = xsk_umem__get_data(s->buffer, desc->addr);
+        iov.iov_len = desc->len;
+
+        /* The frame is copied if the peer queues it, so it can be
+         * recycled right away. */
+        s->pool[s->n_pool++] = desc->addr;
+
+        if (!qemu_sendv_packet_async(&s->nc, &iov, 1,
+                                     af_xdp_send_completed)) {
+            /*
+             * The peer does not receive anymore.  Packet is queued, stop
+             * reading from the backend until af_xdp_send_completed().
+             */
+            af_xdp_read_poll(s, false);
+
+            /* Return unused descriptors to not break the ring cache. */
+            xsk_ring_cons__cancel(&s->rx, n_rx - i - 1);
+            n_rx = i + 1;
+            break;
+        }
+    }
+    qemu_send_batch_end(&s->nc);
+
+    /* Release actually sent descriptors and try to re-fill. */
+    xsk_ring_cons__release(&s->rx, n_rx);
+    af_xdp_fq_refill(s, AF_XDP_BATCH_SIZE);
+}
+
+/* Flush and close. */
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    g_free(s->pool);
+    s->pool = NULL;
+    if (s->umem) {
+        xsk_umem__delete(s->umem);
+        s->umem = NULL;
+    }
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+
+    /* Remove the program if it's the last open queue. */
+    if (!s->inhibit && nc->queue_index == s->n_queues - 1 && s->xdp_flags &&
+        bpf_xdp_detach(s->ifindex, s->xdp_flags, NULL) != 0) {
+        error_report("af-xdp: unable to remove XDP program from '%s', "
+                     "ifindex: %d", s->ifname, s->ifindex);
+    }
+}
+
+static int af_xdp_umem_create(AFXDPState *s, Error **errp)
+{
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    uint64_t n_descs;
+    uint64_t size;
+    int64_t i;
+    int ret;
+
+    /* Number of descriptors if all 4 queues (rx, tx, cq, fq) are full. */
+    n_descs = (XSK_RING_PROD__DEFAULT_NUM_DESCS
+               + XSK_RING_CONS__DEFAULT_NUM_DESCS) * 2;
+    size = n_descs * XSK_UMEM__DEFAULT_FRAME_SIZE;
+
+    s->buffer = qemu_memalign(getpagesize(), size);
+    memset(s->buffer, 0, size);
+
+    ret = xsk_umem__create(&s->umem, s->buffer, size, &s->fq, &s->cq,
+                           &config);
+    if (ret) {
+        qemu_vfree(s->buffer);
+        s->buffer = NULL;
+        error_setg_errno(errp, -ret,
+                         "failed to create umem for %s queue_index: %d",
+                         s->ifname, s->nc.queue_index);
+        return -1;
+    }
+
+    s->pool = g_new(uint64_t, n_descs);
+    /* Fill the pool in the opposite order, because it's a LIFO queue. */
+    for (i = n_descs - 1; i >= 0; i--) {
+        s->pool[i] = i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    }
+    s->n_pool = n_descs;
+
+    af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s,
+                                const NetdevAFXDPOptions *opts, Error **errp)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libxdp_flags = 0,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+        .xdp_flags = 0,
+    };
+    int queue_id, error = 0;
+
+    if (s->inhibit) {
+        cfg.libxdp_flags |= XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD;
+    }
+
+    if (opts->has_force_copy && opts->force_copy) {
+        cfg.bind_flags |= XDP_COPY;
+    }
+
+    queue_id = s->nc.queue_index;
+    if (opts->has_start_queue && opts->start_queue > 0) {
+        queue_id += opts->start_queue;
+    }
+
+    if (opts->has_mode) {
+        /* Specific mode requested. */
+        cfg.xdp_flags |= (opts->mode == AFXDP_MODE_NATIVE)
+                         ? XDP_FLAGS_DRV_MODE : XDP_FLAGS_SKB_MODE;
+        if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                               s->umem, &s->rx, &s->tx, &cfg)) {
+            error = errno;
+        }
+    } else {
+        /* No mode requested, try native first. */
+        cfg.xdp_flags |= XDP_FLAGS_DRV_MODE;
+
+        if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                               s->umem, &s->rx, &s->tx, &cfg)) {
+            /* Can't use native mode, try skb. */
+            cfg.xdp_flags &= ~XDP_FLAGS_DRV_MODE;
+            cfg.xdp_flags |= XDP_FLAGS_SKB_MODE;
+
+            if (xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                   s->umem, &s->rx, &s->tx, &cfg)) {
+                error = errno;
+            }
+        }
+    }
+
+    if (error) {
+        error_setg_errno(errp, error,
+                         "failed to create AF_XDP socket for %s queue_id: %d",
+                         s->ifname, queue_id);
+        return -1;
+    }
+
+    s->xdp_flags = cfg.xdp_flags;
+
+    snprintf(s->nc.info_str, sizeof(s->nc.info_str),
+             "af-xdp: ifname=%s queue=%d mode=%s%s", s->ifname, queue_id,
+             (s->xdp_flags & XDP_FLAGS_DRV_MODE) ? "native" : "skb",
+             (cfg.bind_flags & XDP_COPY) ? ",force-copy" : "");
+
+    return 0;
+}
+
+/* NetClientInfo methods */
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+    .set_aio_context = af_xdp_set_aio_context,
+};
+
+/* The exported init function
+ *
+ * ... -netdev af-xdp,ifname="...",queues=N
+ */
+int net_init_af_xdp(const NetClientOptions *opts,
+                    const char *name, NetClientState *peer, Error **errp)
+{
+    const NetdevAFXDPOptions *af_xdp_opts = opts->u.af_xdp.data;
+    NetClientState *nc, *nc0 = NULL;
+    unsigned int ifindex;
+    AFXDPState *s;
+    int queues, i;
+
+    assert(opts->type == NET_CLIENT_OPTIONS_KIND_AF_XDP);
+
+    ifindex = if_nametoindex(af_xdp_opts->ifname);
+    if (!ifindex) {
+        error_setg_errno(errp, errno, "failed to get ifindex for '%s'",
+                         af_xdp_opts->ifname);
+        return -1;
+    }
+
+    queues = af_xdp_opts->has_queues ? af_xdp_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_setg(errp, "af-xdp number of queues must be in range [1, %d]",
+                   MAX_QUEUE_NUM);
+        return -1;
+    }
+
+    if (af_xdp_opts->has_start_queue && af_xdp_opts->start_queue < 0) {
+        error_setg(errp, "af-xdp start-queue must not be negative");
+        return -1;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        nc->queue_index = i;
+
+        if (!nc0) {
+            nc0 = nc;
+        }
+
+        s = DO_UPCAST(AFXDPState, nc, nc);
+
+        pstrcpy(s->ifname, sizeof(s->ifname), af_xdp_opts->ifname);
+        s->ifindex = ifindex;
+        s->n_queues = queues;
+        s->inhibit = af_xdp_opts->has_inhibit && af_xdp_opts->inhibit;
+
+        if (af_xdp_umem_create(s, errp) ||
+            af_xdp_socket_create(s, af_xdp_opts, errp)) {
+            /* This queue is cleaned up last; make sure it removes the
+             * program that the earlier queues may have loaded. */
+            s->n_queues = i + 1;
+            s->xdp_flags = i ? DO_UPCAST(AFXDPState, nc, nc0)->xdp_flags : 0;
+            /* Deletes every queue created so far, including this one. */
+            qemu_del_net_client(nc0);
+            return -1;
+        }
+
+        af_xdp_read_poll(s, true); /* Initially only poll for reads. */
+    }
+
+    return 0;
+}
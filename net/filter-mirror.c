@@ -53,7 +53,7 @@ static int filter_mirror_send(CharDriverState *chr_out,
     int ret = 0;
     ssize_t size = 0;
     uint32_t len =  0;
-    char *buf;
+    int i;
 
     size = iov_size(iov, iovcnt);
     if (!size) {
@@ -66,12 +66,16 @@ static int filter_mirror_send(CharDriverState *chr_out,
         goto err;
     }
 
-    buf = g_malloc(size);
-    iov_to_buf(iov, iovcnt, 0, buf, size);
-    ret = qemu_chr_fe_write_all(chr_out, (uint8_t *)buf, size);
-    g_free(buf);
-    if (ret != size) {
-        goto err;
+    /* Write the fragments as they are rather than linearizing them */
+    for (i = 0; i < iovcnt; i++) {
+        if (!iov[i].iov_len) {
+            continue;
+        }
+        ret = qemu_chr_fe_write_all(chr_out, iov[i].iov_base,
+                                    iov[i].iov_len);
+        if (ret != iov[i].iov_len) {
+            goto err;
+        }
     }
 
     return 0;
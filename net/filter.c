@@ -217,6 +217,11 @@ static void netfilter_complete(UserCreatable *uc, Error **errp)
         return;
     }
 
+    if (ncs[0]->iothread_bound) {
+        error_setg(errp, "Netdev served by an iothread is not supported");
+        return;
+    }
+
     nf->netdev = ncs[0];
 
     if (nfc->setup) {
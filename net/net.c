@@ -46,6 +46,7 @@
 #include "qapi/opts-visitor.h"
 #include "sysemu/sysemu.h"
 #include "net/filter.h"
+#include "net/vhost_net.h"
 #include "qapi/string-output-visitor.h"
 
 /* Net bridge is currently not supported for W32. */
@@ -66,6 +67,9 @@ const char *host_net_devices[] = {
 #ifdef CONFIG_NETMAP
     "netmap",
 #endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp",
+#endif
 #ifdef CONFIG_SLIRP
     "user",
 #endif
@@ -496,6 +500,25 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+bool qemu_has_aio_context(NetClientState *nc)
+{
+    if (!nc) {
+        return false;
+    }
+
+    return !!nc->info->set_aio_context;
+}
+
+/* Move the client's file descriptor handlers into @ctx, or back to the
+ * main loop if @ctx is NULL.  Callers must check qemu_has_aio_context()
+ * first. */
+void qemu_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    assert(qemu_has_aio_context(nc));
+
+    nc->info->set_aio_context(nc, ctx);
+}
+
 int qemu_set_vnet_le(NetClientState *nc, bool is_le)
 {
 #ifdef HOST_WORDS_BIGENDIAN
@@ -674,6 +697,24 @@ void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size)
     qemu_send_packet_async(nc, buf, size, NULL);
 }
 
+/* Bracket a run of packets sent by @nc in one go.  The peer may defer
+ * per-packet work such as completion and interrupt injection until
+ * qemu_send_batch_end(); packets that are queued or held by filters are
+ * still delivered individually later. */
+void qemu_send_batch_begin(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->info->receive_batch_begin) {
+        nc->peer->info->receive_batch_begin(nc->peer);
+    }
+}
+
+void qemu_send_batch_end(NetClientState *nc)
+{
+    if (nc->peer && nc->peer->info->receive_batch_end) {
+        nc->peer->info->receive_batch_end(nc->peer);
+    }
+}
+
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size)
 {
     return qemu_send_packet_async_with_flags(nc, QEMU_NET_PACKET_FLAG_RAW,
@@ -947,6 +988,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND__MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_OPTIONS_KIND_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_OPTIONS_KIND_AF_XDP]    = net_init_af_xdp,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
@@ -1223,11 +1267,20 @@ static void netfilter_print_info(Monitor *mon, NetFilterState *nf)
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
     NetFilterState *nf;
+    VHostNetState *vhost_net;
 
     monitor_printf(mon, "%s: index=%d,type=%s,%s\n", nc->name,
                    nc->queue_index,
                    NetClientOptionsKind_lookup[nc->info->type],
                    nc->info_str);
+    vhost_net = get_vhost_net(nc);
+    if (vhost_net) {
+        uint64_t rebuilds, updates;
+
+        vhost_net_get_mem_table_stats(vhost_net, &rebuilds, &updates);
+        monitor_printf(mon, "vhost: %" PRIu64 " memory table rebuilds, %"
+                       PRIu64 " updates\n", rebuilds, updates);
+    }
     if (!QTAILQ_EMPTY(&nc->filters)) {
         monitor_printf(mon, "filters:\n");
     }
@@ -24,6 +24,7 @@
 #include "qemu/osdep.h"
 #include "net/queue.h"
 #include "qemu/queue.h"
+#include "qemu/atomic.h"
 #include "net/net.h"
 
 /* The delivery handler may only return zero if it will call
@@ -40,8 +41,27 @@
  * unbounded queueing.
  */
 
+/* Packets that fit in NET_PACKET_SLAB_SIZE bytes are recycled through a
+ * pool owned by the queue that allocated them.  A packet can be handed
+ * over to another queue and freed there, possibly in another thread, so
+ * frees go to an atomic list that the owner drains when its private list
+ * runs dry.  Every pooled packet holds a reference to its pool, which
+ * therefore outlives the queue if packets are still in flight.
+ *
+ * Packets are themselves reference counted.  qemu_net_queue_flush()
+ * keeps the reference of the queue a packet came from until delivery
+ * returns, so a packet handed to another queue meanwhile stays valid.
+ */
+#define NET_PACKET_SLAB_SIZE 2048
+#define NET_PACKET_POOL_MAX  64
+
+typedef struct NetPacketPool NetPacketPool;
+
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
+    QSLIST_ENTRY(NetPacket) pool_next;
+    NetPacketPool *pool;
+    int refcnt;
     NetClientState *sender;
     unsigned flags;
     int size;
@@ -49,6 +69,13 @@ struct NetPacket {
     uint8_t data[0];
 };
 
+struct NetPacketPool {
+    QSLIST_HEAD(, NetPacket) free;      /* owner only */
+    QSLIST_HEAD(, NetPacket) released;  /* freed packets, any thread */
+    unsigned int nreleased;
+    int refcnt;
+};
+
 struct NetQueue {
     void *opaque;
     uint32_t nq_maxlen;
@@ -56,10 +83,89 @@ struct NetQueue {
     NetQueueDeliverFunc *deliver;
 
     QTAILQ_HEAD(packets, NetPacket) packets;
+    NetPacketPool *pool;
 
     unsigned delivering : 1;
 };
 
+/* The packet being delivered by qemu_net_queue_flush() in this thread.
+ * If the delivery handler queues exactly this buffer again (for example
+ * a filter passing a buffered packet on to a busy peer), the new queue
+ * takes a reference to the packet instead of copying it, and clears this
+ * pointer so that any other consumer in the same delivery (a hub port,
+ * filter-mirror) copies as usual.  The data stays valid for them until
+ * the flush drops its own reference after the handler returns, even if
+ * the new owner frees the packet in another thread.
+ */
+static __thread NetPacket *net_queue_handoff;
+
+static void net_packet_pool_unref(NetPacketPool *pool)
+{
+    NetPacket *packet, *next;
+
+    if (atomic_fetch_dec(&pool->refcnt) != 1) {
+        return;
+    }
+
+    QSLIST_FOREACH_SAFE(packet, &pool->free, pool_next, next) {
+        g_free(packet);
+    }
+    QSLIST_FOREACH_SAFE(packet, &pool->released, pool_next, next) {
+        g_free(packet);
+    }
+    g_free(pool);
+}
+
+static NetPacket *net_packet_alloc(NetQueue *queue, size_t size)
+{
+    NetPacketPool *pool = queue->pool;
+    NetPacket *packet;
+
+    if (size > NET_PACKET_SLAB_SIZE) {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->pool = NULL;
+        packet->refcnt = 1;
+        return packet;
+    }
+
+    if (QSLIST_EMPTY(&pool->free)) {
+        QSLIST_MOVE_ATOMIC(&pool->free, &pool->released);
+        atomic_set(&pool->nreleased, 0);
+    }
+
+    packet = QSLIST_FIRST(&pool->free);
+    if (packet) {
+        QSLIST_REMOVE_HEAD(&pool->free, pool_next);
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + NET_PACKET_SLAB_SIZE);
+    }
+    packet->pool = pool;
+    packet->refcnt = 1;
+    atomic_inc(&pool->refcnt);
+    return packet;
+}
+
+static void net_packet_unref(NetPacket *packet)
+{
+    NetPacketPool *pool = packet->pool;
+
+    if (atomic_fetch_dec(&packet->refcnt) != 1) {
+        return;
+    }
+
+    if (!pool) {
+        g_free(packet);
+        return;
+    }
+
+    if (atomic_fetch_inc(&pool->nreleased) < NET_PACKET_POOL_MAX) {
+        QSLIST_INSERT_HEAD_ATOMIC(&pool->released, packet, pool_next);
+    } else {
+        g_free(packet);
+    }
+    net_packet_pool_unref(pool);
+}
+
 NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 {
     NetQueue *queue;
@@ -73,6 +179,9 @@ NetQueue *qemu_new_net_queue(NetQueueDeliverFunc *deliver, void *opaque)
 
     QTAILQ_INIT(&queue->packets);
 
+    queue->pool = g_new0(NetPacketPool, 1);
+    queue->pool->refcnt = 1;
+
     queue->delivering = 0;
 
     return queue;
@@ -84,9 +193,10 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        net_packet_unref(packet);
     }
 
+    net_packet_pool_unref(queue->pool);
     g_free(queue);
 }
 
@@ -102,7 +212,7 @@ static void qemu_net_queue_append(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    packet = g_malloc(sizeof(NetPacket) + size);
+    packet = net_packet_alloc(queue, size);
     packet->sender = sender;
     packet->flags = flags;
     packet->size = size;
@@ -127,11 +237,26 @@ void qemu_net_queue_append_iov(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
+
+    packet = net_queue_handoff;
+    if (packet && iovcnt == 1 && iov[0].iov_base == packet->data &&
+        iov[0].iov_len == (size_t)packet->size) {
+        net_queue_handoff = NULL;
+        atomic_inc(&packet->refcnt);
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    packet = net_packet_alloc(queue, max_len);
     packet->sender = sender;
     packet->sent_cb = sent_cb;
     packet->flags = flags;
@@ -243,7 +368,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
-            g_free(packet);
+            net_packet_unref(packet);
         }
     }
 }
@@ -251,29 +376,51 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
 bool qemu_net_queue_flush(NetQueue *queue)
 {
     while (!QTAILQ_EMPTY(&queue->packets)) {
-        NetPacket *packet;
+        NetPacket *packet, *outer;
+        NetClientState *sender;
+        NetPacketSent *sent_cb;
+        size_t size;
         int ret;
 
         packet = QTAILQ_FIRST(&queue->packets);
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
+        /* The packet may change hands during delivery, and its new owner
+         * may change these fields before we get control back */
+        sender = packet->sender;
+        sent_cb = packet->sent_cb;
+        size = packet->size;
+
+        outer = net_queue_handoff;
+        net_queue_handoff = packet;
         ret = qemu_net_queue_deliver(queue,
                                      packet->sender,
                                      packet->flags,
                                      packet->data,
                                      packet->size);
+        if (!net_queue_handoff) {
+            /* Now queued elsewhere, treat it as delivered */
+            net_queue_handoff = outer;
+            if (sent_cb) {
+                sent_cb(sender, size);
+            }
+            net_packet_unref(packet);
+            continue;
+        }
+        net_queue_handoff = outer;
+
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
             return false;
         }
 
-        if (packet->sent_cb) {
-            packet->sent_cb(packet->sender, ret);
+        if (sent_cb) {
+            sent_cb(sender, ret);
         }
 
-        g_free(packet);
+        net_packet_unref(packet);
     }
     return true;
 }
@@ -40,6 +40,7 @@
 #include "qemu-common.h"
 #include "qemu/cutils.h"
 #include "qemu/error-report.h"
+#include "block/aio.h"
 
 #include "net/tap.h"
 
@@ -58,6 +59,7 @@ typedef struct TAPState {
     bool enabled;
     VHostNetState *vhost_net;
     unsigned host_vnet_hdr_len;
+    AioContext *ctx;            /* NULL when served by the main loop */
 } TAPState;
 
 static void launch_script(const char *setup_script, const char *ifname,
@@ -68,10 +70,16 @@ static void tap_writable(void *opaque);
 
 static void tap_update_fd_handler(TAPState *s)
 {
-    qemu_set_fd_handler(s->fd,
-                        s->read_poll && s->enabled ? tap_send : NULL,
-                        s->write_poll && s->enabled ? tap_writable : NULL,
-                        s);
+    IOHandler *io_read = s->read_poll && s->enabled ? tap_send : NULL;
+    IOHandler *io_write = s->write_poll && s->enabled ? tap_writable : NULL;
+
+    if (s->ctx) {
+        aio_context_acquire(s->ctx);
+        aio_set_fd_handler(s->ctx, s->fd, false, io_read, io_write, s);
+        aio_context_release(s->ctx);
+    } else {
+        qemu_set_fd_handler(s->fd, io_read, io_write, s);
+    }
 }
 
 static void tap_read_poll(TAPState *s, bool enable)
@@ -184,6 +192,8 @@ static void tap_send(void *opaque)
     int size;
     int packets = 0;
 
+    /* Frames read in one wakeup reach the peer as a single batch */
+    qemu_send_batch_begin(&s->nc);
     while (true) {
         uint8_t *buf = s->buf;
 
@@ -216,6 +226,7 @@ static void tap_send(void *opaque)
             break;
         }
     }
+    qemu_send_batch_end(&s->nc);
 }
 
 static bool tap_has_ufo(NetClientState *nc)
@@ -324,6 +335,24 @@ static void tap_poll(NetClientState *nc, bool enable)
     tap_write_poll(s, enable);
 }
 
+static void tap_set_aio_context(NetClientState *nc, AioContext *ctx)
+{
+    TAPState *s = DO_UPCAST(TAPState, nc, nc);
+    bool read_poll = s->read_poll, write_poll = s->write_poll;
+
+    if (s->ctx == ctx) {
+        return;
+    }
+
+    /* Unregister from the old context, then re-register in the new one */
+    s->read_poll = s->write_poll = false;
+    tap_update_fd_handler(s);
+    s->ctx = ctx;
+    s->read_poll = read_poll;
+    s->write_poll = write_poll;
+    tap_update_fd_handler(s);
+}
+
 int tap_get_fd(NetClientState *nc)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
@@ -349,6 +378,7 @@ static NetClientInfo net_tap_info = {
     .set_vnet_hdr_len = tap_set_vnet_hdr_len,
     .set_vnet_le = tap_set_vnet_le,
     .set_vnet_be = tap_set_vnet_be,
+    .set_aio_context = tap_set_aio_context,
 };
 
 static TAPState *net_tap_fd_init(NetClientState *peer,
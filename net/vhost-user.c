@@ -15,6 +15,8 @@
 #include "sysemu/char.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/timer.h"
 #include "qmp-commands.h"
 #include "trace.h"
 
@@ -22,6 +24,17 @@ typedef struct VhostUserState {
     NetClientState nc;
     CharDriverState *chr;
     VHostNetState *vhost_net;
+    /* what the guest acked, restored when the backend reconnects */
+    uint64_t acked_features;
+
+    /* Connection-wide state, only used on the first queue */
+    struct vhost_inflight *inflight;
+    QEMUBH *closed_bh;
+    bool closed_pending;
+    int64_t disconnect_time;
+    unsigned int reconnects;
+    int64_t reconnect_last;
+    int64_t reconnect_max;
 } VhostUserState;
 
 typedef struct VhostUserChardevProps {
@@ -36,6 +49,29 @@ VHostNetState *vhost_user_get_vhost_net(NetClientState *nc)
     return s->vhost_net;
 }
 
+uint64_t vhost_user_get_acked_features(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    return s->acked_features;
+}
+
+void vhost_user_set_acked_features(NetClientState *nc, uint64_t features)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    s->acked_features = features;
+}
+
+/* @nc must be the first queue, which owns the inflight region */
+struct vhost_inflight *vhost_user_get_inflight(NetClientState *nc)
+{
+    VhostUserState *s = DO_UPCAST(VhostUserState, nc, nc);
+    assert(nc->info->type == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
+    assert(nc->queue_index == 0);
+    return s->inflight;
+}
+
 static int vhost_user_running(VhostUserState *s)
 {
     return (s->vhost_net) ? 1 : 0;
@@ -55,6 +91,7 @@ static void vhost_user_stop(int queues, NetClientState *ncs[])
         }
 
         if (s->vhost_net) {
+            s->acked_features = vhost_net_get_acked_features(s->vhost_net);
             vhost_net_cleanup(s->vhost_net);
             s->vhost_net = NULL;
         }
@@ -140,6 +177,14 @@ static void vhost_user_cleanup(NetClientState *nc)
         vhost_net_cleanup(s->vhost_net);
         s->vhost_net = NULL;
     }
+    if (s->closed_bh) {
+        qemu_bh_delete(s->closed_bh);
+        s->closed_bh = NULL;
+    }
+    if (s->inflight) {
+        vhost_net_inflight_free(s->inflight);
+        s->inflight = NULL;
+    }
 
     qemu_purge_queued_packets(nc);
 }
@@ -167,6 +212,53 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
+/* Stop vhost once the backend is gone.  The rings and the inflight
+ * region are kept, so that a backend connecting later resumes them
+ * without the guest having to reset the device.
+ */
+static void net_vhost_user_closed_bh(void *opaque)
+{
+    VhostUserState *s = opaque;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    Error *err = NULL;
+    int queues;
+
+    s->closed_pending = false;
+
+    queues = qemu_find_net_clients_except(s->nc.name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    qmp_set_link(s->nc.name, false, &err);
+    vhost_user_stop(queues, ncs);
+
+    if (err) {
+        error_report_err(err);
+    }
+}
+
+static void net_vhost_user_reconnected(VhostUserState *s, int queues,
+                                       NetClientState *ncs[])
+{
+    int64_t latency;
+    int i;
+
+    latency = qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - s->disconnect_time;
+    s->disconnect_time = 0;
+    s->reconnects++;
+    s->reconnect_last = latency;
+    s->reconnect_max = MAX(s->reconnect_max, latency);
+    trace_vhost_user_reconnect(s->chr->label, latency / SCALE_US);
+
+    for (i = 0; i < queues; i++) {
+        snprintf(ncs[i]->info_str, sizeof(ncs[i]->info_str),
+                 "vhost-user%d to %s, %u reconnects, "
+                 "last %" PRId64 " us, max %" PRId64 " us",
+                 i, s->chr->label, s->reconnects,
+                 s->reconnect_last / SCALE_US,
+                 s->reconnect_max / SCALE_US);
+    }
+}
+
 static void net_vhost_user_event(void *opaque, int event)
 {
     const char *name = opaque;
@@ -184,14 +276,35 @@ static void net_vhost_user_event(void *opaque, int event)
     trace_vhost_user_event(s->chr->label, event);
     switch (event) {
     case CHR_EVENT_OPENED:
+        if (s->closed_pending) {
+            qemu_bh_cancel(s->closed_bh);
+            net_vhost_user_closed_bh(s);
+        }
         if (vhost_user_start(queues, ncs) < 0) {
-            exit(1);
+            if (!s->disconnect_time) {
+                exit(1);
+            }
+            /* The guest keeps using what it negotiated with the previous
+             * backend; leave the link down rather than take it away.
+             */
+            error_report("vhost-user backend %s cannot resume the device, "
+                         "link stays down", s->chr->label);
+            break;
         }
         qmp_set_link(name, true, &err);
+        if (s->disconnect_time) {
+            net_vhost_user_reconnected(s, queues, ncs);
+        }
         break;
     case CHR_EVENT_CLOSED:
-        qmp_set_link(name, false, &err);
-        vhost_user_stop(queues, ncs);
+        /* The close may be noticed in the middle of a request, while the
+         * vhost code still relies on the connection; stop from a BH.
+         */
+        if (!s->closed_pending) {
+            s->disconnect_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+            s->closed_pending = true;
+            qemu_bh_schedule(s->closed_bh);
+        }
         break;
     }
 
@@ -221,6 +334,10 @@ static int net_vhost_user_init(NetClientState *peer, const char *device,
 
         s = DO_UPCAST(VhostUserState, nc, nc);
         s->chr = chr;
+        if (i == 0) {
+            s->inflight = vhost_net_inflight_new();
+            s->closed_bh = qemu_bh_new(net_vhost_user_closed_bh, s);
+        }
     }
 
     qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, nc[0].name);
@@ -239,6 +356,7 @@ static int net_vhost_chardev_opts(void *opaque,
     } else if (strcmp(name, "path") == 0) {
         props->is_unix = true;
     } else if (strcmp(name, "server") == 0) {
+    } else if (strcmp(name, "reconnect") == 0) {
     } else {
         error_setg(errp,
                    "vhost-user does not support a chardev with option %s=%s",
@@ -124,6 +124,8 @@ static void QEMU_NORETURN help(void)
            "  'snapshot_id_or_name' is deprecated, use 'snapshot_param'\n"
            "    instead\n"
            "  '-c' indicates that target image must be compressed (qcow format only)\n"
+           "  '-C' lets the block layer copy data directly between the images when\n"
+           "       possible, e.g. with copy_file_range() or a reflink (convert only)\n"
            "  '-u' enables unsafe rebasing. It is assumed that old and new backing file\n"
            "       match exactly. The image doesn't need a working backing file before\n"
            "       rebasing in this case (useful for renaming the backing file)\n"
@@ -1433,6 +1435,7 @@ typedef struct ImgConvertState {
     BlockBackend *target;
     bool has_zero_init;
     bool compressed;
+    bool copy_range;
     bool target_has_backing;
     int min_sparse;
     size_t cluster_sectors;
@@ -1551,6 +1554,23 @@ static int convert_read(ImgConvertState *s, int64_t sector_num, int nb_sectors,
     return 0;
 }
 
+/* Let the block layer copy the data without reading it into QEMU.  Returns
+ * -ENOTSUP if this is not possible for the given range. */
+static int convert_copy_range(ImgConvertState *s, int64_t sector_num,
+                              int nb_sectors)
+{
+    convert_select_part(s, sector_num);
+    if (nb_sectors > s->src_sectors[s->src_cur] -
+                     (sector_num - s->src_cur_offset)) {
+        return -ENOTSUP;
+    }
+
+    return blk_copy_range(s->src[s->src_cur],
+                          (sector_num - s->src_cur_offset) << BDRV_SECTOR_BITS,
+                          s->target, sector_num << BDRV_SECTOR_BITS,
+                          nb_sectors << BDRV_SECTOR_BITS);
+}
+
 static int convert_write(ImgConvertState *s, int64_t sector_num, int nb_sectors,
                          const uint8_t *buf)
 {
@@ -1692,6 +1712,18 @@ static int convert_do_copy(ImgConvertState *s)
                                 0);
         }
 
+        if (s->status == BLK_DATA && s->copy_range) {
+            ret = convert_copy_range(s, sector_num, n);
+            if (ret == 0) {
+                sector_num += n;
+                continue;
+            } else if (ret != -ENOTSUP) {
+                error_report("error while copying sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                goto fail;
+            }
+        }
+
         if (s->status == BLK_DATA) {
             ret = convert_read(s, sector_num, n, buf);
             if (ret < 0) {
@@ -1732,6 +1764,7 @@ fail:
 static int img_convert(int argc, char **argv)
 {
     int c, bs_n, bs_i, compress, cluster_sectors, skip_create;
+    bool copy_range = false;
     int64_t ret = 0;
     int progress = 0, flags, src_flags;
     bool writethrough, src_writethrough;
@@ -1769,7 +1802,7 @@ static int img_convert(int argc, char **argv)
             {"image-opts", no_argument, 0, OPTION_IMAGE_OPTS},
             {0, 0, 0, 0}
         };
-        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qn",
+        c = getopt_long(argc, argv, "hf:O:B:ce6o:s:l:S:pt:T:qnC",
                         long_options, NULL);
         if (c == -1) {
             break;
@@ -1861,6 +1894,9 @@ static int img_convert(int argc, char **argv)
         case 'n':
             skip_create = 1;
             break;
+        case 'C':
+            copy_range = true;
+            break;
         case OPTION_OBJECT:
             opts = qemu_opts_parse_noisily(&qemu_object_opts,
                                            optarg, true);
@@ -1874,6 +1910,12 @@ static int img_convert(int argc, char **argv)
         }
     }
 
+    if (compress && copy_range) {
+        error_report("Cannot enable copy offloading when -c is used");
+        ret = -1;
+        goto fail_getopt;
+    }
+
     if (qemu_opts_foreach(&qemu_object_opts,
                           user_creatable_add_opts_foreach,
                           NULL, NULL)) {
@@ -2115,6 +2157,7 @@ static int img_convert(int argc, char **argv)
         .total_sectors      = total_sectors,
         .target             = out_blk,
         .compressed         = compress,
+        .copy_range         = copy_range && !compress,
         .target_has_backing = (bool) out_baseimg,
         .min_sparse         = min_sparse,
         .cluster_sectors    = cluster_sectors,
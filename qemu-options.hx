@@ -36,6 +36,7 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off|split controls accelerated irqchip support (default=off)\n"
     "                vmport=on|off|auto controls emulation of vmport (default: auto)\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
+    "                kvm-dirty-ring-size=n collect dirty pages through per-vCPU rings of n entries (default=0)\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
     "                mem-merge=on|off controls memory merge support (default: on)\n"
     "                iommu=on|off controls emulated Intel IOMMU (VT-d) support (default=off)\n"
@@ -67,6 +68,12 @@ value based on accel. For accel=xen the default is off otherwise the default
 is on.
 @item kvm_shadow_mem=size
 Defines the size of the KVM shadow MMU.
+@item kvm-dirty-ring-size=@var{n}
+Collect dirty guest pages through per-vCPU rings of @var{n} entries instead
+of the per-slot dirty bitmap, so that syncing the dirty log costs time
+proportional to the number of dirtied pages rather than to the guest size.
+@var{n} must be a power of two.  The default of 0, or a host kernel without
+dirty ring support, uses the dirty bitmap.
 @item dump-guest-core=on|off
 Include guest memory in a core dump. The default is on.
 @item mem-merge=on|off
@@ -1641,6 +1648,13 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_XDP
+    "-netdev af-xdp,id=str,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m][,inhibit=on|off]\n"
+    "                attach to the host interface 'name' with AF_XDP sockets, one per\n"
+    "                interface queue starting at 'm' ('mode' selects the XDP attach\n"
+    "                mode, by default native with a fallback to skb)\n"
 #endif
     "-netdev vhost-user,id=str,chardev=dev[,vhostforce=on|off]\n"
     "                configure a vhost-user network, backed by a chardev 'dev'\n"
@@ -1665,6 +1679,9 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
 #endif
     "socket][,vlan=n][,option][,option][,...]\n"
     "                old way to initialize a host network interface\n"
@@ -2075,6 +2092,32 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}][,inhibit=on|off]
+
+Connect to queues @var{m} to @var{m}+@var{n}-1 of the host network interface
+@var{name} through AF_XDP sockets, one per queue.  Each socket is paired with
+one queue pair of a multiqueue NIC.  By default a program redirecting all
+traffic of those queues to the sockets is loaded on the interface, in native
+(driver) mode if possible and in generic skb mode otherwise; @option{mode}
+forces one of the two.  Zero-copy is used when the driver supports it unless
+@option{force-copy} is set.  With @option{inhibit=on} no program is loaded,
+and the sockets must be placed in an XSKMAP by an external program.  The
+backend needs CAP_NET_ADMIN and CAP_SYS_ADMIN (or CAP_BPF) on the host.
+
+The interface queues must not be used by the host stack at the same time,
+so a dedicated NIC, or queues steered with ethtool, is recommended.  A veth
+pair is enough for local testing:
+
+@example
+ip link add dev veth0 type veth peer name veth1
+ip link set dev veth0 up
+ip link set dev veth1 up
+qemu -netdev af-xdp,id=n0,ifname=veth0,mode=skb \
+     -device virtio-net-pci,netdev=n0 ...
+@end example
+
+Traffic sent to veth1 on the host is then received by the guest.
+
 @item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=n]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
@@ -2084,6 +2127,12 @@ end of the socket. On non-MSIX guests, the feature can be forced with
 @var{vhostforce}. Use 'queues=@var{n}' to specify the number of queues to
 be created for multiqueue vhost-user.
 
+If the chardev is a client socket with a @option{reconnect} delay, QEMU
+connects again when the backend goes away and hands the memory table, the
+ring state and, if the backend supports it, the inflight descriptor region to
+the new backend.  The guest keeps its device; only the link goes down while
+the backend is absent.  @code{info network} shows how long the outages lasted.
+
 Example:
 @example
 qemu -m 512 -object memory-backend-file,id=mem,size=512M,mem-path=/hugetlbfs,share=on \
@@ -3859,6 +3908,9 @@ queue @var{all|rx|tx} is an option that can be applied to any netfilter.
 @option{tx}: the filter is attached to the transmit queue of the netdev,
              where it will receive packets sent by the netdev.
 
+Netfilters cannot be attached to a netdev whose virtio-net peer is served
+by an IOThread.
+
 @item -object filter-mirror,id=@var{id},netdev=@var{netdevid},outdev=@var{chardevid}[,queue=@var{all|rx|tx}]
 
 filter-mirror on netdev @var{netdevid},mirror net packet to chardev
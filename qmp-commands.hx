@@ -1186,7 +1186,8 @@ EQMP
     {
         .name       = "drive-backup",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
-                      "bitmap:s?,on-source-error:s?,on-target-error:s?",
+                      "bitmap:s?,on-source-error:s?,on-target-error:s?,"
+                      "max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_drive_backup,
     },
 
@@ -1228,6 +1229,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the maximum number of copy requests in flight, between 1
+                 and 64 (json-int, optional, default 4)
 
 Example:
 -> { "execute": "drive-backup", "arguments": { "device": "drive0",
@@ -1240,7 +1243,7 @@ EQMP
     {
         .name       = "blockdev-backup",
         .args_type  = "sync:s,device:B,target:B,speed:i?,"
-                      "on-source-error:s?,on-target-error:s?",
+                      "on-source-error:s?,on-target-error:s?,max-workers:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_backup,
     },
 
@@ -1269,6 +1272,8 @@ Arguments:
                      'report' (no limitations, since this applies to
                      a different block device than device).
                      (BlockdevOnError, optional)
+- "max-workers": the maximum number of copy requests in flight, between 1
+                 and 64 (json-int, optional, default 4)
 
 Example:
 -> { "execute": "blockdev-backup", "arguments": { "device": "src-id",
@@ -1632,7 +1637,7 @@ EQMP
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "node-name:s?,replaces:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "unmap:b?,"
+                      "unmap:b?,copy-mode:s?,"
                       "granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_drive_mirror,
     },
@@ -1674,6 +1679,9 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "unmap": whether the target sectors should be discarded where source has only
   zeroes. (json-bool, optional, default true)
+- "copy-mode": "background" to only copy dirty data in the background, or
+  "write-blocking" to also copy guest writes to the target synchronously
+  (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1695,7 +1703,7 @@ EQMP
         .name       = "blockdev-mirror",
         .args_type  = "sync:s,device:B,target:B,replaces:s?,speed:i?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "copy-mode:s?,granularity:i?,buf-size:i?",
         .mhandler.cmd_new = qmp_marshal_blockdev_mirror,
     },
 
@@ -1725,6 +1733,9 @@ Arguments:
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "copy-mode": "background" to only copy dirty data in the background, or
+  "write-blocking" to also copy guest writes to the target synchronously
+  (MirrorCopyMode, optional, default 'background')
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -2902,6 +2913,10 @@ Return a json-array. Each iothread is represented by a json-object, which contai
 
 - "id": name of iothread (json-str)
 - "thread-id": ID of the underlying host thread (json-int)
+- "poll-max-ns": maximum polling time in ns (json-int)
+- "poll-ns": current polling time in ns (json-int)
+- "poll-hits": number of polling phases that found work (json-int)
+- "poll-misses": number of polling phases that found no work (json-int)
 
 Example:
 
@@ -2910,11 +2925,19 @@ Example:
       "return":[
          {
             "id":"iothread0",
-            "thread-id":3134
+            "thread-id":3134,
+            "poll-max-ns":32768,
+            "poll-ns":8000,
+            "poll-hits":1520,
+            "poll-misses":97
          },
          {
             "id":"iothread1",
-            "thread-id":3135
+            "thread-id":3135,
+            "poll-max-ns":0,
+            "poll-ns":0,
+            "poll-hits":0,
+            "poll-misses":0
          }
       ]
    }
@@ -2927,6 +2950,53 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_query_iothreads,
     },
 
+SQMP
+query-thread-pools
+------------------
+
+Returns statistics for the thread pools that have been created by the main
+loop and by iothreads.  Requests are split in two priority classes, "latency"
+for reads and writes and "bulk" for long-running requests such as flushes.
+
+Return a json-array. Each thread pool is represented by a json-object, which
+contains:
+
+- "iothread": name of the iothread that owns the pool, absent for the main
+  loop (json-str, optional)
+- "threads": number of worker threads (json-int)
+- "idle-threads": number of idle worker threads (json-int)
+- "stolen": number of requests taken from another worker's queue (json-int)
+- "latency", "bulk": statistics for each priority class (json-object):
+  - "queued": number of requests waiting for a worker (json-int)
+  - "completed": number of completed requests (json-int)
+  - "wait-ns": total time completed requests spent queued (json-int)
+  - "run-ns": total time spent running completed requests (json-int)
+
+Example:
+
+-> { "execute": "query-thread-pools" }
+<- {
+      "return":[
+         {
+            "threads":4,
+            "idle-threads":3,
+            "stolen":112,
+            "latency":{ "queued":0, "completed":20816,
+                        "wait-ns":41224000, "run-ns":1734560000 },
+            "bulk":{ "queued":1, "completed":312,
+                     "wait-ns":2240000, "run-ns":5603200000 }
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-thread-pools",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_query_thread_pools,
+    },
+
 SQMP
 query-pci
 ---------
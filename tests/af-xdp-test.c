@@ -0,0 +1,136 @@
+/*
+ * QTest testcase for the AF_XDP network backend
+ *
+ * The tests need a veth pair, so they are skipped unless they can create
+ * one, which usually means running as root.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qapi/qmp/types.h"
+
+#define VETH            "qtest-xdp0"
+#define VETH_PEER       "qtest-xdp1"
+
+static bool run(const char *fmt, ...)
+{
+    char *cmd, *out = NULL, *err = NULL;
+    va_list ap;
+    int status;
+    bool ok;
+
+    va_start(ap, fmt);
+    cmd = g_strdup_vprintf(fmt, ap);
+    va_end(ap);
+
+    ok = g_spawn_command_line_sync(cmd, &out, &err, &status, NULL) &&
+         WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    g_free(cmd);
+    g_free(out);
+    g_free(err);
+    return ok;
+}
+
+static bool veth_create(int queues)
+{
+    run("ip link del dev " VETH);
+    if (!run("ip link add dev " VETH " numtxqueues %d numrxqueues %d "
+             "type veth peer name " VETH_PEER, queues, queues)) {
+        g_test_message("Skipping test: cannot create a veth pair");
+        return false;
+    }
+    g_assert(run("ip link set dev " VETH " up"));
+    g_assert(run("ip link set dev " VETH_PEER " up"));
+    return true;
+}
+
+static void veth_destroy(void)
+{
+    run("ip link del dev " VETH);
+}
+
+/* Whether an XDP program is attached to VETH, in any mode */
+static bool veth_has_xdp(void)
+{
+    char *out = NULL;
+    int status;
+    bool ret;
+
+    g_assert(g_spawn_command_line_sync("ip link show dev " VETH, &out, NULL,
+                                       &status, NULL));
+    g_assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    ret = strstr(out, "xdp") != NULL;
+    g_free(out);
+    return ret;
+}
+
+static QDict *netdev_add(int queues)
+{
+    char *cmd;
+    QDict *response;
+
+    cmd = g_strdup_printf("{ 'execute': 'netdev_add',"
+                          "  'arguments': { 'type': 'af-xdp', 'id': 'n0',"
+                          "    'ifname': '" VETH "', 'mode': 'skb',"
+                          "    'queues': '%d' } }", queues);
+    response = qmp(cmd);
+    g_free(cmd);
+    return response;
+}
+
+/* The program stays loaded until the last queue is gone */
+static void test_detach(void)
+{
+    QDict *response;
+
+    if (!veth_create(2)) {
+        return;
+    }
+    qtest_start("-machine none");
+
+    response = netdev_add(2);
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+    g_assert(veth_has_xdp());
+
+    response = qmp("{ 'execute': 'netdev_del', 'arguments': { 'id': 'n0' } }");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+    g_assert(!veth_has_xdp());
+
+    qtest_end();
+    veth_destroy();
+}
+
+/* A queue that cannot be bound still removes the program of the others */
+static void test_detach_on_error(void)
+{
+    QDict *response;
+
+    if (!veth_create(1)) {
+        return;
+    }
+    qtest_start("-machine none");
+
+    response = netdev_add(2);
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+    g_assert(!veth_has_xdp());
+
+    qtest_end();
+    veth_destroy();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/netdev/af-xdp/detach", test_detach);
+    qtest_add_func("/netdev/af-xdp/detach-on-error", test_detach_on_error);
+
+    return g_test_run();
+}
@@ -0,0 +1,93 @@
+/*
+ * QTest testcase for the per-thread migration dirty logs
+ *
+ * qtest writes to guest memory go through the address space like DMA, so
+ * the pages they dirty are buffered in the dirty log of the main thread
+ * until migration_bitmap_sync() flushes it.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qapi/qmp/types.h"
+
+#define CMD             "-m 128 -display none"
+#define PATTERN_START   (16 << 20)
+#define PATTERN_PAGES   1024
+
+static void migrate_set_speed(int64_t value)
+{
+    char *cmd;
+    QDict *rsp;
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate_set_speed',"
+                          "  'arguments': { 'value': %" PRId64 " } }", value);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+/* Pages dirtied while the migration runs, including a page that is written
+ * again right before the end, must all reach the destination */
+static void test_migrate(void)
+{
+    QTestState *from, *to;
+    char *uri, *cmd;
+    QDict *rsp;
+    int i;
+
+    uri = g_strdup_printf("unix:%s/qtest-dirty-log-%d.sock",
+                          g_get_tmp_dir(), getpid());
+
+    from = qtest_start(CMD);
+    for (i = 0; i < PATTERN_PAGES; i++) {
+        writel(PATTERN_START + i * 4096, 0x5a5a0000 + i);
+    }
+
+    cmd = g_strdup_printf(CMD " -incoming %s", uri);
+    to = qtest_init(cmd);
+    g_free(cmd);
+
+    /* Keep the migration from converging until the second pattern is in */
+    global_qtest = from;
+    migrate_set_speed(1);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "  'arguments': { 'uri': '%s' } }", uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    for (i = 0; i < PATTERN_PAGES; i += 2) {
+        writel(PATTERN_START + i * 4096, 0xa5a50000 + i);
+    }
+    writel(PATTERN_START, 0xa5a5ffff);
+    migrate_set_speed(1000000000);
+    qmp_eventwait("STOP");
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+    g_assert_cmphex(readl(PATTERN_START), ==, 0xa5a5ffff);
+    for (i = 1; i < PATTERN_PAGES; i++) {
+        g_assert_cmphex(readl(PATTERN_START + i * 4096), ==,
+                        (i % 2 ? 0x5a5a0000 : 0xa5a50000) + i);
+    }
+
+    qtest_quit(to);
+    qtest_quit(from);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/migration/dirty-log", test_migrate);
+
+    return g_test_run();
+}
@@ -23,6 +23,18 @@ static void pci_stdvga(void)
     qtest_end();
 }
 
+/* Writes to the legacy window are batched until the next read */
+static void pci_stdvga_coalesced(void)
+{
+    char *mtree;
+
+    qtest_start("-vga none -device VGA");
+    mtree = hmp("info mtree");
+    g_assert(strstr(mtree, ": vga-lowmem [coalesced"));
+    g_free(mtree);
+    qtest_end();
+}
+
 static void pci_secondary(void)
 {
     qtest_start("-vga none -device secondary-vga");
@@ -57,6 +69,10 @@ int main(int argc, char **argv)
 
     qtest_add_func("/display/pci/cirrus", pci_cirrus);
     qtest_add_func("/display/pci/stdvga", pci_stdvga);
+    if (!strcmp(qtest_get_arch(), "i386") ||
+        !strcmp(qtest_get_arch(), "x86_64")) {
+        qtest_add_func("/display/pci/stdvga/coalesced", pci_stdvga_coalesced);
+    }
     qtest_add_func("/display/pci/secondary", pci_secondary);
     qtest_add_func("/display/pci/multihead", pci_multihead);
     qtest_add_func("/display/pci/virtio-gpu", pci_virtio_gpu);
@@ -10,6 +10,7 @@
 #include "qemu/osdep.h"
 #include <glib.h>
 #include "libqtest.h"
+#include "libqos/pci-pc.h"
 
 /* Tests only initialization so far. TODO: Replace with functional tests */
 static void test_device(gconstpointer data)
@@ -27,6 +28,29 @@ static void test_device(gconstpointer data)
     g_free(args);
 }
 
+/* Once BAR 0 is mapped, the registers the guest may batch are coalesced */
+static void test_coalesced(void)
+{
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    char *mtree;
+
+    qtest_start("-device e1000,addr=04.0");
+    bus = qpci_init_pc();
+    dev = qpci_device_find(bus, QPCI_DEVFN(4, 0));
+    g_assert(dev != NULL);
+    qpci_device_enable(dev);
+    qpci_iomap(dev, 0, NULL);
+
+    mtree = hmp("info mtree");
+    g_assert(strstr(mtree, ": e1000-mmio [coalesced"));
+    g_free(mtree);
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
 static const char *models[] = {
     "e1000",
     "e1000-82540em",
@@ -47,5 +71,10 @@ int main(int argc, char **argv)
         qtest_add_data_func(path, models[i], test_device);
     }
 
+    if (!strcmp(qtest_get_arch(), "i386") ||
+        !strcmp(qtest_get_arch(), "x86_64")) {
+        qtest_add_func("e1000/coalesced", test_coalesced);
+    }
+
     return g_test_run();
 }
@@ -0,0 +1,121 @@
+/*
+ * QTest testcase for the global mutex statistics and lockless MMIO
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qapi/qmp/types.h"
+#include "hw/timer/hpet.h"
+
+typedef struct LockStats {
+    uint64_t acquisitions;
+    uint64_t contended;
+    uint64_t wait_ns;
+    uint64_t hold_ns;
+} LockStats;
+
+static void lock_stats(LockStats *stats)
+{
+    char *out = hmp("info iothread-lock");
+
+    g_assert_cmpint(sscanf(out, "acquisitions %" SCNu64
+                           " contended %" SCNu64
+                           " wait time %" SCNu64 " (%*f)"
+                           " hold time %" SCNu64,
+                           &stats->acquisitions, &stats->contended,
+                           &stats->wait_ns, &stats->hold_ns), ==, 4);
+    g_free(out);
+}
+
+static const char *hold_trace_state(void)
+{
+    static char state[16];
+    QDict *rsp;
+    QList *events;
+
+    rsp = qmp("{ 'execute': 'trace-event-get-state',"
+              "  'arguments': { 'name': 'iothread_lock_hold' } }");
+    events = qdict_get_qlist(rsp, "return");
+    g_assert(events && !qlist_empty(events));
+    g_strlcpy(state, qdict_get_str(qobject_to_qdict(qlist_peek(events)),
+                                   "state"), sizeof(state));
+    QDECREF(rsp);
+    return state;
+}
+
+/* Every main loop iteration drops and retakes the mutex, and hold time is
+ * only measured while its trace event is on */
+static void test_stats(void)
+{
+    LockStats before, after;
+    QDict *rsp;
+    int i;
+
+    qtest_start("-machine pc");
+
+    lock_stats(&before);
+    for (i = 0; i < 10; i++) {
+        clock_step(1000);
+    }
+    lock_stats(&after);
+    g_assert_cmpint(after.acquisitions, >, before.acquisitions);
+    g_assert_cmpint(after.contended, <=, after.acquisitions);
+
+    if (strcmp(hold_trace_state(), "disabled")) {
+        g_test_message("Skipping hold time: event cannot be traced");
+        qtest_end();
+        return;
+    }
+    g_assert_cmpint(after.hold_ns, ==, 0);
+
+    rsp = qmp("{ 'execute': 'trace-event-set-state',"
+              "  'arguments': { 'name': 'iothread_lock_hold',"
+              "                 'enable': true } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    for (i = 0; i < 10; i++) {
+        clock_step(1000);
+    }
+    lock_stats(&after);
+    g_assert_cmpint(after.hold_ns, >, 0);
+
+    qtest_end();
+}
+
+/* Main counter reads go through the seqlock instead of the mutex */
+static void test_hpet_counter(void)
+{
+    uint32_t first, second;
+
+    qtest_start("-machine pc");
+
+    writel(HPET_BASE + HPET_CFG, HPET_CFG_ENABLE);
+    first = readl(HPET_BASE + HPET_COUNTER);
+    clock_step(1000000);
+    second = readl(HPET_BASE + HPET_COUNTER);
+    g_assert_cmpint(second, >, first);
+
+    /* A stopped counter keeps its value */
+    writel(HPET_BASE + HPET_CFG, 0);
+    first = readl(HPET_BASE + HPET_COUNTER);
+    clock_step(1000000);
+    second = readl(HPET_BASE + HPET_COUNTER);
+    g_assert_cmpint(second, ==, first);
+
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/iothread-lock/stats", test_stats);
+    qtest_add_func("/iothread-lock/hpet-counter", test_hpet_counter);
+
+    return g_test_run();
+}
@@ -0,0 +1,137 @@
+/*
+ * QTest testcase for the KVM dirty ring
+ *
+ * The migration test needs /dev/kvm and is skipped without it.  A host
+ * kernel without KVM_CAP_DIRTY_LOG_RING falls back to the dirty bitmap,
+ * which the test then covers instead.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "qapi/qmp/types.h"
+
+#define RING_CMD        "-machine pc,accel=kvm,kvm-dirty-ring-size=4096 " \
+                        "-m 128 -display none"
+#define PATTERN_START   (16 << 20)
+#define PATTERN_PAGES   1024
+
+static QDict *ring_size_set(const char *value)
+{
+    char *cmd;
+    QDict *response;
+
+    cmd = g_strdup_printf("{ 'execute': 'qom-set',"
+                          "  'arguments': { 'path': '/machine',"
+                          "    'property': 'kvm-dirty-ring-size',"
+                          "    'value': %s } }", value);
+    response = qmp(cmd);
+    g_free(cmd);
+    return response;
+}
+
+static void test_ring_size(void)
+{
+    QDict *response;
+
+    qtest_start("-machine none");
+
+    response = qmp("{ 'execute': 'qom-get',"
+                   "  'arguments': { 'path': '/machine',"
+                   "    'property': 'kvm-dirty-ring-size' } }");
+    g_assert_cmpint(qdict_get_int(response, "return"), ==, 0);
+    QDECREF(response);
+
+    response = ring_size_set("1000");
+    g_assert(qdict_haskey(response, "error"));
+    g_assert(strstr(qdict_get_str(qdict_get_qdict(response, "error"),
+                                  "desc"), "power of two"));
+    QDECREF(response);
+
+    response = ring_size_set("4096");
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    response = qmp("{ 'execute': 'qom-get',"
+                   "  'arguments': { 'path': '/machine',"
+                   "    'property': 'kvm-dirty-ring-size' } }");
+    g_assert_cmpint(qdict_get_int(response, "return"), ==, 4096);
+    QDECREF(response);
+
+    qtest_end();
+}
+
+/* Every page written on the source before and during the migration must
+ * arrive on the destination, whichever way the dirty pages were logged */
+static void test_migrate(void)
+{
+    QTestState *from, *to;
+    char *uri, *cmd;
+    QDict *rsp;
+    int i;
+
+    if (access("/dev/kvm", R_OK | W_OK)) {
+        g_test_message("Skipping test: /dev/kvm not available");
+        return;
+    }
+
+    uri = g_strdup_printf("unix:%s/qtest-dirty-ring-%d.sock",
+                          g_get_tmp_dir(), getpid());
+
+    from = qtest_start(RING_CMD);
+    for (i = 0; i < PATTERN_PAGES; i++) {
+        writel(PATTERN_START + i * 4096, 0x5a5a0000 + i);
+    }
+
+    cmd = g_strdup_printf(RING_CMD " -incoming %s", uri);
+    to = qtest_init(cmd);
+    g_free(cmd);
+
+    /* Keep the migration from converging until the second pattern is in */
+    global_qtest = from;
+    rsp = qmp("{ 'execute': 'migrate_set_speed',"
+              "  'arguments': { 'value': 1 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "  'arguments': { 'uri': '%s' } }", uri);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+
+    /* Pages dirtied after the first pass go through the log sync */
+    for (i = 0; i < PATTERN_PAGES; i += 2) {
+        writel(PATTERN_START + i * 4096, 0xa5a50000 + i);
+    }
+    rsp = qmp("{ 'execute': 'migrate_set_speed',"
+              "  'arguments': { 'value': 1000000000 } }");
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+    qmp_eventwait("STOP");
+
+    global_qtest = to;
+    qmp_eventwait("RESUME");
+    for (i = 0; i < PATTERN_PAGES; i++) {
+        g_assert_cmphex(readl(PATTERN_START + i * 4096), ==,
+                        (i % 2 ? 0x5a5a0000 : 0xa5a50000) + i);
+    }
+
+    qtest_quit(to);
+    qtest_quit(from);
+    g_free(uri);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/kvm/dirty-ring/size", test_ring_size);
+    qtest_add_func("/kvm/dirty-ring/migrate", test_migrate);
+
+    return g_test_run();
+}
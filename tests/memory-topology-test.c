@@ -0,0 +1,161 @@
+/*
+ * QTest testcase for memory topology updates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+
+typedef struct TopologyStats {
+    uint64_t commits;
+    uint64_t rendered;
+    uint64_t updates;
+    uint64_t unchanged;
+    unsigned sharing;
+    bool mmio_mapped;
+} TopologyStats;
+
+static void topology_stats(TopologyStats *stats)
+{
+    char *mtree = hmp("info mtree");
+    char *line = strstr(mtree, "topology commits:");
+
+    g_assert(line);
+    g_assert_cmpint(sscanf(line, "topology commits: %" SCNu64
+                           ", views rendered: %" SCNu64
+                           ", address space updates: %" SCNu64
+                           ", unchanged: %" SCNu64,
+                           &stats->commits, &stats->rendered,
+                           &stats->updates, &stats->unchanged), ==, 4);
+    line = strstr(mtree, "address spaces sharing a dispatch tree:");
+    g_assert(line);
+    g_assert_cmpint(sscanf(line, "address spaces sharing a dispatch tree: %u",
+                           &stats->sharing), ==, 1);
+    stats->mmio_mapped = strstr(mtree, ": pci-testdev-mmio") != NULL;
+    g_free(mtree);
+}
+
+/* Turning off memory decoding of one device changes the memory address
+ * space and the ones that alias it, but not the I/O address space: that
+ * one is left alone, and the BAR really goes away from the others */
+static void test_unchanged_skipped(void)
+{
+    TopologyStats before, after;
+    QPCIBus *bus;
+    QPCIDevice *dev;
+    uint16_t cmd;
+
+    qtest_start("-device pci-testdev,addr=04.0");
+    bus = qpci_init_pc();
+    dev = qpci_device_find(bus, QPCI_DEVFN(4, 0));
+    g_assert(dev != NULL);
+    qpci_iomap(dev, 0, NULL);
+    qpci_iomap(dev, 1, NULL);
+    qpci_device_enable(dev);
+
+    topology_stats(&before);
+    g_assert(before.mmio_mapped);
+
+    cmd = qpci_config_readw(dev, PCI_COMMAND);
+    qpci_config_writew(dev, PCI_COMMAND, cmd & ~PCI_COMMAND_MEMORY);
+
+    topology_stats(&after);
+    g_assert(!after.mmio_mapped);
+    g_assert_cmpint(after.commits, >, before.commits);
+    g_assert_cmpint(after.updates, >, before.updates);
+    g_assert_cmpint(after.unchanged, >, before.unchanged);
+
+    /* Writing the same value again changes nothing at all */
+    before = after;
+    qpci_config_writew(dev, PCI_COMMAND, cmd & ~PCI_COMMAND_MEMORY);
+    topology_stats(&after);
+    g_assert_cmpint(after.updates, ==, before.updates);
+
+    /* ...and decoding comes back */
+    qpci_config_writew(dev, PCI_COMMAND, cmd);
+    topology_stats(&after);
+    g_assert(after.mmio_mapped);
+    g_assert_cmpint(after.updates, >, before.updates);
+
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+static void set_bus_master(QPCIDevice *dev, bool enable)
+{
+    uint16_t cmd = qpci_config_readw(dev, PCI_COMMAND);
+
+    if (enable) {
+        cmd |= PCI_COMMAND_MASTER;
+    } else {
+        cmd &= ~PCI_COMMAND_MASTER;
+    }
+    qpci_config_writew(dev, PCI_COMMAND, cmd);
+}
+
+/* With bus mastering on, the DMA address space of a device shows system
+ * memory and borrows the dispatch tree of address_space_memory */
+static void test_dispatch_sharing(void)
+{
+    TopologyStats stats;
+    QPCIBus *bus;
+    QPCIDevice *dev4, *dev5, *dev6;
+    unsigned base;
+
+    qtest_start("-device pci-testdev,addr=04.0 -device pci-testdev,addr=05.0");
+    bus = qpci_init_pc();
+    dev4 = qpci_device_find(bus, QPCI_DEVFN(4, 0));
+    dev5 = qpci_device_find(bus, QPCI_DEVFN(5, 0));
+    g_assert(dev4 != NULL && dev5 != NULL);
+
+    topology_stats(&stats);
+    base = stats.sharing;
+
+    set_bus_master(dev4, true);
+    topology_stats(&stats);
+    g_assert_cmpint(stats.sharing, ==, base + 1);
+
+    set_bus_master(dev5, true);
+    topology_stats(&stats);
+    g_assert_cmpint(stats.sharing, ==, base + 2);
+
+    set_bus_master(dev4, false);
+    topology_stats(&stats);
+    g_assert_cmpint(stats.sharing, ==, base + 1);
+
+    /* Destroying a borrower leaves the others alone */
+    qpci_plug_device_test("pci-testdev", "dev6", 6, NULL);
+    dev6 = qpci_device_find(bus, QPCI_DEVFN(6, 0));
+    g_assert(dev6 != NULL);
+    set_bus_master(dev6, true);
+    topology_stats(&stats);
+    g_assert_cmpint(stats.sharing, ==, base + 2);
+
+    qpci_unplug_acpi_device_test("dev6", 6);
+    topology_stats(&stats);
+    g_assert_cmpint(stats.sharing, ==, base + 1);
+
+    g_free(dev6);
+    g_free(dev5);
+    g_free(dev4);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/memory/topology/unchanged-skipped",
+                   test_unchanged_skipped);
+    qtest_add_func("/memory/topology/dispatch-sharing",
+                   test_dispatch_sharing);
+
+    return g_test_run();
+}
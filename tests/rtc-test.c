@@ -543,6 +543,15 @@ static void register_b_set_flag(void)
     g_assert_cmpint(cmos_read(RTC_CENTURY), ==, 0x20);
 }
 
+/* Only the index port may be batched, the data port has side effects */
+static void coalesced_index(void)
+{
+    char *mtree = hmp("info mtree");
+
+    g_assert(strstr(mtree, ": rtc [coalesced"));
+    g_free(mtree);
+}
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
@@ -565,6 +574,7 @@ int main(int argc, char **argv)
     qtest_add_func("/rtc/set-year/1980", set_year_1980);
     qtest_add_func("/rtc/misc/register_b_set_flag", register_b_set_flag);
     qtest_add_func("/rtc/misc/fuzz-registers", fuzz_registers);
+    qtest_add_func("/rtc/misc/coalesced-index", coalesced_index);
     ret = g_test_run();
 
     if (s) {
@@ -400,6 +400,58 @@ static void test_aio_external_client(void)
     }
 }
 
+#ifndef _WIN32
+static bool poll_ready_cb(void *opaque)
+{
+    EventNotifierTestData *data = container_of(opaque, EventNotifierTestData,
+                                               e);
+    if (!data->active) {
+        return false;
+    }
+    data->active--;
+    data->n++;
+    return true;
+}
+
+static void test_poll_handler(void)
+{
+    EventNotifierTestData data = { .n = 0, .active = 0 };
+    BHTestData bh = { .n = 0 };
+    uint64_t hits = ctx->poll_hits;
+
+    event_notifier_init(&data.e, false);
+    set_event_notifier(ctx, &data.e, event_ready_cb);
+    aio_set_event_notifier_poll(ctx, &data.e, poll_ready_cb);
+    aio_context_set_poll_params(ctx, 1000000000, &error_abort);
+    g_assert_cmpint(ctx->poll_ns, ==, 0);
+
+    /* A blocking aio_poll that finds work quickly opens the window */
+    bh.bh = aio_bh_new(ctx, bh_test_cb, &bh);
+    qemu_bh_schedule(bh.bh);
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(bh.n, ==, 1);
+    g_assert_cmpint(data.n, ==, 0);
+    g_assert_cmpint(ctx->poll_ns, >, 0);
+
+    /* Work is now found by polling, without the notifier being set */
+    data.active = 1;
+    g_assert(aio_poll(ctx, true));
+    g_assert_cmpint(data.n, ==, 1);
+    g_assert_cmpint(ctx->poll_hits, ==, hits + 1);
+
+    /* Non-blocking aio_poll does not poll */
+    data.active = 1;
+    g_assert(!aio_poll(ctx, false));
+    g_assert_cmpint(data.n, ==, 1);
+    data.active = 0;
+
+    aio_context_set_poll_params(ctx, 0, &error_abort);
+    qemu_bh_delete(bh.bh);
+    set_event_notifier(ctx, &data.e, NULL);
+    event_notifier_cleanup(&data.e);
+}
+#endif
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -857,6 +909,9 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
     g_test_add_func("/aio/external-client",         test_aio_external_client);
+#ifndef _WIN32
+    g_test_add_func("/aio/poll-handler",            test_poll_handler);
+#endif
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/flush",                   test_source_flush);
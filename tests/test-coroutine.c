@@ -229,6 +229,45 @@ static void test_order(void)
         g_assert_cmpint(records[i].state, ==, expected_pos[i].state);
     }
 }
+/*
+ * Check that the coroutine pool adapts to the number of coroutines in use
+ */
+
+static void coroutine_fn yield_once(void *opaque)
+{
+    qemu_coroutine_yield();
+}
+
+static void test_pool(void)
+{
+    Coroutine *cos[256];
+    CoroutinePoolStats before, after;
+    int i, round;
+
+    if (!CONFIG_COROUTINE_POOL) {
+        return;
+    }
+
+    qemu_coroutine_get_pool_stats(&before);
+
+    /* Enough creations for the pool to be adjusted and publish its stats */
+    for (round = 0; round < 16; round++) {
+        for (i = 0; i < ARRAY_SIZE(cos); i++) {
+            cos[i] = qemu_coroutine_create(yield_once);
+            qemu_coroutine_enter(cos[i], NULL);
+        }
+        for (i = 0; i < ARRAY_SIZE(cos); i++) {
+            qemu_coroutine_enter(cos[i], NULL);
+        }
+    }
+
+    qemu_coroutine_get_pool_stats(&after);
+    g_assert_cmpuint(after.hits + after.misses, >=,
+                     before.hits + before.misses + 3 * 1024);
+    g_assert_cmpuint(after.hits, >, before.hits);
+    g_assert_cmpuint(after.pool_size, >, 0);
+}
+
 /*
  * Lifecycle benchmark
  */
@@ -376,6 +415,7 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/self", test_self);
     g_test_add_func("/basic/in_coroutine", test_in_coroutine);
     g_test_add_func("/basic/order", test_order);
+    g_test_add_func("/basic/pool", test_pool);
     if (g_test_perf()) {
         g_test_add_func("/perf/lifecycle", perf_lifecycle);
         g_test_add_func("/perf/nesting", perf_nesting);
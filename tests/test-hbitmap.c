@@ -12,6 +12,8 @@
 #include "qemu/osdep.h"
 #include <glib.h>
 #include "qemu/hbitmap.h"
+#include "qemu/thread.h"
+#include "qemu/atomic.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
 
@@ -25,6 +27,7 @@ typedef struct TestHBitmapData {
     size_t         size;
     size_t         old_size;
     int            granularity;
+    bool           atomic;
 } TestHBitmapData;
 
 
@@ -147,7 +150,11 @@ static void hbitmap_test_teardown(TestHBitmapData *data,
 static void hbitmap_test_set(TestHBitmapData *data,
                              uint64_t first, uint64_t count)
 {
-    hbitmap_set(data->hb, first, count);
+    if (data->atomic) {
+        hbitmap_set_atomic(data->hb, first, count);
+    } else {
+        hbitmap_set(data->hb, first, count);
+    }
     while (count-- != 0) {
         size_t pos = first >> LOG_BITS_PER_LONG;
         int bit = first & (BITS_PER_LONG - 1);
@@ -166,7 +173,11 @@ static void hbitmap_test_set(TestHBitmapData *data,
 static void hbitmap_test_reset(TestHBitmapData *data,
                                uint64_t first, uint64_t count)
 {
-    hbitmap_reset(data->hb, first, count);
+    if (data->atomic) {
+        hbitmap_reset_atomic(data->hb, first, count);
+    } else {
+        hbitmap_reset(data->hb, first, count);
+    }
     while (count-- != 0) {
         size_t pos = first >> LOG_BITS_PER_LONG;
         int bit = first & (BITS_PER_LONG - 1);
@@ -377,6 +388,109 @@ static void test_hbitmap_reset(TestHBitmapData *data,
     hbitmap_test_set(data, L3 / 2, L3);
 }
 
+static void test_hbitmap_set_atomic(TestHBitmapData *data,
+                                    const void *unused)
+{
+    data->atomic = true;
+    test_hbitmap_set(data, unused);
+    hbitmap_test_check_get(data);
+    hbitmap_test_teardown(data, unused);
+
+    test_hbitmap_set_overlap(data, unused);
+    hbitmap_test_check_get(data);
+}
+
+static void test_hbitmap_reset_atomic(TestHBitmapData *data,
+                                      const void *unused)
+{
+    data->atomic = true;
+    test_hbitmap_reset(data, unused);
+    hbitmap_test_check_get(data);
+}
+
+/* Words that hold a bit that is never reset; all other words are filled
+ * and emptied over and over, so that the summary bits above them come and
+ * go as well.
+ */
+#define KEEP_STRIDE                (L1 + 3)
+#define KEEP_BIT                   5
+
+static bool hbitmap_test_keep_word(uint64_t word)
+{
+    return word % KEEP_STRIDE == 0;
+}
+
+typedef struct HBitmapToggler {
+    HBitmap *hb;
+    bool stop;
+} HBitmapToggler;
+
+static void *hbitmap_test_toggle(void *opaque)
+{
+    HBitmapToggler *t = opaque;
+    uint64_t word;
+    unsigned pass;
+
+    for (pass = 0; !atomic_read(&t->stop); pass++) {
+        for (word = 0; word < L2; word++) {
+            if (hbitmap_test_keep_word(word)) {
+                continue;
+            }
+            if ((word + pass) & 1) {
+                hbitmap_set_atomic(t->hb, word * L1, L1);
+            } else {
+                hbitmap_reset_atomic(t->hb, word * L1, L1);
+            }
+        }
+    }
+    return NULL;
+}
+
+static void test_hbitmap_iter_concurrent_reset(TestHBitmapData *data,
+                                               const void *unused)
+{
+    HBitmapToggler t;
+    QemuThread thread;
+    HBitmapIter hbi;
+    uint64_t word, keep = 0;
+    int64_t item, prev;
+    int i;
+
+    hbitmap_test_init(data, L3, 0);
+    for (word = 0; word < L2; word += KEEP_STRIDE) {
+        hbitmap_set_atomic(data->hb, word * L1 + KEEP_BIT, 1);
+        keep++;
+    }
+
+    t.hb = data->hb;
+    t.stop = false;
+    qemu_thread_create(&thread, "hbitmap-toggle", hbitmap_test_toggle, &t,
+                       QEMU_THREAD_JOINABLE);
+
+    /* A bit that was reset after the iterator read its word may still come
+     * out, but bits that stay set must not be missed.
+     */
+    for (i = 0; i < 200; i++) {
+        uint64_t seen = 0;
+
+        prev = -1;
+        hbitmap_iter_init(&hbi, data->hb, 0);
+        while ((item = hbitmap_iter_next(&hbi)) >= 0) {
+            g_assert_cmpint(item, >, prev);
+            g_assert_cmpint(item, <, L3);
+            if (hbitmap_test_keep_word(item / L1)) {
+                g_assert_cmpint(item % L1, ==, KEEP_BIT);
+                seen++;
+            }
+            prev = item;
+        }
+        g_assert_cmpint(seen, ==, keep);
+    }
+
+    atomic_set(&t.stop, true);
+    qemu_thread_join(&thread);
+}
+
 static void test_hbitmap_reset_all(TestHBitmapData *data,
                                    const void *unused)
 {
@@ -650,6 +764,8 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/iter/empty", test_hbitmap_iter_empty);
     hbitmap_test_add("/hbitmap/iter/partial", test_hbitmap_iter_partial);
     hbitmap_test_add("/hbitmap/iter/granularity", test_hbitmap_iter_granularity);
+    hbitmap_test_add("/hbitmap/iter/concurrent-reset",
+                     test_hbitmap_iter_concurrent_reset);
     hbitmap_test_add("/hbitmap/get/all", test_hbitmap_get_all);
     hbitmap_test_add("/hbitmap/get/some", test_hbitmap_get_some);
     hbitmap_test_add("/hbitmap/set/all", test_hbitmap_set_all);
@@ -658,8 +774,10 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/set/general", test_hbitmap_set);
     hbitmap_test_add("/hbitmap/set/twice", test_hbitmap_set_twice);
     hbitmap_test_add("/hbitmap/set/overlap", test_hbitmap_set_overlap);
+    hbitmap_test_add("/hbitmap/set/atomic", test_hbitmap_set_atomic);
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
+    hbitmap_test_add("/hbitmap/reset/atomic", test_hbitmap_reset_atomic);
     hbitmap_test_add("/hbitmap/reset/all", test_hbitmap_reset_all);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
 
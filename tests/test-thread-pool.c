@@ -212,6 +212,63 @@ static void do_test_cancel(bool sync)
     }
 }
 
+static int bulk_released;
+
+static int bulk_cb(void *opaque)
+{
+    WorkerTestData *data = opaque;
+    atomic_inc(&data->n);
+    while (!atomic_read(&bulk_released)) {
+        g_usleep(1000);
+    }
+    atomic_inc(&data->n);
+    return 0;
+}
+
+static void test_priority(void)
+{
+    WorkerTestData data[40];
+    WorkerTestData latency = { .n = 0 };
+    ThreadPoolStats before, after;
+    int i;
+
+    thread_pool_get_stats(pool, &before);
+
+    /* Bulk requests must not occupy all worker threads...  */
+    for (i = 0; i < 40; i++) {
+        data[i].n = 0;
+        data[i].ret = -EINPROGRESS;
+        data[i].aiocb = thread_pool_submit_aio_prio(pool,
+                            THREAD_POOL_PRIO_BULK, bulk_cb, &data[i],
+                            done_cb, &data[i]);
+    }
+    active = 40;
+
+    /* ... so a latency-sensitive request can still run.  */
+    thread_pool_submit(pool, worker_cb, &latency);
+    while (latency.n == 0) {
+        aio_poll(ctx, true);
+    }
+    g_assert_cmpint(active, ==, 40);
+
+    atomic_set(&bulk_released, 1);
+    while (active > 0) {
+        aio_poll(ctx, true);
+    }
+    for (i = 0; i < 40; i++) {
+        g_assert_cmpint(data[i].n, ==, 2);
+        g_assert_cmpint(data[i].ret, ==, 0);
+    }
+
+    thread_pool_get_stats(pool, &after);
+    g_assert_cmpint(after.queue[THREAD_POOL_PRIO_BULK].completed -
+                    before.queue[THREAD_POOL_PRIO_BULK].completed, ==, 40);
+    g_assert_cmpint(after.queue[THREAD_POOL_PRIO_LATENCY].completed -
+                    before.queue[THREAD_POOL_PRIO_LATENCY].completed, ==, 1);
+    g_assert_cmpint(after.queue[THREAD_POOL_PRIO_BULK].queued, ==, 0);
+    g_assert_cmpint(after.queue[THREAD_POOL_PRIO_LATENCY].queued, ==, 0);
+}
+
 static void test_cancel(void)
 {
     do_test_cancel(true);
@@ -243,6 +300,7 @@ int main(int argc, char **argv)
     g_test_add_func("/thread-pool/submit-many", test_submit_many);
     g_test_add_func("/thread-pool/cancel", test_cancel);
     g_test_add_func("/thread-pool/cancel-async", test_cancel_async);
+    g_test_add_func("/thread-pool/priority", test_priority);
 
     ret = g_test_run();
 
@@ -0,0 +1,331 @@
+/*
+ * vhost memory table unit-tests.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include <linux/vhost.h>
+#include "hw/virtio/vhost.h"
+
+#define PAGE        0x1000
+#define NPAGES      64
+#define UADDR       0x7f0000000000ULL
+
+typedef struct TestVhostMemData {
+    struct vhost_dev dev;
+    VhostOps ops;
+} TestVhostMemData;
+
+static void vhost_mem_test_init(TestVhostMemData *data, const void *unused)
+{
+    memset(data, 0, sizeof *data);
+    data->dev.vhost_ops = &data->ops;
+    data->dev.mem = g_malloc0(offsetof(struct vhost_memory, regions));
+}
+
+static void vhost_mem_test_teardown(TestVhostMemData *data,
+                                    const void *unused)
+{
+    g_free(data->dev.mem);
+    g_free(data->dev.mem_sections);
+}
+
+static void check_region(TestVhostMemData *data, int i, uint64_t start,
+                         uint64_t size, uint64_t uaddr)
+{
+    struct vhost_memory_region *reg = data->dev.mem->regions + i;
+
+    g_assert_cmpint(i, <, data->dev.mem->nregions);
+    g_assert_cmphex(reg->guest_phys_addr, ==, start);
+    g_assert_cmphex(reg->memory_size, ==, size);
+    g_assert_cmphex(reg->userspace_addr, ==, uaddr);
+}
+
+static void test_vhost_mem_merge(TestVhostMemData *data, const void *unused)
+{
+    struct vhost_dev *dev = &data->dev;
+
+    /* Above and below an existing region */
+    vhost_dev_assign_memory(dev, 4 * PAGE, PAGE, UADDR + 4 * PAGE);
+    vhost_dev_assign_memory(dev, 5 * PAGE, PAGE, UADDR + 5 * PAGE);
+    vhost_dev_assign_memory(dev, 3 * PAGE, PAGE, UADDR + 3 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 1);
+    check_region(data, 0, 3 * PAGE, 3 * PAGE, UADDR + 3 * PAGE);
+
+    /* Filling the hole between two regions merges all three */
+    vhost_dev_assign_memory(dev, 8 * PAGE, 2 * PAGE, UADDR + 8 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 2);
+    vhost_dev_assign_memory(dev, 6 * PAGE, 2 * PAGE, UADDR + 6 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 1);
+    check_region(data, 0, 3 * PAGE, 7 * PAGE, UADDR + 3 * PAGE);
+}
+
+static void test_vhost_mem_no_merge(TestVhostMemData *data, const void *unused)
+{
+    struct vhost_dev *dev = &data->dev;
+
+    /* Adjacent in guest memory, but not in the host */
+    vhost_dev_assign_memory(dev, 0, PAGE, UADDR);
+    vhost_dev_assign_memory(dev, PAGE, PAGE, UADDR + 2 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 2);
+    check_region(data, 0, 0, PAGE, UADDR);
+    check_region(data, 1, PAGE, PAGE, UADDR + 2 * PAGE);
+
+    /* Adjacent in the host, but not in guest memory */
+    vhost_dev_assign_memory(dev, 3 * PAGE, PAGE, UADDR + 3 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 3);
+    check_region(data, 2, 3 * PAGE, PAGE, UADDR + 3 * PAGE);
+}
+
+static bool test_vhost_mem_refuse_merge(struct vhost_dev *dev,
+                                        uint64_t start1, uint64_t size1,
+                                        uint64_t start2, uint64_t size2)
+{
+    return false;
+}
+
+static void test_vhost_mem_backend_no_merge(TestVhostMemData *data,
+                                            const void *unused)
+{
+    struct vhost_dev *dev = &data->dev;
+
+    data->ops.vhost_backend_can_merge = test_vhost_mem_refuse_merge;
+    vhost_dev_assign_memory(dev, 0, PAGE, UADDR);
+    vhost_dev_assign_memory(dev, PAGE, PAGE, UADDR + PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 2);
+    check_region(data, 0, 0, PAGE, UADDR);
+    check_region(data, 1, PAGE, PAGE, UADDR + PAGE);
+}
+
+static void test_vhost_mem_split(TestVhostMemData *data, const void *unused)
+{
+    struct vhost_dev *dev = &data->dev;
+
+    vhost_dev_assign_memory(dev, 0, 8 * PAGE, UADDR);
+    vhost_dev_unassign_memory(dev, 2 * PAGE, 3 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 2);
+    check_region(data, 0, 0, 2 * PAGE, UADDR);
+    check_region(data, 1, 5 * PAGE, 3 * PAGE, UADDR + 5 * PAGE);
+
+    /* Putting the same memory back merges the pieces again */
+    vhost_dev_assign_memory(dev, 2 * PAGE, 3 * PAGE, UADDR + 2 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 1);
+    check_region(data, 0, 0, 8 * PAGE, UADDR);
+}
+
+static void test_vhost_mem_unassign_span(TestVhostMemData *data,
+                                         const void *unused)
+{
+    struct vhost_dev *dev = &data->dev;
+    int i;
+
+    for (i = 0; i < 4; i++) {
+        vhost_dev_assign_memory(dev, i * 4 * PAGE, 2 * PAGE,
+                                UADDR + i * 4 * PAGE);
+    }
+    g_assert_cmpint(dev->mem->nregions, ==, 4);
+
+    /* Trims the tail of the first region, drops the two in the middle
+     * and trims the head of the last one */
+    vhost_dev_unassign_memory(dev, PAGE, 12 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 2);
+    check_region(data, 0, 0, PAGE, UADDR);
+    check_region(data, 1, 13 * PAGE, PAGE, UADDR + 13 * PAGE);
+
+    /* Nothing to do in a hole */
+    vhost_dev_unassign_memory(dev, 4 * PAGE, 4 * PAGE);
+    vhost_dev_unassign_memory(dev, 32 * PAGE, 4 * PAGE);
+    g_assert_cmpint(dev->mem->nregions, ==, 2);
+}
+
+static void test_vhost_mem_find(TestVhostMemData *data, const void *unused)
+{
+    struct vhost_dev *dev = &data->dev;
+
+    g_assert(!vhost_dev_find_reg(dev, 0, PAGE));
+    vhost_dev_assign_memory(dev, 2 * PAGE, 2 * PAGE, UADDR);
+    vhost_dev_assign_memory(dev, 8 * PAGE, 2 * PAGE, UADDR + 8 * PAGE);
+
+    g_assert(!vhost_dev_find_reg(dev, 0, 2 * PAGE));
+    g_assert(!vhost_dev_find_reg(dev, 4 * PAGE, 4 * PAGE));
+    g_assert(!vhost_dev_find_reg(dev, 10 * PAGE, PAGE));
+    g_assert(vhost_dev_find_reg(dev, PAGE, 2 * PAGE) ==
+             dev->mem->regions);
+    g_assert(vhost_dev_find_reg(dev, 9 * PAGE, PAGE) ==
+             dev->mem->regions + 1);
+    g_assert(vhost_dev_find_reg(dev, 7 * PAGE, 4 * PAGE) ==
+             dev->mem->regions + 1);
+}
+
+/* Apply random updates and check them page by page against a flat model.
+ * Without a backend hook, regions that touch in both guest and host
+ * memory must also have been merged. */
+static void vhost_mem_random_updates(TestVhostMemData *data)
+{
+    struct vhost_dev *dev = &data->dev;
+    uint64_t model[NPAGES] = { 0 };     /* host address + 1, or 0 */
+    int n;
+
+    for (n = 0; n < 20000; n++) {
+        uint64_t seen[NPAGES] = { 0 };
+        uint64_t start = g_test_rand_int_range(0, NPAGES);
+        uint64_t npages = g_test_rand_int_range(1, NPAGES - start + 1);
+        bool assign = g_test_rand_bit();
+        uint64_t uaddr = UADDR + g_test_rand_int_range(0, 4) * 8 * PAGE +
+                         (g_test_rand_bit() ? start * PAGE : 0);
+        uint64_t p;
+        int i;
+
+        vhost_dev_unassign_memory(dev, start * PAGE, npages * PAGE);
+        if (assign) {
+            vhost_dev_assign_memory(dev, start * PAGE, npages * PAGE, uaddr);
+        }
+        for (p = 0; p < npages; p++) {
+            model[start + p] = assign ? uaddr + p * PAGE + 1 : 0;
+        }
+
+        for (i = 0; i < dev->mem->nregions; i++) {
+            struct vhost_memory_region *reg = dev->mem->regions + i;
+            uint64_t addr;
+
+            g_assert_cmphex(reg->memory_size, !=, 0);
+            if (i > 0) {
+                struct vhost_memory_region *prev = reg - 1;
+
+                g_assert_cmphex(prev->guest_phys_addr + prev->memory_size,
+                                <=, reg->guest_phys_addr);
+                g_assert(data->ops.vhost_backend_can_merge ||
+                         prev->guest_phys_addr + prev->memory_size !=
+                         reg->guest_phys_addr ||
+                         prev->userspace_addr + prev->memory_size !=
+                         reg->userspace_addr);
+            }
+            for (addr = reg->guest_phys_addr;
+                 addr < reg->guest_phys_addr + reg->memory_size;
+                 addr += PAGE) {
+                seen[addr / PAGE] = reg->userspace_addr +
+                                    addr - reg->guest_phys_addr + 1;
+            }
+            g_assert(vhost_dev_find_reg(dev, reg->guest_phys_addr, 1) == reg);
+        }
+        for (p = 0; p < NPAGES; p++) {
+            g_assert_cmphex(seen[p], ==, model[p]);
+        }
+    }
+}
+
+static void test_vhost_mem_random(TestVhostMemData *data, const void *unused)
+{
+    vhost_mem_random_updates(data);
+}
+
+/* Host addresses in different 16 page windows are never merged */
+static bool test_vhost_mem_window_merge(struct vhost_dev *dev,
+                                        uint64_t start1, uint64_t size1,
+                                        uint64_t start2, uint64_t size2)
+{
+    return start1 / (16 * PAGE) == start2 / (16 * PAGE);
+}
+
+static void test_vhost_mem_random_backend(TestVhostMemData *data,
+                                          const void *unused)
+{
+    data->ops.vhost_backend_can_merge = test_vhost_mem_window_merge;
+    vhost_mem_random_updates(data);
+}
+
+/* Any non-NULL MemoryRegion will do, the sections only carry it */
+static MemoryRegion test_section_mr;
+
+static void add_section(struct vhost_dev *dev, uint64_t page)
+{
+    MemoryRegionSection section = {
+        .mr = &test_section_mr,
+        .offset_within_address_space = page * PAGE,
+        .size = int128_make64(PAGE),
+    };
+
+    vhost_dev_add_section(dev, &section);
+}
+
+static bool del_section(struct vhost_dev *dev, uint64_t page)
+{
+    MemoryRegionSection section = {
+        .mr = &test_section_mr,
+        .offset_within_address_space = page * PAGE,
+        .size = int128_make64(PAGE),
+    };
+
+    return vhost_dev_del_section(dev, &section);
+}
+
+/* Random transactions against a flat model; after each commit the
+ * sections are exactly the live ones, in address order */
+static void test_vhost_mem_sections(TestVhostMemData *data,
+                                    const void *unused)
+{
+    struct vhost_dev *dev = &data->dev;
+    bool model[NPAGES] = { false };
+    int n, k, i;
+
+    for (n = 0; n < 2000; n++) {
+        for (k = g_test_rand_int_range(1, 16); k > 0; k--) {
+            uint64_t page = g_test_rand_int_range(0, NPAGES);
+
+            if (model[page]) {
+                g_assert(del_section(dev, page));
+                model[page] = false;
+            } else {
+                g_assert(!del_section(dev, page));
+                add_section(dev, page);
+                model[page] = true;
+            }
+        }
+        vhost_dev_commit_sections(dev);
+
+        i = 0;
+        for (k = 0; k < NPAGES; k++) {
+            if (!model[k]) {
+                continue;
+            }
+            g_assert_cmpint(i, <, dev->n_mem_sections);
+            g_assert(dev->mem_sections[i].mr == &test_section_mr);
+            g_assert_cmphex(dev->mem_sections[i].offset_within_address_space,
+                            ==, k * PAGE);
+            i++;
+        }
+        g_assert_cmpint(i, ==, dev->n_mem_sections);
+        g_assert_cmpint(dev->n_mem_sections, <=, dev->mem_sections_alloc);
+    }
+}
+
+static void vhost_mem_test_add(const char *testpath,
+                               void (*test_func)(TestVhostMemData *data,
+                                                 const void *user_data))
+{
+    g_test_add(testpath, TestVhostMemData, NULL, vhost_mem_test_init,
+               test_func, vhost_mem_test_teardown);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    vhost_mem_test_add("/vhost/memory/merge", test_vhost_mem_merge);
+    vhost_mem_test_add("/vhost/memory/no-merge", test_vhost_mem_no_merge);
+    vhost_mem_test_add("/vhost/memory/backend-no-merge",
+                       test_vhost_mem_backend_no_merge);
+    vhost_mem_test_add("/vhost/memory/split", test_vhost_mem_split);
+    vhost_mem_test_add("/vhost/memory/unassign-span",
+                       test_vhost_mem_unassign_span);
+    vhost_mem_test_add("/vhost/memory/find", test_vhost_mem_find);
+    vhost_mem_test_add("/vhost/memory/random", test_vhost_mem_random);
+    vhost_mem_test_add("/vhost/memory/random/backend",
+                       test_vhost_mem_random_backend);
+    vhost_mem_test_add("/vhost/memory/sections", test_vhost_mem_sections);
+    g_test_run();
+
+    return 0;
+}
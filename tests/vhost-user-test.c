@@ -49,6 +49,9 @@
 
 #define VHOST_USER_F_PROTOCOL_FEATURES 30
 #define VHOST_USER_PROTOCOL_F_LOG_SHMFD 1
+#define VHOST_USER_PROTOCOL_F_REPLY_ACK 3
+#define VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD 12
+#define VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS 15
 
 #define VHOST_LOG_PAGE 0x1000
 
@@ -71,6 +74,10 @@ typedef enum VhostUserRequest {
     VHOST_USER_GET_PROTOCOL_FEATURES = 15,
     VHOST_USER_SET_PROTOCOL_FEATURES = 16,
     VHOST_USER_SET_VRING_ENABLE = 18,
+    VHOST_USER_GET_INFLIGHT_FD = 31,
+    VHOST_USER_SET_INFLIGHT_FD = 32,
+    VHOST_USER_ADD_MEM_REG = 37,
+    VHOST_USER_REM_MEM_REG = 38,
     VHOST_USER_MAX
 } VhostUserRequest;
 
@@ -87,16 +94,29 @@ typedef struct VhostUserMemory {
     VhostUserMemoryRegion regions[VHOST_MEMORY_MAX_NREGIONS];
 } VhostUserMemory;
 
+typedef struct VhostUserMemRegMsg {
+    uint64_t padding;
+    VhostUserMemoryRegion region;
+} VhostUserMemRegMsg;
+
 typedef struct VhostUserLog {
     uint64_t mmap_size;
     uint64_t mmap_offset;
 } VhostUserLog;
 
+typedef struct VhostUserInflight {
+    uint64_t mmap_size;
+    uint64_t mmap_offset;
+    uint16_t num_queues;
+    uint16_t queue_size;
+} VhostUserInflight;
+
 typedef struct VhostUserMsg {
     VhostUserRequest request;
 
 #define VHOST_USER_VERSION_MASK     (0x3)
 #define VHOST_USER_REPLY_MASK       (0x1<<2)
+#define VHOST_USER_NEED_REPLY_MASK  (0x1<<3)
     uint32_t flags;
     uint32_t size; /* the following payload size */
     union {
@@ -106,7 +126,9 @@ typedef struct VhostUserMsg {
         struct vhost_vring_state state;
         struct vhost_vring_addr addr;
         VhostUserMemory memory;
+        VhostUserMemRegMsg mem_reg;
         VhostUserLog log;
+        VhostUserInflight inflight;
     } payload;
 } QEMU_PACKED VhostUserMsg;
 
@@ -133,6 +155,19 @@ typedef struct TestServer {
     GCond data_cond;
     int log_fd;
     uint64_t rings;
+    uint64_t features;
+    uint64_t started;
+    uint32_t vring_base[2];
+    uint64_t used_addr[2];
+    int inflight_fd;
+    uint64_t inflight_size;
+    int inflight_gets;
+    uint64_t protocol_features;
+    int mem_tables;
+    int mem_reg_adds;
+    int mem_reg_rems;
+    uint64_t mem_reg_reply;
+    VhostUserMemoryRegion mem_reg_last;
 } TestServer;
 
 #if !GLIB_CHECK_VERSION(2, 32, 0)
@@ -223,6 +258,20 @@ static void *thread_function(void *data)
     return NULL;
 }
 
+static int inflight_region_new(void)
+{
+    gchar *path = g_strdup_printf("%s/inflight-XXXXXX", tmpfs);
+    int fd;
+
+    fd = mkstemp(path);
+    g_assert(fd >= 0);
+    unlink(path);
+    g_free(path);
+    g_assert_cmpint(ftruncate(fd, getpagesize()), ==, 0);
+
+    return fd;
+}
+
 static int chr_can_read(void *opaque)
 {
     return VHOST_USER_HDR_SIZE;
@@ -263,13 +312,14 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
     case VHOST_USER_SET_FEATURES:
 	g_assert_cmpint(msg.payload.u64 & (0x1ULL << VHOST_USER_F_PROTOCOL_FEATURES),
 			!=, 0ULL);
+        s->features = msg.payload.u64;
         break;
 
     case VHOST_USER_GET_PROTOCOL_FEATURES:
         /* send back features to qemu */
         msg.flags |= VHOST_USER_REPLY_MASK;
         msg.size = sizeof(m.payload.u64);
-        msg.payload.u64 = 1 << VHOST_USER_PROTOCOL_F_LOG_SHMFD;
+        msg.payload.u64 = s->protocol_features;
         p = (uint8_t *) &msg;
         qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
         break;
@@ -290,6 +340,7 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
         /* received the mem table */
         memcpy(&s->memory, &msg.payload.memory, sizeof(msg.payload.memory));
         s->fds_num = qemu_chr_fe_get_msgfds(chr, s->fds, G_N_ELEMENTS(s->fds));
+        s->mem_tables++;
 
         /* signal the test that it can continue */
         g_cond_signal(&s->data_cond);
@@ -305,6 +356,17 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
          * so revert it back to non-blocking.
          */
         qemu_set_nonblock(fd);
+
+        /* the kick fd is the last thing a ring needs to start */
+        if (msg.request == VHOST_USER_SET_VRING_KICK) {
+            s->started |= 0x1ULL << (msg.payload.u64 & VHOST_USER_VRING_IDX_MASK);
+            g_cond_signal(&s->data_cond);
+        }
+        break;
+
+    case VHOST_USER_SET_VRING_ADDR:
+        assert(msg.payload.addr.index < 2);
+        s->used_addr[msg.payload.addr.index] = msg.payload.addr.used_user_addr;
         break;
 
     case VHOST_USER_SET_LOG_BASE:
@@ -324,6 +386,53 @@ static void chr_read(void *opaque, const uint8_t *buf, int size)
     case VHOST_USER_SET_VRING_BASE:
         assert(msg.payload.state.index < 2);
         s->rings |= 0x1ULL << msg.payload.state.index;
+        s->vring_base[msg.payload.state.index] = msg.payload.state.num;
+        break;
+
+    case VHOST_USER_ADD_MEM_REG:
+    case VHOST_USER_REM_MEM_REG:
+        if (msg.request == VHOST_USER_ADD_MEM_REG) {
+            qemu_chr_fe_get_msgfds(chr, &fd, 1);
+            close(fd);
+            s->mem_reg_adds++;
+            s->mem_reg_last = msg.payload.mem_reg.region;
+        } else {
+            s->mem_reg_rems++;
+        }
+
+        g_assert(msg.flags & VHOST_USER_NEED_REPLY_MASK);
+        msg.flags &= ~VHOST_USER_NEED_REPLY_MASK;
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.payload.u64);
+        msg.payload.u64 = s->mem_reg_reply;
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+
+        g_cond_signal(&s->data_cond);
+        break;
+
+    case VHOST_USER_GET_INFLIGHT_FD:
+        /* hand qemu a zeroed region that outlives this connection */
+        fd = inflight_region_new();
+        msg.flags |= VHOST_USER_REPLY_MASK;
+        msg.size = sizeof(m.payload.inflight);
+        msg.payload.inflight.mmap_size = getpagesize();
+        msg.payload.inflight.mmap_offset = 0;
+        qemu_chr_fe_set_msgfds(chr, &fd, 1);
+        p = (uint8_t *) &msg;
+        qemu_chr_fe_write_all(chr, p, VHOST_USER_HDR_SIZE + msg.size);
+        close(fd);
+        s->inflight_gets++;
+        break;
+
+    case VHOST_USER_SET_INFLIGHT_FD:
+        if (s->inflight_fd != -1) {
+            close(s->inflight_fd);
+            s->inflight_fd = -1;
+        }
+        qemu_chr_fe_get_msgfds(chr, &s->inflight_fd, 1);
+        s->inflight_size = msg.payload.inflight.mmap_size;
+        g_assert_cmpint(msg.payload.inflight.mmap_offset, ==, 0);
         break;
 
     default:
@@ -379,6 +488,9 @@ static TestServer *test_server_new(const gchar *name)
     g_cond_init(&server->data_cond);
 
     server->log_fd = -1;
+    server->inflight_fd = -1;
+    server->protocol_features = 1 << VHOST_USER_PROTOCOL_F_LOG_SHMFD |
+                                1 << VHOST_USER_PROTOCOL_F_INFLIGHT_SHMFD;
 
     return server;
 }
@@ -405,6 +517,10 @@ static gboolean _test_server_free(TestServer *server)
         close(server->log_fd);
     }
 
+    if (server->inflight_fd != -1) {
+        close(server->inflight_fd);
+    }
+
     unlink(server->socket_path);
     g_free(server->socket_path);
 
@@ -605,6 +721,269 @@ static void test_migrate(void)
     global_qtest = global;
 }
 
+static void wait_for_rings_started(TestServer *s)
+{
+    gint64 end_time;
+
+    g_mutex_lock(&s->data_mutex);
+    end_time = g_get_monotonic_time() + 10 * G_TIME_SPAN_SECOND;
+    while (s->started != 0x3) {
+        if (!g_cond_wait_until(&s->data_cond, &s->data_mutex, end_time)) {
+            /* timeout has passed */
+            g_assert_cmphex(s->started, ==, 0x3);
+            break;
+        }
+    }
+
+    g_mutex_unlock(&s->data_mutex);
+}
+
+/* Drop the connection and listen again, as a restarted backend would */
+static gboolean test_server_restart(gpointer data)
+{
+    TestServer *s = data;
+    gchar *chr_path;
+
+    qemu_chr_delete(s->chr);
+
+    chr_path = g_strdup_printf("unix:%s,server,nowait", s->socket_path);
+    s->chr = qemu_chr_new(s->chr_name, chr_path, NULL);
+    g_free(chr_path);
+
+    qemu_chr_add_handlers(s->chr, chr_can_read, chr_read, NULL, s);
+
+    return FALSE;
+}
+
+static uint64_t guest_phys_addr(TestServer *s, uint64_t uaddr)
+{
+    int i;
+
+    for (i = 0; i < s->memory.nregions; i++) {
+        VhostUserMemoryRegion *reg = &s->memory.regions[i];
+
+        if (uaddr >= reg->userspace_addr &&
+            uaddr - reg->userspace_addr < reg->memory_size) {
+            return reg->guest_phys_addr + uaddr - reg->userspace_addr;
+        }
+    }
+    g_assert_not_reached();
+}
+
+static void test_reconnect(void)
+{
+    TestServer *s = test_server_new("reconnect");
+    QTestState *global = global_qtest, *from;
+    uint64_t features, used[2];
+    uint32_t base[2], *inflight;
+    gchar *cmd;
+    int i;
+
+    cmd = g_strdup_printf(QEMU_CMD_ACCEL QEMU_CMD_MEM QEMU_CMD_CHR
+                          ",reconnect=1" QEMU_CMD_NETDEV QEMU_CMD_NET,
+                          2, 2, root, s->chr_name, s->socket_path,
+                          s->chr_name);
+    from = qtest_start(cmd);
+    g_free(cmd);
+
+    wait_for_rings_started(s);
+
+    g_mutex_lock(&s->data_mutex);
+    features = s->features;
+    g_assert_cmpint(s->inflight_gets, ==, 1);
+    g_assert_cmpint(s->inflight_fd, !=, -1);
+
+    /* record a request as inflight, the way a backend would */
+    inflight = mmap(0, s->inflight_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    s->inflight_fd, 0);
+    g_assert(inflight != MAP_FAILED);
+    inflight[0] = 0x12345678;
+    munmap(inflight, s->inflight_size);
+
+    s->started = 0;
+    s->features = 0;
+    g_mutex_unlock(&s->data_mutex);
+
+    g_idle_add(test_server_restart, s);
+    wait_for_rings_started(s);
+
+    g_mutex_lock(&s->data_mutex);
+    /* the new backend gets what the guest acked from the old one... */
+    g_assert_cmphex(s->features, ==, features);
+
+    /* ...the inflight region it left behind, rather than a new one... */
+    g_assert_cmpint(s->inflight_gets, ==, 1);
+    inflight = mmap(0, s->inflight_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    s->inflight_fd, 0);
+    g_assert(inflight != MAP_FAILED);
+    g_assert_cmphex(inflight[0], ==, 0x12345678);
+    munmap(inflight, s->inflight_size);
+
+    for (i = 0; i < 2; i++) {
+        base[i] = s->vring_base[i];
+        used[i] = guest_phys_addr(s, s->used_addr[i]);
+    }
+    g_mutex_unlock(&s->data_mutex);
+
+    /* ...and, since the old ring state could not be queried, the used
+     * index in guest memory as the ring base */
+    for (i = 0; i < 2; i++) {
+        g_assert_cmpint(base[i], ==, readw(used[i] + 2));
+    }
+
+    qtest_quit(from);
+    test_server_free(s);
+
+    global_qtest = global;
+}
+
+/* Wait until *@counter, updated by the server, reaches @value */
+static void wait_for_count(TestServer *s, int *counter, int value)
+{
+    gint64 end_time;
+
+    g_mutex_lock(&s->data_mutex);
+    end_time = g_get_monotonic_time() + 5 * G_TIME_SPAN_SECOND;
+    while (*counter < value) {
+        if (!g_cond_wait_until(&s->data_cond, &s->data_mutex, end_time)) {
+            /* timeout has passed */
+            g_assert_cmpint(*counter, >=, value);
+            break;
+        }
+    }
+    g_mutex_unlock(&s->data_mutex);
+}
+
+static void dimm_add(const char *id, const char *memdev)
+{
+    QDict *rsp;
+    gchar *cmd;
+
+    cmd = g_strdup_printf("{ 'execute': 'device_add',"
+                          "  'arguments': { 'driver': 'pc-dimm',"
+                          "    'id': '%s', 'memdev': '%s' } }", id, memdev);
+    rsp = qmp(cmd);
+    g_free(cmd);
+    g_assert(qdict_haskey(rsp, "return"));
+    QDECREF(rsp);
+}
+
+/* A hotplugged DIMM reaches a slave that takes single region updates as
+ * one acknowledged VHOST_USER_ADD_MEM_REG.  If the slave refuses one, it
+ * gets the whole table instead. */
+static void test_mem_hotplug(void)
+{
+    TestServer *s = test_server_new("hotplug");
+    QTestState *global = global_qtest, *from;
+    int mem_tables, dimms = 0, i;
+    gchar *cmd;
+
+    s->protocol_features |= 1 << VHOST_USER_PROTOCOL_F_REPLY_ACK |
+                            1 << VHOST_USER_PROTOCOL_F_CONFIGURE_MEM_SLOTS;
+
+    cmd = g_strdup_printf(QEMU_CMD_ACCEL " -m 2,slots=2,maxmem=1G"
+                          " -object memory-backend-file,id=mem,size=2M,"
+                          "mem-path=%s,share=on -numa node,memdev=mem"
+                          " -object memory-backend-file,id=mem1,size=128M,"
+                          "mem-path=%s,share=on"
+                          " -object memory-backend-file,id=mem2,size=128M,"
+                          "mem-path=%s,share=on"
+                          QEMU_CMD_CHR QEMU_CMD_NETDEV QEMU_CMD_NET,
+                          root, root, root, s->chr_name, s->socket_path,
+                          s->chr_name);
+    from = qtest_start(cmd);
+    g_free(cmd);
+
+    wait_for_rings_started(s);
+    g_mutex_lock(&s->data_mutex);
+    mem_tables = s->mem_tables;
+    g_mutex_unlock(&s->data_mutex);
+
+    dimm_add("dimm1", "mem1");
+    wait_for_count(s, &s->mem_reg_adds, 1);
+    g_mutex_lock(&s->data_mutex);
+    g_assert_cmphex(s->mem_reg_last.memory_size, ==, 128 << 20);
+    g_assert_cmpint(s->mem_reg_rems, ==, 0);
+    g_assert_cmpint(s->mem_tables, ==, mem_tables);
+    s->mem_reg_reply = 1;
+    g_mutex_unlock(&s->data_mutex);
+
+    dimm_add("dimm2", "mem2");
+    wait_for_count(s, &s->mem_tables, mem_tables + 1);
+    g_mutex_lock(&s->data_mutex);
+    g_assert_cmpint(s->mem_reg_adds, ==, 2);
+    for (i = 0; i < s->memory.nregions; i++) {
+        if (s->memory.regions[i].memory_size == 128 << 20) {
+            dimms++;
+        }
+    }
+    g_assert_cmpint(dimms, ==, 2);
+    g_mutex_unlock(&s->data_mutex);
+
+    qtest_quit(from);
+    test_server_free(s);
+
+    global_qtest = global;
+}
+
+/* Each DIMM is a separate RAMBlock.  The slave must get the file and offset
+ * of the right one for each region, which QEMU finds from the host address
+ * of the region. */
+static void test_read_guest_mem_dimms(void)
+{
+    TestServer *s = test_server_new("dimms");
+    QTestState *global = global_qtest, *from;
+    GString *cmd = g_string_new(NULL);
+    uint32_t *guest_mem;
+    int dimms = 0, i, j;
+    size_t size;
+
+    g_string_printf(cmd, QEMU_CMD_ACCEL " -m 2,slots=4,maxmem=1G"
+                    " -object memory-backend-file,id=mem,size=2M,"
+                    "mem-path=%s,share=on -numa node,memdev=mem", root);
+    for (i = 1; i <= 4; i++) {
+        g_string_append_printf(cmd, " -object memory-backend-file,id=mem%d,"
+                               "size=16M,mem-path=%s,share=on"
+                               " -device pc-dimm,id=dimm%d,memdev=mem%d",
+                               i, root, i, i);
+    }
+    g_string_append_printf(cmd, QEMU_CMD_CHR QEMU_CMD_NETDEV QEMU_CMD_NET,
+                           s->chr_name, s->socket_path, s->chr_name);
+    from = qtest_start(cmd->str);
+    g_string_free(cmd, true);
+
+    wait_for_rings_started(s);
+    g_mutex_lock(&s->data_mutex);
+    for (i = 0; i < s->memory.nregions; i++) {
+        VhostUserMemoryRegion *region = &s->memory.regions[i];
+
+        if (region->memory_size != 16 << 20) {
+            continue;
+        }
+        dimms++;
+
+        for (j = 0; j < 256; j++) {
+            writel(region->guest_phys_addr + j * 4, (i << 16) + j);
+        }
+
+        size = region->memory_size + region->mmap_offset;
+        guest_mem = mmap(0, size, PROT_READ, MAP_SHARED, s->fds[i], 0);
+        g_assert(guest_mem != MAP_FAILED);
+        for (j = 0; j < 256; j++) {
+            g_assert_cmphex(guest_mem[region->mmap_offset / 4 + j], ==,
+                            (i << 16) + j);
+        }
+        munmap(guest_mem, size);
+    }
+    g_assert_cmpint(dimms, ==, 4);
+    g_mutex_unlock(&s->data_mutex);
+
+    qtest_quit(from);
+    test_server_free(s);
+
+    global_qtest = global;
+}
+
 int main(int argc, char **argv)
 {
     QTestState *s = NULL;
@@ -648,6 +1027,10 @@ int main(int argc, char **argv)
 
     qtest_add_data_func("/vhost-user/read-guest-mem", server, read_guest_mem);
     qtest_add_func("/vhost-user/migrate", test_migrate);
+    qtest_add_func("/vhost-user/reconnect", test_reconnect);
+    qtest_add_func("/vhost-user/mem-hotplug", test_mem_hotplug);
+    qtest_add_func("/vhost-user/read-guest-mem/dimms",
+                   test_read_guest_mem_dimms);
 
     ret = g_test_run();
 
@@ -422,6 +422,125 @@ static void pci_indirect(void)
     test_end();
 }
 
+#define BATCH_REQS              8
+
+/* Queue @n requests, each of them starting with @heads[i], and notify the
+ * device only once */
+static void virtqueue_kick_batch(const QVirtioBus *bus, QVirtioDevice *dev,
+                                 QVirtQueue *vq, uint32_t *heads, int n)
+{
+    uint16_t idx = readw(vq->avail + 2);
+    int i;
+
+    for (i = 0; i < n; i++) {
+        writew(vq->avail + 4 + 2 * ((idx + i) % vq->size), heads[i]);
+    }
+    writew(vq->avail + 2, idx + n);
+    bus->virtqueue_kick(dev, vq);
+}
+
+static void wait_used_idx(QVirtQueue *vq, uint16_t idx)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (readw(vq->used + 2) != idx) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_BLK_TIMEOUT_US);
+    }
+}
+
+/* Requests that arrive together are popped, and may be merged and completed,
+ * as one batch; each of them must still get its own status and data */
+static void pci_batch(void)
+{
+    QVirtioPCIDevice *dev;
+    QPCIBus *bus;
+    QVirtQueuePCI *vqpci;
+    QGuestAllocator *alloc;
+    QVirtioBlkReq req;
+    uint64_t req_addr[BATCH_REQS];
+    uint32_t heads[BATCH_REQS];
+    uint32_t features;
+    uint16_t idx;
+    char *data;
+    int i;
+
+    bus = pci_test_start();
+    dev = virtio_blk_pci_init(bus, PCI_SLOT);
+
+    alloc = pc_alloc_init();
+    vqpci = (QVirtQueuePCI *)qvirtqueue_setup(&qvirtio_pci, &dev->vdev,
+                                                                    alloc, 0);
+
+    features = qvirtio_get_features(&qvirtio_pci, &dev->vdev);
+    features = features & ~(QVIRTIO_F_BAD_FEATURE |
+                            QVIRTIO_F_RING_INDIRECT_DESC |
+                            QVIRTIO_F_RING_EVENT_IDX | QVIRTIO_BLK_F_SCSI);
+    qvirtio_set_features(&qvirtio_pci, &dev->vdev, features);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+
+    /* Adjacent writes, which the device can merge */
+    for (i = 0; i < BATCH_REQS; i++) {
+        req.type = QVIRTIO_BLK_T_OUT;
+        req.ioprio = 1;
+        req.sector = i;
+        req.data = g_malloc0(512);
+        sprintf(req.data, "TEST%d", i);
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+        g_free(req.data);
+
+        heads[i] = qvirtqueue_add(&vqpci->vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 16, 512, false, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 528, 1, true, false);
+    }
+    idx = readw(vqpci->vq.used + 2);
+    virtqueue_kick_batch(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                         heads, BATCH_REQS);
+    wait_used_idx(&vqpci->vq, idx + BATCH_REQS);
+    for (i = 0; i < BATCH_REQS; i++) {
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        guest_free(alloc, req_addr[i]);
+    }
+
+    /* Read them back in reverse order */
+    for (i = 0; i < BATCH_REQS; i++) {
+        req.type = QVIRTIO_BLK_T_IN;
+        req.ioprio = 1;
+        req.sector = BATCH_REQS - 1 - i;
+        req.data = g_malloc0(512);
+        req_addr[i] = virtio_blk_request(alloc, &req, 512);
+        g_free(req.data);
+
+        heads[i] = qvirtqueue_add(&vqpci->vq, req_addr[i], 16, false, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 16, 512, true, true);
+        qvirtqueue_add(&vqpci->vq, req_addr[i] + 528, 1, true, false);
+    }
+    idx = readw(vqpci->vq.used + 2);
+    virtqueue_kick_batch(&qvirtio_pci, &dev->vdev, &vqpci->vq,
+                         heads, BATCH_REQS);
+    wait_used_idx(&vqpci->vq, idx + BATCH_REQS);
+    data = g_malloc0(512);
+    for (i = 0; i < BATCH_REQS; i++) {
+        char expected[16];
+
+        g_assert_cmpint(readb(req_addr[i] + 528), ==, 0);
+        memread(req_addr[i] + 16, data, 512);
+        sprintf(expected, "TEST%d", BATCH_REQS - 1 - i);
+        g_assert_cmpstr(data, ==, expected);
+        guest_free(alloc, req_addr[i]);
+    }
+    g_free(data);
+
+    /* End test */
+    guest_free(alloc, vqpci->vq.desc);
+    pc_alloc_uninit(alloc);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    test_end();
+}
+
 static void pci_config(void)
 {
     QVirtioPCIDevice *dev;
@@ -772,6 +891,7 @@ int main(int argc, char **argv)
     if (strcmp(arch, "i386") == 0 || strcmp(arch, "x86_64") == 0) {
         qtest_add_func("/virtio/blk/pci/basic", pci_basic);
         qtest_add_func("/virtio/blk/pci/indirect", pci_indirect);
+        qtest_add_func("/virtio/blk/pci/batch", pci_batch);
         qtest_add_func("/virtio/blk/pci/config", pci_config);
         qtest_add_func("/virtio/blk/pci/msix", pci_msix);
         qtest_add_func("/virtio/blk/pci/idx", pci_idx);
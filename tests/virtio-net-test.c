@@ -20,6 +20,7 @@
 #include "libqos/malloc-pc.h"
 #include "libqos/malloc-generic.h"
 #include "qemu/bswap.h"
+#include "qapi/qmp/types.h"
 #include "hw/virtio/virtio-net.h"
 
 #define PCI_SLOT_HP             0x06
@@ -29,6 +30,20 @@
 #define QVIRTIO_NET_TIMEOUT_US (30 * 1000 * 1000)
 #define VNET_HDR_SIZE sizeof(struct virtio_net_hdr_mrg_rxbuf)
 
+/* Long enough that only an explicit clock_step() fires the RSC timer */
+#define RSC_TIMER_NS            (1000 * 1000 * 1000)
+#define RSC_NBUFS               16
+#define RSC_BUF_SIZE            2048
+#define RSC_MSS                 100
+#define RSC_HDR_LEN             (14 + 20 + 32)  /* Ethernet, IP, TCP + TS */
+#define RSC_ACK                 0x10
+#define RSC_ACK_PSH             (RSC_ACK | 0x08)
+
+#define FB_NFRAMES              8
+#define FB_BUF_SIZE             4096
+#define FB_LARGE_FRAME          3000    /* does not fit a pooled packet */
+#define FB_INTERVAL_US          1000
+
 static void test_end(void)
 {
     qtest_end();
@@ -52,12 +67,14 @@ static QVirtioPCIDevice *virtio_net_pci_init(QPCIBus *bus, int slot)
     return dev;
 }
 
-static QPCIBus *pci_test_start(int socket)
+static QPCIBus *pci_test_start(const char *netdev, int socket,
+                               const char *extra_opts)
 {
     char *cmdline;
 
-    cmdline = g_strdup_printf("-netdev socket,fd=%d,id=hs0 -device "
-                              "virtio-net-pci,netdev=hs0", socket);
+    cmdline = g_strdup_printf("-netdev %s,fd=%d,id=hs0 -device "
+                              "virtio-net-pci,netdev=hs0%s", netdev, socket,
+                              extra_opts);
     qtest_start(cmdline);
     g_free(cmdline);
 
@@ -182,6 +199,57 @@ static void rx_stop_cont_test(const QVirtioBus *bus, QVirtioDevice *dev,
     guest_free(alloc, req_addr);
 }
 
+static void dataplane_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                           QGuestAllocator *alloc, QVirtQueue *rvq,
+                           QVirtQueue *tvq, int socket)
+{
+    uint8_t frame[64], buffer[64];
+    uint64_t req_addr;
+    uint32_t free_head;
+    QDict *response;
+    int i, ret;
+
+    for (i = 0; i < sizeof(frame); i++) {
+        frame[i] = i < 6 ? 0xff : i;
+    }
+
+    /* Receive, from the tap fd handler in the IOThread */
+    req_addr = guest_alloc(alloc, VNET_HDR_SIZE + sizeof(frame));
+    free_head = qvirtqueue_add(rvq, req_addr, VNET_HDR_SIZE + sizeof(frame),
+                               true, false);
+    qvirtqueue_kick(bus, dev, rvq, free_head);
+
+    ret = send(socket, frame, sizeof(frame), 0);
+    g_assert_cmpint(ret, ==, sizeof(frame));
+
+    qvirtio_wait_queue_isr(bus, dev, rvq, QVIRTIO_NET_TIMEOUT_US);
+    memread(req_addr + VNET_HDR_SIZE, buffer, sizeof(buffer));
+    g_assert(!memcmp(buffer, frame, sizeof(frame)));
+    guest_free(alloc, req_addr);
+
+    /* Transmit, from the host notifier in the IOThread */
+    req_addr = guest_alloc(alloc, VNET_HDR_SIZE + sizeof(frame));
+    memwrite(req_addr + VNET_HDR_SIZE, frame, sizeof(frame));
+    free_head = qvirtqueue_add(tvq, req_addr, VNET_HDR_SIZE + sizeof(frame),
+                               false, false);
+    qvirtqueue_kick(bus, dev, tvq, free_head);
+
+    qvirtio_wait_queue_isr(bus, dev, tvq, QVIRTIO_NET_TIMEOUT_US);
+    guest_free(alloc, req_addr);
+
+    memset(buffer, 0, sizeof(buffer));
+    ret = qemu_recv(socket, buffer, sizeof(buffer), 0);
+    g_assert_cmpint(ret, ==, sizeof(frame));
+    g_assert(!memcmp(buffer, frame, sizeof(frame)));
+
+    /* Netfilters would run in the main loop, so they are refused */
+    response = qmp("{ 'execute': 'object-add',"
+                   "  'arguments': { 'qom-type': 'filter-buffer', 'id': 'f0',"
+                   "    'props': { 'netdev': 'hs0', 'interval': 1000 } } }");
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+}
+
 static void send_recv_test(const QVirtioBus *bus, QVirtioDevice *dev,
                            QGuestAllocator *alloc, QVirtQueue *rvq,
                            QVirtQueue *tvq, int socket)
@@ -190,6 +258,69 @@ static void send_recv_test(const QVirtioBus *bus, QVirtioDevice *dev,
     tx_test(bus, dev, alloc, tvq, socket);
 }
 
+#define TX_BATCH_FRAMES         240
+#define TX_BATCH_FRAME_SIZE     1514
+
+static void recv_all(int socket, void *data, size_t len)
+{
+    char *buf = data;
+    ssize_t ret;
+
+    while (len > 0) {
+        ret = qemu_recv(socket, buf, len, 0);
+        g_assert_cmpint(ret, >, 0);
+        buf += ret;
+        len -= ret;
+    }
+}
+
+/* More frames than the socket takes at once are posted in one go, so the
+ * device has to hand the rest of its batch back to the ring and pop it
+ * again later.  With interrupts suppressed, only VIRTIO_F_NOTIFY_ON_EMPTY
+ * raises one at the end, and only if every popped element was accounted
+ * for. */
+static void tx_batch_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *rvq,
+                          QVirtQueue *tvq, int socket)
+{
+    uint64_t addr[TX_BATCH_FRAMES];
+    uint32_t free_head, len;
+    uint16_t idx = readw(tvq->avail + 2);
+    uint8_t frame[TX_BATCH_FRAME_SIZE];
+    int i;
+
+    g_assert(qvirtio_get_features(bus, dev) & QVIRTIO_F_NOTIFY_ON_EMPTY);
+    writew(tvq->avail, QVRING_AVAIL_F_NO_INTERRUPT);
+
+    memset(frame, 0, sizeof(frame));
+    for (i = 0; i < TX_BATCH_FRAMES; i++) {
+        addr[i] = guest_alloc(alloc, VNET_HDR_SIZE + TX_BATCH_FRAME_SIZE);
+        memset(frame, i, 16);
+        memwrite(addr[i] + VNET_HDR_SIZE, frame, 16);
+        free_head = qvirtqueue_add(tvq, addr[i],
+                                   VNET_HDR_SIZE + TX_BATCH_FRAME_SIZE,
+                                   false, false);
+        writew(tvq->avail + 4 + 2 * ((idx + i) % tvq->size), free_head);
+    }
+    writew(tvq->avail + 2, idx + TX_BATCH_FRAMES);
+    bus->virtqueue_kick(dev, tvq);
+
+    for (i = 0; i < TX_BATCH_FRAMES; i++) {
+        recv_all(socket, &len, sizeof(len));
+        g_assert_cmpint(ntohl(len), ==, TX_BATCH_FRAME_SIZE);
+        recv_all(socket, frame, TX_BATCH_FRAME_SIZE);
+        g_assert_cmpint(frame[0], ==, i);
+        g_assert_cmpint(frame[15], ==, i);
+    }
+
+    qvirtio_wait_queue_isr(bus, dev, tvq, QVIRTIO_NET_TIMEOUT_US);
+    g_assert_cmpint(readw(tvq->used + 2), ==, (uint16_t)(idx + TX_BATCH_FRAMES));
+
+    for (i = 0; i < TX_BATCH_FRAMES; i++) {
+        guest_free(alloc, addr[i]);
+    }
+}
+
 static void stop_cont_test(const QVirtioBus *bus, QVirtioDevice *dev,
                            QGuestAllocator *alloc, QVirtQueue *rvq,
                            QVirtQueue *tvq, int socket)
@@ -197,7 +328,506 @@ static void stop_cont_test(const QVirtioBus *bus, QVirtioDevice *dev,
     rx_stop_cont_test(bus, dev, alloc, rvq, socket);
 }
 
-static void pci_basic(gconstpointer data)
+#define RX_BATCH_FRAMES         8
+#define RX_BATCH_FRAME_SIZE     64
+
+/* While the VM is stopped the tap backend queues the first frame and stops
+ * reading; on 'cont' that one is flushed on its own and the rest are read
+ * in a single wakeup, so they reach virtio-net as one receive batch.  Each
+ * frame must land in its own buffer, in order, once the batch ends. */
+static void rx_batch_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *rvq,
+                          QVirtQueue *tvq, int socket)
+{
+    uint64_t addr[RX_BATCH_FRAMES];
+    uint32_t head[RX_BATCH_FRAMES];
+    uint8_t frame[RX_BATCH_FRAME_SIZE], buffer[RX_BATCH_FRAME_SIZE];
+    uint16_t idx = readw(rvq->used + 2);
+    uint64_t elem;
+    gint64 start_time;
+    int i, ret;
+
+    for (i = 0; i < RX_BATCH_FRAMES; i++) {
+        addr[i] = guest_alloc(alloc, VNET_HDR_SIZE + RX_BATCH_FRAME_SIZE);
+        head[i] = qvirtqueue_add(rvq, addr[i],
+                                 VNET_HDR_SIZE + RX_BATCH_FRAME_SIZE,
+                                 true, false);
+        qvirtqueue_kick(bus, dev, rvq, head[i]);
+    }
+
+    qmp_discard_response("{ 'execute' : 'stop'}");
+    memset(frame, 0xff, 6);
+    for (i = 0; i < RX_BATCH_FRAMES; i++) {
+        memset(frame + 6, i, sizeof(frame) - 6);
+        ret = send(socket, frame, sizeof(frame), 0);
+        g_assert_cmpint(ret, ==, sizeof(frame));
+    }
+    qmp_discard_response("{ 'execute' : 'query-status'}");
+    qmp_discard_response("{ 'execute' : 'cont'}");
+
+    start_time = g_get_monotonic_time();
+    while (readw(rvq->used + 2) != (uint16_t)(idx + RX_BATCH_FRAMES)) {
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+
+    for (i = 0; i < RX_BATCH_FRAMES; i++) {
+        /* vq->used->ring[idx + i] */
+        elem = rvq->used + 4 + 8 * ((idx + i) % rvq->size);
+        g_assert_cmpint(readl(elem), ==, head[i]);
+        g_assert_cmpint(readl(elem + 4), ==,
+                        VNET_HDR_SIZE + RX_BATCH_FRAME_SIZE);
+
+        memread(addr[i] + VNET_HDR_SIZE, buffer, sizeof(buffer));
+        g_assert_cmpint(buffer[6], ==, i);
+        g_assert_cmpint(buffer[RX_BATCH_FRAME_SIZE - 1], ==, i);
+        guest_free(alloc, addr[i]);
+    }
+}
+
+/* Receive segment coalescing.  The peer sends TCP segments of a single
+ * IPv4 flow; which of them reach the guest as one GSO buffer, and when,
+ * depends on the merge rules. */
+
+typedef struct RscRx {
+    QVirtQueue *vq;
+    uint64_t addr[RSC_NBUFS];
+    uint32_t head;
+    uint16_t used;
+} RscRx;
+
+static uint32_t rsc_csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += i & 1 ? buf[i] : buf[i] << 8;
+    }
+    return sum;
+}
+
+static uint16_t rsc_csum_finish(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return ~sum;
+}
+
+static size_t rsc_build_frame(uint8_t *buf, uint32_t seq, uint32_t ack,
+                              uint8_t flags, uint32_t tsval,
+                              size_t payload_len)
+{
+    static const uint8_t eth[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,     /* default MAC */
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+        0x08, 0x00,
+    };
+    uint8_t *ip = buf + sizeof(eth);
+    uint8_t *tcp = ip + 20;
+    size_t tcp_len = 32 + payload_len;
+    uint32_t sum;
+    size_t i;
+
+    memcpy(buf, eth, sizeof(eth));
+
+    memset(ip, 0, 20);
+    ip[0] = 0x45;
+    stw_be_p(ip + 2, 20 + tcp_len);
+    stw_be_p(ip + 6, 0x4000);                   /* DF */
+    ip[8] = 64;
+    ip[9] = 6;                                  /* TCP */
+    stl_be_p(ip + 12, 0x0a000001);
+    stl_be_p(ip + 16, 0x0a000002);
+    stw_be_p(ip + 10, rsc_csum_finish(rsc_csum_add(0, ip, 20)));
+
+    memset(tcp, 0, 32);
+    stw_be_p(tcp, 1234);
+    stw_be_p(tcp + 2, 5678);
+    stl_be_p(tcp + 4, seq);
+    stl_be_p(tcp + 8, ack);
+    tcp[12] = 8 << 4;
+    tcp[13] = flags;
+    stw_be_p(tcp + 14, 0xffff);
+    tcp[20] = 1;                                /* NOP, NOP, timestamp */
+    tcp[21] = 1;
+    tcp[22] = 8;
+    tcp[23] = 10;
+    stl_be_p(tcp + 24, tsval);
+    for (i = 0; i < payload_len; i++) {
+        tcp[32 + i] = seq + i;
+    }
+
+    sum = rsc_csum_add(0, ip + 12, 8);
+    sum += 6 + tcp_len;
+    sum = rsc_csum_add(sum, tcp, tcp_len);
+    stw_be_p(tcp + 16, rsc_csum_finish(sum));
+
+    return sizeof(eth) + 20 + tcp_len;
+}
+
+static void rsc_send(int socket, uint32_t seq, uint32_t ack, uint8_t flags,
+                     uint32_t tsval, size_t payload_len, bool bad_csum)
+{
+    uint8_t frame[RSC_HDR_LEN + RSC_MSS];
+    uint32_t len;
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = frame,
+        },
+    };
+    int ret;
+
+    g_assert_cmpint(payload_len, <=, RSC_MSS);
+    iov[1].iov_len = rsc_build_frame(frame, seq, ack, flags, tsval,
+                                     payload_len);
+    if (bad_csum) {
+        frame[RSC_HDR_LEN - 16] ^= 0xff;
+    }
+    len = htonl(iov[1].iov_len);
+
+    ret = iov_send(socket, iov, 2, 0, sizeof(len) + iov[1].iov_len);
+    g_assert_cmpint(ret, ==, sizeof(len) + iov[1].iov_len);
+}
+
+static uint64_t rsc_stat(const char *name)
+{
+    QDict *response;
+    uint64_t val;
+
+    response = qmp("{ 'execute': 'qom-get',"
+                   "  'arguments': { 'path': '/machine/peripheral/net0/"
+                   "virtio-backend', 'property': 'rsc-stats' } }");
+    g_assert(qdict_haskey(response, "return"));
+    val = qdict_get_int(qdict_get_qdict(response, "return"), name);
+    QDECREF(response);
+    return val;
+}
+
+/* Wait until the device has seen @n TCP segments in total */
+static void rsc_wait_received(uint64_t n)
+{
+    gint64 start_time = g_get_monotonic_time();
+
+    while (rsc_stat("received") < n) {
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+        g_usleep(1000);
+    }
+    g_assert_cmpint(rsc_stat("received"), ==, n);
+}
+
+static void rsc_rx_init(RscRx *rx, const QVirtioBus *bus, QVirtioDevice *dev,
+                        QGuestAllocator *alloc, QVirtQueue *vq)
+{
+    uint32_t free_head;
+    int i;
+
+    rx->vq = vq;
+    rx->used = 0;
+    for (i = 0; i < RSC_NBUFS; i++) {
+        rx->addr[i] = guest_alloc(alloc, RSC_BUF_SIZE);
+        free_head = qvirtqueue_add(vq, rx->addr[i], RSC_BUF_SIZE,
+                                   true, false);
+        if (i == 0) {
+            rx->head = free_head;
+        }
+        qvirtqueue_kick(bus, dev, vq, free_head);
+    }
+}
+
+static void rsc_rx_cleanup(RscRx *rx, QGuestAllocator *alloc)
+{
+    int i;
+
+    for (i = 0; i < RSC_NBUFS; i++) {
+        guest_free(alloc, rx->addr[i]);
+    }
+}
+
+static uint16_t rsc_used_idx(RscRx *rx)
+{
+    /* vq->used->idx */
+    return readw(rx->vq->used + 2);
+}
+
+/* Wait for the next buffer and check the header and TCP segment in it.
+ * A @gso_size of zero means a single segment passed through. */
+static void rsc_expect(RscRx *rx, uint8_t hdr_flags, uint16_t gso_size,
+                       uint32_t seq, size_t payload_len, uint8_t tcp_flags)
+{
+    gint64 start_time = g_get_monotonic_time();
+    uint8_t frame[RSC_BUF_SIZE];
+    uint64_t addr, elem;
+    uint32_t len;
+    size_t i;
+
+    while (rsc_used_idx(rx) == rx->used) {
+        /* 100 ns steps never reach RSC_TIMER_NS */
+        clock_step(100);
+        g_assert(g_get_monotonic_time() - start_time <=
+                 QVIRTIO_NET_TIMEOUT_US);
+    }
+
+    /* vq->used->ring[rx->used] */
+    elem = rx->vq->used + 4 + 8 * (rx->used % rx->vq->size);
+    g_assert_cmpint(readl(elem), ==, rx->head + rx->used);
+    len = readl(elem + 4);
+    addr = rx->addr[rx->used];
+    rx->used++;
+
+    g_assert_cmpint(len, ==, VNET_HDR_SIZE + RSC_HDR_LEN + payload_len);
+    /* flags, gso_type, hdr_len, gso_size, num_buffers */
+    g_assert_cmphex(readb(addr), ==, hdr_flags);
+    if (gso_size) {
+        g_assert_cmpint(readb(addr + 1), ==, VIRTIO_NET_HDR_GSO_TCPV4);
+        g_assert_cmpint(readw(addr + 2), ==, RSC_HDR_LEN);
+        g_assert_cmpint(readw(addr + 4), ==, gso_size);
+    } else {
+        g_assert_cmpint(readb(addr + 1), ==, VIRTIO_NET_HDR_GSO_NONE);
+    }
+    g_assert_cmpint(readw(addr + 10), ==, 1);
+
+    memread(addr + VNET_HDR_SIZE, frame, len - VNET_HDR_SIZE);
+    g_assert_cmpint(lduw_be_p(frame + 14 + 2), ==, 20 + 32 + payload_len);
+    g_assert_cmphex(rsc_csum_finish(rsc_csum_add(0, frame + 14, 20)), ==, 0);
+    g_assert_cmphex(ldl_be_p(frame + 14 + 20 + 4), ==, seq);
+    g_assert_cmphex(frame[14 + 20 + 13], ==, tcp_flags);
+    for (i = 0; i < payload_len; i++) {
+        g_assert_cmphex(frame[RSC_HDR_LEN + i], ==, (uint8_t)(seq + i));
+    }
+}
+
+/* Nothing may arrive until the timer expires */
+static void rsc_expect_held(RscRx *rx)
+{
+    g_assert_cmpint(rsc_used_idx(rx), ==, rx->used);
+    clock_step(RSC_TIMER_NS);
+}
+
+static void rsc_merge_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                           QGuestAllocator *alloc, QVirtQueue *rvq,
+                           QVirtQueue *tvq, int socket)
+{
+    RscRx rx;
+
+    rsc_rx_init(&rx, bus, dev, alloc, rvq);
+
+    rsc_send(socket, 1000, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_send(socket, 1100, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_send(socket, 1200, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_wait_received(3);
+    rsc_expect_held(&rx);
+    rsc_expect(&rx, VIRTIO_NET_HDR_F_DATA_VALID, RSC_MSS, 1000,
+               3 * RSC_MSS, RSC_ACK);
+
+    /* A short segment completes the buffer without waiting */
+    rsc_send(socket, 1300, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_send(socket, 1400, 1, RSC_ACK, 1, RSC_MSS / 2, false);
+    rsc_expect(&rx, VIRTIO_NET_HDR_F_DATA_VALID, RSC_MSS, 1300,
+               RSC_MSS + RSC_MSS / 2, RSC_ACK);
+
+    g_assert_cmpint(rsc_stat("coalesced"), ==, 3);
+    g_assert_cmpint(rsc_stat("delivered"), ==, 2);
+    g_assert_cmpint(rsc_stat("timeouts"), ==, 1);
+    rsc_rx_cleanup(&rx, alloc);
+}
+
+/* Without receive buffers the timer gives up; posting them delivers */
+static void rsc_no_room_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                             QGuestAllocator *alloc, QVirtQueue *rvq,
+                             QVirtQueue *tvq, int socket)
+{
+    RscRx rx;
+    int i;
+
+    rsc_send(socket, 1000, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_send(socket, 1100, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_wait_received(2);
+    for (i = 0; i < 4; i++) {
+        clock_step(RSC_TIMER_NS);
+    }
+    g_assert_cmpint(rsc_stat("timeouts"), ==, 1);
+    g_assert_cmpint(rsc_stat("delivered"), ==, 0);
+
+    rsc_rx_init(&rx, bus, dev, alloc, rvq);
+    rsc_expect(&rx, VIRTIO_NET_HDR_F_DATA_VALID, RSC_MSS, 1000,
+               2 * RSC_MSS, RSC_ACK);
+    g_assert_cmpint(rsc_stat("timeouts"), ==, 1);
+    g_assert_cmpint(rsc_stat("purged"), ==, 0);
+    rsc_rx_cleanup(&rx, alloc);
+}
+
+static void rsc_psh_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                         QGuestAllocator *alloc, QVirtQueue *rvq,
+                         QVirtQueue *tvq, int socket)
+{
+    RscRx rx;
+
+    rsc_rx_init(&rx, bus, dev, alloc, rvq);
+
+    /* PSH ends the burst, and is kept in the coalesced header */
+    rsc_send(socket, 1000, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_send(socket, 1100, 1, RSC_ACK_PSH, 1, RSC_MSS, false);
+    rsc_expect(&rx, VIRTIO_NET_HDR_F_DATA_VALID, RSC_MSS, 1000,
+               2 * RSC_MSS, RSC_ACK_PSH);
+
+    /* With nothing to merge with, a pushed segment is not held */
+    rsc_send(socket, 1200, 1, RSC_ACK_PSH, 1, RSC_MSS, false);
+    rsc_expect(&rx, 0, 0, 1200, RSC_MSS, RSC_ACK_PSH);
+
+    g_assert_cmpint(rsc_stat("bypassed"), ==, 1);
+    g_assert_cmpint(rsc_stat("timeouts"), ==, 0);
+    rsc_rx_cleanup(&rx, alloc);
+}
+
+/* The first segment goes out on its own when the second one arrives;
+ * the second is held until the timer expires. */
+static void rsc_no_merge(RscRx *rx, int socket, uint64_t received,
+                         uint32_t seq, uint32_t next_seq, uint32_t ack,
+                         uint32_t tsval)
+{
+    rsc_send(socket, seq, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_send(socket, next_seq, ack, RSC_ACK, tsval, RSC_MSS, false);
+    rsc_expect(rx, VIRTIO_NET_HDR_F_DATA_VALID, 0, seq, RSC_MSS, RSC_ACK);
+    rsc_wait_received(received + 2);
+    rsc_expect_held(rx);
+    rsc_expect(rx, VIRTIO_NET_HDR_F_DATA_VALID, 0, next_seq, RSC_MSS,
+               RSC_ACK);
+}
+
+static void rsc_no_merge_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                              QGuestAllocator *alloc, QVirtQueue *rvq,
+                              QVirtQueue *tvq, int socket)
+{
+    RscRx rx;
+
+    rsc_rx_init(&rx, bus, dev, alloc, rvq);
+
+    /* Sequence gap */
+    rsc_no_merge(&rx, socket, 0, 1000, 1200, 1, 1);
+    /* Different ACK */
+    rsc_no_merge(&rx, socket, 2, 2000, 2100, 2, 1);
+    /* Different TCP options */
+    rsc_no_merge(&rx, socket, 4, 3000, 3100, 1, 2);
+
+    g_assert_cmpint(rsc_stat("coalesced"), ==, 0);
+    g_assert_cmpint(rsc_stat("bypassed"), ==, 0);
+    rsc_rx_cleanup(&rx, alloc);
+}
+
+static void rsc_csum_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                          QGuestAllocator *alloc, QVirtQueue *rvq,
+                          QVirtQueue *tvq, int socket)
+{
+    RscRx rx;
+
+    rsc_rx_init(&rx, bus, dev, alloc, rvq);
+
+    /* A bad segment is passed through as is, after the pending buffer
+     * of its flow, and without DATA_VALID */
+    rsc_send(socket, 1000, 1, RSC_ACK, 1, RSC_MSS, false);
+    rsc_send(socket, 1100, 1, RSC_ACK, 1, RSC_MSS, true);
+    rsc_expect(&rx, VIRTIO_NET_HDR_F_DATA_VALID, 0, 1000, RSC_MSS, RSC_ACK);
+    rsc_expect(&rx, 0, 0, 1100, RSC_MSS, RSC_ACK);
+
+    g_assert_cmpint(rsc_stat("coalesced"), ==, 0);
+    g_assert_cmpint(rsc_stat("bypassed"), ==, 1);
+    rsc_rx_cleanup(&rx, alloc);
+}
+
+/* filter-buffer in front of a busy peer.  The buffered frames are
+ * passed on while virtio-net has no receive buffers, so they move into
+ * its incoming queue, and must come out intact once buffers are posted. */
+
+static void fb_send(int socket, int n, size_t size)
+{
+    uint8_t frame[FB_LARGE_FRAME];
+    uint32_t len = htonl(size);
+    struct iovec iov[] = {
+        {
+            .iov_base = &len,
+            .iov_len = sizeof(len),
+        }, {
+            .iov_base = frame,
+            .iov_len = size,
+        },
+    };
+    int ret;
+
+    memset(frame, 0xff, 6);
+    memset(frame + 6, n, size - 6);
+    ret = iov_send(socket, iov, 2, 0, sizeof(len) + size);
+    g_assert_cmpint(ret, ==, sizeof(len) + size);
+}
+
+static size_t fb_frame_size(int n)
+{
+    return n % 2 ? FB_LARGE_FRAME : 100;
+}
+
+static void filter_buffer_test(const QVirtioBus *bus, QVirtioDevice *dev,
+                               QGuestAllocator *alloc, QVirtQueue *rvq,
+                               QVirtQueue *tvq, int socket)
+{
+    uint64_t addr[FB_NFRAMES], elem;
+    uint8_t frame[FB_BUF_SIZE];
+    uint32_t head = 0, free_head, len;
+    uint16_t used = 0;
+    int round, i, j;
+
+    /* Later rounds take their packets from the pools */
+    for (round = 0; round < 3; round++) {
+        for (i = 0; i < FB_NFRAMES; i++) {
+            fb_send(socket, i, fb_frame_size(i));
+        }
+
+        /* Let the filter read the frames and release them to the peer */
+        for (i = 0; i < 100; i++) {
+            g_usleep(1000);
+            clock_step(FB_INTERVAL_US * 1000);
+        }
+
+        for (i = 0; i < FB_NFRAMES; i++) {
+            addr[i] = guest_alloc(alloc, FB_BUF_SIZE);
+            free_head = qvirtqueue_add(rvq, addr[i], FB_BUF_SIZE, true, false);
+            if (i == 0) {
+                head = free_head;
+            }
+            qvirtqueue_kick(bus, dev, rvq, free_head);
+        }
+
+        for (i = 0; i < FB_NFRAMES; i++, used++) {
+            gint64 start_time = g_get_monotonic_time();
+
+            /* vq->used->idx */
+            while (readw(rvq->used + 2) == used) {
+                clock_step(FB_INTERVAL_US * 1000);
+                g_assert(g_get_monotonic_time() - start_time <=
+                         QVIRTIO_NET_TIMEOUT_US);
+            }
+
+            /* vq->used->ring[used] */
+            elem = rvq->used + 4 + 8 * (used % rvq->size);
+            g_assert_cmpint(readl(elem), ==, head + i);
+            len = readl(elem + 4);
+            g_assert_cmpint(len, ==, VNET_HDR_SIZE + fb_frame_size(i));
+
+            memread(addr[i] + VNET_HDR_SIZE, frame, len - VNET_HDR_SIZE);
+            for (j = 6; j < len - VNET_HDR_SIZE; j++) {
+                g_assert_cmpint(frame[j], ==, i);
+            }
+            guest_free(alloc, addr[i]);
+        }
+    }
+}
+
+static void pci_run(gconstpointer data, const char *netdev, int type,
+                    const char *extra_opts)
 {
     QVirtioPCIDevice *dev;
     QPCIBus *bus;
@@ -211,10 +841,10 @@ static void pci_basic(gconstpointer data)
                   int socket) = data;
     int sv[2], ret;
 
-    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    ret = socketpair(PF_UNIX, type, 0, sv);
     g_assert_cmpint(ret, !=, -1);
 
-    bus = pci_test_start(sv[1]);
+    bus = pci_test_start(netdev, sv[1], extra_opts);
     dev = virtio_net_pci_init(bus, PCI_SLOT);
 
     alloc = pc_alloc_init();
@@ -235,6 +865,69 @@ static void pci_basic(gconstpointer data)
     qpci_free_pc(bus);
     test_end();
 }
+
+static void pci_basic(gconstpointer data)
+{
+    pci_run(data, "socket", SOCK_STREAM, "");
+}
+
+static void pci_rsc(gconstpointer data)
+{
+    char *opts;
+
+    opts = g_strdup_printf(",id=net0,rsc=on,x-rsctimer=%d", RSC_TIMER_NS);
+    pci_run(data, "socket", SOCK_STREAM, opts);
+    g_free(opts);
+}
+
+static void pci_filter_buffer(gconstpointer data)
+{
+    char *opts;
+
+    opts = g_strdup_printf(" -object filter-buffer,id=f0,netdev=hs0,"
+                           "queue=tx,interval=%d", FB_INTERVAL_US);
+    pci_run(data, "socket", SOCK_STREAM, opts);
+    g_free(opts);
+}
+
+/* A datagram socket stands in for the tap device; without IFF_VNET_HDR
+ * each datagram is one Ethernet frame */
+static void pci_tap(gconstpointer data)
+{
+    pci_run(data, "tap", SOCK_DGRAM, "");
+}
+
+/* The same, with the tap fd handler in an IOThread */
+static void pci_dataplane(gconstpointer data)
+{
+    pci_run(data, "tap", SOCK_DGRAM,
+            ",iothread=io0 -object iothread,id=io0");
+}
+
+/* Only tap and af-xdp can move their fd handlers to an IOThread */
+static void dataplane_reject(void)
+{
+    QDict *response;
+    char *cmdline;
+    int sv[2], ret;
+
+    ret = socketpair(PF_UNIX, SOCK_STREAM, 0, sv);
+    g_assert_cmpint(ret, !=, -1);
+
+    cmdline = g_strdup_printf("-object iothread,id=io0 "
+                              "-netdev socket,fd=%d,id=hs0", sv[1]);
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    response = qmp("{ 'execute': 'device_add',"
+                   "  'arguments': { 'driver': 'virtio-net-pci',"
+                   "                 'netdev': 'hs0', 'iothread': 'io0' } }");
+    g_assert(qdict_haskey(response, "error"));
+    QDECREF(response);
+
+    close(sv[0]);
+    test_end();
+}
 #endif
 
 static void hotplug(void)
@@ -256,6 +949,20 @@ int main(int argc, char **argv)
     qtest_add_data_func("/virtio/net/pci/basic", send_recv_test, pci_basic);
     qtest_add_data_func("/virtio/net/pci/rx_stop_cont",
                         stop_cont_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/tx_batch", tx_batch_test, pci_basic);
+    qtest_add_data_func("/virtio/net/pci/rx_batch", rx_batch_test, pci_tap);
+    qtest_add_data_func("/virtio/net/pci/rsc/merge", rsc_merge_test, pci_rsc);
+    qtest_add_data_func("/virtio/net/pci/rsc/psh", rsc_psh_test, pci_rsc);
+    qtest_add_data_func("/virtio/net/pci/rsc/no_room",
+                        rsc_no_room_test, pci_rsc);
+    qtest_add_data_func("/virtio/net/pci/rsc/no_merge",
+                        rsc_no_merge_test, pci_rsc);
+    qtest_add_data_func("/virtio/net/pci/rsc/csum", rsc_csum_test, pci_rsc);
+    qtest_add_data_func("/virtio/net/pci/filter-buffer", filter_buffer_test,
+                        pci_filter_buffer);
+    qtest_add_data_func("/virtio/net/pci/dataplane", dataplane_test,
+                        pci_dataplane);
+    qtest_add_func("/virtio/net/pci/dataplane/reject", dataplane_reject);
 #endif
     qtest_add_func("/virtio/net/pci/hotplug", hotplug);
 
@@ -0,0 +1,114 @@
+/*
+ * QTest testcase for the virtqueue ring cache
+ *
+ * The device caches host pointers to the rings and drops them whenever the
+ * memory map changes.  To check that, the rings live in the BAR of an
+ * ivshmem device, and the BAR of a second one is moved over them.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include "qemu/osdep.h"
+#include <glib.h>
+#include "libqtest.h"
+#include "libqos/virtio.h"
+#include "libqos/virtio-pci.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc.h"
+#include "hw/pci/pci_regs.h"
+
+#define RNG_TIMEOUT_US  (30 * 1000 * 1000)
+#define BUF_SIZE        64
+
+static QPCIDevice *shm_init(QPCIBus *bus, int slot, uint64_t *base,
+                            uint64_t *size)
+{
+    QPCIDevice *dev = qpci_device_find(bus, QPCI_DEVFN(slot, 0));
+
+    g_assert(dev != NULL);
+    *base = (uintptr_t)qpci_iomap(dev, 2, size);
+    qpci_device_enable(dev);
+    return dev;
+}
+
+static void rng_request(QVirtioPCIDevice *dev, QVirtQueue *vq, uint64_t buf)
+{
+    uint32_t free_head;
+
+    free_head = qvirtqueue_add(vq, buf, BUF_SIZE, true, false);
+    qvirtqueue_kick(&qvirtio_pci, &dev->vdev, vq, free_head);
+    qvirtio_wait_queue_isr(&qvirtio_pci, &dev->vdev, vq, RNG_TIMEOUT_US);
+}
+
+/* Once the rings are at the same address in different memory, the device
+ * must pick up the new requests from there and not from the old pages */
+static void test_remap(void)
+{
+    QPCIBus *bus;
+    QVirtioPCIDevice *dev;
+    QPCIDevice *shm0, *shm1;
+    QGuestAllocator *alloc;
+    QVirtQueue *vq;
+    uint64_t base0, base1, size, buf, len;
+    uint8_t *data;
+
+    qtest_start("-object rng-random,id=rng0,filename=/dev/urandom "
+                "-device virtio-rng-pci,rng=rng0,addr=04.0 "
+                "-object memory-backend-ram,id=mb0,size=1M "
+                "-device ivshmem-plain,memdev=mb0,addr=05.0 "
+                "-object memory-backend-ram,id=mb1,size=1M "
+                "-device ivshmem-plain,memdev=mb1,addr=06.0");
+    bus = qpci_init_pc();
+
+    dev = qvirtio_pci_device_find(bus, QVIRTIO_RNG_DEVICE_ID);
+    g_assert(dev != NULL);
+    qvirtio_pci_device_enable(dev);
+    qvirtio_reset(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_acknowledge(&qvirtio_pci, &dev->vdev);
+    qvirtio_set_driver(&qvirtio_pci, &dev->vdev);
+
+    shm0 = shm_init(bus, 5, &base0, &size);
+    shm1 = shm_init(bus, 6, &base1, &size);
+
+    alloc = alloc_init(base0, base0 + size);
+    vq = qvirtqueue_setup(&qvirtio_pci, &dev->vdev, alloc, 0);
+    qvirtio_set_driver_ok(&qvirtio_pci, &dev->vdev);
+    buf = guest_alloc(alloc, BUF_SIZE);
+
+    rng_request(dev, vq, buf);
+    g_assert_cmpint(readw(vq->used + 2), ==, 1);
+
+    /* Swap the two BARs and carry the rings over to the second device */
+    qpci_config_writel(shm0, PCI_BASE_ADDRESS_2, base1);
+    qpci_config_writel(shm1, PCI_BASE_ADDRESS_2, base0);
+    len = buf + BUF_SIZE - base0;
+    data = g_malloc(len);
+    memread(base1, data, len);
+    memwrite(base0, data, len);
+    g_free(data);
+
+    rng_request(dev, vq, buf);
+    g_assert_cmpint(readw(vq->used + 2), ==, 2);
+
+    /* The old copy of the rings was left alone */
+    g_assert_cmpint(readw(vq->used - base0 + base1 + 2), ==, 1);
+
+    alloc_uninit(alloc);
+    g_free(vq);
+    g_free(shm1);
+    g_free(shm0);
+    qvirtio_pci_device_disable(dev);
+    g_free(dev);
+    qpci_free_pc(bus);
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/virtio/ring-cache/remap", test_remap);
+
+    return g_test_run();
+}
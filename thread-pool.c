@@ -19,6 +19,7 @@
 #include "qemu/queue.h"
 #include "qemu/thread.h"
 #include "qemu/coroutine.h"
+#include "qemu/timer.h"
 #include "trace.h"
 #include "block/thread-pool.h"
 #include "qemu/main-loop.h"
@@ -26,6 +27,16 @@
 static void do_spawn_thread(ThreadPool *pool);
 
 typedef struct ThreadPoolElement ThreadPoolElement;
+typedef struct ThreadPoolWorker ThreadPoolWorker;
+
+#define THREAD_POOL_MAX_THREADS 64
+
+/* How long a worker polls for new requests before sleeping on the
+ * semaphore.  Requests often come in bursts, and waking up a sleeping
+ * thread costs more than the I/O itself for fast storage.  Only one
+ * worker spins at a time, so an idle pool burns at most one CPU.
+ */
+#define THREAD_POOL_SPIN_NS     (20 * SCALE_US)
 
 enum ThreadState {
     THREAD_QUEUED,
@@ -38,82 +49,259 @@ struct ThreadPoolElement {
     ThreadPool *pool;
     ThreadPoolFunc *func;
     void *arg;
+    ThreadPoolPriority prio;
+    int64_t submit_ns;
+
+    /* The queue that holds the element while it is THREAD_QUEUED.  */
+    ThreadPoolWorker *queue;
 
-    /* Moving state out of THREAD_QUEUED is protected by lock.  After
-     * that, only the worker thread can write to it.  Reads and writes
-     * of state and ret are ordered with memory barriers.
+    /* Moving state out of THREAD_QUEUED is protected by queue->lock.
+     * After that, only the worker thread can write to it.  Reads and
+     * writes of state and ret are ordered with memory barriers.
      */
     enum ThreadState state;
     int ret;
 
-    /* Access to this list is protected by lock.  */
+    /* Access to this list is protected by queue->lock.  */
     QTAILQ_ENTRY(ThreadPoolElement) reqs;
 
     /* Access to this list is protected by the global mutex.  */
     QLIST_ENTRY(ThreadPoolElement) all;
 };
 
+/* Each worker thread owns a queue.  Submission spreads requests across
+ * the queues and a worker whose own queue is empty steals from the
+ * others, so that workers only contend with each other when they run
+ * out of work.  Queues whose owner has exited are drained by stealing.
+ */
+struct ThreadPoolWorker {
+    ThreadPool *pool;
+    QemuMutex lock;
+
+    /* Read without lock to skip empty queues while stealing.  */
+    int nr_queued[THREAD_POOL_PRIO__MAX];
+
+    /* The following variables are protected by lock.  */
+    QTAILQ_HEAD(, ThreadPoolElement) queue[THREAD_POOL_PRIO__MAX];
+    uint64_t completed[THREAD_POOL_PRIO__MAX];
+    uint64_t wait_ns[THREAD_POOL_PRIO__MAX];
+    uint64_t run_ns[THREAD_POOL_PRIO__MAX];
+    uint64_t stolen;
+
+    /* Protected by pool->lock.  */
+    bool in_use;
+};
+
 struct ThreadPool {
     AioContext *ctx;
     QEMUBH *completion_bh;
     QemuMutex lock;
     QemuCond worker_stopped;
-    QemuSemaphore sem;
+    QemuSemaphore sem;  /* one count per queued request */
+    QemuEvent reschedule;
     int max_threads;
+    int max_bulk;
     QEMUBH *new_thread_bh;
 
+    ThreadPoolWorker workers[THREAD_POOL_MAX_THREADS];
+
     /* The following variables are only accessed from one AioContext. */
     QLIST_HEAD(, ThreadPoolElement) head;
+    unsigned next_queue;
 
-    /* The following variables are protected by lock.  */
-    QTAILQ_HEAD(, ThreadPoolElement) request_list;
-    int cur_threads;
+    /* The following variables are accessed atomically.  */
+    int nr_queued[THREAD_POOL_PRIO__MAX];
+    int bulk_active;
     int idle_threads;
+    bool spinning;
+
+    /* The following variables are protected by lock.  cur_threads and
+     * stopping are also read atomically outside it.
+     */
+    int cur_threads;
     int new_threads;     /* backlog of threads we need to create */
     int pending_threads; /* threads created but not running yet */
     bool stopping;
 };
 
+static ThreadPoolElement *thread_pool_take_from(ThreadPoolWorker *q,
+                                                ThreadPoolPriority prio)
+{
+    ThreadPool *pool = q->pool;
+    ThreadPoolElement *req;
+
+    qemu_mutex_lock(&q->lock);
+    req = QTAILQ_FIRST(&q->queue[prio]);
+    if (req) {
+        QTAILQ_REMOVE(&q->queue[prio], req, reqs);
+        atomic_dec(&q->nr_queued[prio]);
+        atomic_dec(&pool->nr_queued[prio]);
+        req->state = THREAD_ACTIVE;
+    }
+    qemu_mutex_unlock(&q->lock);
+    return req;
+}
+
+/* Take a request of class @prio, trying the worker's own queue first.  */
+static ThreadPoolElement *thread_pool_take(ThreadPoolWorker *self,
+                                           ThreadPoolPriority prio,
+                                           bool *stolen)
+{
+    ThreadPool *pool = self->pool;
+    int start = self - pool->workers;
+    int i;
+
+    for (i = 0; i < pool->max_threads; i++) {
+        ThreadPoolWorker *q = &pool->workers[(start + i) % pool->max_threads];
+        ThreadPoolElement *req;
+
+        if (!atomic_read(&q->nr_queued[prio])) {
+            continue;
+        }
+        req = thread_pool_take_from(q, prio);
+        if (req) {
+            *stolen = (q != self);
+            return req;
+        }
+    }
+    return NULL;
+}
+
+static void thread_pool_bulk_done(ThreadPool *pool)
+{
+    atomic_dec(&pool->bulk_active);
+    qemu_event_set(&pool->reschedule);
+}
+
+/* Called after taking a count from the semaphore, so there is a queued
+ * request for us somewhere.  Latency-sensitive requests are always
+ * preferred; at most max_bulk workers run bulk requests at a time, so
+ * that long flushes cannot occupy every thread in the pool.  A worker
+ * that waits for a bulk slot is woken up by new latency-sensitive
+ * requests too, since it may as well run them in the meanwhile.
+ */
+static ThreadPoolElement *thread_pool_next_request(ThreadPoolWorker *self,
+                                                   bool *stolen)
+{
+    ThreadPool *pool = self->pool;
+    ThreadPoolElement *req;
+
+    for (;;) {
+        qemu_event_reset(&pool->reschedule);
+
+        req = thread_pool_take(self, THREAD_POOL_PRIO_LATENCY, stolen);
+        if (req) {
+            return req;
+        }
+
+        if (!atomic_read(&pool->nr_queued[THREAD_POOL_PRIO_BULK])) {
+            /* Somebody else took our request and the one that replaces
+             * it has not been queued yet.
+             */
+            continue;
+        }
+
+        if (atomic_fetch_inc(&pool->bulk_active) < pool->max_bulk) {
+            req = thread_pool_take(self, THREAD_POOL_PRIO_BULK, stolen);
+            if (req) {
+                return req;
+            }
+            thread_pool_bulk_done(pool);
+        } else {
+            atomic_dec(&pool->bulk_active);
+            qemu_event_wait(&pool->reschedule);
+        }
+    }
+}
+
+static bool thread_pool_spin(ThreadPool *pool)
+{
+    int64_t deadline;
+    bool found = false;
+
+    if (atomic_xchg(&pool->spinning, true)) {
+        return false;
+    }
+
+    deadline = get_clock() + THREAD_POOL_SPIN_NS;
+    do {
+        if ((atomic_read(&pool->nr_queued[THREAD_POOL_PRIO_LATENCY]) ||
+             atomic_read(&pool->nr_queued[THREAD_POOL_PRIO_BULK])) &&
+            qemu_sem_timedwait(&pool->sem, 0) == 0) {
+            found = true;
+            break;
+        }
+    } while (!atomic_read(&pool->stopping) && get_clock() < deadline);
+
+    atomic_set(&pool->spinning, false);
+    return found;
+}
+
 static void *worker_thread(void *opaque)
 {
-    ThreadPool *pool = opaque;
+    ThreadPoolWorker *self = opaque;
+    ThreadPool *pool = self->pool;
 
     qemu_mutex_lock(&pool->lock);
     pool->pending_threads--;
     do_spawn_thread(pool);
+    qemu_mutex_unlock(&pool->lock);
 
-    while (!pool->stopping) {
+    while (!atomic_read(&pool->stopping)) {
         ThreadPoolElement *req;
+        ThreadPoolPriority prio;
+        int64_t submit_ns, start_ns, end_ns;
+        bool stolen = false;
         int ret;
 
-        do {
-            pool->idle_threads++;
-            qemu_mutex_unlock(&pool->lock);
-            ret = qemu_sem_timedwait(&pool->sem, 10000);
-            qemu_mutex_lock(&pool->lock);
-            pool->idle_threads--;
-        } while (ret == -1 && !QTAILQ_EMPTY(&pool->request_list));
-        if (ret == -1 || pool->stopping) {
+        /* A spinning worker is idle too: submitters must leave new
+         * requests to it instead of spawning more threads.
+         */
+        atomic_inc(&pool->idle_threads);
+        if (!thread_pool_spin(pool)) {
+            do {
+                ret = qemu_sem_timedwait(&pool->sem, 10000);
+            } while (ret == -1 &&
+                     (atomic_read(&pool->nr_queued[THREAD_POOL_PRIO_LATENCY]) ||
+                      atomic_read(&pool->nr_queued[THREAD_POOL_PRIO_BULK])));
+            if (ret == -1) {
+                atomic_dec(&pool->idle_threads);
+                break;
+            }
+        }
+        atomic_dec(&pool->idle_threads);
+        if (atomic_read(&pool->stopping)) {
             break;
         }
 
-        req = QTAILQ_FIRST(&pool->request_list);
-        QTAILQ_REMOVE(&pool->request_list, req, reqs);
-        req->state = THREAD_ACTIVE;
-        qemu_mutex_unlock(&pool->lock);
+        req = thread_pool_next_request(self, &stolen);
+        prio = req->prio;
+        submit_ns = req->submit_ns;
+        start_ns = get_clock();
 
         ret = req->func(req->arg);
 
+        end_ns = get_clock();
         req->ret = ret;
         /* Write ret before state.  */
         smp_wmb();
         req->state = THREAD_DONE;
 
-        qemu_mutex_lock(&pool->lock);
+        qemu_mutex_lock(&self->lock);
+        self->completed[prio]++;
+        self->wait_ns[prio] += start_ns - submit_ns;
+        self->run_ns[prio] += end_ns - start_ns;
+        self->stolen += stolen;
+        qemu_mutex_unlock(&self->lock);
 
+        if (prio == THREAD_POOL_PRIO_BULK) {
+            thread_pool_bulk_done(pool);
+        }
         qemu_bh_schedule(pool->completion_bh);
     }
 
+    qemu_mutex_lock(&pool->lock);
+    self->in_use = false;
     pool->cur_threads--;
     qemu_cond_signal(&pool->worker_stopped);
     qemu_mutex_unlock(&pool->lock);
@@ -123,16 +311,26 @@ static void *worker_thread(void *opaque)
 static void do_spawn_thread(ThreadPool *pool)
 {
     QemuThread t;
+    int i;
 
     /* Runs with lock taken.  */
     if (!pool->new_threads) {
         return;
     }
 
+    /* There are never more running threads than cur_threads, so a free
+     * queue is always available.
+     */
+    for (i = 0; pool->workers[i].in_use; i++) {
+        assert(i < pool->max_threads - 1);
+    }
+    pool->workers[i].in_use = true;
+
     pool->new_threads--;
     pool->pending_threads++;
 
-    qemu_thread_create(&t, "worker", worker_thread, pool, QEMU_THREAD_DETACHED);
+    qemu_thread_create(&t, "worker", worker_thread, &pool->workers[i],
+                       QEMU_THREAD_DETACHED);
 }
 
 static void spawn_thread_bh_fn(void *opaque)
@@ -197,10 +395,11 @@ static void thread_pool_cancel(BlockAIOCB *acb)
 {
     ThreadPoolElement *elem = (ThreadPoolElement *)acb;
     ThreadPool *pool = elem->pool;
+    ThreadPoolWorker *q = elem->queue;
 
     trace_thread_pool_cancel(elem, elem->common.opaque);
 
-    qemu_mutex_lock(&pool->lock);
+    qemu_mutex_lock(&q->lock);
     if (elem->state == THREAD_QUEUED &&
         /* No thread has yet started working on elem. we can try to "steal"
          * the item from the worker if we can get a signal from the
@@ -208,14 +407,16 @@ static void thread_pool_cancel(BlockAIOCB *acb)
          * the lock taken and ensure that elem will remain THREAD_QUEUED.
          */
         qemu_sem_timedwait(&pool->sem, 0) == 0) {
-        QTAILQ_REMOVE(&pool->request_list, elem, reqs);
+        QTAILQ_REMOVE(&q->queue[elem->prio], elem, reqs);
+        atomic_dec(&q->nr_queued[elem->prio]);
+        atomic_dec(&pool->nr_queued[elem->prio]);
         qemu_bh_schedule(pool->completion_bh);
 
         elem->state = THREAD_DONE;
         elem->ret = -ECANCELED;
     }
 
-    qemu_mutex_unlock(&pool->lock);
+    qemu_mutex_unlock(&q->lock);
 }
 
 static AioContext *thread_pool_get_aio_context(BlockAIOCB *acb)
@@ -231,15 +432,21 @@ static const AIOCBInfo thread_pool_aiocb_info = {
     .get_aio_context    = thread_pool_get_aio_context,
 };
 
-BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
-        ThreadPoolFunc *func, void *arg,
+BlockAIOCB *thread_pool_submit_aio_prio(ThreadPool *pool,
+        ThreadPoolPriority prio, ThreadPoolFunc *func, void *arg,
         BlockCompletionFunc *cb, void *opaque)
 {
     ThreadPoolElement *req;
+    ThreadPoolWorker *q;
+    int nr_queues;
+
+    assert(prio < THREAD_POOL_PRIO__MAX);
 
     req = qemu_aio_get(&thread_pool_aiocb_info, NULL, cb, opaque);
     req->func = func;
     req->arg = arg;
+    req->prio = prio;
+    req->submit_ns = get_clock();
     req->state = THREAD_QUEUED;
     req->pool = pool;
 
@@ -247,16 +454,45 @@ BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
 
     trace_thread_pool_submit(pool, req, arg);
 
-    qemu_mutex_lock(&pool->lock);
-    if (pool->idle_threads == 0 && pool->cur_threads < pool->max_threads) {
-        spawn_thread(pool);
+    /* Hand the request to an idle or spinning worker if there is one
+     * that the already queued requests have not claimed.
+     */
+    if (atomic_read(&pool->nr_queued[THREAD_POOL_PRIO_LATENCY]) +
+        atomic_read(&pool->nr_queued[THREAD_POOL_PRIO_BULK]) >=
+        atomic_read(&pool->idle_threads) &&
+        atomic_read(&pool->cur_threads) < pool->max_threads) {
+        qemu_mutex_lock(&pool->lock);
+        if (pool->cur_threads < pool->max_threads) {
+            spawn_thread(pool);
+        }
+        qemu_mutex_unlock(&pool->lock);
+    }
+
+    nr_queues = MAX(atomic_read(&pool->cur_threads), 1);
+    q = &pool->workers[pool->next_queue++ % nr_queues];
+    req->queue = q;
+
+    qemu_mutex_lock(&q->lock);
+    QTAILQ_INSERT_TAIL(&q->queue[prio], req, reqs);
+    atomic_inc(&q->nr_queued[prio]);
+    atomic_inc(&pool->nr_queued[prio]);
+    qemu_mutex_unlock(&q->lock);
+
+    if (prio == THREAD_POOL_PRIO_LATENCY) {
+        qemu_event_set(&pool->reschedule);
     }
-    QTAILQ_INSERT_TAIL(&pool->request_list, req, reqs);
-    qemu_mutex_unlock(&pool->lock);
     qemu_sem_post(&pool->sem);
     return &req->common;
 }
 
+BlockAIOCB *thread_pool_submit_aio(ThreadPool *pool,
+        ThreadPoolFunc *func, void *arg,
+        BlockCompletionFunc *cb, void *opaque)
+{
+    return thread_pool_submit_aio_prio(pool, THREAD_POOL_PRIO_LATENCY,
+                                       func, arg, cb, opaque);
+}
+
 typedef struct ThreadPoolCo {
     Coroutine *co;
     int ret;
@@ -270,23 +506,61 @@ static void thread_pool_co_cb(void *opaque, int ret)
     qemu_coroutine_enter(co->co, NULL);
 }
 
-int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
-                                       void *arg)
+int coroutine_fn thread_pool_submit_co_prio(ThreadPool *pool,
+                                            ThreadPoolPriority prio,
+                                            ThreadPoolFunc *func, void *arg)
 {
     ThreadPoolCo tpc = { .co = qemu_coroutine_self(), .ret = -EINPROGRESS };
     assert(qemu_in_coroutine());
-    thread_pool_submit_aio(pool, func, arg, thread_pool_co_cb, &tpc);
+    thread_pool_submit_aio_prio(pool, prio, func, arg, thread_pool_co_cb, &tpc);
     qemu_coroutine_yield();
     return tpc.ret;
 }
 
+int coroutine_fn thread_pool_submit_co(ThreadPool *pool, ThreadPoolFunc *func,
+                                       void *arg)
+{
+    return thread_pool_submit_co_prio(pool, THREAD_POOL_PRIO_LATENCY,
+                                      func, arg);
+}
+
 void thread_pool_submit(ThreadPool *pool, ThreadPoolFunc *func, void *arg)
 {
     thread_pool_submit_aio(pool, func, arg, NULL, NULL);
 }
 
+void thread_pool_get_stats(ThreadPool *pool, ThreadPoolStats *stats)
+{
+    int i, prio;
+
+    memset(stats, 0, sizeof(*stats));
+
+    qemu_mutex_lock(&pool->lock);
+    stats->threads = pool->cur_threads;
+    qemu_mutex_unlock(&pool->lock);
+    stats->idle_threads = atomic_read(&pool->idle_threads);
+
+    for (i = 0; i < pool->max_threads; i++) {
+        ThreadPoolWorker *q = &pool->workers[i];
+
+        qemu_mutex_lock(&q->lock);
+        for (prio = 0; prio < THREAD_POOL_PRIO__MAX; prio++) {
+            ThreadPoolQueueStats *qs = &stats->queue[prio];
+
+            qs->queued += q->nr_queued[prio];
+            qs->completed += q->completed[prio];
+            qs->wait_ns += q->wait_ns[prio];
+            qs->run_ns += q->run_ns[prio];
+        }
+        stats->stolen += q->stolen;
+        qemu_mutex_unlock(&q->lock);
+    }
+}
+
 static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
 {
+    int i, prio;
+
     if (!ctx) {
         ctx = qemu_get_aio_context();
     }
@@ -297,11 +571,22 @@ static void thread_pool_init_one(ThreadPool *pool, AioContext *ctx)
     qemu_mutex_init(&pool->lock);
     qemu_cond_init(&pool->worker_stopped);
     qemu_sem_init(&pool->sem, 0);
-    pool->max_threads = 64;
+    qemu_event_init(&pool->reschedule, false);
+    pool->max_threads = THREAD_POOL_MAX_THREADS;
+    pool->max_bulk = MAX(pool->max_threads / 2, 1);
     pool->new_thread_bh = aio_bh_new(ctx, spawn_thread_bh_fn, pool);
 
+    for (i = 0; i < THREAD_POOL_MAX_THREADS; i++) {
+        ThreadPoolWorker *q = &pool->workers[i];
+
+        q->pool = pool;
+        qemu_mutex_init(&q->lock);
+        for (prio = 0; prio < THREAD_POOL_PRIO__MAX; prio++) {
+            QTAILQ_INIT(&q->queue[prio]);
+        }
+    }
+
     QLIST_INIT(&pool->head);
-    QTAILQ_INIT(&pool->request_list);
 }
 
 ThreadPool *thread_pool_new(AioContext *ctx)
@@ -313,6 +598,8 @@ ThreadPool *thread_pool_new(AioContext *ctx)
 
 void thread_pool_free(ThreadPool *pool)
 {
+    int i;
+
     if (!pool) {
         return;
     }
@@ -327,7 +614,7 @@ void thread_pool_free(ThreadPool *pool)
     pool->new_threads = 0;
 
     /* Wait for worker threads to terminate */
-    pool->stopping = true;
+    atomic_set(&pool->stopping, true);
     while (pool->cur_threads > 0) {
         qemu_sem_post(&pool->sem);
         qemu_cond_wait(&pool->worker_stopped, &pool->lock);
@@ -335,7 +622,11 @@ void thread_pool_free(ThreadPool *pool)
 
     qemu_mutex_unlock(&pool->lock);
 
+    for (i = 0; i < THREAD_POOL_MAX_THREADS; i++) {
+        qemu_mutex_destroy(&pool->workers[i].lock);
+    }
     qemu_bh_delete(pool->completion_bh);
+    qemu_event_destroy(&pool->reschedule);
     qemu_sem_destroy(&pool->sem);
     qemu_cond_destroy(&pool->worker_stopped);
     qemu_mutex_destroy(&pool->lock);
@@ -158,6 +158,11 @@ void qemu_coroutine_delete(Coroutine *co_)
     g_free(co);
 }
 
+void qemu_coroutine_trim_stack(Coroutine *co)
+{
+    /* Thread stacks are managed by GLib */
+}
+
 CoroutineAction qemu_coroutine_switch(Coroutine *from_,
                                       Coroutine *to_,
                                       CoroutineAction action)
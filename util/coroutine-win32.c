@@ -71,11 +71,10 @@ static void CALLBACK coroutine_trampoline(void *co_)
 
 Coroutine *qemu_coroutine_new(void)
 {
-    const size_t stack_size = 1 << 20;
     CoroutineWin32 *co;
 
     co = g_malloc0(sizeof(*co));
-    co->fiber = CreateFiber(stack_size, coroutine_trampoline, &co->base);
+    co->fiber = CreateFiber(COROUTINE_STACK_SIZE, coroutine_trampoline, &co->base);
     return &co->base;
 }
 
@@ -87,6 +86,11 @@ void qemu_coroutine_delete(Coroutine *co_)
     g_free(co);
 }
 
+void qemu_coroutine_trim_stack(Coroutine *co)
+{
+    /* Fiber stacks are managed by Windows */
+}
+
 Coroutine *qemu_coroutine_self(void)
 {
     if (!current) {
@@ -100,9 +100,11 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
 {
     size_t pos = hbi->pos;
     const HBitmap *hb = hbi->hb;
-    unsigned i = HBITMAP_LEVELS - 1;
+    unsigned i;
 
     unsigned long cur;
+retry:
+    i = HBITMAP_LEVELS - 1;
     do {
         cur = hbi->cur[--i];
         pos >>= BITS_PER_LEVEL;
@@ -127,7 +129,22 @@ unsigned long hbitmap_iter_skip_words(HBitmapIter *hbi)
         hbi->cur[i] = cur & (cur - 1);
 
         /* Set up next level for iteration.  */
-        cur = hb->levels[i + 1][pos];
+        cur = atomic_read(&hb->levels[i + 1][pos]);
+
+        /* hbitmap_reset_atomic() clears a word before the bit that
+         * summarizes it in the level above, so a concurrent reset can
+         * leave us looking at an empty word.  Skip it and go on from the
+         * next sibling.
+         */
+        if (cur == 0) {
+            unsigned j;
+
+            for (j = i + 1; j < HBITMAP_LEVELS - 1; j++) {
+                hbi->cur[j] = 0;
+            }
+            pos <<= BITS_PER_LEVEL * (HBITMAP_LEVELS - 2 - i);
+            goto retry;
+        }
     }
 
     hbi->pos = pos;
@@ -153,7 +170,7 @@ void hbitmap_iter_init(HBitmapIter *hbi, const HBitmap *hb, uint64_t first)
         pos >>= BITS_PER_LEVEL;
 
         /* Drop bits representing items before first.  */
-        hbi->cur[i] = hb->levels[i][pos] & ~((1UL << bit) - 1);
+        hbi->cur[i] = atomic_read(&hb->levels[i][pos]) & ~((1UL << bit) - 1);
 
         /* We have already added level i+1, so the lowest set bit has
          * been processed.  Clear it.
@@ -354,6 +371,103 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count)
     hb_reset_between(hb, HBITMAP_LEVELS - 1, start, last);
 }
 
+/* Set bit @pos of @level, and propagate up if the word was empty.  */
+static void hb_set_bit_atomic(HBitmap *hb, int level, uint64_t pos)
+{
+    unsigned long *elem = &hb->levels[level][pos >> BITS_PER_LEVEL];
+    unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
+
+    if (atomic_fetch_or(elem, bit) == 0 && level > 0) {
+        hb_set_bit_atomic(hb, level - 1, pos >> BITS_PER_LEVEL);
+    }
+}
+
+/* Clear bit @pos of @level after word @pos of the level below became
+ * empty, and propagate up if this word became empty too.  A concurrent
+ * hb_set_bit_atomic() may have refilled the word below in the meantime;
+ * in that case put the bit back.
+ */
+static void hb_reset_bit_atomic(HBitmap *hb, int level, uint64_t pos)
+{
+    unsigned long *elem = &hb->levels[level][pos >> BITS_PER_LEVEL];
+    unsigned long bit = 1UL << (pos & (BITS_PER_LONG - 1));
+
+    if (atomic_fetch_and(elem, ~bit) == bit && level > 0) {
+        hb_reset_bit_atomic(hb, level - 1, pos >> BITS_PER_LEVEL);
+    }
+    if (atomic_read(&hb->levels[level + 1][pos]) != 0) {
+        hb_set_bit_atomic(hb, level, pos);
+    }
+}
+
+void hbitmap_set_atomic(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    /* Compute range in the last layer.  */
+    uint64_t last = start + count - 1;
+    unsigned long *leaf = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t added = 0;
+    size_t i;
+
+    trace_hbitmap_set(hb, start, count,
+                      start >> hb->granularity, last >> hb->granularity);
+
+    start >>= hb->granularity;
+    last >>= hb->granularity;
+
+    for (i = start >> BITS_PER_LEVEL; i <= last >> BITS_PER_LEVEL; i++) {
+        uint64_t first = MAX(start, (uint64_t)i << BITS_PER_LEVEL);
+        uint64_t end = MIN(last, ((uint64_t)i << BITS_PER_LEVEL) |
+                                 (BITS_PER_LONG - 1));
+        unsigned long mask, old;
+
+        mask = 2UL << (end & (BITS_PER_LONG - 1));
+        mask -= 1UL << (first & (BITS_PER_LONG - 1));
+        old = atomic_fetch_or(&leaf[i], mask);
+        added += ctpopl(mask & ~old);
+        if (old == 0) {
+            hb_set_bit_atomic(hb, HBITMAP_LEVELS - 2, i);
+        }
+    }
+
+    if (added) {
+        atomic_add(&hb->count, added);
+    }
+}
+
+void hbitmap_reset_atomic(HBitmap *hb, uint64_t start, uint64_t count)
+{
+    /* Compute range in the last layer.  */
+    uint64_t last = start + count - 1;
+    unsigned long *leaf = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t removed = 0;
+    size_t i;
+
+    trace_hbitmap_reset(hb, start, count,
+                        start >> hb->granularity, last >> hb->granularity);
+
+    start >>= hb->granularity;
+    last >>= hb->granularity;
+
+    for (i = start >> BITS_PER_LEVEL; i <= last >> BITS_PER_LEVEL; i++) {
+        uint64_t first = MAX(start, (uint64_t)i << BITS_PER_LEVEL);
+        uint64_t end = MIN(last, ((uint64_t)i << BITS_PER_LEVEL) |
+                                 (BITS_PER_LONG - 1));
+        unsigned long mask, old;
+
+        mask = 2UL << (end & (BITS_PER_LONG - 1));
+        mask -= 1UL << (first & (BITS_PER_LONG - 1));
+        old = atomic_fetch_and(&leaf[i], ~mask);
+        removed += ctpopl(old & mask);
+        if (old != 0 && (old & ~mask) == 0) {
+            hb_reset_bit_atomic(hb, HBITMAP_LEVELS - 2, i);
+        }
+    }
+
+    if (removed) {
+        atomic_sub(&hb->count, removed);
+    }
+}
+
 void hbitmap_reset_all(HBitmap *hb)
 {
     unsigned int i;
@@ -133,6 +133,56 @@ void qemu_anon_ram_free(void *ptr, size_t size)
     qemu_ram_munmap(ptr, size);
 }
 
+void *qemu_alloc_stack(size_t *sz)
+{
+    void *ptr;
+    size_t pagesz = getpagesize();
+#ifdef _SC_THREAD_STACK_MIN
+    /* avoid stacks smaller than _SC_THREAD_STACK_MIN */
+    long min_stack_sz = sysconf(_SC_THREAD_STACK_MIN);
+    *sz = MAX(MAX(min_stack_sz, 0), *sz);
+#endif
+    /* adjust stack size to a multiple of the page size */
+    *sz = ROUND_UP(*sz, pagesz);
+    /* allocate one extra page for the guard page */
+    *sz += pagesz;
+
+    /* Pages are only committed when the stack actually grows into them */
+    ptr = mmap(NULL, *sz, PROT_READ | PROT_WRITE,
+               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ptr == MAP_FAILED) {
+        abort();
+    }
+
+    /* The stack grows down, so the guard page goes at the bottom */
+    if (mprotect(ptr, pagesz, PROT_NONE) != 0) {
+        abort();
+    }
+
+    trace_qemu_alloc_stack(*sz, ptr);
+    return ptr;
+}
+
+void qemu_trim_stack(void *stack, size_t sz, size_t keep)
+{
+    size_t pagesz = getpagesize();
+    size_t unused;
+
+    keep = ROUND_UP(keep, pagesz);
+    if (sz <= pagesz + keep) {
+        return;
+    }
+    unused = sz - pagesz - keep;
+
+    qemu_madvise(stack + pagesz, unused, QEMU_MADV_DONTNEED);
+}
+
+void qemu_free_stack(void *stack, size_t sz)
+{
+    trace_qemu_free_stack(stack, sz);
+    munmap(stack, sz);
+}
+
 void qemu_set_block(int fd)
 {
     int f;
@@ -21,25 +21,226 @@
 #include "qemu/coroutine_int.h"
 
 enum {
-    POOL_BATCH_SIZE = 64,
+    /* Bounds for the adaptive per-thread pool size */
+    POOL_MIN_SIZE = 64,
+    POOL_MAX_SIZE = 16384,
+
+    /* Number of coroutine creations between pool adjustments */
+    POOL_WINDOW = 1024,
+
+    /* Initial CoroutineOwner reference count, see below */
+    OWNER_BIAS = INT_MAX / 2,
+};
+
+/* The part of a pool that other threads can see.  A coroutine that
+ * terminates in another thread than the one that created it is pushed
+ * onto @released, and the creating thread takes it back the next time its
+ * own list runs dry.
+ *
+ * @refcnt counts OWNER_BIAS for the thread, minus the coroutines released
+ * from other threads and not yet taken back.  Local creation and
+ * termination therefore need no atomics.  When the thread exits it trades
+ * OWNER_BIAS for the number of coroutines still alive, and whoever drops
+ * @refcnt to zero frees the owner.
+ */
+struct CoroutineOwner {
+    QSLIST_HEAD(, Coroutine) released;
+    int refcnt;
 };
 
-/** Free list to speed up creation */
-static QSLIST_HEAD(, Coroutine) release_pool = QSLIST_HEAD_INITIALIZER(pool);
-static unsigned int release_pool_size;
-static __thread QSLIST_HEAD(, Coroutine) alloc_pool = QSLIST_HEAD_INITIALIZER(pool);
-static __thread unsigned int alloc_pool_size;
+/** Per-thread free list to speed up creation
+ *
+ * Coroutines are returned to the pool of the thread that created them, so
+ * no atomics are needed unless they terminate elsewhere.  Every
+ * POOL_WINDOW creations the pool limit is set to the peak number of
+ * coroutines that were in use during the window, and coroutines that
+ * stayed in the pool for the whole window either get their stacks trimmed
+ * or, above the limit, are freed.
+ */
+typedef struct {
+    CoroutineOwner *owner;
+    QSLIST_HEAD(, Coroutine) list;
+    unsigned int size;          /* coroutines in list */
+    unsigned int max_size;      /* adaptive limit for size */
+    unsigned int low_water;     /* smallest size during this window */
+    int in_use;                 /* created here, minus taken back */
+    int peak;                   /* largest in_use during this window */
+    unsigned int ops;           /* creations during this window */
+
+    /* Not yet published to pool_stats */
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t trimmed;
+    unsigned int published_size;
+} CoroutinePool;
+
+static __thread CoroutinePool pool = {
+    .max_size = POOL_MIN_SIZE,
+};
 static __thread Notifier coroutine_pool_cleanup_notifier;
 
+static QemuMutex pool_stats_lock;
+static CoroutinePoolStats pool_stats;
+
+static void __attribute__((constructor)) coroutine_pool_init(void)
+{
+    qemu_mutex_init(&pool_stats_lock);
+}
+
+static void coroutine_pool_publish_stats(void)
+{
+    qemu_mutex_lock(&pool_stats_lock);
+    pool_stats.pool_size += pool.size;
+    pool_stats.pool_size -= pool.published_size;
+    pool_stats.hits += pool.hits;
+    pool_stats.misses += pool.misses;
+    pool_stats.trimmed += pool.trimmed;
+    qemu_mutex_unlock(&pool_stats_lock);
+
+    pool.published_size = pool.size;
+    pool.hits = 0;
+    pool.misses = 0;
+    pool.trimmed = 0;
+}
+
+static void coroutine_owner_free(CoroutineOwner *owner)
+{
+    Coroutine *co, *tmp;
+
+    QSLIST_FOREACH_SAFE(co, &owner->released, pool_next, tmp) {
+        qemu_coroutine_delete(co);
+    }
+    g_free(owner);
+}
+
+/* Take back the coroutines that terminated in other threads */
+static void coroutine_pool_reclaim(void)
+{
+    QSLIST_HEAD(, Coroutine) released;
+    Coroutine *co, *tmp;
+    int n = 0;
+
+    if (!pool.owner || !atomic_read(&pool.owner->released.slh_first)) {
+        return;
+    }
+
+    QSLIST_MOVE_ATOMIC(&released, &pool.owner->released);
+    QSLIST_FOREACH_SAFE(co, &released, pool_next, tmp) {
+        QSLIST_INSERT_HEAD(&pool.list, co, pool_next);
+        pool.size++;
+        n++;
+    }
+    pool.in_use -= n;
+    atomic_add(&pool.owner->refcnt, n);
+}
+
 static void coroutine_pool_cleanup(Notifier *n, void *value)
 {
     Coroutine *co;
     Coroutine *tmp;
 
-    QSLIST_FOREACH_SAFE(co, &alloc_pool, pool_next, tmp) {
-        QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
+    coroutine_pool_reclaim();
+    QSLIST_FOREACH_SAFE(co, &pool.list, pool_next, tmp) {
+        QSLIST_REMOVE_HEAD(&pool.list, pool_next);
+        qemu_coroutine_delete(co);
+    }
+    pool.size = 0;
+    coroutine_pool_publish_stats();
+
+    /* Coroutines still running elsewhere keep the owner alive */
+    if (atomic_fetch_add(&pool.owner->refcnt, pool.in_use - OWNER_BIAS) ==
+        OWNER_BIAS - pool.in_use) {
+        coroutine_owner_free(pool.owner);
+    }
+    pool.owner = NULL;
+}
+
+/* Resize the pool at the end of a window and release the memory used by
+ * idle coroutines.
+ */
+static void coroutine_pool_adjust(void)
+{
+    Coroutine *co, *prev = NULL;
+    unsigned int i, hot;
+
+    coroutine_pool_reclaim();
+    pool.max_size = MIN(MAX(pool.peak, POOL_MIN_SIZE), POOL_MAX_SIZE);
+
+    /* The pool is LIFO, so the coroutines past the first "hot" ones sat
+     * unused in the pool for the whole window.
+     */
+    hot = pool.size - pool.low_water;
+    i = 0;
+    QSLIST_FOREACH(co, &pool.list, pool_next) {
+        if (i == pool.max_size) {
+            break;
+        }
+        if (i >= hot && !co->stack_trimmed) {
+            qemu_coroutine_trim_stack(co);
+            co->stack_trimmed = true;
+            pool.trimmed++;
+        }
+        prev = co;
+        i++;
+    }
+
+    /* Free whatever exceeds the new limit */
+    while (co) {
+        Coroutine *next = QSLIST_NEXT(co, pool_next);
+
         qemu_coroutine_delete(co);
+        pool.size--;
+        co = next;
+    }
+    if (prev) {
+        QSLIST_NEXT(prev, pool_next) = NULL;
+    } else {
+        QSLIST_INIT(&pool.list);
+    }
+
+    trace_qemu_coroutine_pool_adjust(pool.max_size, pool.size, pool.peak,
+                                     pool.hits, pool.misses);
+    coroutine_pool_publish_stats();
+
+    pool.ops = 0;
+    pool.peak = pool.in_use;
+    pool.low_water = pool.size;
+}
+
+static Coroutine *coroutine_pool_get(void)
+{
+    Coroutine *co;
+
+    if (QSLIST_EMPTY(&pool.list)) {
+        coroutine_pool_reclaim();
     }
+
+    co = QSLIST_FIRST(&pool.list);
+    if (co) {
+        QSLIST_REMOVE_HEAD(&pool.list, pool_next);
+        pool.size--;
+        pool.low_water = MIN(pool.low_water, pool.size);
+        co->stack_trimmed = false;
+        pool.hits++;
+    } else {
+        /* Slow path; a good place to register the destructor, too.  */
+        if (!coroutine_pool_cleanup_notifier.notify) {
+            coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
+            qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
+        }
+        if (!pool.owner) {
+            pool.owner = g_new0(CoroutineOwner, 1);
+            pool.owner->refcnt = OWNER_BIAS;
+        }
+        pool.misses++;
+    }
+
+    pool.in_use++;
+    pool.peak = MAX(pool.peak, pool.in_use);
+    if (++pool.ops == POOL_WINDOW) {
+        coroutine_pool_adjust();
+    }
+    return co;
 }
 
 Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
@@ -47,34 +248,14 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
     Coroutine *co = NULL;
 
     if (CONFIG_COROUTINE_POOL) {
-        co = QSLIST_FIRST(&alloc_pool);
-        if (!co) {
-            if (release_pool_size > POOL_BATCH_SIZE) {
-                /* Slow path; a good place to register the destructor, too.  */
-                if (!coroutine_pool_cleanup_notifier.notify) {
-                    coroutine_pool_cleanup_notifier.notify = coroutine_pool_cleanup;
-                    qemu_thread_atexit_add(&coroutine_pool_cleanup_notifier);
-                }
-
-                /* This is not exact; there could be a little skew between
-                 * release_pool_size and the actual size of release_pool.  But
-                 * it is just a heuristic, it does not need to be perfect.
-                 */
-                alloc_pool_size = atomic_xchg(&release_pool_size, 0);
-                QSLIST_MOVE_ATOMIC(&alloc_pool, &release_pool);
-                co = QSLIST_FIRST(&alloc_pool);
-            }
-        }
-        if (co) {
-            QSLIST_REMOVE_HEAD(&alloc_pool, pool_next);
-            alloc_pool_size--;
-        }
+        co = coroutine_pool_get();
     }
 
     if (!co) {
         co = qemu_coroutine_new();
     }
 
+    co->owner = pool.owner;
     co->entry = entry;
     QTAILQ_INIT(&co->co_queue_wakeup);
     return co;
@@ -82,17 +263,26 @@ Coroutine *qemu_coroutine_create(CoroutineEntry *entry)
 
 static void coroutine_delete(Coroutine *co)
 {
+    CoroutineOwner *owner = co->owner;
+
     co->caller = NULL;
 
-    if (CONFIG_COROUTINE_POOL) {
-        if (release_pool_size < POOL_BATCH_SIZE * 2) {
-            QSLIST_INSERT_HEAD_ATOMIC(&release_pool, co, pool_next);
-            atomic_inc(&release_pool_size);
-            return;
+    if (owner && owner != pool.owner) {
+        /* Charge it back to the thread that created it.  The push comes
+         * first: until we drop our reference the owner cannot go away.
+         */
+        QSLIST_INSERT_HEAD_ATOMIC(&owner->released, co, pool_next);
+        if (atomic_fetch_dec(&owner->refcnt) == 1) {
+            coroutine_owner_free(owner);
         }
-        if (alloc_pool_size < POOL_BATCH_SIZE) {
-            QSLIST_INSERT_HEAD(&alloc_pool, co, pool_next);
-            alloc_pool_size++;
+        return;
+    }
+
+    if (CONFIG_COROUTINE_POOL) {
+        pool.in_use--;
+        if (pool.size < pool.max_size) {
+            QSLIST_INSERT_HEAD(&pool.list, co, pool_next);
+            pool.size++;
             return;
         }
     }
@@ -100,6 +290,13 @@ static void coroutine_delete(Coroutine *co)
     qemu_coroutine_delete(co);
 }
 
+void qemu_coroutine_get_pool_stats(CoroutinePoolStats *stats)
+{
+    qemu_mutex_lock(&pool_stats_lock);
+    *stats = pool_stats;
+    qemu_mutex_unlock(&pool_stats_lock);
+}
+
 void qemu_coroutine_enter(Coroutine *co, void *opaque)
 {
     Coroutine *self = qemu_coroutine_self();